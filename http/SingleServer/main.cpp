@@ -52,6 +52,11 @@ int main(int argc, char *argv[])
     /*-----------------------------------------------------------------*/
     server.Process2();
 
+    // A single query grows the arenas only if a reservation is missing
+    auto arenas = server.GetArenaStats();
+    std::cout << "Arenas: high-water mark " << arenas.high_water_bytes << " bytes, " << arenas.growth_count
+              << " growths by " << arenas.grown_bytes << " bytes" << std::endl;
+
     /*-----------------------------------------------------------------*/
     /*                           Reconstruct                           */
     /*-----------------------------------------------------------------*/
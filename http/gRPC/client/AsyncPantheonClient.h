@@ -0,0 +1,170 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <grpc/grpc.h>
+#include <grpcpp/channel.h>
+#include <grpcpp/client_context.h>
+
+#include "pantheon_pir.grpc.pb.h"
+#include "PIRClient.h"
+
+/*
+Asynchronous lookups over the callback stub of PantheonInterface. Every lookup keeps its own call state and uses
+only the concurrent overloads of PIRClient, so many lookups may be outstanding on one channel. A lookup that fails
+with a transient status is sent again with a fresh context, up to max_attempts times. A bulk client's lookups go to
+the server's bulk lane, behind interactive ones.
+*/
+class AsyncPantheonClient
+{
+public:
+    // Called once per lookup with the final status and, when it is OK, the value of the key
+    using LookupCallback = std::function<void(const grpc::Status &, const std::string &)>;
+
+    AsyncPantheonClient(
+        std::shared_ptr<grpc::Channel> channel, PIRClient *client, const std::string &client_id, int max_attempts = 3,
+        std::chrono::milliseconds deadline = std::chrono::seconds(60), bool bulk = false)
+        : stub_(pantheon::PantheonInterface::NewStub(channel)), client_(client), client_id_(client_id),
+          max_attempts_(max_attempts), deadline_(deadline), bulk_(bulk), outstanding_(0)
+    {
+        if (max_attempts < 1)
+        {
+            throw std::invalid_argument("max_attempts must be at least 1");
+        }
+    }
+
+    // Waits for the outstanding lookups, whose callbacks refer to this client
+    ~AsyncPantheonClient()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this]
+                 { return outstanding_ == 0; });
+    }
+
+    void Lookup(const std::string &desired_key, LookupCallback done)
+    {
+        auto call = std::make_shared<Call>();
+        call->desired_key = desired_key;
+        call->done = std::move(done);
+
+        // The query is made on the caller's thread; with the query pool of PIRClient it is only encode and add
+        std::stringstream qss;
+        client_->QueryMake(desired_key, qss);
+        call->request.set_qss(qss.str());
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            outstanding_++;
+        }
+        Send(call);
+    }
+
+    // Throws the failed status as a runtime_error from get()
+    std::future<std::string> Lookup(const std::string &desired_key)
+    {
+        auto value = std::make_shared<std::promise<std::string>>();
+        auto future = value->get_future();
+        Lookup(desired_key, [value](const grpc::Status &status, const std::string &result)
+               {
+                   if (status.ok())
+                   {
+                       value->set_value(result);
+                   }
+                   else
+                   {
+                       value->set_exception(std::make_exception_ptr(std::runtime_error(
+                           "lookup failed: " + std::to_string(status.error_code()) + ": " + status.error_message())));
+                   }
+               });
+        return future;
+    }
+
+    size_t Outstanding()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return outstanding_;
+    }
+
+private:
+    struct Call
+    {
+        std::string desired_key;
+        LookupCallback done;
+        int attempt = 0;
+        std::unique_ptr<grpc::ClientContext> context;
+        pantheon::QueryStream request;
+        pantheon::ResponseStream reply;
+    };
+
+    std::unique_ptr<pantheon::PantheonInterface::Stub> stub_;
+    PIRClient *client_;
+    std::string client_id_;
+    int max_attempts_;
+    std::chrono::milliseconds deadline_;
+    bool bulk_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    size_t outstanding_;
+
+    // RESOURCE_EXHAUSTED is the server shedding load, which a retry at once would only add to
+    static bool transient(const grpc::Status &status)
+    {
+        return status.error_code() == grpc::StatusCode::UNAVAILABLE ||
+               status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED;
+    }
+
+    void Send(std::shared_ptr<Call> call)
+    {
+        // A ClientContext serves one RPC, so every attempt gets its own
+        call->attempt++;
+        call->context = std::make_unique<grpc::ClientContext>();
+        call->context->AddMetadata("client_id", client_id_);
+        if (bulk_)
+        {
+            call->context->AddMetadata("priority", "bulk");
+        }
+        call->context->set_deadline(std::chrono::system_clock::now() + deadline_);
+        // A retry waits for the channel to reconnect instead of failing at once
+        call->context->set_wait_for_ready(call->attempt > 1);
+
+        stub_->async()->Query(call->context.get(), &call->request, &call->reply, [this, call](grpc::Status status)
+                              { Finish(call, status); });
+    }
+
+    void Finish(std::shared_ptr<Call> call, const grpc::Status &status)
+    {
+        if (!status.ok() && transient(status) && call->attempt < max_attempts_)
+        {
+            Send(call);
+            return;
+        }
+
+        // Decrypted on the callback thread; a failure to decode reaches the caller as an internal error
+        std::string value;
+        grpc::Status result = status;
+        if (status.ok())
+        {
+            try
+            {
+                std::stringstream ss(call->reply.ss());
+                value = client_->ReconstructStr(ss, call->desired_key);
+            }
+            catch (const std::exception &e)
+            {
+                result = grpc::Status(grpc::StatusCode::INTERNAL, e.what());
+            }
+        }
+        call->done(result, value);
+
+        // Notified under the lock: once the destructor sees no lookups outstanding it destroys cv_ and mutex_
+        std::lock_guard<std::mutex> lock(mutex_);
+        outstanding_--;
+        cv_.notify_all();
+    }
+};
@@ -4,6 +4,7 @@
 #include <grpcpp/channel.h>
 #include <grpcpp/security/credentials.h>
 #include <grpcpp/client_context.h>
+#include <openssl/sha.h>
 
 #include "pantheon_pir.grpc.pb.h"
 #include "PIRClient.h"
@@ -18,6 +19,8 @@ using grpc::Status;
 using pantheon::CryptoKeys;
 using pantheon::CryptoParams;
 using pantheon::Info;
+using pantheon::KeysDigest;
+using pantheon::KeysUpload;
 using pantheon::OneCiphertext;
 using pantheon::PantheonInterface;
 using pantheon::QueryStream;
@@ -62,51 +65,84 @@ public:
         }
     }
 
-    void SendKeys(std::stringstream &keys_ss)
+    // Uploads the key set unless the server already stores one of the same SHA-256, and resumes an upload that an
+    // earlier attempt or connection left partial at the size the server received
+    void SendKeys(std::stringstream &keys_ss, int max_attempts = 3)
     {
-        std::cout << "\r"
-                  << "[" << this->client_id << "] "
-                  << "2.Sending keys..." << std::flush;
-        CryptoKeys request;
-        // request.set_keys_ss(keys_ss.str());
-        Info reply;
-        ClientContext context;
-        context.AddMetadata("client_id", this->client_id);
-
-        std::unique_ptr<ClientWriter<CryptoKeys>> writer(stub_->SendKeys(&context, &reply));
+        const string keys = keys_ss.str();
+        unsigned char digest[SHA256_DIGEST_LENGTH];
+        SHA256(reinterpret_cast<const unsigned char *>(keys.data()), keys.size(), digest);
+        KeysDigest keys_digest;
+        keys_digest.set_digest(digest, SHA256_DIGEST_LENGTH);
+        keys_digest.set_size(keys.size());
+        const size_t chunk_size = GRPC_DEFAULT_MAX_RECV_MESSAGE_LENGTH - 100;
 
-        for (size_t i = 0; i < keys_ss.str().size(); i += GRPC_DEFAULT_MAX_RECV_MESSAGE_LENGTH - 100)
+        Status status;
+        for (int attempt = 0; attempt < max_attempts; attempt++)
         {
-            request.set_keys_ss(keys_ss.str().substr(i, GRPC_DEFAULT_MAX_RECV_MESSAGE_LENGTH - 100));
-            if (!writer->Write(request))
+            KeysUpload upload;
+            {
+                ClientContext context;
+                context.AddMetadata("client_id", this->client_id);
+                status = stub_->CheckKeys(&context, keys_digest, &upload);
+            }
+            if (!status.ok())
             {
-                // Broken stream.
-                break;
+                continue;
+            }
+            if (upload.complete())
+            {
+                std::cout << "[" << this->client_id << "] "
+                          << "2.Keys already on server." << std::endl;
+                return;
             }
 
             std::cout << "\r"
                       << "[" << this->client_id << "] "
-                      << "Sent Msgs Count: " << i / (GRPC_DEFAULT_MAX_RECV_MESSAGE_LENGTH - 100) << "/" << keys_ss.str().size() / (GRPC_DEFAULT_MAX_RECV_MESSAGE_LENGTH - 100) << std::flush;
-        }
+                      << "2.Sending keys..." << std::flush;
+            Info reply;
+            ClientContext context;
+            context.AddMetadata("client_id", this->client_id);
+            std::unique_ptr<ClientWriter<CryptoKeys>> writer(stub_->SendKeys(&context, &reply));
 
-        writer->WritesDone();
+            // The first message names the upload; every chunk is assigned into the same request buffer
+            CryptoKeys request;
+            request.set_digest(digest, SHA256_DIGEST_LENGTH);
+            request.set_size(keys.size());
+            request.set_offset(upload.received());
+            size_t i = upload.received();
+            do
+            {
+                request.mutable_keys_ss()->assign(keys.data() + i, min(chunk_size, keys.size() - i));
+                if (!writer->Write(request))
+                {
+                    // Broken stream.
+                    break;
+                }
+                request.clear_digest();
+                request.clear_size();
+                request.clear_offset();
+                i += request.keys_ss().size();
 
-        Status status = writer->Finish();
-        if (status.ok())
-        {
-            std::cout << "\r"
-                      << "[" << this->client_id << "] "
-                      << "2.Keys sent.      " << std::endl;
-            // return reply.message();
-            return;
-        }
-        else
-        {
-            std::cout << "RPC failed" << std::endl;
-            std::cout << status.error_code() << ": " << status.error_message()
-                      << std::endl;
-            return;
+                std::cout << "\r"
+                          << "[" << this->client_id << "] "
+                          << "Sent: " << i << "/" << keys.size() << " bytes" << std::flush;
+            } while (i < keys.size());
+
+            writer->WritesDone();
+            status = writer->Finish();
+            if (status.ok() && reply.info() == "complete")
+            {
+                std::cout << "\r"
+                          << "[" << this->client_id << "] "
+                          << "2.Keys sent.      " << std::endl;
+                return;
+            }
         }
+
+        std::cout << "RPC failed" << std::endl;
+        std::cout << status.error_code() << ": " << status.error_message()
+                  << std::endl;
     }
 
     void SendOneCiphertext(std::stringstream &one_ct_ss)
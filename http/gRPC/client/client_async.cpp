@@ -0,0 +1,64 @@
+#include <iostream>
+#include <future>
+#include <grpc/grpc.h>
+#include <grpcpp/create_channel.h>
+#include <grpcpp/channel.h>
+#include <grpcpp/security/credentials.h>
+
+#include "pantheon_pir.grpc.pb.h"
+#include "PIRClient.h"
+#include "globals.h"
+#include "PantheonClient.h"
+#include "AsyncPantheonClient.h"
+
+using namespace std;
+
+// Usage: client_async -i clientID key...
+int main(int argc, char *argv[])
+{
+    /* client ID */
+    string clientID = ParamsParse(argc, argv);
+    if (clientID == "")
+    {
+        return -1;
+    }
+    vector<string> desired_keys(argv + optind, argv + argc);
+
+    uint32_t key_size = 64;
+    uint32_t obj_size = 128;
+    PIRClient client(key_size, obj_size);
+
+    string target_str = "localhost:50051";
+    AsyncPantheonClient rpc_client(grpc::CreateChannel(target_str, grpc::InsecureChannelCredentials()), &client, clientID);
+
+    /*-----------------------------------------------------------------*/
+    /*                           Load from file                        */
+    /*-----------------------------------------------------------------*/
+    string load_file_dir = "../data/" + clientID;
+    client.SetupCrypto(load_file_dir);
+    std::cout << "[" << clientID << "] "
+              << "1.Crypto params loaded." << std::endl;
+
+    /*-----------------------------------------------------------------*/
+    /*                           Lookups                               */
+    /*-----------------------------------------------------------------*/
+    // All lookups are outstanding on the channel at once
+    vector<std::future<string>> answers;
+    for (auto &desired_key : desired_keys)
+    {
+        answers.push_back(rpc_client.Lookup(desired_key));
+    }
+    for (int i = 0; i < answers.size(); i++)
+    {
+        try
+        {
+            std::cout << "[" << clientID << "] " << desired_keys[i] << ": " << answers[i].get() << std::endl;
+        }
+        catch (const std::exception &e)
+        {
+            std::cout << "[" << clientID << "] " << desired_keys[i] << ": " << e.what() << std::endl;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,263 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <grpcpp/server_context.h>
+#include <grpcpp/support/server_callback.h>
+
+#include "pantheon_pir.grpc.pb.h"
+
+/*
+Admission and ordering of the Query calls waiting for the compute thread.
+
+There are two lanes. Calls with "priority: bulk" metadata go to the bulk lane, all others to the interactive
+lane, which is always served first. A call is rejected with RESOURCE_EXHAUSTED at once when:
+- the queue is full;
+- its client has used up its token bucket;
+- the queue would keep it past its deadline, estimated from the running average of query time.
+A call whose deadline passes or that is cancelled while it waits is dropped when it is taken, without running.
+The bucket of a client that stayed idle until its bucket was full again is dropped, since a new client starts with
+a full bucket, and a bucket is only kept for a call that was queued; so callers that rotate their client id hold at
+most a bucket per queued call and refill period.
+*/
+class QueryQueue
+{
+public:
+    using steady_clock = std::chrono::steady_clock;
+
+    enum Lane
+    {
+        interactive = 0,
+        bulk = 1
+    };
+
+    struct Job
+    {
+        std::string client_id;
+        Lane lane;
+        grpc::CallbackServerContext *context;
+        const pantheon::QueryStream *request;
+        pantheon::ResponseStream *response;
+        grpc::ServerUnaryReactor *reactor;
+        steady_clock::time_point enqueued;
+    };
+
+    // max_queued bounds both lanes together; a client may burst client_burst queries and then client_rate per second
+    QueryQueue(std::size_t max_queued, double client_rate, double client_burst)
+        : max_queued_(max_queued), client_rate_(client_rate), client_burst_(client_burst)
+    {
+    }
+
+    // OK if the job is queued, otherwise the status to finish the call with
+    grpc::Status Admit(Job job)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto now = steady_clock::now();
+        if (stopping_)
+        {
+            return grpc::Status(grpc::StatusCode::UNAVAILABLE, "server is shutting down");
+        }
+        if (lanes_[interactive].size() + lanes_[bulk].size() >= max_queued_)
+        {
+            rejected_full_++;
+            return grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "query queue is full");
+        }
+
+        // A new client's bucket is only kept once a call of it is queued, so rejected calls add no buckets
+        evict_full_buckets(now);
+        auto found = buckets_.find(job.client_id);
+        TokenBucket bucket;
+        if (found == buckets_.end())
+        {
+            bucket.tokens = client_burst_;
+        }
+        else
+        {
+            double elapsed = std::chrono::duration<double>(now - found->second.last).count();
+            bucket.tokens = std::min(client_burst_, found->second.tokens + elapsed * client_rate_);
+        }
+        bucket.last = now;
+        if (found != buckets_.end())
+        {
+            found->second = bucket;
+        }
+        if (bucket.tokens < 1)
+        {
+            rejected_rate_++;
+            return grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "client query rate exceeded");
+        }
+
+        // An interactive call only waits for the interactive lane; a bulk call waits for both
+        std::size_t ahead = lanes_[interactive].size() + (job.lane == bulk ? lanes_[bulk].size() : 0) + running_;
+        auto projected = std::chrono::duration_cast<std::chrono::system_clock::duration>(service_time_ * (ahead + 1));
+        if (job.context->deadline() != std::chrono::system_clock::time_point::max() &&
+            std::chrono::system_clock::now() + projected > job.context->deadline())
+        {
+            rejected_deadline_++;
+            return grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "projected queue time exceeds the deadline");
+        }
+
+        bucket.tokens -= 1;
+        buckets_[job.client_id] = bucket;
+        job.enqueued = now;
+        lanes_[job.lane].push_back(job);
+        cv_.notify_all();
+        return grpc::Status::OK;
+    }
+
+    // Waits for the next job to run; false once the queue is stopped and empty. Jobs that expired or were cancelled
+    // while they waited are finished here.
+    bool Take(Job &job)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true)
+        {
+            cv_.wait(lock, [this]
+                     { return stopping_ || !lanes_[interactive].empty() || !lanes_[bulk].empty(); });
+            Lane lane = !lanes_[interactive].empty() ? interactive : bulk;
+            if (lanes_[lane].empty())
+            {
+                return false;
+            }
+            job = lanes_[lane].front();
+            lanes_[lane].pop_front();
+
+            auto queue_time = steady_clock::now() - job.enqueued;
+            LaneMetrics &metrics = metrics_[lane];
+            metrics.count++;
+            metrics.queue_time += queue_time;
+            metrics.max_queue_time = std::max(metrics.max_queue_time, queue_time);
+
+            if (job.context->IsCancelled())
+            {
+                metrics.shed++;
+                job.reactor->Finish(grpc::Status::CANCELLED);
+                continue;
+            }
+            if (std::chrono::system_clock::now() > job.context->deadline())
+            {
+                metrics.expired++;
+                job.reactor->Finish(grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED, "deadline passed in the query queue"));
+                continue;
+            }
+            running_++;
+            return true;
+        }
+    }
+
+    // Ends a job of Take, which kept the server for service_time; zero for a job that did not run
+    void Done(steady_clock::duration service_time)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        running_--;
+        // A moving average, since a query after a change of client also loads its keys
+        if (service_time == steady_clock::duration::zero())
+        {
+            return;
+        }
+        if (service_time_ == steady_clock::duration::zero())
+        {
+            service_time_ = service_time;
+        }
+        else
+        {
+            service_time_ = (service_time_ * 4 + service_time) / 5;
+        }
+    }
+
+    void Stop()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+        cv_.notify_all();
+    }
+
+    void Report(std::ostream &stream)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const char *names[] = { "interactive", "bulk" };
+        for (int lane = interactive; lane <= bulk; lane++)
+        {
+            LaneMetrics &metrics = metrics_[lane];
+            stream << "[queue] " << names[lane] << ": " << metrics.count << " taken, " << metrics.expired << " expired, "
+                   << metrics.shed << " shed, "
+                   << "mean queue time " << (metrics.count ? to_ms(metrics.queue_time) / metrics.count : 0) << " ms, "
+                   << "max " << to_ms(metrics.max_queue_time) << " ms, " << lanes_[lane].size() << " waiting" << std::endl;
+        }
+        stream << "[queue] rejected: " << rejected_full_ << " full, " << rejected_rate_ << " rate, " << rejected_deadline_
+               << " deadline; query time " << to_ms(service_time_) << " ms; " << buckets_.size() << " client buckets"
+               << std::endl;
+    }
+
+private:
+    struct TokenBucket
+    {
+        double tokens = 0;
+        steady_clock::time_point last;
+    };
+
+    struct LaneMetrics
+    {
+        std::size_t count = 0;
+        std::size_t expired = 0;
+        std::size_t shed = 0; // cancelled while waiting
+        steady_clock::duration queue_time = steady_clock::duration::zero();
+        steady_clock::duration max_queue_time = steady_clock::duration::zero();
+    };
+
+    // A bucket idle for client_burst / client_rate seconds has refilled, so dropping it changes nothing. The sweep
+    // runs at most once per refill period, which keeps Admit amortized constant time.
+    void evict_full_buckets(steady_clock::time_point now)
+    {
+        if (client_rate_ <= 0)
+        {
+            return;
+        }
+        auto refill = std::chrono::duration_cast<steady_clock::duration>(std::chrono::duration<double>(client_burst_ / client_rate_));
+        if (now - last_eviction_ < refill)
+        {
+            return;
+        }
+        last_eviction_ = now;
+        for (auto it = buckets_.begin(); it != buckets_.end();)
+        {
+            if (now - it->second.last >= refill)
+            {
+                it = buckets_.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    static double to_ms(steady_clock::duration duration)
+    {
+        return std::chrono::duration<double, std::milli>(duration).count();
+    }
+
+    std::size_t max_queued_;
+    double client_rate_;
+    double client_burst_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Job> lanes_[2];
+    std::map<std::string, TokenBucket> buckets_;
+    steady_clock::time_point last_eviction_;
+    std::size_t running_ = 0;
+    bool stopping_ = false;
+    steady_clock::duration service_time_ = steady_clock::duration::zero();
+
+    LaneMetrics metrics_[2];
+    std::size_t rejected_full_ = 0;
+    std::size_t rejected_rate_ = 0;
+    std::size_t rejected_deadline_ = 0;
+};
@@ -1,136 +1,527 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <set>
+#include <openssl/sha.h>
+#include <google/protobuf/arena.h>
 #include <grpc/grpc.h>
 #include <grpcpp/security/server_credentials.h>
 #include <grpcpp/server.h>
 #include <grpcpp/server_builder.h>
 #include <grpcpp/server_context.h>
+#include <grpcpp/support/message_allocator.h>
 
 #include "pantheon_pir.grpc.pb.h"
 #include "PIRServer.h"
 #include "globals.h"
+#include "PIRScheduler.h"
+#include "QueryQueue.h"
 
 using namespace std;
+using grpc::CallbackServerContext;
 using grpc::Server;
 using grpc::ServerBuilder;
-using grpc::ServerContext;
-using grpc::ServerReader;
-using grpc::ServerReaderWriter;
+using grpc::ServerReadReactor;
+using grpc::ServerUnaryReactor;
 using grpc::Status;
 using grpc::StatusCode;
 using pantheon::CryptoKeys;
 using pantheon::CryptoParams;
 using pantheon::Info;
+using pantheon::KeysDigest;
+using pantheon::KeysUpload;
 using pantheon::OneCiphertext;
 using pantheon::PantheonInterface;
 using pantheon::QueryStream;
 using pantheon::ResponseStream;
 
-class PantheonImpl final : public PantheonInterface::Service
+// Queries waiting for the compute thread, over both priority lanes
+#define MAX_QUEUED_QUERIES 64
+// Token bucket of every client: a burst of CLIENT_QUERY_BURST queries, then CLIENT_QUERY_RATE per second
+#define CLIENT_QUERY_RATE 4.0
+#define CLIENT_QUERY_BURST 16.0
+// Threads of QueryExpand + Process1 and of Process2, which run at the same time on different queries
+#define PROCESS1_THREADS 24
+#define PROCESS2_THREADS 8
+// Finished queries between reports of the queue metrics
+#define QUEUE_REPORT_INTERVAL 64
+
+// Request and response of a unary call on one protobuf arena, freed together when the call is done
+template <typename Request, typename Response>
+class ArenaMessageAllocator : public grpc::MessageAllocator<Request, Response>
+{
+    class Holder : public grpc::MessageHolder<Request, Response>
+    {
+    public:
+        Holder()
+        {
+            this->set_request(google::protobuf::Arena::CreateMessage<Request>(&arena_));
+            this->set_response(google::protobuf::Arena::CreateMessage<Response>(&arena_));
+        }
+        void Release() override { delete this; }
+
+    private:
+        google::protobuf::Arena arena_;
+    };
+
+public:
+    grpc::MessageHolder<Request, Response> *AllocateMessages() override { return new Holder(); }
+};
+
+string to_hex(const string &bytes)
+{
+    static const char digits[] = "0123456789abcdef";
+    string hex;
+    for (unsigned char byte : bytes)
+    {
+        hex += digits[byte >> 4];
+        hex += digits[byte & 0xF];
+    }
+    return hex;
+}
+
+// Adds a file to a SHA-256, read in blocks
+void sha256_update_file(SHA256_CTX &sha256, const string &path)
+{
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    vector<char> block(1 << 20);
+    while (file.read(block.data(), block.size()) || file.gcount())
+    {
+        SHA256_Update(&sha256, block.data(), file.gcount());
+    }
+}
+
+string get_client_id(CallbackServerContext *context)
+{
+    auto found = context->client_metadata().find("client_id");
+    if (found == context->client_metadata().end())
+    {
+        return "";
+    }
+    return string(found->second.data(), found->second.size());
+}
+
+class PantheonImpl final : public PantheonInterface::CallbackService
 {
 private:
-    std::mutex mu_;
     PIRServer *server;
     string keys_file_dir;
     vector<string> *db_keys;
     vector<string> *db_elems;
 
+    // Queries wait here for the scheduler, so no gRPC thread runs a query
+    QueryQueue queries_;
+    pthread_t dispatch_thread_;
+    // Runs QueryExpand + Process1 of one query beside Process2 of the one before it
+    std::unique_ptr<PIRScheduler> scheduler_;
+    std::atomic<size_t> finished_{ 0 };
+
+    // The client whose keys and one-ciphertext the server holds; only the dispatch thread loads a client
+    string loaded_client_;
+    std::mutex loaded_mu_;
+
+    ArenaMessageAllocator<QueryStream, ResponseStream> query_allocator_;
+
+    // Key sets are stored once under the hex SHA-256 of their bytes; a client names its set in <client>/keys_digest
+    string keyset_path(const string &hex_digest) { return keys_file_dir + "keysets/" + hex_digest; }
+    std::set<string> uploading_; // digests with an upload in progress, which appends to their .part file
+    std::mutex uploads_mu_;
+
+    // Appends the chunks of an upload straight to the .part file of its digest. A broken upload keeps what arrived,
+    // and the client resumes it at that offset; the set moves into place once all bytes arrived and match the digest.
+    // The chunks are hashed as they arrive, so finishing an upload does not read the whole set again.
+    class KeysReader : public ServerReadReactor<CryptoKeys>
+    {
+    public:
+        KeysReader(PantheonImpl *service, const string &client_id, Info *response) : service_(service), client_id_(client_id), response_(response)
+        {
+            if (client_id_ == "")
+            {
+                Finish(Status(StatusCode::INVALID_ARGUMENT, "keys of unknown client"));
+                return;
+            }
+            StartRead(&chunk_);
+        }
+
+        void OnReadDone(bool ok) override
+        {
+            if (ok)
+            {
+                if (!file_.is_open() && !begin_upload())
+                {
+                    return;
+                }
+                const string &bytes = chunk_.keys_ss();
+                received_ += bytes.size();
+                if (received_ > size_)
+                {
+                    file_.close();
+                    std::remove(part_path_.c_str());
+                    Finish(Status(StatusCode::DATA_LOSS, "uploaded keys are longer than their size"));
+                    return;
+                }
+                SHA256_Update(&sha256_, bytes.data(), bytes.size());
+                file_.write(bytes.data(), bytes.size());
+                StartRead(&chunk_);
+                return;
+            }
+
+            if (!file_.is_open())
+            {
+                Finish(cancelled_ ? Status::CANCELLED : Status(StatusCode::INVALID_ARGUMENT, "empty key upload"));
+                return;
+            }
+            file_.close();
+            if (cancelled_)
+            {
+                Finish(Status::CANCELLED);
+                return;
+            }
+            Finish(end_upload());
+        }
+
+        void OnCancel() override { cancelled_ = true; }
+
+        void OnDone() override
+        {
+            if (hex_digest_ != "")
+            {
+                std::lock_guard<std::mutex> lock(service_->uploads_mu_);
+                service_->uploading_.erase(hex_digest_);
+            }
+            delete this;
+        }
+
+    private:
+        PantheonImpl *service_;
+        string client_id_;
+        Info *response_;
+        string hex_digest_;
+        string part_path_;
+        uint64_t size_ = 0;
+        uint64_t received_ = 0;
+        SHA256_CTX sha256_;
+        std::ofstream file_;
+        CryptoKeys chunk_;
+        bool cancelled_ = false;
+
+        bool begin_upload()
+        {
+            if (chunk_.digest().size() != SHA256_DIGEST_LENGTH)
+            {
+                Finish(Status(StatusCode::INVALID_ARGUMENT, "key upload does not start with its digest"));
+                return false;
+            }
+            string hex_digest = to_hex(chunk_.digest());
+            {
+                std::lock_guard<std::mutex> lock(service_->uploads_mu_);
+                if (!service_->uploading_.insert(hex_digest).second)
+                {
+                    Finish(Status(StatusCode::ABORTED, "these keys are being uploaded"));
+                    return false;
+                }
+            }
+            hex_digest_ = hex_digest;
+            part_path_ = service_->keyset_path(hex_digest_) + ".part";
+            size_ = chunk_.size();
+
+            std::error_code ec;
+            uint64_t received = std::filesystem::file_size(part_path_, ec);
+            if (ec)
+            {
+                received = 0;
+            }
+            if (chunk_.offset() != received)
+            {
+                Finish(Status(StatusCode::FAILED_PRECONDITION, "key upload does not resume where the last one stopped"));
+                return false;
+            }
+
+            // A resumed upload hashes what the broken one left once, then only its own chunks
+            SHA256_Init(&sha256_);
+            if (received)
+            {
+                sha256_update_file(sha256_, part_path_);
+            }
+            received_ = received;
+            std::filesystem::create_directories(std::filesystem::path(part_path_).parent_path());
+            file_.open(part_path_, std::ios::out | std::ios::binary | std::ios::app);
+            if (!file_.is_open())
+            {
+                Finish(Status(StatusCode::INTERNAL, "cannot save keys"));
+                return false;
+            }
+            return true;
+        }
+
+        Status end_upload()
+        {
+            if (!file_)
+            {
+                return Status(StatusCode::INTERNAL, "cannot save keys");
+            }
+            if (received_ < size_)
+            {
+                response_->set_info("partial");
+                return Status::OK;
+            }
+            unsigned char digest[SHA256_DIGEST_LENGTH];
+            SHA256_Final(digest, &sha256_);
+            if (received_ > size_ || to_hex(string(reinterpret_cast<char *>(digest), SHA256_DIGEST_LENGTH)) != hex_digest_)
+            {
+                std::remove(part_path_.c_str());
+                return Status(StatusCode::DATA_LOSS, "uploaded keys do not match their digest");
+            }
+            std::filesystem::rename(part_path_, service_->keyset_path(hex_digest_));
+            service_->bind_keys(client_id_, hex_digest_);
+            response_->set_info("complete");
+            std::cout << "[" << client_id_ << "] "
+                      << "2.SendKeys finished." << std::endl;
+            return Status::OK;
+        }
+    };
+
 public:
-    explicit PantheonImpl(PIRServer *_server, vector<string> *db_keys, vector<string> *db_elems, string &keys_file_dir) : server(_server), db_keys(db_keys), db_elems(db_elems), keys_file_dir(keys_file_dir) {}
+    explicit PantheonImpl(PIRServer *_server, vector<string> *db_keys, vector<string> *db_elems, string &keys_file_dir, size_t max_queued, double client_rate, double client_burst) : server(_server), db_keys(db_keys), db_elems(db_elems), keys_file_dir(keys_file_dir), queries_(max_queued, client_rate, client_burst)
+    {
+        SetMessageAllocatorFor_Query(&query_allocator_);
+        scheduler_ = std::make_unique<PIRScheduler>(*server, 1, PROCESS1_THREADS, PROCESS2_THREADS);
+        if (pthread_create(&dispatch_thread_, NULL, run_queries, static_cast<void *>(this)))
+        {
+            printf("Error creating query dispatch thread");
+        }
+    }
+
+    ~PantheonImpl()
+    {
+        queries_.Stop();
+        pthread_join(dispatch_thread_, NULL);
+        // Finishes the queries still in the stages
+        scheduler_.reset();
+    }
 
-    Status ReceiveParams(ServerContext *context, const Info *request, CryptoParams *response)
+    ServerUnaryReactor *ReceiveParams(CallbackServerContext *context, const Info *request, CryptoParams *response) override
     {
-        const string client_id = context->client_metadata().find("client_id")->second.data();
+        const string client_id = get_client_id(context);
 
         response->set_parms_ss(server->parms_ss.str());
         std::cout << "[" << client_id << "] "
                   << "1.ReceiveParams finished." << std::endl;
-        return Status::OK;
+        auto reactor = context->DefaultReactor();
+        reactor->Finish(Status::OK);
+        return reactor;
     }
-    Status SendKeys(ServerContext *context, ServerReader<CryptoKeys> *reader, Info *response)
+
+    ServerUnaryReactor *CheckKeys(CallbackServerContext *context, const KeysDigest *request, KeysUpload *response) override
     {
-        const string client_id = context->client_metadata().find("client_id")->second.data();
-        std::stringstream ss;
-        CryptoKeys keys_ss;
+        const string client_id = get_client_id(context);
+        auto reactor = context->DefaultReactor();
+        if (client_id == "" || request->digest().size() != SHA256_DIGEST_LENGTH)
+        {
+            reactor->Finish(Status(StatusCode::INVALID_ARGUMENT, "keys of unknown client or digest"));
+            return reactor;
+        }
 
-        int i = 0;
-        while (reader->Read(&keys_ss))
+        // A stored set of the same digest is taken as is; the client skips the upload
+        string hex_digest = to_hex(request->digest());
+        std::error_code ec;
+        uint64_t stored = std::filesystem::file_size(keyset_path(hex_digest), ec);
+        if (!ec && stored == request->size())
         {
-            ss << keys_ss.keys_ss();
+            bind_keys(client_id, hex_digest);
+            response->set_complete(true);
+            response->set_received(stored);
+            std::cout << "[" << client_id << "] "
+                      << "2.Keys already stored." << std::endl;
+            reactor->Finish(Status::OK);
+            return reactor;
         }
-        // check stream status
+
+        uint64_t received = std::filesystem::file_size(keyset_path(hex_digest) + ".part", ec);
+        response->set_complete(false);
+        response->set_received(ec || received > request->size() ? 0 : received);
+        reactor->Finish(Status::OK);
+        return reactor;
+    }
+
+    ServerReadReactor<CryptoKeys> *SendKeys(CallbackServerContext *context, Info *response) override
+    {
+        return new KeysReader(this, get_client_id(context), response);
+    }
+
+    ServerUnaryReactor *SendOneCiphertext(CallbackServerContext *context, const OneCiphertext *request, Info *response) override
+    {
+        const string client_id = get_client_id(context);
+        auto reactor = context->DefaultReactor();
         if (context->IsCancelled())
         {
-            return Status::CANCELLED;
+            reactor->Finish(Status::CANCELLED);
+            return reactor;
         }
 
-        // save stream to file
-        saveToBinaryFile(keys_file_dir + client_id + "/keys", ss.str());
+        // save the received bytes to file
+        saveToBinaryFile(keys_file_dir + client_id + "/oneciphertext", request->one_ct_ss());
+        forget_client(client_id);
 
         std::cout << "[" << client_id << "] "
-                  << "2.SendKeys finished." << std::endl;
-        return Status::OK;
+                  << "3.SendOneCiphertext finished." << std::endl;
+        reactor->Finish(Status::OK);
+        return reactor;
     }
-    Status SendOneCiphertext(ServerContext *context, const OneCiphertext *request, Info *response)
+
+    ServerUnaryReactor *Query(CallbackServerContext *context, const QueryStream *request, ResponseStream *response) override
     {
-        const string client_id = context->client_metadata().find("client_id")->second.data();
-        std::stringstream ss(request->one_ct_ss());
+        auto reactor = context->DefaultReactor();
+        auto priority = context->client_metadata().find("priority");
+        bool bulk = priority != context->client_metadata().end() && priority->second == "bulk";
 
-        // save steram to file
-        saveToBinaryFile(keys_file_dir + client_id + "/oneciphertext", ss.str());
-        // check stream status
-        if (context->IsCancelled())
+        // A rejected call fails at once rather than timing out in the queue
+        Status status = queries_.Admit({get_client_id(context), bulk ? QueryQueue::bulk : QueryQueue::interactive, context, request, response, reactor});
+        if (!status.ok())
         {
-            return Status::CANCELLED;
+            reactor->Finish(status);
         }
+        return reactor;
+    }
 
-        std::cout << "[" << client_id << "] "
-                  << "3.SendOneCiphertext finished." << std::endl;
-        return Status::OK;
+private:
+    // New keys or a new one-ciphertext make the compute thread load the client again
+    void forget_client(const string &client_id)
+    {
+        std::lock_guard<std::mutex> lock(loaded_mu_);
+        if (loaded_client_ == client_id)
+        {
+            loaded_client_ = "";
+        }
     }
-    Status Query(ServerContext *context, const QueryStream *request, ResponseStream *response)
+
+    void bind_keys(const string &client_id, const string &hex_digest)
     {
-        std::unique_lock<std::mutex> lock(this->mu_);
-        const string client_id = context->client_metadata().find("client_id")->second.data();
-        std::cout << "\r"
-                  << "[" << client_id << "] "
-                  << "4.Querying..." << std::flush;
+        saveToBinaryFile(keys_file_dir + client_id + "/keys_digest.part", hex_digest);
+        std::filesystem::rename(keys_file_dir + client_id + "/keys_digest.part", keys_file_dir + client_id + "/keys_digest");
+        forget_client(client_id);
+    }
 
-        // loading client config
-        std::string data = loadFromBinaryFile(keys_file_dir + client_id + "/keys");
-        if (data == "")
+    // Loads the client config unless the server still holds it; false if the client has not set up yet
+    bool load_client(const string &client_id)
+    {
         {
-            Status status(StatusCode::UNAUTHENTICATED, "client haven't setup yet!");
-            return status;
+            std::lock_guard<std::mutex> lock(loaded_mu_);
+            if (client_id != "" && loaded_client_ == client_id)
+            {
+                return true;
+            }
         }
-        std::stringstream data_ss(data);
-        server->SetupKeys(data_ss);
-        data_ss.clear();
-        data_ss.str("");
 
-        data = loadFromBinaryFile(keys_file_dir + client_id + "/oneciphertext");
-        if (data == "")
+        // The queries in the stages use the keys of the loaded client. Their callbacks may forget a client, so the
+        // lock is not held while they finish.
+        scheduler_->Drain();
+        std::lock_guard<std::mutex> lock(loaded_mu_);
+        loaded_client_ = "";
+
+        // SEAL reads the keys straight from the files
+        string hex_digest = loadFromBinaryFile(keys_file_dir + client_id + "/keys_digest");
+        std::ifstream keys(keyset_path(hex_digest), std::ios::in | std::ios::binary);
+        std::ifstream one_ct(keys_file_dir + client_id + "/oneciphertext", std::ios::in | std::ios::binary);
+        if (client_id == "" || hex_digest == "" || !keys.is_open() || !one_ct.is_open())
         {
-            Status status(StatusCode::UNAUTHENTICATED, "client haven't setup yet!");
-            return status;
+            return false;
         }
-        data_ss.str(data);
-        server->RecOneCiphertext(data_ss);
+        server->SetupKeys(keys);
+        server->RecOneCiphertext(one_ct);
         server->SetupDB(*this->db_keys, *this->db_elems); // compact_pid
-        // End of client config
+        loaded_client_ = client_id;
+        return true;
+    }
+
+    // Takes the admitted queries in order and hands them to the scheduler, which finishes them on its stage threads
+    static void *run_queries(void *arg)
+    {
+        PantheonImpl *service = static_cast<PantheonImpl *>(arg);
+        QueryQueue::Job job;
+        while (service->queries_.Take(job))
+        {
+            std::cout << "\r"
+                      << "[" << job.client_id << "] "
+                      << "4.Querying..." << std::flush;
+            try
+            {
+                if (!service->load_client(job.client_id))
+                {
+                    job.reactor->Finish(Status(StatusCode::UNAUTHENTICATED, "client haven't setup yet!"));
+                    service->queries_.Done(std::chrono::steady_clock::duration::zero());
+                    continue;
+                }
+            }
+            catch (const std::exception &e)
+            {
+                job.reactor->Finish(Status(StatusCode::INTERNAL, e.what()));
+                service->queries_.Done(std::chrono::steady_clock::duration::zero());
+                continue;
+            }
 
-        std::stringstream ss(request->qss());
-        server->QueryExpand(ss);
-        server->Process1();
-        server->Process2(); // result to server->ss
+            // The stages stop between rows, columns and rotations once the caller is gone or out of time
+            auto context = job.context;
+            auto cancel = std::make_shared<const CancellationToken>([context]
+                                                                    { return context->IsCancelled() || std::chrono::system_clock::now() > context->deadline(); });
 
-        response->set_ss(server->ss.str());
-        server->ss.clear();
-        server->ss.str("");
+            // The query is read from the request bytes, which live until the reactor finishes
+            const string &qss = job.request->qss();
+            service->scheduler_->Submit(qss.data(), qss.size(), cancel, [service, job](PIRScheduler::Result &result)
+                                        { service->finish_query(job, result); });
+        }
+        return nullptr;
+    }
+
+    void finish_query(const QueryQueue::Job &job, PIRScheduler::Result &result)
+    {
+        Status status = Status::OK;
+        if (result.error)
+        {
+            try
+            {
+                std::rethrow_exception(result.error);
+            }
+            catch (const QueryCancelled &)
+            {
+                // The server state is intact, so the client stays loaded
+                status = job.context->IsCancelled() ? Status::CANCELLED : Status(StatusCode::DEADLINE_EXCEEDED, "query ran past its deadline");
+                std::cout << "\r"
+                          << "[" << job.client_id << "] "
+                          << "4.Query cancelled." << std::endl;
+            }
+            catch (const std::exception &e)
+            {
+                forget_client(job.client_id);
+                status = Status(StatusCode::INTERNAL, e.what());
+            }
+        }
+        else
+        {
+            // The response moves into the reply without a copy
+            job.response->mutable_ss()->swap(result.response);
+            std::cout << "\r"
+                      << "[" << job.client_id << "] "
+                      << "4.Query finished." << std::endl;
+        }
+        job.reactor->Finish(status);
 
-        std::cout << "\r"
-                  << "[" << client_id << "] "
-                  << "4.Query finished." << std::endl;
-        return Status::OK;
+        // Queries leave the stages every max(Process1, Process2), which is what a query waits per query ahead of it
+        queries_.Done(std::max(result.process1_time, result.process2_time));
+        if (++finished_ % QUEUE_REPORT_INTERVAL == 0)
+        {
+            queries_.Report(std::cout);
+            auto arenas = server->GetArenaStats();
+            std::cout << "[arena] reserved " << arenas.reserved_bytes << " bytes, high-water mark " << arenas.high_water_bytes
+                      << " bytes; grew " << arenas.growth_count << " times by " << arenas.grown_bytes << " bytes" << std::endl;
+        }
     }
 };
 
@@ -146,11 +537,12 @@ void RunServer()
     vector<string> db_elems = {"Aapple", "Abanana", "Acat", "Adog"};
 
     PIRServer server(number_of_items, key_size, obj_size);
-    PantheonImpl service(&server, &db_keys, &db_elems, keys_file_dir);
-
     /* server pre-process */
     server.SetupCryptoParams();
 
+    // The scheduler splits the threads between the stages, which sizes and warms the arenas of the parameters
+    PantheonImpl service(&server, &db_keys, &db_elems, keys_file_dir, MAX_QUEUED_QUERIES, CLIENT_QUERY_RATE, CLIENT_QUERY_BURST);
+
     /* gRPC build */
     ServerBuilder builder;
     std::string server_address("0.0.0.0:50051");
@@ -0,0 +1,318 @@
+#include "KernelArena.h"
+#include <algorithm>
+#include <stdexcept>
+#include "seal/util/uintcore.h"
+
+using namespace seal;
+using namespace seal::util;
+using namespace std;
+
+namespace
+{
+    using Footprint = map<size_t, size_t>;
+
+    void add(Footprint &footprint, size_t word_count, size_t count = 1)
+    {
+        if (word_count && count)
+        {
+            footprint[word_count] += count;
+        }
+    }
+
+    void add(Footprint &footprint, const Footprint &other)
+    {
+        for (auto &block : other)
+        {
+            add(footprint, block.first, block.second);
+        }
+    }
+
+    // For blocks that are never live at the same time as the ones already in footprint
+    void merge_max(Footprint &footprint, const Footprint &other)
+    {
+        for (auto &block : other)
+        {
+            auto &count = footprint[block.first];
+            count = max(count, block.second);
+        }
+    }
+
+    size_t byte_count(const Footprint &footprint)
+    {
+        size_t total = 0;
+        for (auto &block : footprint)
+        {
+            total += block.first * block.second * sizeof(uint64_t);
+        }
+        return total;
+    }
+} // namespace
+
+KernelArena::KernelArena(const KernelContext &context, size_t arena_count) : context_(context)
+{
+    for (size_t i = 0; i < arena_count; i++)
+    {
+        arenas_.push_back(Arena{ MemoryPoolHandle::New(), Footprint(), Footprint(), 0 });
+    }
+}
+
+KernelArena::Arena &KernelArena::arena(size_t index)
+{
+    if (index >= arenas_.size())
+    {
+        throw out_of_range("index");
+    }
+    return arenas_[index];
+}
+
+void KernelArena::merge_scratch(size_t index, const Footprint &footprint)
+{
+    merge_max(arena(index).scratch, footprint);
+}
+
+void KernelArena::reserve_square(size_t index, parms_id_type parms_id)
+{
+    auto &level = context_.level(parms_id);
+    size_t n = level.coeff_count;
+    size_t q_size = level.coeff_modulus_size;
+    size_t B_size = level.rns_tool->base_B()->size();
+    size_t Bsk_size = level.rns_tool->base_Bsk()->size();
+
+    // Live for the whole call: the q and Bsk copies, the m_tilde lift, the products and the floor input
+    Footprint footprint;
+    add(footprint, 2 * n * q_size);
+    add(footprint, 2 * n * Bsk_size);
+    add(footprint, n * (Bsk_size + 1));
+    add(footprint, n * q_size);
+    add(footprint, 3 * n * q_size);
+    add(footprint, 3 * n * Bsk_size);
+    add(footprint, n * (q_size + Bsk_size));
+    add(footprint, n * Bsk_size);
+
+    // One at a time: base conversion temporaries, r_m_tilde, and the Shenoy-Kumaresan step
+    Footprint step;
+    add(step, n * q_size);
+    merge_max(step, Footprint{ { n, 1 } });
+    Footprint sk;
+    add(sk, n * B_size);
+    add(sk, n, 2);
+    merge_max(step, sk);
+
+    add(footprint, step);
+    merge_scratch(index, footprint);
+}
+
+void KernelArena::reserve_multiply(size_t index, parms_id_type parms_id)
+{
+    auto &level = context_.level(parms_id);
+    size_t n = level.coeff_count;
+    size_t q_size = level.coeff_modulus_size;
+    size_t B_size = level.rns_tool->base_B()->size();
+    size_t Bsk_size = level.rns_tool->base_Bsk()->size();
+
+    // Live for the whole call: the q and Bsk copies of both operands, the products and the floor input
+    Footprint footprint;
+    add(footprint, 2 * n * q_size, 2);
+    add(footprint, 2 * n * Bsk_size, 2);
+    add(footprint, 3 * n * q_size);
+    add(footprint, 3 * n * Bsk_size);
+    add(footprint, n * (q_size + Bsk_size));
+    add(footprint, n * Bsk_size);
+
+    // One at a time: the base extension with its two lifts, and the Shenoy-Kumaresan step
+    Footprint step;
+    add(step, n * (Bsk_size + 1), 2);
+    add(step, n * q_size);
+    add(step, n);
+    Footprint sk;
+    add(sk, n * B_size);
+    add(sk, n, 2);
+    merge_max(step, sk);
+
+    add(footprint, step);
+    merge_scratch(index, footprint);
+}
+
+KernelArena::Footprint KernelArena::switch_key_footprint(parms_id_type parms_id, int num_threads) const
+{
+    auto &level = context_.level(parms_id);
+    size_t n = level.coeff_count;
+    size_t decomp_size = level.coeff_modulus_size;
+    size_t key_component_count = 2;
+    // Threads beyond the number of output primes get no loop iteration and allocate nothing
+    size_t thread_count = min(static_cast<size_t>(max(num_threads, 1)), decomp_size + 1);
+
+    // The target copy and the products, plus a lazy accumulator per thread
+    Footprint footprint;
+    add(footprint, n * decomp_size);
+    add(footprint, key_component_count * n * (decomp_size + 1));
+    add(footprint, key_component_count * n * 2, thread_count);
+
+    size_t digit_count = context_.key_switch_digit_count();
+    if (digit_count == context_.key_switch_prime_count())
+    {
+        // An NTT buffer per thread
+        add(footprint, n, thread_count);
+    }
+    else
+    {
+        // Every digit raised to the level, and the scaled input of one base conversion at a time
+        auto &digits = context_.key_switch_digits(parms_id, digit_count);
+        add(footprint, digits.size() * n * (decomp_size + 1));
+        Footprint conversion;
+        for (auto &digit : digits)
+        {
+            merge_max(conversion, Footprint{ { n * digit.size, 1 } });
+        }
+        add(footprint, conversion);
+    }
+    return footprint;
+}
+
+void KernelArena::reserve_relinearize(size_t index, parms_id_type parms_id, int num_threads)
+{
+    merge_scratch(index, switch_key_footprint(parms_id, num_threads));
+}
+
+void KernelArena::reserve_rotate(size_t index, parms_id_type parms_id, int num_threads)
+{
+    auto &level = context_.level(parms_id);
+
+    // The permuted first component next to the key switching scratch
+    Footprint footprint = switch_key_footprint(parms_id, num_threads);
+    add(footprint, level.coeff_count * level.coeff_modulus_size);
+    merge_scratch(index, footprint);
+}
+
+void KernelArena::reserve_rotate_hoisted(size_t index, parms_id_type parms_id, int num_threads)
+{
+    auto &level = context_.level(parms_id);
+    size_t n = level.coeff_count;
+    size_t decomp_size = level.coeff_modulus_size;
+    size_t rns_size = decomp_size + 1;
+    size_t thread_count = min(static_cast<size_t>(max(num_threads, 1)), rns_size);
+
+    // Live for the whole call: the coefficient-form target and the raised digits
+    Footprint footprint;
+    add(footprint, n * decomp_size);
+
+    // One at a time: a base conversion while raising, or the products of one rotation with their accumulators
+    // and the NTT buffers of the modulus switch
+    Footprint step;
+    add(step, 2 * n * rns_size);
+    add(step, 2 * n * 2, thread_count);
+    add(step, n, thread_count);
+
+    size_t digit_count = context_.key_switch_digit_count();
+    if (digit_count == context_.key_switch_prime_count())
+    {
+        add(footprint, decomp_size * n * rns_size);
+    }
+    else
+    {
+        auto &digits = context_.key_switch_digits(parms_id, digit_count);
+        add(footprint, digits.size() * n * rns_size);
+        for (auto &digit : digits)
+        {
+            Footprint conversion;
+            add(conversion, n * (rns_size - digit.size));
+            add(conversion, n * digit.size);
+            merge_max(step, conversion);
+        }
+    }
+
+    add(footprint, step);
+    merge_scratch(index, footprint);
+}
+
+void KernelArena::reserve_rescale(size_t index, parms_id_type from, parms_id_type to)
+{
+    auto &from_level = context_.level(from);
+    auto &to_level = context_.level(to);
+    size_t n = from_level.coeff_count;
+    size_t keep_size = to_level.coeff_modulus_size;
+    if (keep_size > from_level.coeff_modulus_size)
+    {
+        throw invalid_argument("cannot rescale to a higher level");
+    }
+    size_t drop_size = from_level.coeff_modulus_size - keep_size;
+
+    // The rescaled ciphertext, the lifted residues modulo P and their conversion with its temporary
+    Footprint footprint;
+    add(footprint, 2 * n * keep_size);
+    add(footprint, n * drop_size, 2);
+    add(footprint, n * keep_size);
+    merge_scratch(index, footprint);
+}
+
+void KernelArena::reserve_ciphertexts(size_t index, parms_id_type parms_id, size_t size, size_t count)
+{
+    auto &level = context_.level(parms_id);
+    add(arena(index).storage, size * level.coeff_count * level.coeff_modulus_size, count);
+}
+
+void KernelArena::warm_up()
+{
+    for (auto &arena : arenas_)
+    {
+        Footprint footprint = arena.scratch;
+        add(footprint, arena.storage);
+
+        // All blocks of a size must be live at once, otherwise the pool hands the same block out again
+        vector<Pointer<uint64_t>> blocks;
+        for (auto &block : footprint)
+        {
+            for (size_t i = 0; i < block.second; i++)
+            {
+                blocks.push_back(allocate_uint(block.first, arena.pool));
+            }
+        }
+        blocks.clear();
+        arena.baseline_byte_count = arena.pool.alloc_byte_count();
+    }
+}
+
+size_t KernelArena::reserved_byte_count(size_t index) const
+{
+    if (index >= arenas_.size())
+    {
+        throw out_of_range("index");
+    }
+    return byte_count(arenas_[index].scratch) + byte_count(arenas_[index].storage);
+}
+
+size_t KernelArena::total_high_water_mark() const
+{
+    size_t byte_count = 0;
+    for (size_t i = 0; i < arenas_.size(); i++)
+    {
+        byte_count += high_water_mark(i);
+    }
+    return byte_count;
+}
+
+size_t KernelArena::end_query()
+{
+    size_t grown_count = 0;
+    for (size_t i = 0; i < arenas_.size(); i++)
+    {
+        size_t alloc_byte_count = arenas_[i].pool.alloc_byte_count();
+        if (alloc_byte_count > arenas_[i].baseline_byte_count)
+        {
+            grown_byte_count_.fetch_add(alloc_byte_count - arenas_[i].baseline_byte_count, memory_order_relaxed);
+            arenas_[i].baseline_byte_count = alloc_byte_count;
+            grown_count++;
+        }
+    }
+    growth_count_.fetch_add(grown_count, memory_order_relaxed);
+    return grown_count;
+}
+
+void KernelArena::report(ostream &out) const
+{
+    for (size_t i = 0; i < arenas_.size(); i++)
+    {
+        out << "arena " << i << ": reserved " << reserved_byte_count(i) << " bytes, high-water mark "
+            << high_water_mark(i) << " bytes" << endl;
+    }
+}
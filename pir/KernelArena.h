@@ -0,0 +1,106 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <map>
+#include <ostream>
+#include <vector>
+#include "seal/memorymanager.h"
+#include "KernelContext.h"
+
+/*
+Per-thread scratch pools for the my_* kernels, sized from the encryption parameters.
+
+Every arena is its own MemoryPoolHandle, so threads working on different arenas never share a free list.
+The reserve_* calls record the blocks a kernel takes from its pool at a given level; warm_up() allocates
+all of them at once and hands them back, which leaves them on the free lists of the pool. Kernel calls
+matching the reservations then only reuse blocks, and since a SEAL pool never frees what it holds, the
+memory is simply reused by the next query.
+
+Kernel scratch is reserved as the maximum over the kernels run on an arena, since an arena is used by one
+thread at a time. Ciphertext storage lives next to that scratch and is reserved on top of it.
+*/
+class KernelArena
+{
+public:
+    KernelArena(const KernelContext &context, std::size_t arena_count);
+
+    KernelArena(const KernelArena &) = delete;
+    KernelArena &operator=(const KernelArena &) = delete;
+
+    std::size_t size() const
+    {
+        return arenas_.size();
+    }
+
+    const seal::MemoryPoolHandle &pool(std::size_t index) const
+    {
+        return arenas_[index].pool;
+    }
+
+    // Scratch of the kernels on ciphertexts at the level of parms_id; num_threads is the team size passed to them
+    void reserve_square(std::size_t index, seal::parms_id_type parms_id);
+    void reserve_multiply(std::size_t index, seal::parms_id_type parms_id);
+    void reserve_relinearize(std::size_t index, seal::parms_id_type parms_id, int num_threads);
+    void reserve_rotate(std::size_t index, seal::parms_id_type parms_id, int num_threads);
+    void reserve_rotate_hoisted(std::size_t index, seal::parms_id_type parms_id, int num_threads);
+    void reserve_rescale(std::size_t index, seal::parms_id_type from, seal::parms_id_type to);
+
+    // Storage of count ciphertexts with the given size whose data is allocated from this arena
+    void reserve_ciphertexts(std::size_t index, seal::parms_id_type parms_id, std::size_t size, std::size_t count);
+
+    // Allocates every reserved block once and releases it again; may be called again after more reservations
+    void warm_up();
+
+    // Bytes recorded by the reserve_* calls
+    std::size_t reserved_byte_count(std::size_t index) const;
+
+    // Bytes held by the pool; pools never release memory, so this is also the high-water mark
+    std::size_t high_water_mark(std::size_t index) const
+    {
+        return arenas_[index].pool.alloc_byte_count();
+    }
+
+    // Bytes held by all pools together
+    std::size_t total_high_water_mark() const;
+
+    // Call between queries. Counts every arena that grew since the last call and returns how many did; in steady
+    // state this is zero.
+    std::size_t end_query();
+
+    // Arena growths counted by end_query and the bytes they added; may be read from any thread
+    std::size_t growth_count() const
+    {
+        return growth_count_.load(std::memory_order_relaxed);
+    }
+
+    std::size_t grown_byte_count() const
+    {
+        return grown_byte_count_.load(std::memory_order_relaxed);
+    }
+
+    void report(std::ostream &out) const;
+
+private:
+    // Block size in uint64_t words -> number of blocks
+    using Footprint = std::map<std::size_t, std::size_t>;
+
+    struct Arena
+    {
+        seal::MemoryPoolHandle pool;
+        Footprint scratch;
+        Footprint storage;
+        std::size_t baseline_byte_count;
+    };
+
+    Arena &arena(std::size_t index);
+
+    void merge_scratch(std::size_t index, const Footprint &footprint);
+
+    Footprint switch_key_footprint(seal::parms_id_type parms_id, int num_threads) const;
+
+    const KernelContext &context_;
+    std::vector<Arena> arenas_;
+    std::atomic<std::size_t> growth_count_{ 0 };
+    std::atomic<std::size_t> grown_byte_count_{ 0 };
+};
@@ -0,0 +1,209 @@
+#include "KernelContext.h"
+#include <algorithm>
+#include <stdexcept>
+
+using namespace seal;
+using namespace seal::util;
+using namespace std;
+
+KernelContext::KernelContext(const SEALContext &context, bool validate) : context_(context), validate_(validate)
+{
+    if (!context_.parameters_set())
+    {
+        throw invalid_argument("encryption parameters are not set correctly");
+    }
+
+    for (auto context_data = context_.key_context_data(); context_data; context_data = context_data->next_context_data())
+    {
+        Level level;
+        level.context_data = context_data.get();
+        level.parms = &context_data->parms();
+        level.coeff_modulus = context_data->parms().coeff_modulus().data();
+        level.ntt_tables = context_data->small_ntt_tables();
+        level.rns_tool = context_data->rns_tool();
+        level.galois_tool = context_data->galois_tool();
+        level.coeff_count = context_data->parms().poly_modulus_degree();
+        level.coeff_modulus_size = context_data->parms().coeff_modulus().size();
+        levels_.emplace(context_data->parms_id(), level);
+    }
+    key_level_ = &levels_.at(context_.key_parms_id());
+    key_switch_digit_count_ = key_switch_prime_count();
+}
+
+const KernelContext::Level &KernelContext::level(parms_id_type parms_id) const
+{
+    auto found = levels_.find(parms_id);
+    if (found == levels_.end())
+    {
+        throw invalid_argument("parms_id is not valid for encryption parameters");
+    }
+    return found->second;
+}
+
+const uint32_t *KernelContext::galois_permutation(uint32_t galois_elt) const
+{
+    lock_guard<mutex> lock(cache_mutex_);
+    auto found = galois_permutations_.find(galois_elt);
+    if (found != galois_permutations_.end())
+    {
+        return found->second.data();
+    }
+
+    // Same index computation as GaloisTool::apply_galois, done once per element
+    size_t coeff_count = key_level_->coeff_count;
+    int coeff_count_power = get_power_of_two(coeff_count);
+    uint64_t coeff_count_minus_one = coeff_count - 1;
+    vector<uint32_t> permutation(coeff_count);
+    for (size_t i = 0; i < coeff_count; i++)
+    {
+        uint64_t index_raw = i * static_cast<uint64_t>(galois_elt);
+        uint32_t index = static_cast<uint32_t>(index_raw & coeff_count_minus_one);
+        if ((index_raw >> coeff_count_power) & 1)
+        {
+            index |= GALOIS_NEGATE_FLAG;
+        }
+        permutation[i] = index;
+    }
+    return galois_permutations_.emplace(galois_elt, move(permutation)).first->second.data();
+}
+
+const uint32_t *KernelContext::galois_permutation_ntt(uint32_t galois_elt) const
+{
+    lock_guard<mutex> lock(cache_mutex_);
+    auto found = galois_permutations_ntt_.find(galois_elt);
+    if (found != galois_permutations_ntt_.end())
+    {
+        return found->second.data();
+    }
+
+    // Same table as GaloisTool::generate_table_ntt. Slot i holds the evaluation at psi^e with e = 2 * rev(i) + 1,
+    // which is the bit reversal of N + i; x -> x^galois_elt moves it to e * galois_elt mod 2N.
+    size_t coeff_count = key_level_->coeff_count;
+    int coeff_count_power = get_power_of_two(coeff_count);
+    uint64_t coeff_count_minus_one = coeff_count - 1;
+    vector<uint32_t> permutation(coeff_count);
+    for (size_t i = 0; i < coeff_count; i++)
+    {
+        uint32_t reversed = reverse_bits<uint32_t>(static_cast<uint32_t>(coeff_count + i), coeff_count_power + 1);
+        uint64_t index_raw = ((static_cast<uint64_t>(galois_elt) * reversed) >> 1) & coeff_count_minus_one;
+        permutation[i] = reverse_bits<uint32_t>(static_cast<uint32_t>(index_raw), coeff_count_power);
+    }
+    return galois_permutations_ntt_.emplace(galois_elt, move(permutation)).first->second.data();
+}
+
+const MultiLevelRescaleTool &KernelContext::rescale_tool(parms_id_type from, parms_id_type to) const
+{
+    auto &context_data = *level(from).context_data;
+    auto &target_context_data = *level(to).context_data;
+
+    lock_guard<mutex> lock(cache_mutex_);
+    auto key = make_pair(from, to);
+    auto found = rescale_tools_.find(key);
+    if (found != rescale_tools_.end())
+    {
+        return *found->second;
+    }
+
+    auto &coeff_modulus = context_data.parms().coeff_modulus();
+    size_t keep_size = target_context_data.parms().coeff_modulus().size();
+    vector<Modulus> keep_base(coeff_modulus.begin(), coeff_modulus.begin() + keep_size);
+    vector<Modulus> drop_base(coeff_modulus.begin() + keep_size, coeff_modulus.end());
+
+    auto pool = MemoryManager::GetPool();
+    auto tool = make_unique<MultiLevelRescaleTool>();
+    tool->keep_size = keep_size;
+    tool->drop_size = drop_base.size();
+    tool->drop_to_keep_conv = allocate<BaseConverter>(pool, RNSBase(drop_base, pool), RNSBase(keep_base, pool), pool);
+
+    // P is odd, so floor(P/2) = (P - 1) / 2, which is (q_j - 1) / 2 modulo a dropped prime q_j
+    for (auto &modulus : drop_base)
+    {
+        tool->half_mod_drop.push_back(modulus.value() >> 1);
+    }
+    for (auto &modulus : keep_base)
+    {
+        uint64_t drop_prod = 1;
+        for (auto &drop_modulus : drop_base)
+        {
+            drop_prod = multiply_uint_mod(drop_prod, barrett_reduce_64(drop_modulus.value(), modulus), modulus);
+        }
+        uint64_t inv_two = (modulus.value() + 1) >> 1;
+        tool->half_mod_keep.push_back(multiply_uint_mod(sub_uint_mod(drop_prod, 1, modulus), inv_two, modulus));
+
+        uint64_t inv_drop_prod;
+        if (!try_invert_uint_mod(drop_prod, modulus, inv_drop_prod))
+        {
+            throw logic_error("invalid rns bases");
+        }
+        MultiplyUIntModOperand inv_drop_prod_operand;
+        inv_drop_prod_operand.set(inv_drop_prod, modulus);
+        tool->inv_drop_prod_mod_keep.push_back(inv_drop_prod_operand);
+    }
+
+    return *rescale_tools_.emplace(key, move(tool)).first->second;
+}
+
+size_t KernelContext::key_switch_digit_size(size_t digit_count) const
+{
+    size_t prime_count = key_switch_prime_count();
+    if (!digit_count || digit_count > prime_count)
+    {
+        throw invalid_argument("digit_count must be between 1 and the number of data primes");
+    }
+    return (prime_count + digit_count - 1) / digit_count;
+}
+
+bool KernelContext::is_key_switch_digit_count(size_t digit_count) const
+{
+    size_t prime_count = key_switch_prime_count();
+    if (!digit_count || digit_count > prime_count)
+    {
+        return false;
+    }
+    size_t digit_size = key_switch_digit_size(digit_count);
+    return (prime_count + digit_size - 1) / digit_size == digit_count;
+}
+
+void KernelContext::set_key_switch_digit_count(size_t digit_count)
+{
+    if (!is_key_switch_digit_count(digit_count))
+    {
+        throw invalid_argument("digit_count does not split the data primes into that many digits");
+    }
+    key_switch_digit_count_ = digit_count;
+}
+
+const vector<KeySwitchDigit> &KernelContext::key_switch_digits(parms_id_type parms_id, size_t digit_count) const
+{
+    auto &level = this->level(parms_id);
+    size_t digit_size = key_switch_digit_size(digit_count);
+
+    lock_guard<mutex> lock(cache_mutex_);
+    auto key = make_pair(parms_id, digit_count);
+    auto found = key_switch_digits_.find(key);
+    if (found != key_switch_digits_.end())
+    {
+        return found->second;
+    }
+
+    size_t decomp_size = level.coeff_modulus_size;
+    auto &special_modulus = key_level_->coeff_modulus[key_level_->coeff_modulus_size - 1];
+    auto pool = MemoryManager::GetPool();
+    vector<KeySwitchDigit> digits;
+    for (size_t start = 0; start < decomp_size; start += digit_size)
+    {
+        size_t end = min(start + digit_size, decomp_size);
+        vector<Modulus> digit_base(level.coeff_modulus + start, level.coeff_modulus + end);
+        vector<Modulus> rest_base(level.coeff_modulus, level.coeff_modulus + start);
+        rest_base.insert(rest_base.end(), level.coeff_modulus + end, level.coeff_modulus + decomp_size);
+        rest_base.push_back(special_modulus);
+
+        KeySwitchDigit digit;
+        digit.start = start;
+        digit.size = end - start;
+        digit.digit_to_rest_conv =
+            allocate<BaseConverter>(pool, RNSBase(digit_base, pool), RNSBase(rest_base, pool), pool);
+        digits.push_back(move(digit));
+    }
+    return key_switch_digits_.emplace(key, move(digits)).first->second;
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "seal/context.h"
+#include "seal/memorymanager.h"
+#include "seal/util/galois.h"
+#include "seal/util/ntt.h"
+#include "seal/util/rns.h"
+#include "seal/util/uintarithsmallmod.h"
+
+// Precomputation for dropping the primes P = q_{l'} * ... * q_{l-1} from level l to level l' in one step
+struct MultiLevelRescaleTool
+{
+    std::size_t keep_size;
+    std::size_t drop_size;
+    seal::util::Pointer<seal::util::BaseConverter> drop_to_keep_conv;
+    std::vector<std::uint64_t> half_mod_drop;                              // floor(P/2) mod q_j, dropped primes
+    std::vector<std::uint64_t> half_mod_keep;                              // floor(P/2) mod q_i, kept primes
+    std::vector<seal::util::MultiplyUIntModOperand> inv_drop_prod_mod_keep; // P^(-1) mod q_i, kept primes
+};
+
+// One digit of a hybrid key switching decomposition at some level: the data primes [start, start + size) and the
+// conversion of their residues to the other data primes of the level followed by the special prime
+struct KeySwitchDigit
+{
+    std::size_t start;
+    std::size_t size;
+    seal::util::Pointer<seal::util::BaseConverter> digit_to_rest_conv;
+};
+
+/*
+Everything the my_* kernels in utils.cpp look up per call, built once per parameter set and shared by all
+threads. Level handles are filled in the constructor and never change afterwards; Galois permutation tables
+and rescale tools are built on first use under a lock.
+
+With validation turned off the kernels skip their metadata checks, which is meant for the server hot paths
+once the inputs are known to come from this context.
+*/
+class KernelContext
+{
+public:
+    struct Level
+    {
+        const seal::SEALContext::ContextData *context_data;
+        const seal::EncryptionParameters *parms;
+        const seal::Modulus *coeff_modulus;
+        const seal::util::NTTTables *ntt_tables;
+        const seal::util::RNSTool *rns_tool;
+        const seal::util::GaloisTool *galois_tool;
+        std::size_t coeff_count;
+        std::size_t coeff_modulus_size;
+    };
+
+    explicit KernelContext(const seal::SEALContext &context, bool validate = true);
+
+    // Level handles point into this object
+    KernelContext(const KernelContext &) = delete;
+    KernelContext &operator=(const KernelContext &) = delete;
+
+    // The copy kept alive by this object; kernels hand it to SEAL calls that need a SEALContext
+    const seal::SEALContext &seal_context() const
+    {
+        return context_;
+    }
+
+    // Throws invalid_argument if parms_id does not belong to this context
+    const Level &level(seal::parms_id_type parms_id) const;
+
+    const Level &key_level() const
+    {
+        return *key_level_;
+    }
+
+    seal::parms_id_type key_parms_id() const
+    {
+        return context_.key_parms_id();
+    }
+
+    bool validate() const
+    {
+        return validate_;
+    }
+
+    void set_validate(bool validate)
+    {
+        validate_ = validate;
+    }
+
+    // Destination index of every coefficient under x -> x^galois_elt; GALOIS_NEGATE_FLAG marks a negation
+    const std::uint32_t *galois_permutation(std::uint32_t galois_elt) const;
+
+    // Source index of every NTT slot under x -> x^galois_elt; the automorphism only permutes NTT slots
+    const std::uint32_t *galois_permutation_ntt(std::uint32_t galois_elt) const;
+
+    std::uint32_t galois_elt_from_step(int step) const
+    {
+        return key_level_->galois_tool->get_elt_from_step(step);
+    }
+
+    const MultiLevelRescaleTool &rescale_tool(seal::parms_id_type from, seal::parms_id_type to) const;
+
+    // Number of data primes of the key level, which is also the digit count of SEAL's per-prime decomposition
+    std::size_t key_switch_prime_count() const
+    {
+        return key_level_->coeff_modulus_size - 1;
+    }
+
+    // Digit count of the key switching keys in use; key generation and arena sizing follow it, while the
+    // kernels take the decomposition from the keys they are given
+    std::size_t key_switch_digit_count() const
+    {
+        return key_switch_digit_count_;
+    }
+
+    // Throws invalid_argument unless is_key_switch_digit_count(digit_count)
+    void set_key_switch_digit_count(std::size_t digit_count);
+
+    // Primes per digit for digit_count digits; only the last digit may be smaller
+    std::size_t key_switch_digit_size(std::size_t digit_count) const;
+
+    // Whether digit_count digits of key_switch_digit_size primes cover the data primes without an empty digit.
+    // Counts like 5 digits of 12 primes give the same digits as 4 and are rejected, so a key vector always
+    // holds exactly one key per digit.
+    bool is_key_switch_digit_count(std::size_t digit_count) const;
+
+    // The non-empty digits at the level of parms_id, in order
+    const std::vector<KeySwitchDigit> &key_switch_digits(seal::parms_id_type parms_id, std::size_t digit_count) const;
+
+    static constexpr std::uint32_t GALOIS_NEGATE_FLAG = 0x80000000U;
+
+private:
+    seal::SEALContext context_;
+    bool validate_;
+    std::unordered_map<seal::parms_id_type, Level> levels_;
+    const Level *key_level_;
+    std::size_t key_switch_digit_count_;
+
+    mutable std::mutex cache_mutex_;
+    mutable std::unordered_map<std::uint32_t, std::vector<std::uint32_t>> galois_permutations_;
+    mutable std::unordered_map<std::uint32_t, std::vector<std::uint32_t>> galois_permutations_ntt_;
+    mutable std::map<std::pair<seal::parms_id_type, seal::parms_id_type>, std::unique_ptr<MultiLevelRescaleTool>>
+        rescale_tools_;
+    mutable std::map<std::pair<seal::parms_id_type, std::size_t>, std::vector<KeySwitchDigit>> key_switch_digits_;
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+/*
+Compile-time shapes for the hot kernels in utils.cpp.
+
+A kernel body takes its coefficient count and limb count as template parameters that are either size_t or a
+KernelConstant. dispatch_kernel_shape instantiates it once per shape in SpecializedKernelShapes, where the
+coefficient and limb loops have constant trip counts the compiler can unroll and vectorize, and once with plain
+size_t for every other parameter set. Any shape is correct; the list only decides which ones are fast.
+
+The listed shapes are those of the parameters in globals.h: N = 32768 with 12 data primes at the first level and
+3 after MOD_SWITCH_COUNT primes are dropped, each with one more limb for the special prime or for m_sk in BEHZ.
+*/
+
+template <std::size_t Value>
+using KernelConstant = std::integral_constant<std::size_t, Value>;
+
+template <std::size_t CoeffCount, std::size_t... LimbCounts>
+struct KernelShapes
+{
+    template <typename Kernel>
+    static void dispatch(std::size_t coeff_count, std::size_t limb_count, Kernel &kernel)
+    {
+        if (coeff_count == CoeffCount &&
+            ((limb_count == LimbCounts && (kernel(KernelConstant<CoeffCount>(), KernelConstant<LimbCounts>()), true)) || ...))
+        {
+            return;
+        }
+        kernel(coeff_count, limb_count);
+    }
+};
+
+using SpecializedKernelShapes = KernelShapes<32768, 3, 4, 12, 13>;
+
+// Calls kernel(coeff_count, limb_count) with the matching specialization, or with the runtime values
+template <typename Kernel>
+inline void dispatch_kernel_shape(std::size_t coeff_count, std::size_t limb_count, Kernel &&kernel)
+{
+    SpecializedKernelShapes::dispatch(coeff_count, limb_count, kernel);
+}
@@ -0,0 +1,445 @@
+#include "KeySwitching.h"
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include "seal/valcheck.h"
+#include "seal/util/polyarithsmallmod.h"
+#include "seal/util/rlwe.h"
+#include "utils.h"
+
+using namespace seal;
+using namespace seal::util;
+using namespace std;
+
+namespace
+{
+    // Single-limb multiply passes of one switch at a level with decomp_size data primes. An NTT costs about
+    // log2(N) / 2 passes; the modulus switch back down is the same for every decomposition and left out.
+    double switch_cost(size_t decomp_size, size_t digit_size, double log_coeff_count)
+    {
+        size_t rns_size = decomp_size + 1;
+        double cost = 0;
+        for (size_t start = 0; start < decomp_size; start += digit_size)
+        {
+            size_t size = min(digit_size, decomp_size - start);
+
+            // The NTTs of the raised digit and its products with both key components
+            cost += rns_size * log_coeff_count / 2 + 2 * rns_size;
+
+            // The base conversion scales every input limb and takes a dot product per output limb
+            if (size > 1)
+            {
+                cost += size + size * (rns_size - size);
+            }
+        }
+        return cost;
+    }
+
+    // Bits by which a digit product exceeds the special prime, which is what remains of it after the modulus switch
+    double switch_noise_bits(const KernelContext &context, size_t digit_size)
+    {
+        auto &key_level = context.key_level();
+        size_t prime_count = context.key_switch_prime_count();
+        double special_bits = log2(static_cast<double>(key_level.coeff_modulus[prime_count].value()));
+
+        double noise_bits = 0;
+        for (size_t start = 0; start < prime_count; start += digit_size)
+        {
+            size_t end = min(start + digit_size, prime_count);
+            double digit_bits = log2(static_cast<double>(end - start));
+            for (size_t i = start; i < end; i++)
+            {
+                digit_bits += log2(static_cast<double>(key_level.coeff_modulus[i].value()));
+            }
+            noise_bits = max(noise_bits, digit_bits - special_bits);
+        }
+        return noise_bits;
+    }
+
+    // Share of a rotation at the level of parms_id that is left for each rotation once its digits are raised
+    double hoisted_rotation_share(const KernelContext &context, parms_id_type parms_id)
+    {
+        size_t decomp_size = context.level(parms_id).coeff_modulus_size;
+        size_t rns_size = decomp_size + 1;
+        double ntt_cost = log2(static_cast<double>(context.key_level().coeff_count)) / 2;
+        size_t digit_size = context.key_switch_digit_size(context.key_switch_digit_count());
+
+        // Raising takes the inverse NTT of the target and an NTT per digit and output prime after the conversions;
+        // what is left are the permutations, the key products and the modulus switch back
+        double raise_cost = decomp_size * ntt_cost;
+        double apply_cost = 2 * rns_size + 2 * (decomp_size + 1) * ntt_cost;
+        for (size_t start = 0; start < decomp_size; start += digit_size)
+        {
+            size_t size = min(digit_size, decomp_size - start);
+            raise_cost += rns_size * ntt_cost;
+            if (size > 1)
+            {
+                raise_cost += size + size * (rns_size - size);
+            }
+            apply_cost += 2 * rns_size;
+        }
+        return apply_cost / (raise_cost + apply_cost);
+    }
+
+    vector<int> column_rotation_steps(size_t baby_steps, size_t giant_steps, size_t stride, bool hoisted_babies, bool giant_tree)
+    {
+        set<int> steps;
+        for (size_t b = 1; b < baby_steps; b++)
+        {
+            if (hoisted_babies || !(b & (b - 1)))
+            {
+                steps.insert(-static_cast<int>(b * stride));
+            }
+        }
+        for (size_t g = 1; g < giant_steps; g++)
+        {
+            if (!giant_tree || !(g & (g - 1)))
+            {
+                steps.insert(-static_cast<int>(g * baby_steps * stride));
+            }
+        }
+        return vector<int>(steps.begin(), steps.end());
+    }
+
+    int row_step(int step, int row_size)
+    {
+        return (step % row_size + row_size) % row_size;
+    }
+
+    // Shortest sums of key steps for every target from a breadth-first search modulo row_size, with the key
+    // switches they add; false if a target cannot be reached
+    bool compose_rotation_keys(
+        const vector<int> &key_steps, const map<int, size_t> &counts, int row_size, RotationKeyPlan &plan)
+    {
+        vector<int> via(row_size, 0);
+        vector<char> seen(row_size, 0);
+        vector<int> queue{ 0 };
+        seen[0] = 1;
+        size_t remaining = counts.size();
+        for (size_t head = 0; head < queue.size() && remaining; head++)
+        {
+            for (int key_step : key_steps)
+            {
+                int next = (queue[head] + key_step) % row_size;
+                if (!seen[next])
+                {
+                    seen[next] = 1;
+                    via[next] = key_step;
+                    queue.push_back(next);
+                    remaining -= counts.count(next);
+                }
+            }
+        }
+        if (remaining)
+        {
+            return false;
+        }
+
+        plan.row_size = row_size;
+        plan.key_steps = key_steps;
+        plan.compositions.clear();
+        plan.extra_switches = 0;
+        for (auto &count : counts)
+        {
+            auto &path = plan.compositions[count.first];
+            for (int node = count.first; node; node = row_step(node - via[node], row_size))
+            {
+                path.push_back(via[node]);
+            }
+            plan.extra_switches += count.second * (path.size() - 1);
+        }
+        return true;
+    }
+
+    // One key per digit switching from new_key, in NTT form at the key level, to secret_key. The digit's share of
+    // the gadget is P on its own primes and zero elsewhere, which reduces to SEAL's keys for one prime per digit.
+    void create_kswitch_key(
+        const KernelContext &context, const SecretKey &secret_key, ConstRNSIter new_key, bool save_seed,
+        vector<PublicKey> &destination)
+    {
+        auto &key_level = context.key_level();
+        size_t coeff_count = key_level.coeff_count;
+        auto key_modulus = key_level.coeff_modulus;
+        size_t prime_count = context.key_switch_prime_count();
+        size_t digit_count = context.key_switch_digit_count();
+        size_t digit_size = context.key_switch_digit_size(digit_count);
+        auto pool = MemoryManager::GetPool(mm_prof_opt::mm_force_new, true);
+
+        destination.resize(digit_count);
+        SEAL_ALLOCATE_GET_COEFF_ITER(temp, coeff_count, pool);
+        for (size_t d = 0; d < digit_count; d++)
+        {
+            encrypt_zero_symmetric(
+                secret_key, context.seal_context(), context.key_parms_id(), true, save_seed, destination[d].data());
+
+            for (size_t i = d * digit_size; i < min((d + 1) * digit_size, prime_count); i++)
+            {
+                uint64_t factor = barrett_reduce_64(key_modulus[prime_count].value(), key_modulus[i]);
+                multiply_poly_scalar_coeffmod(new_key[i], coeff_count, factor, key_modulus[i], temp);
+
+                CoeffIter destination_iter = (*iter(destination[d].data()))[i];
+                add_poly_coeffmod(destination_iter, temp, coeff_count, key_modulus[i], destination_iter);
+            }
+        }
+    }
+} // namespace
+
+KeySwitchPlan plan_key_switch_digits(
+    const KernelContext &context, const vector<pair<parms_id_type, size_t>> &switch_counts, double noise_headroom_bits)
+{
+    size_t prime_count = context.key_switch_prime_count();
+    double log_coeff_count = log2(static_cast<double>(context.key_level().coeff_count));
+    double baseline_noise_bits = switch_noise_bits(context, 1);
+
+    // One digit per prime never adds noise, so there is always a plan
+    KeySwitchPlan best{ 0, 0, 0, 0 };
+    for (size_t digit_count = prime_count; digit_count > 0; digit_count--)
+    {
+        if (!context.is_key_switch_digit_count(digit_count))
+        {
+            continue;
+        }
+        size_t digit_size = context.key_switch_digit_size(digit_count);
+        double noise_bits = switch_noise_bits(context, digit_size) - baseline_noise_bits;
+        if (noise_bits > noise_headroom_bits)
+        {
+            continue;
+        }
+
+        double cost = 0;
+        for (auto &switch_count : switch_counts)
+        {
+            size_t decomp_size = context.level(switch_count.first).coeff_modulus_size;
+            cost += switch_count.second * switch_cost(decomp_size, digit_size, log_coeff_count);
+        }
+        if (!best.digit_count || cost < best.cost)
+        {
+            best = KeySwitchPlan{ digit_count, digit_size, cost, noise_bits };
+        }
+    }
+    return best;
+}
+
+ColumnRotationPlan plan_column_rotations(
+    const KernelContext &context, parms_id_type parms_id, size_t column_count, size_t row_count, size_t stride,
+    size_t baby_steps, size_t max_keys)
+{
+    if (!column_count || !row_count || !stride)
+    {
+        throw invalid_argument("column_count, row_count and stride must be positive");
+    }
+    if (column_count * stride > context.level(parms_id).coeff_count / 2)
+    {
+        throw invalid_argument("the columns of a group do not fit in a row");
+    }
+    if (baby_steps && ((baby_steps & (baby_steps - 1)) || column_count % baby_steps))
+    {
+        throw invalid_argument("baby_steps must be a power of two that divides column_count");
+    }
+    double hoisted_share = hoisted_rotation_share(context, parms_id);
+
+    // Equal costs go to the direct giant steps, which need no placement rotations across the PIR threads, and
+    // then to fewer keys
+    bool found = false;
+    ColumnRotationPlan best{ 0, 0, stride, false, false, 0, {} };
+    for (size_t b = 1; b <= column_count && !(column_count % b); b *= 2)
+    {
+        if (baby_steps && b != baby_steps)
+        {
+            continue;
+        }
+        size_t g = column_count / b;
+        for (bool giant_tree : { false, true })
+        {
+            for (bool hoisted_babies : { true, false })
+            {
+                // Process1 also keeps b rotated copies of every row, so a row count above one soon favours b = 1
+                double cost = row_count * (b - 1) * (hoisted_babies ? hoisted_share : 1.0) + (g - 1);
+                auto steps = column_rotation_steps(b, g, stride, hoisted_babies, giant_tree);
+                if (max_keys && steps.size() > max_keys)
+                {
+                    continue;
+                }
+                if (!found || cost < best.cost ||
+                    (cost == best.cost && best.giant_tree == giant_tree && steps.size() < best.steps.size()))
+                {
+                    best = ColumnRotationPlan{ b, g, stride, hoisted_babies, giant_tree, cost, move(steps) };
+                    found = true;
+                }
+            }
+        }
+    }
+    if (!found)
+    {
+        throw invalid_argument("no column rotation plan fits in max_keys");
+    }
+    return best;
+}
+
+const vector<int> &RotationKeyPlan::composition(int step) const
+{
+    auto found = compositions.find(row_step(step, row_size));
+    if (found == compositions.end())
+    {
+        throw out_of_range("step is not in the rotation key plan");
+    }
+    return found->second;
+}
+
+RotationKeyPlan plan_rotation_keys(const KernelContext &context, const vector<RotationUse> &uses, double key_weight)
+{
+    int row_size = static_cast<int>(context.key_level().coeff_count / 2);
+    map<int, size_t> counts;
+    set<int> fixed_steps;
+    for (auto &use : uses)
+    {
+        int step = row_step(use.step, row_size);
+        if (!step)
+        {
+            throw invalid_argument("a rotation must not be a multiple of the row size");
+        }
+        counts[step] += use.count;
+        if (!use.composable)
+        {
+            fixed_steps.insert(step);
+        }
+    }
+
+    // Start from a key per step, which always composes, and drop the key that lowers the cost most
+    vector<int> key_steps;
+    for (auto &count : counts)
+    {
+        key_steps.push_back(count.first);
+    }
+    RotationKeyPlan best;
+    compose_rotation_keys(key_steps, counts, row_size, best);
+    while (true)
+    {
+        double best_cost = key_weight * best.key_steps.size() + best.extra_switches;
+        RotationKeyPlan next;
+        bool improved = false;
+        for (size_t i = 0; i < best.key_steps.size(); i++)
+        {
+            if (fixed_steps.count(best.key_steps[i]))
+            {
+                continue;
+            }
+            vector<int> candidate_steps = best.key_steps;
+            candidate_steps.erase(candidate_steps.begin() + i);
+            RotationKeyPlan candidate;
+            if (!compose_rotation_keys(candidate_steps, counts, row_size, candidate))
+            {
+                continue;
+            }
+            double cost = key_weight * candidate.key_steps.size() + candidate.extra_switches;
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                next = move(candidate);
+                improved = true;
+            }
+        }
+        if (!improved)
+        {
+            return best;
+        }
+        best = move(next);
+    }
+}
+
+void my_create_relin_keys(const KernelContext &context, const SecretKey &secret_key, bool save_seed, RelinKeys &destination)
+{
+    auto &key_level = context.key_level();
+    size_t coeff_count = key_level.coeff_count;
+    size_t key_modulus_size = key_level.coeff_modulus_size;
+    auto pool = MemoryManager::GetPool(mm_prof_opt::mm_force_new, true);
+
+    // The secret key is stored in NTT form at the key level, so its square is a dyadic product
+    ConstRNSIter secret_key_iter(secret_key.data().data(), coeff_count);
+    SEAL_ALLOCATE_GET_RNS_ITER(secret_key_square, coeff_count, key_modulus_size, pool);
+    dyadic_product_coeffmod(
+        secret_key_iter, secret_key_iter, key_modulus_size, key_level.coeff_modulus, secret_key_square);
+
+    // Only the key for s^2, which sits at RelinKeys::get_index(2)
+    destination.data().assign(1, vector<PublicKey>());
+    create_kswitch_key(context, secret_key, secret_key_square, save_seed, destination.data()[0]);
+    destination.parms_id() = context.key_parms_id();
+}
+
+void my_create_galois_keys(
+    const KernelContext &context, const SecretKey &secret_key, const vector<uint32_t> &galois_elts, bool save_seed,
+    GaloisKeys &destination)
+{
+    auto &key_level = context.key_level();
+    size_t coeff_count = key_level.coeff_count;
+    size_t key_modulus_size = key_level.coeff_modulus_size;
+    auto pool = MemoryManager::GetPool(mm_prof_opt::mm_force_new, true);
+
+    ConstRNSIter secret_key_iter(secret_key.data().data(), coeff_count);
+
+    set<uint32_t> unique_elts(galois_elts.begin(), galois_elts.end());
+    for (auto galois_elt : unique_elts)
+    {
+        if (!(galois_elt & 1) || galois_elt >= 2 * coeff_count)
+        {
+            throw invalid_argument("Galois element is not valid");
+        }
+    }
+    vector<uint32_t> elts(unique_elts.begin(), unique_elts.end());
+
+    // Every key has its own slot and encryption randomness, so the keys are generated in parallel
+    destination.data().assign(coeff_count, vector<PublicKey>());
+#pragma omp parallel for
+    for (int k = 0; k < static_cast<int>(elts.size()); k++)
+    {
+        uint32_t galois_elt = elts[k];
+        SEAL_ALLOCATE_GET_RNS_ITER(rotated_secret_key, coeff_count, key_modulus_size, pool);
+
+        // The key switches from the rotated secret key back to the secret key
+        auto permutation = context.galois_permutation_ntt(galois_elt);
+        for (size_t i = 0; i < key_modulus_size; i++)
+        {
+            my_apply_galois_ntt_permutation(secret_key_iter[i], permutation, coeff_count, rotated_secret_key[i]);
+        }
+        create_kswitch_key(
+            context, secret_key, rotated_secret_key, save_seed, destination.data()[GaloisKeys::get_index(galois_elt)]);
+    }
+    destination.parms_id() = context.key_parms_id();
+}
+
+size_t my_load_kswitch_keys(const KernelContext &context, istream &stream, KSwitchKeys &destination)
+{
+    destination.unsafe_load(context.seal_context(), stream);
+    if (destination.parms_id() != context.key_parms_id())
+    {
+        throw logic_error("KSwitchKeys data is invalid");
+    }
+
+    // Every non-empty key vector has one key per digit of the same decomposition
+    size_t digit_count = 0;
+    for (auto &key_vector : destination.data())
+    {
+        if (key_vector.empty())
+        {
+            continue;
+        }
+        if (!digit_count)
+        {
+            digit_count = key_vector.size();
+        }
+        if (key_vector.size() != digit_count || !context.is_key_switch_digit_count(digit_count))
+        {
+            throw logic_error("KSwitchKeys data is invalid");
+        }
+        for (auto &key : key_vector)
+        {
+            if (!is_valid_for(key, context.seal_context()))
+            {
+                throw logic_error("KSwitchKeys data is invalid");
+            }
+        }
+    }
+    return digit_count ? digit_count : context.key_switch_prime_count();
+}
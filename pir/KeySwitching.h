@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <map>
+#include <utility>
+#include <vector>
+#include "seal/galoiskeys.h"
+#include "seal/kswitchkeys.h"
+#include "seal/relinkeys.h"
+#include "seal/secretkey.h"
+#include "KernelContext.h"
+
+/*
+Hybrid key switching keys and the choice of their decomposition.
+
+SEAL decomposes the ciphertext into one digit per data prime, so a switch at a level with L data primes costs
+about L * (L + 1) NTTs. A hybrid decomposition groups the primes into digits, raises each digit to the whole
+level with a fast base conversion and needs one NTT per digit and output prime instead. The price is noise:
+the special prime P has to absorb a digit product of Q_d instead of a single prime, and with a single 60-bit
+special prime every extra prime in a digit adds about its bit size to the key switching noise.
+
+The keys keep SEAL's containers, with one PublicKey per digit in every key vector. With one digit per prime they
+are exactly SEAL's keys; otherwise SEAL's own validation rejects them on load, so use my_load_kswitch_keys.
+*/
+
+struct KeySwitchPlan
+{
+    std::size_t digit_count;
+    std::size_t digit_size;
+    double cost;           // Weighted cost of the switches in single-limb multiply passes
+    double noise_bits;     // Growth of the key switching noise over the per-prime decomposition
+};
+
+// Picks the digit count with the lowest total cost for switch_counts, pairs of a level and the number of key
+// switches at that level, among those whose noise grows by at most noise_headroom_bits
+KeySwitchPlan plan_key_switch_digits(
+    const KernelContext &context, const std::vector<std::pair<seal::parms_id_type, std::size_t>> &switch_counts,
+    double noise_headroom_bits);
+
+// Keys for context.key_switch_digit_count() digits. With save_seed the second component of every key is replaced
+// by a seed, as SEAL does for keys that are only serialized.
+void my_create_relin_keys(
+    const KernelContext &context, const seal::SecretKey &secret_key, bool save_seed, seal::RelinKeys &destination);
+void my_create_galois_keys(
+    const KernelContext &context, const seal::SecretKey &secret_key, const std::vector<std::uint32_t> &galois_elts,
+    bool save_seed, seal::GaloisKeys &destination);
+
+/*
+Placement of the column inner products in Process2 with baby steps and giant steps.
+
+Column j = g * B + b is rotated by -j into place, or by -j * stride when the slots hold stride interleaved
+groups. Process1 rotates every row by -b for the B baby steps, and the database plaintext of column j is stored
+rotated by -b, so each giant step g sums plain products of the rotated rows and needs a single rotation by -g * B;
+every step is taken times the stride. Hoisted baby steps rotate the row directly and share the raised
+digits of one key switch; chained ones rotate the previous baby step by a power of two and need fewer keys. The
+giant sums are rotated into place directly, or combined by a rotation tree that needs a key per power of two.
+*/
+struct ColumnRotationPlan
+{
+    std::size_t baby_steps;  // divides the column count; 1 is the plain rotation tree
+    std::size_t giant_steps;
+    std::size_t stride;      // slots between the columns of one group
+    bool hoisted_babies;
+    bool giant_tree;
+    double cost;             // Key switches of all rows and the giant steps, a hoisted rotation counting by its share
+    std::vector<int> steps;  // Galois steps the plan rotates by
+};
+
+// The plan with the lowest cost for column_count columns of each of row_count rows at the level of parms_id with at
+// most max_keys Galois keys, or with baby_steps baby steps if that is not 0. The baby steps run on every row and
+// the giant steps once. Throws invalid_argument if no plan fits.
+ColumnRotationPlan plan_column_rotations(
+    const KernelContext &context, seal::parms_id_type parms_id, std::size_t column_count, std::size_t row_count,
+    std::size_t stride, std::size_t baby_steps, std::size_t max_keys);
+
+/*
+The Galois keys for the row rotations of a query.
+
+Every rotation the server runs is listed with how often a query runs it. A step without its own key is composed
+of key steps that add up to it modulo the row size, at one key switch per key step. Keys are dropped greedily
+while a key saves more than key_weight key switches per query, which trades key generation, upload and server
+memory against query time. Steps that are not composable, like hoisted rotations, always keep their key.
+*/
+struct RotationUse
+{
+    int step;
+    std::size_t count;  // rotations by step per query
+    bool composable;
+};
+
+struct RotationKeyPlan
+{
+    int row_size;
+    std::vector<int> key_steps;                    // in [1, row_size)
+    std::map<int, std::vector<int>> compositions;  // key steps applied for each planned step in [1, row_size)
+    std::size_t extra_switches;                    // key switches per query added by the compositions
+
+    // Throws out_of_range for a step that was not planned
+    const std::vector<int> &composition(int step) const;
+};
+
+RotationKeyPlan plan_rotation_keys(const KernelContext &context, const std::vector<RotationUse> &uses, double key_weight);
+
+// Loads keys of any valid digit count and returns it; throws logic_error for invalid keys
+std::size_t my_load_kswitch_keys(const KernelContext &context, std::istream &stream, seal::KSwitchKeys &destination);
@@ -1,5 +1,10 @@
 #include "PIRClient.h"
 #include "globals.h"
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
 #include <set>
 #include <openssl/sha.h>
 #include "utils.h"
@@ -9,31 +14,61 @@ PIRClient::PIRClient(uint32_t key_size, uint32_t obj_size)
     this->SetupDBParams(key_size, obj_size);
 }
 
+PIRClient::~PIRClient()
+{
+    stop_zero_pool();
+}
+
 void PIRClient::SetupCrypto(std::stringstream &parms_ss)
 {
+    stop_zero_pool();
+
     this->parms = std::make_unique<EncryptionParameters>();
     this->parms->load(parms_ss);
+    uint32_t row_count = 0;
+    parms_ss.read(reinterpret_cast<char *>(&row_count), sizeof(row_count));
+    if (!parms_ss || !row_count)
+    {
+        throw logic_error("crypto params do not hold the row count of the database");
+    }
+    this->NUM_ROW = static_cast<int>(row_count);
 
     this->context = std::make_unique<SEALContext>(*parms);
+    this->kernel_context = std::make_unique<KernelContext>(*context);
 
     this->keygen = std::make_unique<KeyGenerator>(*context);
     this->secret_key = keygen->secret_key();
 
-    this->keygen->create_relin_keys().save(this->keys_ss);
-    GaloisKeys galois_keys;
-    set<int> rotation_steps;
-    rotation_steps.insert(0);
-    for (int i = N / (2 * NUM_COL); i < N / 2; i *= 2)
+    size_t digit_count = key_switch_digit_count(*kernel_context, NUM_COL);
+    kernel_context->set_key_switch_digit_count(digit_count);
+    bool per_prime = digit_count == kernel_context->key_switch_prime_count();
+
+    // SEAL's Serializable keys and the hybrid keys made with save_seed both save seeds for their second polynomials
+    save_wire_header(keys_ss, WireArtifact::relin_keys);
+    if (per_prime)
     {
-        rotation_steps.insert(i);
+        this->keygen->create_relin_keys().save(this->keys_ss, wire_compr_mode());
+    }
+    else
+    {
+        RelinKeys relin_keys;
+        my_create_relin_keys(*kernel_context, secret_key, true, relin_keys);
+        relin_keys.save(keys_ss, wire_compr_mode());
     }
 
-    for (int i = 1; i < (pir_num_columns_per_obj / 2); i *= 2)
+    // Step 0 is the row conjugation; the rest are the keys of the rotation key plan the server composes from.
+    // my_create_galois_keys with one digit per prime gives SEAL's keys, and it generates them in parallel.
+    auto rotation_plan = column_rotation_plan(*kernel_context, pir_num_columns_per_obj / 2, NUM_ROW);
+    auto key_plan = rotation_key_plan(*kernel_context, NUM_COL, NUM_ROW, rotation_plan);
+    vector<uint32_t> galois_elts{ kernel_context->galois_elt_from_step(0) };
+    for (int step : key_plan.key_steps)
     {
-        rotation_steps.insert(-i);
+        galois_elts.push_back(kernel_context->galois_elt_from_step(step));
     }
-    keygen->create_galois_keys(vector<int>(rotation_steps.begin(), rotation_steps.end()), galois_keys);
-    galois_keys.save(keys_ss);
+    GaloisKeys galois_keys;
+    my_create_galois_keys(*kernel_context, secret_key, galois_elts, true, galois_keys);
+    save_wire_header(keys_ss, WireArtifact::galois_keys);
+    galois_keys.save(keys_ss, wire_compr_mode());
 
     this->batch_encoder = std::make_unique<BatchEncoder>(*context);
     this->row_size = batch_encoder->slot_count() / 2;
@@ -41,16 +76,21 @@ void PIRClient::SetupCrypto(std::stringstream &parms_ss)
     this->encryptor = std::make_unique<Encryptor>(*context, this->secret_key);
     this->evaluator = std::make_unique<Evaluator>(*context);
     this->decryptor = std::make_unique<Decryptor>(*context, secret_key);
+
+    start_zero_pool();
 }
 
 void PIRClient::SetupCrypto(std::string &load_file_dir)
 {
+    stop_zero_pool();
+
     string loaded_data = loadFromBinaryFile(load_file_dir + "/crypto_params");
     std::stringstream ss(loaded_data);
 
     this->parms = std::make_unique<EncryptionParameters>();
     this->parms->load(ss);
     this->context = std::make_unique<SEALContext>(*parms);
+    this->kernel_context = std::make_unique<KernelContext>(*context);
 
     loaded_data = loadFromBinaryFile(load_file_dir + "/crypto_secretkey");
     ss.str(loaded_data);
@@ -61,6 +101,82 @@ void PIRClient::SetupCrypto(std::string &load_file_dir)
     this->encryptor = std::make_unique<Encryptor>(*context, this->secret_key);
     this->evaluator = std::make_unique<Evaluator>(*context);
     this->decryptor = std::make_unique<Decryptor>(*context, secret_key);
+
+    start_zero_pool();
+}
+
+void PIRClient::start_zero_pool()
+{
+    if (!QUERY_POOL_SIZE)
+    {
+        return;
+    }
+    zero_pool_stopping = false;
+    if (pthread_create(&zero_pool_thread, NULL, refill_zero_pool, static_cast<void *>(this)))
+    {
+        printf("Error creating query pool thread");
+        return;
+    }
+    zero_pool_running = true;
+}
+
+void PIRClient::stop_zero_pool()
+{
+    if (zero_pool_running)
+    {
+        {
+            std::lock_guard<std::mutex> lock(zero_pool_mutex);
+            zero_pool_stopping = true;
+        }
+        zero_pool_cv.notify_all();
+        pthread_join(zero_pool_thread, NULL);
+        zero_pool_running = false;
+    }
+    zero_pool.clear();
+}
+
+void *PIRClient::refill_zero_pool(void *arg)
+{
+    PIRClient *client = static_cast<PIRClient *>(arg);
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(client->zero_pool_mutex);
+            client->zero_pool_cv.wait(lock, [client]
+                                      { return client->zero_pool_stopping || client->zero_pool.size() < QUERY_POOL_SIZE; });
+            if (client->zero_pool_stopping)
+            {
+                break;
+            }
+        }
+
+        // The encryption runs outside the lock, so a query never waits for a refill in progress
+        Ciphertext seeded_zero;
+        make_seeded_zero(*client->kernel_context, client->secret_key, client->context->first_parms_id(), seeded_zero);
+
+        std::lock_guard<std::mutex> lock(client->zero_pool_mutex);
+        client->zero_pool.push_back(std::move(seeded_zero));
+    }
+    return nullptr;
+}
+
+void PIRClient::take_seeded_zero(Ciphertext &destination)
+{
+    {
+        std::lock_guard<std::mutex> lock(zero_pool_mutex);
+        if (!zero_pool.empty())
+        {
+            destination = std::move(zero_pool.front());
+            zero_pool.pop_front();
+        }
+    }
+    zero_pool_cv.notify_all();
+
+    // An empty pool, after a burst of queries or with QUERY_POOL_SIZE 0, encrypts online
+    if (destination.size() == 0)
+    {
+        make_seeded_zero(*kernel_context, secret_key, context->first_parms_id(), destination);
+    }
 }
 
 void PIRClient::SetOneCiphertext()
@@ -74,22 +190,17 @@ void PIRClient::SetOneCiphertext()
         one_mat.push_back(1);
     }
     Plaintext one_pt;
-    Ciphertext one_ct;
     batch_encoder->encode(one_mat, one_pt);
 
-    encryptor->encrypt_symmetric(one_pt, one_ct);
-
-    for (int k = 0; k < MOD_SWITCH_COUNT; k++)
-    {
-        evaluator->mod_switch_to_next_inplace(one_ct);
-    }
-    one_ct.save(this->one_ct_ss);
+    // Encrypted right at the compact level, where the seed still stands in for the second polynomial
+    auto compact_pid = get_lower_parms_id(*kernel_context, context->first_parms_id(), MOD_SWITCH_COUNT);
+    save_wire_header(this->one_ct_ss, WireArtifact::one_ciphertext);
+    save_seeded_encryption(*kernel_context, secret_key, one_pt, compact_pid, this->one_ct_ss, wire_compr_mode());
 }
 
 void PIRClient::QueryMake(int desired_index)
 {
     this->desired_index = desired_index;
-    vector<uint64_t> client_query_mat(N, 0ULL);
 
     int val = desired_index + 1;
     const char str[] = {val & 0xFF, (val >> 8) & 0xFF, (val >> 16) & 0xFF, (val >> 24) & 0xFF, 0};
@@ -97,91 +208,173 @@ void PIRClient::QueryMake(int desired_index)
     unsigned char hash[SHA256_DIGEST_LENGTH];
     sha256(str, 4, hash);
 
-    for (int i = 0; i < NUM_COL; i++)
-    {
-        for (int j = i * (N / (NUM_COL * 2)); j < ((i + 1) * (N / (NUM_COL * 2))); j++)
-        {
-            client_query_mat[j] = (uint64_t(hash[4 * i]) << 8) + hash[4 * i + 1];
-            ;
-            client_query_mat[j + (N / 2)] = (uint64_t(hash[4 * i + 2]) << 8) + hash[4 * i + 3];
-            ;
-        }
-    }
-
-    Plaintext client_query_pt, result_pt;
-
-    batch_encoder->encode(client_query_mat, client_query_pt);
-    Serializable<Ciphertext> ser_query = encryptor->encrypt_symmetric(client_query_pt);
-    ser_query.save(qss); // save query ciphertext
-
-    // printf("query size (Byte): %lu\n", qss.str().size());
+    // Every group asks for the same hash; only the group of the item's slot can match it
+    vector<const unsigned char *> group_hashes(KEYS_PER_QUERY, hash);
+    encode_query(group_hashes, qss);
 }
 
 void PIRClient::QueryMake(string &desired_key)
 {
     this->desired_key = desired_key;
-    vector<uint64_t> client_query_mat(N, 0ULL);
+    QueryMake(desired_key, qss);
+}
+
+void PIRClient::QueryMake(const string &desired_key, std::stringstream &ss)
+{
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    key_hash(desired_key, hash);
+
+    vector<const unsigned char *> group_hashes(KEYS_PER_QUERY, hash);
+    encode_query(group_hashes, ss);
+}
 
-    char str[NUM_COL * 4];
-    int j = 0;
-    for (j; j < desired_key.size(); j++)
+vector<string> PIRClient::QueryMake(vector<string> &desired_keys)
+{
+    // Query r asks for the r-th key of every slot group, so keys of the same group go to different queries
+    vector<array<unsigned char, SHA256_DIGEST_LENGTH>> hashes(desired_keys.size());
+    vector<size_t> group_counts(KEYS_PER_QUERY, 0);
+    batch_rounds.clear();
+    for (int k = 0; k < desired_keys.size(); k++)
     {
-        str[j] = desired_key[j];
+        key_hash(desired_keys[k], hashes[k].data());
+        uint32_t group = key_group(hashes[k].data());
+        size_t round = group_counts[group]++;
+        if (round == batch_rounds.size())
+        {
+            batch_rounds.emplace_back(KEYS_PER_QUERY, -1);
+        }
+        batch_rounds[round][group] = k;
     }
-    for (j; j < 4 * NUM_COL; j++)
+    batch_key_count = desired_keys.size();
+
+    // A group without a key of its own asks for another key of the query, which only matches in that key's group
+    vector<string> queries;
+    for (auto &round : batch_rounds)
     {
-        str[j] = 0;
+        int filler = *std::max_element(round.begin(), round.end());
+        vector<const unsigned char *> group_hashes(KEYS_PER_QUERY);
+        for (int group = 0; group < KEYS_PER_QUERY; group++)
+        {
+            group_hashes[group] = hashes[round[group] >= 0 ? round[group] : filler].data();
+        }
+        std::stringstream ss;
+        encode_query(group_hashes, ss);
+        queries.push_back(ss.str());
     }
+    return queries;
+}
 
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-    sha256(str, 4 * NUM_COL, hash);
+void PIRClient::encode_query(const vector<const unsigned char *> &group_hashes, std::stringstream &ss)
+{
+    vector<uint64_t> client_query_mat(N, 0ULL);
 
+    // Slot j of the block of column i holds that column of the key of group j mod KEYS_PER_QUERY. The block size
+    // is a multiple of KEYS_PER_QUERY, so the expansion keeps every slot in its group.
     for (int i = 0; i < NUM_COL; i++)
     {
         for (int j = i * (N / (NUM_COL * 2)); j < ((i + 1) * (N / (NUM_COL * 2))); j++)
         {
+            const unsigned char *hash = group_hashes[j % KEYS_PER_QUERY];
             client_query_mat[j] = (uint64_t(hash[4 * i]) << 8) + hash[4 * i + 1];
-            ;
             client_query_mat[j + (N / 2)] = (uint64_t(hash[4 * i + 2]) << 8) + hash[4 * i + 3];
-            ;
         }
     }
 
-    Plaintext client_query_pt, result_pt;
+    Plaintext client_query_pt;
 
     batch_encoder->encode(client_query_mat, client_query_pt);
-    Serializable<Ciphertext> ser_query = encryptor->encrypt_symmetric(client_query_pt);
-    ser_query.save(qss); // save query ciphertext
+    Ciphertext query;
+    take_seeded_zero(query);
+    save_wire_header(ss, WireArtifact::query);
+    save_seeded_encryption(*kernel_context, client_query_pt, query, ss, wire_compr_mode()); // save query ciphertext
 
-    // printf("query size (Byte): %lu\n", qss.str().size());
+    // printf("query size (Byte): %lu\n", ss.str().size());
 }
 
 vector<uint64_t> PIRClient::Reconstruct(std::stringstream &ss)
 {
     Ciphertext final_result;
-    final_result.load(*context, ss);
+    load_response(ss, final_result);
 
     // cout << "Result noise budget " << decryptor->invariant_noise_budget(final_result) << endl;
 
     decryptor->decrypt(final_result, result_pt);
     batch_encoder->decode(result_pt, result_mat);
 
+    // The item's columns follow its slot at a stride of KEYS_PER_QUERY, within the slots of its group
+    int slot = desired_index % row_size;
     vector<uint64_t> decoded_response;
-    decoded_response = rotate_plain(result_mat, desired_index % row_size);
+    decoded_response = rotate_plain(group_slots(result_mat, slot % KEYS_PER_QUERY), slot / KEYS_PER_QUERY);
     return decoded_response;
 }
 
 string PIRClient::ReconstructStr(std::stringstream &ss)
+{
+    return ReconstructStr(ss, desired_key);
+}
+
+string PIRClient::ReconstructStr(std::stringstream &ss, const string &desired_key)
 {
     Ciphertext final_result;
-    final_result.load(*context, ss);
+    load_response(ss, final_result);
 
     // cout << "Result noise budget " << decryptor->invariant_noise_budget(final_result) << endl;
 
-    decryptor->decrypt(final_result, result_pt);
-    batch_encoder->decode(result_pt, result_mat);
+    // Decrypted into locals, so concurrent queries do not share result_pt and result_mat
+    Plaintext response_pt;
+    vector<uint64_t> response_mat;
+    decryptor->decrypt(final_result, response_pt);
+    batch_encoder->decode(response_pt, response_mat);
+
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    key_hash(desired_key, hash);
+    return this->getresult(group_slots(response_mat, key_group(hash)));
+}
+
+vector<string> PIRClient::ReconstructStr(vector<string> &responses)
+{
+    if (responses.size() != batch_rounds.size())
+    {
+        throw invalid_argument("there must be one response for every batch query");
+    }
+
+    vector<string> values(batch_key_count);
+    for (int r = 0; r < responses.size(); r++)
+    {
+        std::stringstream ss(responses[r]);
+        Ciphertext final_result;
+        load_response(ss, final_result);
+        decryptor->decrypt(final_result, result_pt);
+        batch_encoder->decode(result_pt, result_mat);
 
-    return this->getresult();
+        for (int group = 0; group < KEYS_PER_QUERY; group++)
+        {
+            if (batch_rounds[r][group] >= 0)
+            {
+                values[batch_rounds[r][group]] = this->getresult(group_slots(result_mat, group));
+            }
+        }
+    }
+    return values;
+}
+
+void PIRClient::load_response(std::stringstream &ss, Ciphertext &final_result)
+{
+    if (!COMPACT_RESPONSE)
+    {
+        final_result.load(*context, ss);
+        return;
+    }
+
+    // The packed words of my_pack_ciphertext at the last prime
+    string data((istreambuf_iterator<char>(ss)), istreambuf_iterator<char>());
+    if (data.size() % sizeof(uint64_t))
+    {
+        throw invalid_argument("response is not a packed ciphertext");
+    }
+    vector<uint64_t> packed(data.size() / sizeof(uint64_t));
+    memcpy(packed.data(), data.data(), data.size());
+    my_unpack_ciphertext(*kernel_context, packed, context->last_parms_id(), final_result);
 }
 
 void PIRClient::SetupDBParams(uint32_t key_size, uint32_t obj_size)
@@ -200,6 +393,27 @@ void PIRClient::sha256(const char *str, int len, unsigned char *dest)
     SHA256_Final(dest, &sha256);
 }
 
+void PIRClient::key_hash(const string &key, unsigned char *hash)
+{
+    // Keys are zero-padded to the key size before hashing, as in PIRServer
+    vector<char> str(NUM_COL * 4, 0);
+    std::copy(key.begin(), key.begin() + min(key.size(), str.size()), str.begin());
+    sha256(str.data(), 4 * NUM_COL, hash);
+}
+
+vector<uint64_t> PIRClient::group_slots(const vector<uint64_t> &mat, int group)
+{
+    int row_count = mat.size() / 2;
+    int group_row_count = row_count / KEYS_PER_QUERY;
+    vector<uint64_t> result(2 * group_row_count);
+    for (int i = 0; i < group_row_count; i++)
+    {
+        result[i] = mat[group + i * KEYS_PER_QUERY];
+        result[group_row_count + i] = mat[row_count + group + i * KEYS_PER_QUERY];
+    }
+    return result;
+}
+
 vector<uint64_t> PIRClient::rotate_plain(std::vector<uint64_t> original, int index)
 {
     int sz = original.size();
@@ -214,8 +428,9 @@ vector<uint64_t> PIRClient::rotate_plain(std::vector<uint64_t> original, int ind
     return result;
 }
 
-string PIRClient::getresult()
+string PIRClient::getresult(const vector<uint64_t> &result_mat)
 {
+    int row_size = result_mat.size() / 2;
     string res;
     if (result_mat[result_mat.size() - 1] != 0 && result_mat[0] != 0)
     {
@@ -227,17 +442,19 @@ string PIRClient::getresult()
         }
         int j = i;
         int k = 0;
+        // The value wraps around the end of the slots
         for (i; i < result_mat.size() + j; i++)
         {
-            if (result_mat[i] != 0)
+            uint64_t value = result_mat[i % result_mat.size()];
+            if (value != 0)
             {
-                if (result_mat[i] < 256)
+                if (value < 256)
                 {
-                    res = res + static_cast<char>(result_mat[i]);
+                    res = res + static_cast<char>(value);
                     break;
                 }
-                res = res + static_cast<char>(result_mat[i] / 256);
-                res = res + static_cast<char>(result_mat[i] % 256);
+                res = res + static_cast<char>(value / 256);
+                res = res + static_cast<char>(value % 256);
                 k++;
             }
         }
@@ -1,5 +1,10 @@
 #pragma once
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <pthread.h>
 #include "seal/seal.h"
+#include "KernelContext.h"
 
 using namespace seal;
 using namespace std;
@@ -12,10 +17,12 @@ public:
     uint32_t obj_size;
     uint32_t pir_num_columns_per_obj;
     int NUM_COL = 32;
+    int NUM_ROW = 1; // sent by the server with the crypto params
 
     /* Crypto params */
     std::unique_ptr<EncryptionParameters> parms;
     std::unique_ptr<SEALContext> context;
+    std::unique_ptr<KernelContext> kernel_context;
     std::unique_ptr<KeyGenerator> keygen;
     SecretKey secret_key;
     std::stringstream keys_ss; // relin_keys + galois_keys
@@ -33,6 +40,16 @@ public:
     int desired_index;
     string desired_key;
     std::stringstream qss;
+    vector<vector<int>> batch_rounds; // key index per slot group in every batch query, -1 if none
+    size_t batch_key_count = 0;
+
+    /* Precomputed query encryptions */
+    std::deque<Ciphertext> zero_pool; // seeded encryptions of zero at the first level
+    std::mutex zero_pool_mutex;
+    std::condition_variable zero_pool_cv;
+    pthread_t zero_pool_thread;
+    bool zero_pool_running = false;
+    bool zero_pool_stopping = false;
 
     /* Reconstruct */
     Plaintext result_pt;
@@ -52,17 +69,29 @@ public:
     /* QueryMake */
     void QueryMake(int desired_index);   // save to qss
     void QueryMake(string &desired_key); // save to qss
-    //-----------> send qss
+    void QueryMake(const string &desired_key, std::stringstream &ss); // save to ss, safe to call concurrently
+    vector<string> QueryMake(vector<string> &desired_keys); // one query per key in the same slot group
+    //-----------> send qss / the batch queries
 
     /* Reconstruct */
     vector<uint64_t> Reconstruct(std::stringstream &ss);
     string ReconstructStr(std::stringstream &ss);
+    string ReconstructStr(std::stringstream &ss, const string &desired_key); // safe to call concurrently
+    vector<string> ReconstructStr(vector<string> &responses); // values of the batch keys, in order
 
-    ~PIRClient() = default;
+    ~PIRClient();
 
 private:
     void SetupDBParams(uint32_t key_size, uint32_t obj_size);
     void sha256(const char *str, int len, unsigned char *dest);
+    void key_hash(const string &key, unsigned char *hash);
+    void start_zero_pool();
+    void stop_zero_pool();
+    static void *refill_zero_pool(void *arg);
+    void take_seeded_zero(Ciphertext &destination);
+    void encode_query(const vector<const unsigned char *> &group_hashes, std::stringstream &ss);
+    void load_response(std::stringstream &ss, Ciphertext &final_result);
+    vector<uint64_t> group_slots(const vector<uint64_t> &mat, int group);
     vector<uint64_t> rotate_plain(std::vector<uint64_t> original, int index);
-    string getresult();
+    string getresult(const vector<uint64_t> &result_mat);
 };
\ No newline at end of file
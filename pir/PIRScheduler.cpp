@@ -0,0 +1,203 @@
+#include "PIRScheduler.h"
+#include <cstdio>
+#include <exception>
+#include <stdexcept>
+
+using std::chrono::steady_clock;
+
+PIRScheduler::PIRScheduler(PIRServer &server, size_t queue_depth, int process1_threads, int process2_threads, int buffer_count)
+    : server_(server), queue_depth_(queue_depth), in_flight_(0), stopping_(false), process1_done_(false)
+{
+    if (!queue_depth)
+    {
+        throw invalid_argument("queue_depth must be at least 1");
+    }
+    server_.SetupStages(process1_threads, process2_threads, buffer_count);
+    for (int i = 0; i < buffer_count; i++)
+    {
+        free_buffers_.push_back(i);
+    }
+
+    if (pthread_create(&process1_thread_, NULL, run_process1, static_cast<void *>(this)))
+    {
+        printf("Error creating Process1 stage thread");
+    }
+    if (pthread_create(&process2_thread_, NULL, run_process2, static_cast<void *>(this)))
+    {
+        printf("Error creating Process2 stage thread");
+    }
+}
+
+PIRScheduler::~PIRScheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    pthread_join(process1_thread_, NULL);
+    pthread_join(process2_thread_, NULL);
+}
+
+std::future<std::string> PIRScheduler::Submit(std::string query, std::shared_ptr<const CancellationToken> cancel)
+{
+    auto response = std::make_shared<std::promise<std::string>>();
+    auto future = response->get_future();
+    Callback done = [response](Result &result)
+    {
+        if (result.error)
+        {
+            response->set_exception(result.error);
+        }
+        else
+        {
+            response->set_value(std::move(result.response));
+        }
+    };
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]
+             { return stopping_ || pending_.size() < queue_depth_; });
+    if (stopping_)
+    {
+        throw logic_error("scheduler is shutting down");
+    }
+
+    pending_.emplace_back();
+    pending_.back().owned = std::move(query);
+    pending_.back().cancel = std::move(cancel);
+    pending_.back().done = std::move(done);
+    in_flight_++;
+    cv_.notify_all();
+    return future;
+}
+
+void PIRScheduler::Submit(const char *data, size_t size, std::shared_ptr<const CancellationToken> cancel, Callback done)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]
+             { return stopping_ || pending_.size() < queue_depth_; });
+    if (stopping_)
+    {
+        throw logic_error("scheduler is shutting down");
+    }
+
+    pending_.emplace_back();
+    pending_.back().data = data;
+    pending_.back().size = size;
+    pending_.back().cancel = std::move(cancel);
+    pending_.back().done = std::move(done);
+    in_flight_++;
+    cv_.notify_all();
+}
+
+void PIRScheduler::Drain()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]
+             { return in_flight_ == 0; });
+}
+
+void PIRScheduler::finish(Query &query)
+{
+    query.done(query.result);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        in_flight_--;
+    }
+    cv_.notify_all();
+}
+
+void *PIRScheduler::run_process1(void *arg)
+{
+    PIRScheduler *scheduler = static_cast<PIRScheduler *>(arg);
+    while (true)
+    {
+        // A query needs a free stage buffer before Process1 may write its results
+        std::unique_lock<std::mutex> lock(scheduler->mutex_);
+        scheduler->cv_.wait(lock, [scheduler]
+                            { return (!scheduler->pending_.empty() && !scheduler->free_buffers_.empty()) ||
+                                     (scheduler->stopping_ && scheduler->pending_.empty()); });
+        if (scheduler->pending_.empty())
+        {
+            break;
+        }
+        Query query = std::move(scheduler->pending_.front());
+        scheduler->pending_.pop_front();
+        query.buffer = scheduler->free_buffers_.back();
+        scheduler->free_buffers_.pop_back();
+        lock.unlock();
+        scheduler->cv_.notify_all();
+
+        auto start = steady_clock::now();
+        try
+        {
+            const char *data = query.data ? query.data : query.owned.data();
+            size_t size = query.data ? query.size : query.owned.size();
+            scheduler->server_.QueryExpand(data, size, query.cancel.get());
+            scheduler->server_.Process1(query.buffer);
+        }
+        catch (...)
+        {
+            query.result.error = std::current_exception();
+            query.result.process1_time = steady_clock::now() - start;
+            lock.lock();
+            scheduler->free_buffers_.push_back(query.buffer);
+            lock.unlock();
+            scheduler->cv_.notify_all();
+            scheduler->finish(query);
+            continue;
+        }
+        query.result.process1_time = steady_clock::now() - start;
+
+        lock.lock();
+        scheduler->processed_.push_back(std::move(query));
+        lock.unlock();
+        scheduler->cv_.notify_all();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(scheduler->mutex_);
+        scheduler->process1_done_ = true;
+    }
+    scheduler->cv_.notify_all();
+    return nullptr;
+}
+
+void *PIRScheduler::run_process2(void *arg)
+{
+    PIRScheduler *scheduler = static_cast<PIRScheduler *>(arg);
+    PIRServer &server = scheduler->server_;
+    while (true)
+    {
+        std::unique_lock<std::mutex> lock(scheduler->mutex_);
+        scheduler->cv_.wait(lock, [scheduler]
+                            { return !scheduler->processed_.empty() || scheduler->process1_done_; });
+        if (scheduler->processed_.empty())
+        {
+            break;
+        }
+        Query query = std::move(scheduler->processed_.front());
+        scheduler->processed_.pop_front();
+        lock.unlock();
+
+        // The response is written straight into the result, which the callback may take over
+        auto start = steady_clock::now();
+        try
+        {
+            server.Process2(query.buffer, query.result.response, query.cancel.get());
+        }
+        catch (...)
+        {
+            query.result.error = std::current_exception();
+        }
+        query.result.process2_time = steady_clock::now() - start;
+
+        lock.lock();
+        scheduler->free_buffers_.push_back(query.buffer);
+        lock.unlock();
+        scheduler->cv_.notify_all();
+        scheduler->finish(query);
+    }
+    return nullptr;
+}
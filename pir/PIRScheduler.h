@@ -0,0 +1,91 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include "PIRServer.h"
+#include "QueryCancellation.h"
+
+/*
+Serves queries on one PIRServer with QueryExpand + Process1 and Process2 as two stages that run at the same time
+on different queries.
+
+Process1 is bound by the squarings and key switches, Process2 by streaming pir_encoded_db, so the machine is split
+between them instead of giving each the whole machine in turn. A query moves from Process1 to Process2 through
+one of the server's stage buffers; with two buffers Process1 of the next query fills one while Process2 reads the
+other. In steady state a query leaves every max(Process1, Process2) instead of every Process1 + Process2.
+
+Up to queue_depth submitted queries wait for Process1; Submit blocks while the queue is full. Both stages of a
+query check its cancellation token, and a cancelled query fails with QueryCancelled.
+*/
+class PIRScheduler
+{
+public:
+    PIRScheduler(PIRServer &server, std::size_t queue_depth, int process1_threads, int process2_threads, int buffer_count = 2);
+
+    PIRScheduler(const PIRScheduler &) = delete;
+    PIRScheduler &operator=(const PIRScheduler &) = delete;
+
+    // Finishes every submitted query before returning
+    ~PIRScheduler();
+
+    // What a query leaves: the serialized response of Process2 or the error of a stage, and the time each stage took
+    struct Result
+    {
+        std::string response;
+        std::exception_ptr error;
+        std::chrono::steady_clock::duration process1_time = std::chrono::steady_clock::duration::zero();
+        std::chrono::steady_clock::duration process2_time = std::chrono::steady_clock::duration::zero();
+    };
+    using Callback = std::function<void(Result &)>;
+
+    // The serialized query as the client sends it; the future holds the serialized response of Process2
+    std::future<std::string> Submit(std::string query, std::shared_ptr<const CancellationToken> cancel = nullptr);
+
+    // The query is read in place, so data must stay valid until done is called. done runs on the stage thread the
+    // query finishes on and must not block it.
+    void Submit(const char *data, std::size_t size, std::shared_ptr<const CancellationToken> cancel, Callback done);
+
+    // Waits until every submitted query has finished, e.g. before the keys of the server change
+    void Drain();
+
+private:
+    struct Query
+    {
+        std::string owned; // the query of the future Submit; data is null then
+        const char *data = nullptr;
+        std::size_t size = 0;
+        std::shared_ptr<const CancellationToken> cancel;
+        Callback done;
+        Result result;
+        int buffer;
+    };
+
+    void finish(Query &query);
+
+    static void *run_process1(void *arg);
+    static void *run_process2(void *arg);
+
+    PIRServer &server_;
+    std::size_t queue_depth_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Query> pending_;   // waiting for Process1
+    std::deque<Query> processed_; // waiting for Process2
+    std::vector<int> free_buffers_;
+    std::size_t in_flight_; // submitted and not finished
+    bool stopping_;
+    bool process1_done_;
+
+    pthread_t process1_thread_;
+    pthread_t process2_thread_;
+};
@@ -1,6 +1,7 @@
 #include "PIRServer.h"
 #include "globals.h"
 #include <cmath>
+#include <cstring>
 #include <set>
 #include <openssl/sha.h>
 #include "config.h"
@@ -11,10 +12,18 @@
 PIRServer::PIRServer(uint64_t number_of_items, uint32_t key_size, uint32_t obj_size)
 {
     this->SetupDBParams(number_of_items, key_size, obj_size);
-    this->SetupMemPool();
     this->SetupPIRParams();
+    this->TOTAL_MACHINE_THREAD = 32;
+    this->PIR_MACHINE_THREAD = 32;
+    this->NUM_STAGE_BUFFER = 1;
     this->SetupThreadParams();
 }
+
+PIRServer::~PIRServer()
+{
+    // A query that was expanded but never processed still has its expansion threads running
+    join_query_expansion();
+}
 void PIRServer::SetupCryptoParams()
 {
     this->parms = std::make_unique<EncryptionParameters>(scheme_type::bfv);
@@ -23,23 +32,84 @@ void PIRServer::SetupCryptoParams()
     parms->set_plain_modulus(PLAIN_MODULUS);
     /* save into stream */
     this->parms->save(this->parms_ss);
+    // The client plans the column placement, and so its Galois keys, for the same number of rows
+    uint32_t row_count = NUM_ROW;
+    this->parms_ss.write(reinterpret_cast<const char *>(&row_count), sizeof(row_count));
 
     this->context = std::make_unique<SEALContext>(*parms);
+    // Keys and ciphertexts are validated by SEAL when they are loaded, so the kernels skip their own checks
+    this->kernel_context = std::make_unique<KernelContext>(*context, false);
 
     this->evaluator = std::make_unique<Evaluator>(*context);
     this->batch_encoder = std::make_unique<BatchEncoder>(*context);
+
+    // The arenas are sized from the parameters, so they are set up here rather than in the constructor
+    this->SetupMemPool();
 }
 
-void PIRServer::SetupKeys(std::stringstream &keys_ss)
+void PIRServer::SetupKeys(std::istream &keys_ss)
 {
-    this->relin_keys.load(*context, keys_ss);
-    this->galois_keys.load(*context, keys_ss);
+    // Hybrid keys have one key per digit, which SEAL's own load rejects
+    load_wire_header(keys_ss, WireArtifact::relin_keys);
+    size_t digit_count = my_load_kswitch_keys(*kernel_context, keys_ss, relin_keys);
+    load_wire_header(keys_ss, WireArtifact::galois_keys);
+    if (my_load_kswitch_keys(*kernel_context, keys_ss, galois_keys) != digit_count)
+    {
+        throw logic_error("relinearization and Galois keys use different decompositions");
+    }
+
+    // The key switching scratch depends on the decomposition, so the arenas are sized again for other keys
+    if (digit_count != kernel_context->key_switch_digit_count())
+    {
+        kernel_context->set_key_switch_digit_count(digit_count);
+        this->SetupMemPool();
+    }
+
+    // The client planned the rotations with the same decomposition and generated exactly these keys; any other
+    // key would only hold memory
+    set<uint32_t> expected_elts{ kernel_context->galois_elt_from_step(0) };
+    for (int step : key_plan.key_steps)
+    {
+        expected_elts.insert(kernel_context->galois_elt_from_step(step));
+    }
+    for (uint32_t galois_elt : expected_elts)
+    {
+        if (!galois_keys.has_key(galois_elt))
+        {
+            throw logic_error("Galois keys do not cover the rotation key plan");
+        }
+    }
+    for (size_t index = 0; index < galois_keys.data().size(); index++)
+    {
+        if (!expected_elts.count(GaloisKeys::get_elt_from_index(index)))
+        {
+            vector<PublicKey>().swap(galois_keys.data()[index]);
+        }
+    }
 }
 
-void PIRServer::RecOneCiphertext(std::stringstream &one_ct_ss)
+void PIRServer::RecOneCiphertext(std::istream &one_ct_ss)
 {
-    this->one_ct.load(*context, one_ct_ss);
-    this->compact_pid = one_ct.parms_id();
+    load_wire_header(one_ct_ss, WireArtifact::one_ciphertext);
+    // Loaded aside, so a rejected one-ciphertext leaves the last good one in place
+    Ciphertext loaded;
+    loaded.load(*context, one_ct_ss);
+
+    // Clients may also send it at a higher level, which only costs them the seed
+    this->compact_pid = get_lower_parms_id(*kernel_context, context->first_parms_id(), MOD_SWITCH_COUNT);
+
+    // The kernel context skips its checks, and the rescale trusts the level; a ciphertext from the network must not
+    size_t chain_index = kernel_context->level(loaded.parms_id()).context_data->chain_index();
+    if (chain_index < kernel_context->level(compact_pid).context_data->chain_index() ||
+        chain_index > context->first_context_data()->chain_index())
+    {
+        throw invalid_argument("one-ciphertext is not between the first and the compact level");
+    }
+    if (loaded.is_ntt_form() || loaded.size() != 2)
+    {
+        throw invalid_argument("one-ciphertext must be a fresh BFV ciphertext not in NTT form");
+    }
+    my_mod_switch_scale_to(*kernel_context, loaded, one_ct, compact_pid, MemoryManager::GetPool(), TOTAL_MACHINE_THREAD);
 }
 
 void PIRServer::SetupDB()
@@ -62,19 +132,21 @@ void PIRServer::SetupDB()
 void PIRServer::SetupDB(vector<string> &keydb, vector<string> &elems)
 {
     this->pir_db.resize(0);
-    populate_db(keydb);
+    vector<int> key_at = populate_db(keydb);
     for (int i = 0; i < pir_num_obj; i++)
     {
+        // The element of a key sits at the item position of the key
+        int k = key_at[i];
         vector<uint64_t> v;
         for (int j = 0; j < (pir_obj_size / 2); j++)
         { // 2 bytes each plaintxt slot
             uint64_t tem = 0;
-            if (i < elems.size() && 2 * j < elems[i].size())
+            if (k >= 0 && k < elems.size() && 2 * j < elems[k].size())
             {
-                tem = static_cast<int>(elems[i][2 * j]);
-                if ((2 * j + 1) < elems[i].size())
+                tem = static_cast<int>(elems[k][2 * j]);
+                if ((2 * j + 1) < elems[k].size())
                 {
-                    tem = 256 * tem + static_cast<int>(elems[i][2 * j + 1]);
+                    tem = 256 * tem + static_cast<int>(elems[k][2 * j + 1]);
                 }
             }
             v.push_back(tem);
@@ -86,18 +158,32 @@ void PIRServer::SetupDB(vector<string> &keydb, vector<string> &elems)
     // cout << "DB population complete!" << endl;
 }
 
-void PIRServer::QueryExpand(std::stringstream &qss)
+void PIRServer::QueryExpand(std::istream &qss, const CancellationToken *cancel)
 {
-    pthread_t query_expansion_thread[NUM_COL];
-    int expansion_thread_id[NUM_COL];
-    for (int i = 0; i < NUM_COL; i++)
-    {
-        expansion_thread_id[i] = i;
-    }
+    prepare_query_expansion(cancel);
+    load_wire_header(qss, WireArtifact::query);
+    server_query_ct.load(*context, qss); // load query ciphertext
+    start_query_expansion();
+}
+
+void PIRServer::QueryExpand(const char *data, size_t size, const CancellationToken *cancel)
+{
+    prepare_query_expansion(cancel);
+    size_t header_size = load_wire_header(data, size, WireArtifact::query);
+    server_query_ct.load(*context, reinterpret_cast<const seal_byte *>(data + header_size), size - header_size);
+    start_query_expansion();
+}
 
+void PIRServer::prepare_query_expansion(const CancellationToken *cancel)
+{
+    // The expansion threads of the last query still read server_query_ct and its token
+    join_query_expansion();
+    query_expansion.cancel = cancel;
     this->expanded_query.resize(NUM_COL);
+    query_expansion.ready.assign(NUM_COL, 0);
 
-    for (int i = 0; i < NUM_COL; i++)
+    // The masks only depend on the parameters
+    for (int i = masks.size(); i < NUM_COL; i++)
     {
         vector<uint64_t> mat(N, 0ULL);
         Plaintext pt;
@@ -109,29 +195,82 @@ void PIRServer::QueryExpand(std::stringstream &qss)
         evaluator->transform_to_ntt_inplace(pt, context->first_parms_id());
         masks.push_back(pt);
     }
+}
 
-    server_query_ct.load(*context, qss); // load query ciphertext
+void PIRServer::start_query_expansion()
+{
+    my_transform_to_ntt_inplace(*kernel_context, server_query_ct, TOTAL_MACHINE_THREAD);
 
-    my_transform_to_ntt_inplace(*context, server_query_ct, TOTAL_MACHINE_THREAD);
-    PIRServer::ExpandQueryStructure *expand_query_structure_ptr[NUM_COL];
+    // Process1 joins these threads; it waits for each column separately, see wait_expanded_query
+    query_expansion.threads.resize(NUM_COL);
+    query_expansion.structures.resize(NUM_COL);
     for (int i = 0; i < NUM_COL; i++)
     {
-        expand_query_structure_ptr[i] = new PIRServer::ExpandQueryStructure(expansion_thread_id[i], this);
-        if (pthread_create(&(query_expansion_thread[i]), NULL, expand_query, static_cast<void *>(expand_query_structure_ptr[i])))
+        query_expansion.structures[i] = new PIRServer::ExpandQueryStructure(i, this);
+        if (pthread_create(&(query_expansion.threads[i]), NULL, expand_query, static_cast<void *>(query_expansion.structures[i])))
         {
             printf("Error creating expansion thread");
         }
     }
-    for (int i = 0; i < NUM_COL; i++)
+}
+
+void PIRServer::wait_expanded_query(int col_idx)
+{
+    std::unique_lock<std::mutex> lock(query_expansion.mutex);
+    query_expansion.cv.wait(lock, [this, col_idx]
+                            { return query_expansion.ready[col_idx]; });
+}
+
+void PIRServer::join_query_expansion()
+{
+    for (int i = 0; i < query_expansion.threads.size(); i++)
     {
-        pthread_join(query_expansion_thread[i], NULL);
-        delete expand_query_structure_ptr[i];
+        pthread_join(query_expansion.threads[i], NULL);
+        delete query_expansion.structures[i];
     }
+    query_expansion.threads.clear();
+    query_expansion.structures.clear();
 }
 
 void PIRServer::Process1()
 {
-    this->row_result.resize(NUM_ROW);
+    Process1(0);
+}
+
+void PIRServer::Process1(int buffer)
+{
+    if (buffer < 0 || buffer >= NUM_STAGE_BUFFER)
+    {
+        throw out_of_range("buffer is not a stage buffer");
+    }
+    this->process1_buffer = buffer;
+
+    // With pipeline_rows the PIR threads accumulate the rows while they are produced
+    pthread_t accumulate_thread[NUM_PIR_THREAD];
+    PIRServer::ProcessPIRStructure *accumulate_structure_ptr[NUM_PIR_THREAD];
+    if (pipeline_rows)
+    {
+        row_pipeline.published.clear();
+        row_pipeline.aborted = false;
+        row_pipeline.free_slots.clear();
+        for (int i = 0; i < row_pipeline.slot_row.size(); i++)
+        {
+            row_pipeline.free_slots.push_back(i);
+        }
+        for (int i = 0; i < NUM_PIR_THREAD; i++)
+        {
+            accumulate_structure_ptr[i] = new PIRServer::ProcessPIRStructure(i, this);
+            if (pthread_create(&(accumulate_thread[i]), NULL, accumulate_rows, static_cast<void *>(accumulate_structure_ptr[i])))
+            {
+                printf("Error creating accumulation thread");
+            }
+        }
+    }
+    else
+    {
+        stage_buffers[buffer].row_result.resize(NUM_ROW * rotation_plan.baby_steps);
+    }
+
     pthread_t row_process_thread[NUM_ROW_THREAD];
     int row_thread_id[NUM_ROW_THREAD];
     for (int i = 0; i < NUM_ROW_THREAD; i++)
@@ -163,10 +302,81 @@ void PIRServer::Process1()
             delete process_row_structure_ptr[i];
         }
     }
+
+    if (pipeline_rows)
+    {
+        for (int i = 0; i < NUM_PIR_THREAD; i++)
+        {
+            pthread_join(accumulate_thread[i], NULL);
+            delete accumulate_structure_ptr[i];
+        }
+    }
+
+    // Every column has been waited for, so the expansion threads are done
+    join_query_expansion();
+    if (query_cancelled())
+    {
+        throw QueryCancelled();
+    }
+
+    // Steady-state queries reuse the reserved blocks; anything else means a reservation is missing. Only this
+    // stage allocates from these arenas, so Process2 running beside it does not show up here.
+    column_arena->end_query();
+    accumulate_arena->end_query();
 }
 
 void PIRServer::Process2()
 {
+    Process2(0);
+}
+
+void PIRServer::Process2(int buffer, const CancellationToken *cancel)
+{
+    process2_cancel = cancel;
+    process_columns_to_result(buffer);
+    if (COMPACT_RESPONSE)
+    {
+        auto packed = pack_result();
+        this->ss.write(reinterpret_cast<const char *>(packed.data()), packed.size() * sizeof(uint64_t));
+    }
+    else
+    {
+        pir_results[0].save(this->ss);
+    }
+    pir_arena->end_query();
+}
+
+void PIRServer::Process2(std::string &response, const CancellationToken *cancel)
+{
+    Process2(0, response, cancel);
+}
+
+void PIRServer::Process2(int buffer, std::string &response, const CancellationToken *cancel)
+{
+    process2_cancel = cancel;
+    process_columns_to_result(buffer);
+    if (COMPACT_RESPONSE)
+    {
+        auto packed = pack_result();
+        response.resize(packed.size() * sizeof(uint64_t));
+        memcpy(&response[0], packed.data(), response.size());
+    }
+    else
+    {
+        response.resize(pir_results[0].save_size(compr_mode_type::none));
+        size_t size = pir_results[0].save(reinterpret_cast<seal_byte *>(&response[0]), response.size(), compr_mode_type::none);
+        response.resize(size);
+    }
+    pir_arena->end_query();
+}
+
+void PIRServer::process_columns_to_result(int buffer)
+{
+    if (buffer < 0 || buffer >= NUM_STAGE_BUFFER)
+    {
+        throw out_of_range("buffer is not a stage buffer");
+    }
+    this->process2_buffer = buffer;
     this->pir_results.resize(NUM_PIR_THREAD);
 
     pthread_t pir_thread[NUM_PIR_THREAD];
@@ -191,13 +401,66 @@ void PIRServer::Process2()
         pthread_join(pir_thread[i], NULL);
         delete process_pir_structure_ptr[i];
     }
+    // The PIR threads of a cancelled query may have left their results unfinished
+    if (process2_cancelled())
+    {
+        throw QueryCancelled();
+    }
     for (int i = 1; i < NUM_PIR_THREAD; i++)
     {
-        my_add_inplace(*context, pir_results[0], pir_results[i]);
+        my_add_inplace(*kernel_context, pir_results[0], pir_results[i]);
     }
 
-    Ciphertext final_result = pir_results[0];
-    final_result.save(this->ss);
+    if (COMPACT_RESPONSE)
+    {
+        // The client only decrypts, so the response can drop to the last prime and the bits its noise covers
+        my_mod_switch_scale_to(*kernel_context, pir_results[0], pir_results[0], kernel_context->seal_context().last_parms_id(), pir_arena->pool(0), PIR_MACHINE_THREAD);
+    }
+}
+
+vector<uint64_t> PIRServer::pack_result()
+{
+    size_t c0_drop_bits, c1_drop_bits;
+    compact_response_drop_bits(*kernel_context, c0_drop_bits, c1_drop_bits);
+    return my_pack_ciphertext(*kernel_context, pir_results[0], c0_drop_bits, c1_drop_bits);
+}
+
+void PIRServer::SetupStages(int process1_threads, int process2_threads, int buffer_count)
+{
+    if (process1_threads < 1 || process2_threads < 1 || buffer_count < 1)
+    {
+        throw invalid_argument("every stage needs a thread and a buffer");
+    }
+    this->TOTAL_MACHINE_THREAD = process1_threads;
+    this->PIR_MACHINE_THREAD = process2_threads;
+    this->NUM_STAGE_BUFFER = buffer_count;
+    this->SetupThreadParams();
+
+    // Thread counts size the kernel scratch, so the arenas are set up again once they exist
+    if (this->kernel_context)
+    {
+        this->SetupMemPool();
+    }
+}
+
+PIRServer::ArenaStats PIRServer::GetArenaStats() const
+{
+    ArenaStats stats{ 0, 0, 0, 0 };
+    for (auto arena : { column_arena.get(), accumulate_arena.get(), pir_arena.get() })
+    {
+        if (!arena)
+        {
+            continue;
+        }
+        for (size_t i = 0; i < arena->size(); i++)
+        {
+            stats.reserved_bytes += arena->reserved_byte_count(i);
+        }
+        stats.high_water_bytes += arena->total_high_water_mark();
+        stats.growth_count += arena->growth_count();
+        stats.grown_bytes += arena->grown_byte_count();
+    }
+    return stats;
 }
 
 void PIRServer::SetupDBParams(uint64_t number_of_items, uint32_t key_size, uint32_t obj_size)
@@ -207,25 +470,163 @@ void PIRServer::SetupDBParams(uint64_t number_of_items, uint32_t key_size, uint3
     this->obj_size = obj_size;
     this->NUM_COL = (int)ceil(key_size / (2.0 * PLAIN_BIT));
     this->NUM_ROW = (int)ceil(number_of_items / ((double)(N / 2)));
+
+    // The expansion rotates by multiples of N / (2 * NUM_COL), which has to keep every slot in its group
+    if ((KEYS_PER_QUERY & (KEYS_PER_QUERY - 1)) || (N / (2 * NUM_COL)) % KEYS_PER_QUERY)
+    {
+        throw invalid_argument("KEYS_PER_QUERY must be a power of two that divides the slots of a column");
+    }
 }
 
 void PIRServer::SetupMemPool()
 {
-    for (int i = 0; i < NUM_COL; i++)
+    // The client drops the same number of primes from OneCiphertext, see PIRClient
+    auto first_pid = context->first_parms_id();
+    auto pid = get_lower_parms_id(*kernel_context, first_pid, MOD_SWITCH_COUNT);
+    int row_threads = TOTAL_MACHINE_THREAD / NUM_ROW_THREAD;
+
+    // The placement decides how many rotated copies of every row Process1 keeps, and every PIR thread needs a
+    // giant step
+    rotation_plan = column_rotation_plan(*kernel_context, pir_num_columns_per_obj / 2, NUM_ROW);
+    key_plan = rotation_key_plan(*kernel_context, NUM_COL, NUM_ROW, rotation_plan);
+    int baby_steps = rotation_plan.baby_steps;
+    NUM_PIR_THREAD = min(NUM_PIR_THREAD, static_cast<int>(rotation_plan.giant_steps));
+
+    // Row thread r runs column i on arena r * NUM_COL + i; the expansion runs on the arenas of row thread 0
+    column_arena = std::make_unique<KernelArena>(*kernel_context, NUM_ROW_THREAD * NUM_COL);
+    stage_buffers.assign(NUM_STAGE_BUFFER, StageBuffer());
+    row_pipeline.slots.clear();
+    for (int r = 0; r < NUM_ROW_THREAD; r++)
     {
-        column_pools.emplace_back(MemoryPoolHandle::New());
+        int arena_offset = r * NUM_COL;
+        for (int i = 0; i < NUM_COL; i++)
+        {
+            int a = arena_offset + i;
+            if (r == 0)
+            {
+                column_arena->reserve_rotate(a, first_pid, NUM_EXPANSION_THREAD);
+                column_arena->reserve_ciphertexts(a, first_pid, 2, 1);
+            }
+            column_arena->reserve_square(a, first_pid);
+            column_arena->reserve_relinearize(a, first_pid, NUM_EXPONENT_THREAD);
+            column_arena->reserve_rescale(a, first_pid, pid);
+            column_arena->reserve_multiply(a, pid);
+            column_arena->reserve_relinearize(a, pid, row_threads);
+
+            // The squared difference before and after relinearization, and the column result
+            column_arena->reserve_ciphertexts(a, first_pid, 2, 1);
+            column_arena->reserve_ciphertexts(a, first_pid, 3, 1);
+            column_arena->reserve_ciphertexts(a, pid, 2, 1);
+            column_arena->reserve_ciphertexts(a, pid, 3, 1);
+        }
+
+        // The row thread finishes each of its rows on its first arena with a conjugated copy of the column product
+        // and the baby steps of the row
+        column_arena->reserve_rotate(arena_offset, pid, row_threads);
+        column_arena->reserve_relinearize(arena_offset, pid, row_threads);
+        column_arena->reserve_ciphertexts(arena_offset, pid, 2, baby_steps);
+        if (rotation_plan.hoisted_babies && baby_steps > 1)
+        {
+            column_arena->reserve_rotate_hoisted(arena_offset, pid, row_threads);
+        }
+
+        // Row results, or the pipeline slots standing in for them, are swapped with the column result of that arena,
+        // so they keep their buffers across queries
+        int start_idx, end_idx;
+        GetRowRange(r, start_idx, end_idx);
+        if (pipeline_rows)
+        {
+            int slot_count = min(2, end_idx - start_idx);
+            column_arena->reserve_ciphertexts(arena_offset, pid, 3, slot_count);
+            column_arena->reserve_ciphertexts(arena_offset, pid, 2, slot_count * (baby_steps - 1));
+            for (int i = 0; i < slot_count * baby_steps; i++)
+            {
+                row_pipeline.slots.emplace_back(column_arena->pool(arena_offset));
+            }
+        }
+        else
+        {
+            column_arena->reserve_ciphertexts(arena_offset, pid, 3, (end_idx - start_idx) * NUM_STAGE_BUFFER);
+            column_arena->reserve_ciphertexts(arena_offset, pid, 2, (end_idx - start_idx) * (baby_steps - 1) * NUM_STAGE_BUFFER);
+            for (auto &stage_buffer : stage_buffers)
+            {
+                stage_buffer.row_result.resize(NUM_ROW * baby_steps);
+                for (int b = 0; b < baby_steps; b++)
+                {
+                    for (int i = start_idx; i < end_idx; i++)
+                    {
+                        stage_buffer.row_result[b * NUM_ROW + i] = Ciphertext(column_arena->pool(arena_offset));
+                    }
+                }
+            }
+        }
     }
+    row_pipeline.slot_row.assign(row_pipeline.slots.size() / baby_steps, 0);
+    row_pipeline.slot_pending.assign(row_pipeline.slots.size() / baby_steps, 0);
+    row_pipeline.published.reserve(NUM_ROW);
+
+    // PIR thread i rotates and sums its giant step sums on arena i. Without pipeline_rows it also builds the sums
+    // of every stage buffer there; with it the accumulators of Process1 build them on an arena of their stage buffer,
+    // so Process1 of one query never allocates from the pools Process2 of another is using.
+    pir_arena = std::make_unique<KernelArena>(*kernel_context, NUM_PIR_THREAD);
+    accumulate_arena = std::make_unique<KernelArena>(*kernel_context, pipeline_rows ? NUM_STAGE_BUFFER * NUM_PIR_THREAD : 0);
+    for (auto &stage_buffer : stage_buffers)
+    {
+        stage_buffer.column_sums.assign(NUM_PIR_THREAD, vector<Ciphertext>());
+    }
+    for (int i = 0; i < NUM_PIR_THREAD; i++)
+    {
+        int start_idx, end_idx;
+        GetGiantRange(i, start_idx, end_idx);
+        pir_arena->reserve_rotate(i, pid, PIR_MACHINE_THREAD / NUM_PIR_THREAD);
+        if (pipeline_rows)
+        {
+            for (int buffer = 0; buffer < NUM_STAGE_BUFFER; buffer++)
+            {
+                accumulate_arena->reserve_ciphertexts(buffer * NUM_PIR_THREAD + i, pid, 2, end_idx - start_idx);
+            }
+        }
+        else
+        {
+            pir_arena->reserve_ciphertexts(i, pid, 2, (end_idx - start_idx) * NUM_STAGE_BUFFER);
+        }
+    }
+    if (COMPACT_RESPONSE)
+    {
+        pir_arena->reserve_rescale(0, pid, kernel_context->seal_context().last_parms_id());
+    }
+
+    column_arena->warm_up();
+    pir_arena->warm_up();
+    accumulate_arena->warm_up();
 }
 
 void PIRServer::SetupThreadParams()
 {
     this->NUM_COL_THREAD = NUM_COL;
-    this->NUM_ROW_THREAD = 1;
+    // Every row thread runs its own column threads, so rows take the cores the columns leave idle
+    this->NUM_ROW_THREAD = max(1, min(NUM_ROW, TOTAL_MACHINE_THREAD / NUM_COL_THREAD));
+    // A power of two that divides the columns and leaves every PIR thread at least one Process2 thread
     int log_tmp = floor(log2(this->pir_num_columns_per_obj / 2));
-    this->NUM_PIR_THREAD = (pow(2, log_tmp) < 32) ? pow(2, log_tmp) : 32;
-    this->TOTAL_MACHINE_THREAD = 32;
-    this->NUM_EXPANSION_THREAD = TOTAL_MACHINE_THREAD / NUM_COL_THREAD;
-    this->NUM_EXPONENT_THREAD = TOTAL_MACHINE_THREAD / (NUM_COL_THREAD * NUM_ROW_THREAD);
+    int log_pir_machine = floor(log2(PIR_MACHINE_THREAD));
+    this->NUM_PIR_THREAD = pow(2, min(log_tmp, log_pir_machine));
+    this->NUM_EXPANSION_THREAD = max(1, TOTAL_MACHINE_THREAD / NUM_COL_THREAD);
+    this->NUM_EXPONENT_THREAD = max(1, TOTAL_MACHINE_THREAD / (NUM_COL_THREAD * NUM_ROW_THREAD));
+    this->pipeline_rows = PIPELINE_ROWS;
+}
+
+void PIRServer::GetRowRange(int row_thread_id, int &start_idx, int &end_idx) const
+{
+    // Balanced split that covers every row; thread sizes differ by at most one row
+    start_idx = (int)((int64_t)NUM_ROW * row_thread_id / NUM_ROW_THREAD);
+    end_idx = (int)((int64_t)NUM_ROW * (row_thread_id + 1) / NUM_ROW_THREAD);
+}
+
+void PIRServer::GetGiantRange(int pir_thread_id, int &start_idx, int &end_idx) const
+{
+    int giant_steps = rotation_plan.giant_steps;
+    start_idx = (int)((int64_t)giant_steps * pir_thread_id / NUM_PIR_THREAD);
+    end_idx = (int)((int64_t)giant_steps * (pir_thread_id + 1) / NUM_PIR_THREAD);
 }
 
 void PIRServer::SetupPIRParams()
@@ -278,7 +679,7 @@ void PIRServer::populate_db()
     return;
 }
 
-void PIRServer::populate_db(vector<string> &keydb)
+vector<int> PIRServer::populate_db(vector<string> &keydb)
 {
     vector<vector<uint64_t>> mat_db;
     for (int i = 0; i < NUM_ROW * NUM_COL; i++)
@@ -288,25 +689,28 @@ void PIRServer::populate_db(vector<string> &keydb)
         mat_db.push_back(v);
     }
     unsigned char hash[SHA256_DIGEST_LENGTH];
-    for (uint32_t row = 0; row < NUM_ROW * (N / 2); row++)
+
+    // Key i goes to the next free item position of its slot group, which with one group is position i
+    uint32_t position_count = NUM_ROW * (N / 2);
+    vector<int> key_at(position_count, -1);
+    vector<uint32_t> group_fill(KEYS_PER_QUERY, 0);
+    for (int i = 0; i < keydb.size(); i++)
     {
-        uint32_t row_in_vector = row % (N / 2);
-        int j = 0;
-        string key;
-        char str[NUM_COL * 4];
-        if (row < keydb.size())
-        {
-            key = keydb[row];
-            for (j; j < key.size(); j++)
-            {
-                str[j] = key[j];
-            }
-        }
-        for (j; j < 4 * NUM_COL; j++)
+        key_hash(keydb[i], hash);
+        uint32_t group = key_group(hash);
+        uint32_t position = group + group_fill[group]++ * KEYS_PER_QUERY;
+        if (position >= position_count)
         {
-            str[j] = 0;
+            throw out_of_range("the slot group of a key is full");
         }
-        sha256(str, 4 * NUM_COL, hash);
+        key_at[position] = i;
+    }
+
+    string empty_key;
+    for (uint32_t row = 0; row < position_count; row++)
+    {
+        uint32_t row_in_vector = row % (N / 2);
+        key_hash(key_at[row] >= 0 ? keydb[key_at[row]] : empty_key, hash);
         for (int col = 0; col < NUM_COL; col++)
         {
             int vector_idx = (row / (N / 2)) * NUM_COL + col;
@@ -325,7 +729,15 @@ void PIRServer::populate_db(vector<string> &keydb)
         }
         db.push_back(row_partition);
     }
-    return;
+    return key_at;
+}
+
+void PIRServer::key_hash(const string &key, unsigned char *hash)
+{
+    // Keys are zero-padded to the key size before hashing, as in PIRClient
+    vector<char> str(NUM_COL * 4, 0);
+    std::copy(key.begin(), key.begin() + min(key.size(), str.size()), str.begin());
+    sha256(str.data(), 4 * NUM_COL, hash);
 }
 
 void PIRServer::sha256(const char *str, int len, unsigned char *dest)
@@ -365,11 +777,27 @@ void PIRServer::set_pir_db(std::vector<std::vector<uint64_t>> db)
 
 void PIRServer::pir_encode_db(std::vector<std::vector<uint64_t>> db)
 {
+    // Column j is stored rotated by its baby step -(j mod baby_steps) times the stride, see ColumnRotationPlan
+    auto &level = kernel_context->level(compact_pid);
+    vector<uint64_t> limb(level.coeff_count);
     pir_encoded_db = std::vector<seal::Plaintext>(db.size());
     for (int i = 0; i < db.size(); i++)
     {
         batch_encoder->encode(db[i], pir_encoded_db[i]);
         evaluator->transform_to_ntt_inplace(pir_encoded_db[i], compact_pid);
+
+        int baby_step = (i / pir_num_query_ciphertext) % rotation_plan.baby_steps;
+        if (baby_step)
+        {
+            int step = -baby_step * static_cast<int>(rotation_plan.stride);
+            const uint32_t *permutation = kernel_context->galois_permutation_ntt(kernel_context->galois_elt_from_step(step));
+            for (size_t j = 0; j < level.coeff_modulus_size; j++)
+            {
+                uint64_t *plain_limb = pir_encoded_db[i].data() + j * level.coeff_count;
+                std::copy(plain_limb, plain_limb + level.coeff_count, limb.begin());
+                my_apply_galois_ntt_permutation(limb.data(), permutation, level.coeff_count, plain_limb);
+            }
+        }
     }
 }
 
@@ -379,17 +807,24 @@ void *PIRServer::expand_query(void *arg)
     int id = args_ptr->id;
     PIRServer *server = args_ptr->server;
 
-    server->expanded_query[id] = server->server_query_ct;
-    my_multiply_plain_ntt(*(server->context), server->expanded_query[id], server->masks[id], server->NUM_EXPANSION_THREAD);
-    my_transform_from_ntt_inplace(*(server->context), server->expanded_query[id], server->NUM_EXPANSION_THREAD);
-    Ciphertext temp_ct;
+    // The masked query and every rotation are written straight into their buffers instead of into copies.
+    // Rotations work on NTT form, so expansion stays in the evaluation domain until Process1 needs coefficients.
+    my_multiply_plain_ntt(*(server->kernel_context), server->server_query_ct, server->masks[id], server->expanded_query[id], server->NUM_EXPANSION_THREAD);
+    Ciphertext temp_ct(server->column_arena->pool(id));
 
-    for (int i = N / (2 * server->NUM_COL); i < N / 2; i *= 2)
+    // A cancelled expansion still marks its column ready, so no column thread waits for it
+    for (int i = N / (2 * server->NUM_COL); i < N / 2 && !server->query_cancelled(); i *= 2)
     {
-        temp_ct = server->expanded_query[id];
-        my_rotate_internal(*(server->context), temp_ct, i, server->galois_keys, server->column_pools[id], server->NUM_EXPANSION_THREAD);
-        my_add_inplace(*(server->context), server->expanded_query[id], temp_ct);
+        server->rotate(server->expanded_query[id], i, temp_ct, server->column_arena->pool(id), server->NUM_EXPANSION_THREAD);
+        my_add_inplace(*(server->kernel_context), server->expanded_query[id], temp_ct);
     }
+    my_transform_from_ntt_inplace(*(server->kernel_context), server->expanded_query[id], server->NUM_EXPANSION_THREAD);
+
+    {
+        std::lock_guard<std::mutex> lock(server->query_expansion.mutex);
+        server->query_expansion.ready[id] = 1;
+    }
+    server->query_expansion.cv.notify_all();
     return nullptr;
 }
 
@@ -403,24 +838,51 @@ void *PIRServer::process_rows(void *arg)
     vector<column_thread_arg> column_args;
     vector<mult_thread_arg> mult_args;
 
+    // Column results grow during the column products, so they live in the arena of their column thread
+    int arena_offset = id * server->NUM_COL;
+    auto &row_pool = server->column_arena->pool(arena_offset);
+    int row_threads = server->TOTAL_MACHINE_THREAD / server->NUM_ROW_THREAD;
+    for (int i = 0; i < server->NUM_COL; i++)
+    {
+        column_results[i] = Ciphertext(server->column_arena->pool(arena_offset + i));
+    }
+
     for (int i = 0; i < server->NUM_COL_THREAD; i++)
     {
-        column_args.push_back(column_thread_arg(i, id, column_results));
+        column_args.push_back(column_thread_arg(i, id, column_results, arena_offset));
     }
     for (int i = 0; i < server->NUM_COL_THREAD; i++)
     {
-        mult_args.push_back(mult_thread_arg(i, 1, column_results));
+        mult_args.push_back(mult_thread_arg(i, 1, column_results, arena_offset));
     }
-    int num_row_per_thread = server->NUM_ROW / server->NUM_ROW_THREAD;
-    int start_idx = num_row_per_thread * id;
-    int end_idx = start_idx + num_row_per_thread;
+    int start_idx, end_idx;
+    server->GetRowRange(id, start_idx, end_idx);
 
     pthread_t col_process_thread[server->NUM_COL_THREAD];
     pthread_t col_mult_thread[server->NUM_COL_THREAD];
 
+    // Conjugate of the column product, reused by every row
+    Ciphertext temp_ct(row_pool);
+
+    // Baby step b of the row at b - 1, see ColumnRotationPlan
+    int baby_steps = server->rotation_plan.baby_steps;
+    int stride = server->rotation_plan.stride;
+    vector<Ciphertext> baby_cts;
+    vector<int> baby_rotation_steps;
+    for (int b = 1; b < baby_steps; b++)
+    {
+        baby_cts.emplace_back(row_pool);
+        baby_rotation_steps.push_back(-b * stride);
+    }
+
     for (int row_idx = start_idx; row_idx < end_idx; row_idx++)
     {
         // time_start = chrono::high_resolution_clock::now();
+        if (server->query_cancelled())
+        {
+            server->abort_rows();
+            break;
+        }
 
         PIRServer::ProcessColStructure *process_col_structure_ptr[server->NUM_COL_THREAD];
         for (int i = 0; i < server->NUM_COL_THREAD; i++)
@@ -439,6 +901,13 @@ void *PIRServer::process_rows(void *arg)
             delete process_col_structure_ptr[i];
         }
 
+        // Column threads that stopped for a cancellation left their results unfinished
+        if (server->query_cancelled())
+        {
+            server->abort_rows();
+            break;
+        }
+
         PIRServer::MultiplyColStructure *mul_col_structure_ptr[server->NUM_COL_THREAD];
         for (int diff = 2; diff <= server->NUM_COL_THREAD; diff *= 2)
         {
@@ -463,13 +932,46 @@ void *PIRServer::process_rows(void *arg)
             }
         }
 
-        Ciphertext temp_ct = column_results[0];
-        my_conjugate_internal(*(server->context), temp_ct, server->galois_keys, server->column_pools[0], server->TOTAL_MACHINE_THREAD / server->NUM_ROW_THREAD);
+        my_conjugate_internal(*(server->kernel_context), column_results[0], server->galois_keys, temp_ct, row_pool, row_threads);
+
+        my_bfv_multiply(*(server->kernel_context), column_results[0], temp_ct, row_pool, row_threads);
+        my_relinearize_internal(*(server->kernel_context), column_results[0], server->relin_keys, 2, row_pool, row_threads);
+        my_transform_to_ntt_inplace(*(server->kernel_context), column_results[0], row_threads);
+
+        // Hoisted baby steps share the raised digits of the row; chained ones rotate an earlier baby step by the
+        // highest power of two below b
+        if (server->rotation_plan.hoisted_babies)
+        {
+            my_rotate_hoisted(*(server->kernel_context), column_results[0], baby_rotation_steps, server->galois_keys, baby_cts, row_pool, row_threads);
+        }
+        else
+        {
+            for (int b = 1; b < baby_steps; b++)
+            {
+                int high = 1;
+                while (2 * high <= b)
+                {
+                    high *= 2;
+                }
+                const Ciphertext &source = (b == high) ? column_results[0] : baby_cts[b - high - 1];
+                server->rotate(source, -high * stride, baby_cts[b - 1], row_pool, row_threads);
+            }
+        }
 
-        my_bfv_multiply(*(server->context), column_results[0], temp_ct, server->column_pools[0], server->TOTAL_MACHINE_THREAD / server->NUM_ROW_THREAD);
-        my_relinearize_internal(*(server->context), column_results[0], server->relin_keys, 2, MemoryManager::GetPool(), server->TOTAL_MACHINE_THREAD / server->NUM_ROW_THREAD);
-        my_transform_to_ntt_inplace(*(server->context), column_results[0], server->TOTAL_MACHINE_THREAD / server->NUM_ROW_THREAD);
-        server->row_result[row_idx] = column_results[0];
+        // Hand the row its result and take the buffers it held in the previous query for the next row
+        if (server->pipeline_rows)
+        {
+            server->publish_row(row_idx, column_results[0], baby_cts);
+        }
+        else
+        {
+            auto &row_result = server->stage_buffers[server->process1_buffer].row_result;
+            std::swap(row_result[row_idx], column_results[0]);
+            for (int b = 1; b < baby_steps; b++)
+            {
+                std::swap(row_result[b * server->NUM_ROW + row_idx], baby_cts[b - 1]);
+            }
+        }
     }
     return nullptr;
 }
@@ -487,20 +989,29 @@ void *PIRServer::process_columns(void *arg)
     int end_idx = start_idx + num_col_per_thread;
     for (int i = start_idx; i < end_idx; i++)
     {
-        Ciphertext sub;
-        Ciphertext prod;
+        auto &pool = server->column_arena->pool(col_arg.arena_offset + i);
+        Ciphertext sub(pool);
+        server->wait_expanded_query(i);
+        if (server->query_cancelled())
+        {
+            return nullptr;
+        }
         server->evaluator->sub_plain(server->expanded_query[i], server->db[col_arg.row_idx][i], sub);
 
         for (int k = 0; k < 16; k++)
         {
-            my_bfv_square(*(server->context), sub, server->column_pools[i], server->NUM_EXPONENT_THREAD);
-            my_relinearize_internal(*(server->context), sub, server->relin_keys, 2, server->column_pools[i], server->NUM_EXPONENT_THREAD);
-        }
-        for (int k = 0; k < MOD_SWITCH_COUNT; k++)
-        {
-            my_mod_switch_scale_to_next(*(server->context), sub, sub, server->column_pools[i], server->NUM_EXPONENT_THREAD);
+            if (server->query_cancelled())
+            {
+                return nullptr;
+            }
+            my_bfv_square(*(server->kernel_context), sub, pool, server->NUM_EXPONENT_THREAD);
+            my_relinearize_internal(*(server->kernel_context), sub, server->relin_keys, 2, pool, server->NUM_EXPONENT_THREAD);
         }
-        server->evaluator->sub(server->one_ct, sub, (col_arg.column_result)[i]);
+        my_mod_switch_scale_to(*(server->kernel_context), sub, sub, server->compact_pid, pool, server->NUM_EXPONENT_THREAD);
+
+        // one_ct - sub is computed in sub, which then swaps buffers with the column result
+        server->evaluator->sub(server->one_ct, sub, sub);
+        std::swap((col_arg.column_result)[i], sub);
     }
     return nullptr;
 }
@@ -514,10 +1025,11 @@ void *PIRServer::multiply_columns(void *arg)
     Ciphertext *column_results = mult_arg.column_result;
     int id = mult_arg.id;
     int diff = mult_arg.diff;
-    int num_threads = server->TOTAL_MACHINE_THREAD / (server->NUM_COL / diff);
+    int num_threads = max(1, server->TOTAL_MACHINE_THREAD / (server->NUM_ROW_THREAD * (server->NUM_COL / diff)));
+    auto &pool = server->column_arena->pool(mult_arg.arena_offset + id);
 
-    my_bfv_multiply(*(server->context), column_results[id], column_results[id + (diff / 2)], server->column_pools[id], num_threads);
-    my_relinearize_internal(*(server->context), column_results[id], server->relin_keys, 2, server->column_pools[id], num_threads);
+    my_bfv_multiply(*(server->kernel_context), column_results[id], column_results[id + (diff / 2)], pool, num_threads);
+    my_relinearize_internal(*(server->kernel_context), column_results[id], server->relin_keys, 2, pool, num_threads);
     return nullptr;
 }
 
@@ -527,25 +1039,206 @@ void *PIRServer::process_pir(void *arg)
     int my_id = args_ptr->my_id;
     PIRServer *server = args_ptr->server;
 
-    int column_per_thread = (server->pir_num_columns_per_obj / 2) / server->NUM_PIR_THREAD;
-    int start_idx = my_id * column_per_thread;
-    int end_idx = start_idx + column_per_thread - 1;
+    int start_idx, end_idx;
+    server->GetGiantRange(my_id, start_idx, end_idx);
+    int giant_count = end_idx - start_idx;
+    int baby_steps = server->rotation_plan.baby_steps;
+    int stride = server->rotation_plan.stride;
+    int num_threads = server->PIR_MACHINE_THREAD / server->NUM_PIR_THREAD;
+
+    // All giant step sums of this thread in one pass over row_result and its baby steps, unless accumulate_rows
+    // already built them during Process1
+    auto &pool = server->pir_arena->pool(my_id);
+    auto &stage_buffer = server->stage_buffers[server->process2_buffer];
+    vector<Ciphertext> &column_sums = stage_buffer.column_sums[my_id];
+    if (!server->pipeline_rows)
+    {
+        column_sums.clear();
+        for (int i = 0; i < giant_count; i++)
+        {
+            column_sums.emplace_back(pool);
+        }
+        my_dot_product_plain_ntt(*(server->kernel_context), stage_buffer.row_result, &server->pir_encoded_db[server->pir_num_query_ciphertext * start_idx * baby_steps], giant_count, column_sums, num_threads);
+    }
+
+    // Giant step g goes to -g * baby_steps * stride. The rotations work on NTT form, so only the sum of this thread leaves
+    // the evaluation domain.
+    if (server->rotation_plan.giant_tree)
+    {
+        server->pir_results[my_id] = get_sum(column_sums, 0, giant_count - 1, pool, server);
+
+        int mask = 1;
+        while (mask <= start_idx && !server->process2_cancelled())
+        {
+            if (start_idx & mask)
+            {
+                server->rotate_inplace(server->pir_results[my_id], -mask * baby_steps * stride, pool, num_threads);
+            }
+            mask <<= 1;
+        }
+    }
+    else
+    {
+        for (int i = 0; i < giant_count && !server->process2_cancelled(); i++)
+        {
+            if (start_idx + i)
+            {
+                server->rotate_inplace(column_sums[i], -(start_idx + i) * baby_steps * stride, pool, num_threads);
+            }
+            if (i)
+            {
+                my_add_inplace(*(server->kernel_context), server->pir_results[my_id], column_sums[i]);
+            }
+            else
+            {
+                server->pir_results[my_id] = std::move(column_sums[0]);
+            }
+        }
+    }
+    if (server->process2_cancelled())
+    {
+        return nullptr;
+    }
+    my_transform_from_ntt_inplace(*(server->kernel_context), server->pir_results[my_id], num_threads);
+    return nullptr;
+}
+
+void *PIRServer::accumulate_rows(void *arg)
+{
+    PIRServer::ProcessPIRStructure *args_ptr = static_cast<PIRServer::ProcessPIRStructure *>(arg);
+    int my_id = args_ptr->my_id;
+    PIRServer *server = args_ptr->server;
+
+    // Same giant steps as process_pir of this thread
+    int start_idx, end_idx;
+    server->GetGiantRange(my_id, start_idx, end_idx);
+    int baby_steps = server->rotation_plan.baby_steps;
 
-    server->pir_results[my_id] = get_sum(server->row_result, start_idx, end_idx, server);
+    auto &pool = server->accumulate_arena->pool(server->process1_buffer * server->NUM_PIR_THREAD + my_id);
+    vector<Ciphertext> &column_sums = server->stage_buffers[server->process1_buffer].column_sums[my_id];
+    column_sums.clear();
+    for (int i = start_idx; i < end_idx; i++)
+    {
+        column_sums.emplace_back(pool);
+    }
 
-    int mask = 1;
-    while (mask <= start_idx)
+    // Rows arrive in the order the row threads finish them; the first one initializes the sums
+    for (int cursor = 0; cursor < server->NUM_ROW; cursor++)
     {
-        if (start_idx & mask)
+        int slot = server->take_row(cursor);
+        if (slot < 0)
         {
-            my_rotate_internal(*(server->context), server->pir_results[my_id], -mask, server->galois_keys, MemoryManager::GetPool(), server->TOTAL_MACHINE_THREAD / server->NUM_PIR_THREAD);
+            break;
         }
-        mask <<= 1;
+        int row_idx = server->row_pipeline.slot_row[slot];
+        for (int b = 0; b < baby_steps; b++)
+        {
+            const Ciphertext &row_ct = server->row_pipeline.slots[slot * baby_steps + b];
+            for (int i = 0; i < end_idx - start_idx; i++)
+            {
+                int column = (start_idx + i) * baby_steps + b;
+                auto &plain = server->pir_encoded_db[server->pir_num_query_ciphertext * column + row_idx];
+                if (cursor == 0 && b == 0)
+                {
+                    my_multiply_plain_ntt(*(server->kernel_context), row_ct, plain, column_sums[i], 1);
+                }
+                else
+                {
+                    my_multiply_plain_accumulate_ntt(*(server->kernel_context), row_ct, plain, column_sums[i], 1);
+                }
+            }
+        }
+        server->release_row(slot);
     }
     return nullptr;
 }
 
-Ciphertext PIRServer::get_sum(vector<Ciphertext> &query, uint32_t start, uint32_t end, PIRServer *server)
+void PIRServer::publish_row(int row_idx, Ciphertext &row_ct, vector<Ciphertext> &baby_cts)
+{
+    std::unique_lock<std::mutex> lock(row_pipeline.mutex);
+    row_pipeline.cv.wait(lock, [this]
+                         { return !row_pipeline.free_slots.empty() || row_pipeline.aborted; });
+    if (row_pipeline.aborted)
+    {
+        return;
+    }
+    int slot = row_pipeline.free_slots.back();
+    row_pipeline.free_slots.pop_back();
+
+    // The row thread takes the buffers of the slot for its next row
+    int baby_steps = rotation_plan.baby_steps;
+    std::swap(row_pipeline.slots[slot * baby_steps], row_ct);
+    for (int b = 1; b < baby_steps; b++)
+    {
+        std::swap(row_pipeline.slots[slot * baby_steps + b], baby_cts[b - 1]);
+    }
+    row_pipeline.slot_row[slot] = row_idx;
+    row_pipeline.slot_pending[slot] = NUM_PIR_THREAD;
+    row_pipeline.published.push_back(slot);
+    row_pipeline.cv.notify_all();
+}
+
+int PIRServer::take_row(int cursor)
+{
+    std::unique_lock<std::mutex> lock(row_pipeline.mutex);
+    row_pipeline.cv.wait(lock, [this, cursor]
+                         { return row_pipeline.published.size() > cursor || row_pipeline.aborted; });
+    if (row_pipeline.aborted)
+    {
+        return -1;
+    }
+    return row_pipeline.published[cursor];
+}
+
+void PIRServer::abort_rows()
+{
+    if (pipeline_rows)
+    {
+        std::lock_guard<std::mutex> lock(row_pipeline.mutex);
+        row_pipeline.aborted = true;
+        row_pipeline.cv.notify_all();
+    }
+}
+
+bool PIRServer::query_cancelled() const
+{
+    return query_expansion.cancel && query_expansion.cancel->cancelled();
+}
+
+bool PIRServer::process2_cancelled() const
+{
+    return process2_cancel && process2_cancel->cancelled();
+}
+
+void PIRServer::release_row(int slot)
+{
+    std::lock_guard<std::mutex> lock(row_pipeline.mutex);
+    if (!--row_pipeline.slot_pending[slot])
+    {
+        row_pipeline.free_slots.push_back(slot);
+        row_pipeline.cv.notify_all();
+    }
+}
+
+void PIRServer::rotate(const Ciphertext &encrypted, int step, Ciphertext &destination, const MemoryPoolHandle &pool, int num_threads)
+{
+    auto &composition = key_plan.composition(step);
+    my_rotate_internal(*kernel_context, encrypted, composition[0], galois_keys, destination, pool, num_threads);
+    for (size_t i = 1; i < composition.size(); i++)
+    {
+        my_rotate_internal(*kernel_context, destination, composition[i], galois_keys, pool, num_threads);
+    }
+}
+
+void PIRServer::rotate_inplace(Ciphertext &encrypted, int step, const MemoryPoolHandle &pool, int num_threads)
+{
+    for (int key_step : key_plan.composition(step))
+    {
+        my_rotate_internal(*kernel_context, encrypted, key_step, galois_keys, pool, num_threads);
+    }
+}
+
+Ciphertext PIRServer::get_sum(vector<Ciphertext> &column_sums, uint32_t start, uint32_t end, const MemoryPoolHandle &pool, PIRServer *server)
 {
     if (start != end)
     {
@@ -553,27 +1246,21 @@ Ciphertext PIRServer::get_sum(vector<Ciphertext> &query, uint32_t start, uint32_
         int next_power_of_two = get_next_power_of_two(count);
         int mid = next_power_of_two / 2;
 
-        seal::Ciphertext left_sum = get_sum(query, start, start + mid - 1, server);
-        seal::Ciphertext right_sum = get_sum(query, start + mid, end, server);
-        my_rotate_internal(*server->context, right_sum, -mid, server->galois_keys, server->column_pools[0], server->TOTAL_MACHINE_THREAD / server->NUM_PIR_THREAD);
-        my_add_inplace(*server->context, left_sum, right_sum);
+        seal::Ciphertext left_sum = get_sum(column_sums, start, start + mid - 1, pool, server);
+        seal::Ciphertext right_sum = get_sum(column_sums, start + mid, end, pool, server);
+        if (server->process2_cancelled())
+        {
+            return left_sum;
+        }
+        int step = -mid * static_cast<int>(server->rotation_plan.baby_steps * server->rotation_plan.stride);
+        server->rotate_inplace(right_sum, step, pool, server->PIR_MACHINE_THREAD / server->NUM_PIR_THREAD);
+        my_add_inplace(*server->kernel_context, left_sum, right_sum);
         return left_sum;
     }
     else
     {
-
-        seal::Ciphertext column_sum = query[0];
-        seal::Ciphertext temp_ct;
-        my_multiply_plain_ntt(*server->context, column_sum, server->pir_encoded_db[server->pir_num_query_ciphertext * start], server->TOTAL_MACHINE_THREAD / server->NUM_PIR_THREAD);
-
-        for (int j = 1; j < server->pir_num_query_ciphertext; j++)
-        {
-            temp_ct = query[j];
-            my_multiply_plain_ntt(*server->context, temp_ct, server->pir_encoded_db[server->pir_num_query_ciphertext * start + j], server->TOTAL_MACHINE_THREAD / server->NUM_PIR_THREAD);
-            my_add_inplace(*server->context, column_sum, temp_ct);
-        }
-        my_transform_from_ntt_inplace(*server->context, column_sum, server->TOTAL_MACHINE_THREAD / server->NUM_PIR_THREAD);
-        return column_sum;
+        // Leaves are consumed exactly once
+        return std::move(column_sums[start]);
     }
 }
 
@@ -1,6 +1,12 @@
 #pragma once
+#include <condition_variable>
 #include <cstdint>
+#include <mutex>
 #include "seal/seal.h"
+#include "KernelArena.h"
+#include "KernelContext.h"
+#include "KeySwitching.h"
+#include "QueryCancellation.h"
 #include "config.h"
 
 using namespace seal;
@@ -36,13 +42,16 @@ public:
     std::unique_ptr<EncryptionParameters> parms;
     std::stringstream parms_ss;
     std::unique_ptr<SEALContext> context;
+    std::unique_ptr<KernelContext> kernel_context;
     GaloisKeys galois_keys;
     RelinKeys relin_keys;
     std::unique_ptr<Evaluator> evaluator;
     std::unique_ptr<BatchEncoder> batch_encoder;
 
     /* Memory pool */
-    vector<MemoryPoolHandle> column_pools;
+    std::unique_ptr<KernelArena> column_arena; // one arena per column thread of every row thread
+    std::unique_ptr<KernelArena> pir_arena;    // one arena per PIR thread
+    std::unique_ptr<KernelArena> accumulate_arena; // with pipeline_rows, one per PIR thread of every stage buffer
 
     /* OneCiphertext */
     Ciphertext one_ct; // receive from client
@@ -53,7 +62,7 @@ public:
     vector<Ciphertext> expanded_query;
 
     /* Process1 */
-    vector<Ciphertext> row_result;
+    bool pipeline_rows; // rows go straight to the Process2 accumulators, see PIPELINE_ROWS
 
     /* Process2 */
     vector<Ciphertext> pir_results;
@@ -65,7 +74,9 @@ private:
     int NUM_COL_THREAD; // sub thread
     int NUM_ROW_THREAD; // main thread
     int NUM_PIR_THREAD;
-    int TOTAL_MACHINE_THREAD;
+    int TOTAL_MACHINE_THREAD; // QueryExpand and Process1
+    int PIR_MACHINE_THREAD;   // Process2
+    int NUM_STAGE_BUFFER;
     int NUM_EXPANSION_THREAD;
     int NUM_EXPONENT_THREAD;
 
@@ -100,39 +111,133 @@ private:
         ProcessPIRStructure(int my_id, PIRServer *server) : my_id(my_id), server(server) {}
     };
 
+    /* Process2 column placement, see ColumnRotationPlan */
+    ColumnRotationPlan rotation_plan;
+
+    /* Galois keys the client generates for the rotations of the expansion and the placement, see RotationKeyPlan */
+    RotationKeyPlan key_plan;
+
+    /*
+    Hand-off of finished rows from the row threads to the accumulator threads. A row and its baby steps are swapped
+    into a free slot, published, and read by every accumulator; the last one to finish with it frees the slot again.
+    Row threads wait for a free slot, so at most slot_row.size() rows are held at once.
+    */
+    struct RowPipeline
+    {
+        std::mutex mutex;
+        std::condition_variable cv;
+        vector<Ciphertext> slots; // baby step b of slot s at s * baby_steps + b
+        vector<int> slot_row;
+        vector<int> slot_pending;
+        vector<int> free_slots;
+        vector<int> published; // slots in publication order, one per finished row of the query
+        bool aborted = false;  // a row thread stopped for a cancellation, so no further rows come
+    };
+    RowPipeline row_pipeline;
+
+    /*
+    What Process1 leaves for Process2: the row results, or with pipeline_rows the column sums of every PIR thread
+    filled by accumulate_rows. There is one buffer per query that can sit between the two stages, so Process1 of
+    one query can run while Process2 of an earlier one reads its own buffer, see PIRScheduler.
+    */
+    struct StageBuffer
+    {
+        vector<Ciphertext> row_result; // baby step b of row r at b * NUM_ROW + r
+        vector<vector<Ciphertext>> column_sums; // giant step sums of every PIR thread
+    };
+    vector<StageBuffer> stage_buffers;
+    int process1_buffer;
+    int process2_buffer;
+    const CancellationToken *process2_cancel = nullptr;
+
+    /*
+    QueryExpand returns with the expansion threads still running. Each column is marked ready when its expansion
+    is done, so Process1 starts a column as soon as its query is expanded instead of after the slowest column.
+    */
+    struct QueryExpansion
+    {
+        std::mutex mutex;
+        std::condition_variable cv;
+        vector<char> ready;
+        vector<pthread_t> threads;
+        vector<ExpandQueryStructure *> structures;
+        const CancellationToken *cancel = nullptr; // of the query, which Process1 also checks
+    };
+    QueryExpansion query_expansion;
+
 public:
     PIRServer(uint64_t number_of_items, uint32_t key_size, uint32_t obj_size);
     /* Crypto setup */
     void SetupCryptoParams();
     //-----------> send parms_ss
-    void SetupKeys(std::stringstream &keys_ss /* relin_keys + galois_keys */);
+    void SetupKeys(std::istream &keys_ss /* relin_keys + galois_keys */);
 
     /* Receive OneCiphertext */
-    void RecOneCiphertext(std::stringstream &one_ct_ss);
+    void RecOneCiphertext(std::istream &one_ct_ss);
 
     /* Setup DB */
     void SetupDB();
     void SetupDB(vector<string> &keydb, vector<string> &elems);
 
     /* QueryExpand */
-    void QueryExpand(std::stringstream &qss);
+    // Process1 of the query stops once cancel is cancelled; it must outlive Process1
+    void QueryExpand(std::istream &qss, const CancellationToken *cancel = nullptr);
+    void QueryExpand(const char *data, size_t size, const CancellationToken *cancel = nullptr); // loads the query straight from the received bytes
 
     /* Process1  */
+    // Throws QueryCancelled after a cancelled query's threads have stopped
     void Process1();
+    void Process1(int buffer);
 
     /* Process2 */
     void Process2();
+    void Process2(int buffer, const CancellationToken *cancel = nullptr);
     //-----------> send ss
+    // Write the response straight into response instead of ss
+    void Process2(std::string &response, const CancellationToken *cancel = nullptr);
+    void Process2(int buffer, std::string &response, const CancellationToken *cancel = nullptr);
+
+    // Splits the machine between the stages and keeps buffer_count stage buffers; resizes the arenas if set up
+    void SetupStages(int process1_threads, int process2_threads, int buffer_count);
+
+    /* Arena metrics */
+    // Memory the query arenas hold and how often a query had to grow them; growth in steady state means a
+    // reservation is missing. Zero before SetupCryptoParams.
+    struct ArenaStats
+    {
+        size_t reserved_bytes;
+        size_t high_water_bytes;
+        size_t growth_count;
+        size_t grown_bytes;
+    };
+    ArenaStats GetArenaStats() const;
 
-    ~PIRServer() = default;
+    ~PIRServer();
 
 private:
     void SetupDBParams(uint64_t number_of_items, uint32_t key_size, uint32_t obj_size);
     void SetupMemPool();
     void SetupThreadParams();
+    void GetRowRange(int row_thread_id, int &start_idx, int &end_idx) const;
+    void GetGiantRange(int pir_thread_id, int &start_idx, int &end_idx) const;
     void SetupPIRParams();
+    void wait_expanded_query(int col_idx);
+    void prepare_query_expansion(const CancellationToken *cancel);
+    bool query_cancelled() const;
+    bool process2_cancelled() const;
+    void abort_rows();
+    void start_query_expansion();
+    void join_query_expansion();
+    void publish_row(int row_idx, Ciphertext &row_ct, vector<Ciphertext> &baby_cts);
+    int take_row(int cursor);
+    void release_row(int slot);
+    // Row rotations by a step of key_plan, composed of its key steps where the client has no key for it
+    void rotate(const Ciphertext &encrypted, int step, Ciphertext &destination, const MemoryPoolHandle &pool, int num_threads);
+    void rotate_inplace(Ciphertext &encrypted, int step, const MemoryPoolHandle &pool, int num_threads);
     void populate_db();
-    void populate_db(vector<string>& keydb);
+    // Returns the index into keydb of the key at every item position, -1 where there is none
+    vector<int> populate_db(vector<string>& keydb);
+    void key_hash(const string &key, unsigned char *hash);
     void sha256(const char *str, int len, unsigned char *dest);
     void set_pir_db(std::vector<std::vector<uint64_t>> db);
     void pir_encode_db(std::vector<std::vector<uint64_t>> db);
@@ -140,8 +245,12 @@ private:
     static void *process_rows(void *arg);
     static void *process_columns(void *arg);
     static void *multiply_columns(void *arg);
+    static void *accumulate_rows(void *arg);
     static void *process_pir(void *arg);
-    static Ciphertext get_sum(vector<Ciphertext> &query, uint32_t start, uint32_t end, PIRServer *server);
+    // Process2 up to the response in pir_results[0], at the last prime with COMPACT_RESPONSE
+    void process_columns_to_result(int buffer);
+    vector<uint64_t> pack_result();
+    static Ciphertext get_sum(vector<Ciphertext> &column_sums, uint32_t start, uint32_t end, const MemoryPoolHandle &pool, PIRServer *server);
     static uint32_t get_next_power_of_two(uint32_t number);
     static uint32_t get_number_of_bits(uint64_t number);
 };
\ No newline at end of file
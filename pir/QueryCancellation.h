@@ -0,0 +1,52 @@
+#pragma once
+#include <atomic>
+#include <functional>
+#include <stdexcept>
+#include <utility>
+
+/*
+Cancellation of a query that the server stages check between rows, columns, squarings and rotations. A token is
+cancelled by cancel() or by its poll function, e.g. a check of the RPC's state and deadline; once cancelled it
+stays cancelled, so the threads of a stage agree on it.
+*/
+class CancellationToken
+{
+public:
+    CancellationToken() = default;
+
+    explicit CancellationToken(std::function<bool()> poll) : poll_(std::move(poll))
+    {
+    }
+
+    void cancel()
+    {
+        cancelled_.store(true, std::memory_order_relaxed);
+    }
+
+    bool cancelled() const
+    {
+        if (cancelled_.load(std::memory_order_relaxed))
+        {
+            return true;
+        }
+        if (poll_ && poll_())
+        {
+            cancelled_.store(true, std::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
+private:
+    std::function<bool()> poll_;
+    mutable std::atomic<bool> cancelled_{ false };
+};
+
+// Thrown by a server stage that stopped for its token; the server stays ready for the next query
+class QueryCancelled : public std::runtime_error
+{
+public:
+    QueryCancelled() : std::runtime_error("query was cancelled")
+    {
+    }
+};
@@ -0,0 +1,96 @@
+#include "WireFormat.h"
+#include <cstring>
+#include <stdexcept>
+#include "seal/valcheck.h"
+#include "seal/util/rlwe.h"
+#include "seal/util/scalingvariant.h"
+
+using namespace seal;
+using namespace seal::util;
+using namespace std;
+
+namespace
+{
+    // "PWIR" in a little-endian dump
+    constexpr uint32_t wire_magic = 0x52495750;
+
+    void check_wire_header(const uint32_t *header, WireArtifact artifact)
+    {
+        if (header[0] != wire_magic)
+        {
+            throw logic_error("stream does not hold a wire artifact");
+        }
+        if (header[1] != WIRE_FORMAT_VERSION)
+        {
+            throw logic_error("wire format version is not supported");
+        }
+        if (header[2] != static_cast<uint32_t>(artifact))
+        {
+            throw logic_error("wire artifact is not of the expected kind");
+        }
+    }
+} // namespace
+
+void save_wire_header(ostream &stream, WireArtifact artifact)
+{
+    uint32_t header[3] = { wire_magic, WIRE_FORMAT_VERSION, static_cast<uint32_t>(artifact) };
+    stream.write(reinterpret_cast<const char *>(header), sizeof(header));
+}
+
+void load_wire_header(istream &stream, WireArtifact artifact)
+{
+    uint32_t header[3] = { 0, 0, 0 };
+    if (!stream.read(reinterpret_cast<char *>(header), sizeof(header)))
+    {
+        throw logic_error("stream does not hold a wire artifact");
+    }
+    check_wire_header(header, artifact);
+}
+
+size_t load_wire_header(const char *data, size_t size, WireArtifact artifact)
+{
+    uint32_t header[3] = { 0, 0, 0 };
+    if (size < sizeof(header))
+    {
+        throw logic_error("stream does not hold a wire artifact");
+    }
+    memcpy(header, data, sizeof(header));
+    check_wire_header(header, artifact);
+    return sizeof(header);
+}
+
+void make_seeded_zero(
+    const KernelContext &context, const SecretKey &secret_key, parms_id_type parms_id, Ciphertext &destination)
+{
+    // Throws for a level the kernels do not know
+    context.level(parms_id);
+    encrypt_zero_symmetric(secret_key, context.seal_context(), parms_id, false, true, destination);
+}
+
+void save_seeded_encryption(
+    const KernelContext &context, const Plaintext &plain, Ciphertext &seeded_zero, ostream &stream,
+    compr_mode_type compr_mode)
+{
+    auto &level = context.level(seeded_zero.parms_id());
+    if (!is_valid_for(plain, context.seal_context()) || plain.is_ntt_form())
+    {
+        throw invalid_argument("plain is not valid for encryption parameters");
+    }
+    if (seeded_zero.size() != 2 || seeded_zero.is_ntt_form())
+    {
+        throw invalid_argument("seeded_zero is not a seeded encryption of zero");
+    }
+
+    // The seed replaces the second polynomial, so the message only goes into the first, as in Encryptor
+    multiply_add_plain_with_scaling_variant(plain, *level.context_data, *iter(seeded_zero));
+    seeded_zero.save(stream, compr_mode);
+}
+
+void save_seeded_encryption(
+    const KernelContext &context, const SecretKey &secret_key, const Plaintext &plain, parms_id_type parms_id,
+    ostream &stream, compr_mode_type compr_mode)
+{
+    Ciphertext encrypted;
+    make_seeded_zero(context, secret_key, parms_id, encrypted);
+    save_seeded_encryption(context, plain, encrypted, stream, compr_mode);
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include "seal/ciphertext.h"
+#include "seal/plaintext.h"
+#include "seal/secretkey.h"
+#include "seal/serialization.h"
+#include "KernelContext.h"
+
+/*
+Wire format of what a client sends to the server: the relinearization and Galois keys, the one-ciphertext and the
+queries.
+
+Every artifact starts with a header of a magic number, WIRE_FORMAT_VERSION and the kind of artifact, followed by
+the SEAL object. The keys and ciphertexts are symmetric encryptions saved with their seed, so their second
+polynomial travels as a seed and the server expands it on load. SEAL records the compression mode in each object
+and inflates it while reading the stream, so the server takes whatever mode the client chose.
+*/
+
+constexpr std::uint32_t WIRE_FORMAT_VERSION = 1;
+
+enum class WireArtifact : std::uint32_t
+{
+    relin_keys = 1,
+    galois_keys = 2,
+    one_ciphertext = 3,
+    query = 4
+};
+
+void save_wire_header(std::ostream &stream, WireArtifact artifact);
+
+// Throws logic_error unless the stream continues with artifact in this version of the format
+void load_wire_header(std::istream &stream, WireArtifact artifact);
+
+// The same for an artifact in memory; returns the size of the header, after which the SEAL object starts
+std::size_t load_wire_header(const char *data, std::size_t size, WireArtifact artifact);
+
+// Seeded symmetric encryption of zero at the level of parms_id, for save_seeded_encryption to add a message to
+void make_seeded_zero(
+    const KernelContext &context, const seal::SecretKey &secret_key, seal::parms_id_type parms_id,
+    seal::Ciphertext &destination);
+
+// Adds plain to seeded_zero of make_seeded_zero and saves it with its seed; this is all of the encryption that
+// depends on the message
+void save_seeded_encryption(
+    const KernelContext &context, const seal::Plaintext &plain, seal::Ciphertext &seeded_zero, std::ostream &stream,
+    seal::compr_mode_type compr_mode);
+
+// Symmetric encryption of plain at the level of parms_id, saved with its seed. Encrypting at the level the server
+// works at keeps the seed, which switching a fresh encryption down to that level would lose.
+void save_seeded_encryption(
+    const KernelContext &context, const seal::SecretKey &secret_key, const seal::Plaintext &plain,
+    seal::parms_id_type parms_id, std::ostream &stream, seal::compr_mode_type compr_mode);
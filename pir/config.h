@@ -10,11 +10,13 @@ struct column_thread_arg
     int col_id;
     int row_idx;
     Ciphertext *column_result;
-    column_thread_arg(int c_id, int r_idx, Ciphertext *res)
+    int arena_offset; // first column arena of the row thread
+    column_thread_arg(int c_id, int r_idx, Ciphertext *res, int offset = 0)
     {
         col_id = c_id;
         row_idx = r_idx;
         column_result = res;
+        arena_offset = offset;
     }
 };
 
@@ -23,10 +25,12 @@ struct mult_thread_arg
     int id;
     int diff;
     Ciphertext *column_result;
-    mult_thread_arg(int _id, int _diff, Ciphertext *_column_result)
+    int arena_offset; // first column arena of the row thread
+    mult_thread_arg(int _id, int _diff, Ciphertext *_column_result, int _arena_offset = 0)
     {
         id = _id;
         diff = _diff;
         column_result = _column_result;
+        arena_offset = _arena_offset;
     }
 };
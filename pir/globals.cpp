@@ -1,3 +1,114 @@
 #include "globals.h"
 
-vector<int> CT_PRIMES({60,60,60,60,60,60,60,60,60,60,60,60,60});
\ No newline at end of file
+vector<int> CT_PRIMES({60,60,60,60,60,60,60,60,60,60,60,60,60});
+
+size_t key_switch_digit_count(KernelContext &context, int num_col)
+{
+    if (KSWITCH_DIGITS)
+    {
+        return KSWITCH_DIGITS;
+    }
+
+    // Key switches by level for one row of Process1: the squarings at the first level, the column products and
+    // the row conjugation at the compact level
+    auto first_pid = context.seal_context().first_parms_id();
+    auto compact_pid = get_lower_parms_id(context, first_pid, MOD_SWITCH_COUNT);
+    vector<pair<parms_id_type, size_t>> switch_counts{
+        { first_pid, static_cast<size_t>(num_col) * PLAIN_BIT }, { compact_pid, static_cast<size_t>(num_col) + 2 }
+    };
+    return plan_key_switch_digits(context, switch_counts, KSWITCH_NOISE_HEADROOM).digit_count;
+}
+
+ColumnRotationPlan column_rotation_plan(KernelContext &context, size_t column_count, size_t row_count)
+{
+    // The plan depends on the digit count, so it has to be taken after the keys are set up on both sides
+    auto compact_pid = get_lower_parms_id(context, context.seal_context().first_parms_id(), MOD_SWITCH_COUNT);
+    return plan_column_rotations(
+        context, compact_pid, column_count, row_count, KEYS_PER_QUERY, BSGS_BABY_STEPS, BSGS_MAX_ROTATION_KEYS);
+}
+
+uint32_t key_group(const unsigned char *hash)
+{
+    return ((static_cast<uint32_t>(hash[0]) << 8) + hash[1]) % KEYS_PER_QUERY;
+}
+
+RotationKeyPlan rotation_key_plan(
+    KernelContext &context, int num_col, size_t row_count, const ColumnRotationPlan &column_plan)
+{
+    vector<RotationUse> uses;
+
+    // The expansion of every column query sums its rotations by all multiples of the column width
+    for (int i = N / (2 * num_col); i < N / 2; i *= 2)
+    {
+        uses.push_back({ i, static_cast<size_t>(num_col), true });
+    }
+
+    // Hoisted baby steps share the raised digits of the row, so each needs its own key; chained ones rotate the
+    // baby step of b minus its highest power of two
+    int baby_steps = static_cast<int>(column_plan.baby_steps);
+    int stride = static_cast<int>(column_plan.stride);
+    for (int b = 1; b < baby_steps; b++)
+    {
+        if (column_plan.hoisted_babies)
+        {
+            uses.push_back({ -b * stride, row_count, false });
+            continue;
+        }
+        int high = 1;
+        while (high * 2 <= b)
+        {
+            high *= 2;
+        }
+        uses.push_back({ -high * stride, row_count, true });
+    }
+
+    // The rotation tree rotates by -g * baby_steps * stride about giant_steps / (2g) times for every power of two g
+    int giant_steps = static_cast<int>(column_plan.giant_steps);
+    for (int g = 1; g < giant_steps; g++)
+    {
+        if (!column_plan.giant_tree)
+        {
+            uses.push_back({ -g * baby_steps * stride, 1, true });
+        }
+        else if (!(g & (g - 1)))
+        {
+            uses.push_back({ -g * baby_steps * stride, static_cast<size_t>(max(1, giant_steps / (2 * g))), true });
+        }
+    }
+    return plan_rotation_keys(context, uses, ROTATION_KEY_WEIGHT);
+}
+
+void compact_response_drop_bits(KernelContext &context, size_t &c0_drop_bits, size_t &c1_drop_bits)
+{
+    auto &level = context.level(context.seal_context().last_parms_id());
+    auto &modulus = level.coeff_modulus[0];
+    double scale_bits = log2(static_cast<double>(modulus.value())) - log2(static_cast<double>(PLAIN_MODULUS));
+
+    // Decryption holds while the noise stays below q / (2t), and a budget of b bits means noise of q / (2t) / 2^b.
+    // Trimming may add up to q / (4t) minus that, half of it in each polynomial. Rounding the first polynomial
+    // moves a coefficient by at most 2^(drop - 1); in the second that is multiplied by the ternary secret key,
+    // which gives about 2 * sqrt(2N) times as much at six standard deviations.
+    double slack = 0.25 - pow(2.0, -(RESPONSE_NOISE_BUDGET + 1.0));
+    if (slack <= 0)
+    {
+        c0_drop_bits = c1_drop_bits = 0;
+        return;
+    }
+    double c0_bits = floor(log2(slack / 2) + scale_bits + 1);
+    double c1_bits = floor(c0_bits - log2(2 * sqrt(2.0 * level.coeff_count)));
+
+    double max_bits = modulus.bit_count() - 1;
+    c0_drop_bits = static_cast<size_t>(max(0.0, min(c0_bits, max_bits)));
+    c1_drop_bits = static_cast<size_t>(max(0.0, min(c1_bits, max_bits)));
+}
+
+compr_mode_type wire_compr_mode()
+{
+#ifdef SEAL_USE_ZSTD
+    if (WIRE_COMPRESSION)
+    {
+        return compr_mode_type::zstd;
+    }
+#endif
+    return compr_mode_type::none;
+}
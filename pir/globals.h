@@ -5,6 +5,9 @@
 #include "seal/seal.h"
 
 #include "utils.h"
+#include "KernelArena.h"
+#include "KeySwitching.h"
+#include "WireFormat.h"
 
 using namespace std::chrono;
 using namespace std;
@@ -20,6 +23,68 @@ using namespace seal;
 #define PLAIN_BIT 16
 #define PLAIN_MODULUS 65537
 
+// Digits of the key switching keys; 0 lets plan_key_switch_digits choose, CT_PRIMES.size() - 1 is SEAL's default
+#define KSWITCH_DIGITS 0
+// Bits the planner may add to the key switching noise. With a single 60-bit special prime a two-prime digit
+// already costs about 60 bits, which the 16 squarings cannot spare, so the planner keeps one digit per prime.
+#define KSWITCH_NOISE_HEADROOM 0
+
+// Process1 hands every finished row straight to the Process2 column accumulators instead of keeping all rows
+#define PIPELINE_ROWS 1
+
+// Keys one query retrieves. Slot s of a query holds the key of group s mod KEYS_PER_QUERY and the database places
+// every key in the slots of its group, so Process2 lays the columns of each group out with this stride. A power of
+// two that divides N / (2 * NUM_COL); 1 is one key per query.
+// Keys go to the group of their hash, and each group has only NUM_ROW * N / (2 * KEYS_PER_QUERY) item positions, so
+// the database fills up once its fullest group does, before all positions are used; SetupDB throws out_of_range
+// then. A batch needs as many queries as its fullest group has keys. Builds may set it, see pir/tests.
+#ifndef KEYS_PER_QUERY
+#define KEYS_PER_QUERY 1
+#endif
+
+// Baby steps of the Process2 column placement; 0 lets plan_column_rotations choose, 1 is the plain rotation tree
+#define BSGS_BABY_STEPS 0
+// Galois keys the column placement may use, on top of those of the expansion; 0 for no bound
+#define BSGS_MAX_ROTATION_KEYS 0
+
+// Responses are switched to the last prime, trimmed and bit-packed with my_pack_ciphertext instead of saved whole
+#define COMPACT_RESPONSE 1
+// Noise budget the response keeps at the last prime before trimming, as the client's decryptor reports it; the
+// trimming may spend all but one bit of it. The switch to one prime alone leaves about 30 bits.
+#define RESPONSE_NOISE_BUDGET 8
+
+// Key switches per query a Galois key is worth to plan_rotation_keys; a key is tens of MB at the key level, and a
+// query runs thousands of key switches in Process1. 0 keeps a key for every rotation step.
+#define ROTATION_KEY_WEIGHT 64
+
+// Client artifacts are saved with zstd when SEAL is built with it, see wire_compr_mode
+#define WIRE_COMPRESSION 1
+
+// Seeded encryptions of zero the client keeps ready for its queries, refilled by a background thread, so a query
+// only encodes and adds its message online; 0 encrypts every query when it is made
+#define QUERY_POOL_SIZE 16
+
 #define LARGE_COEFF_COUNT (((CT_PRIMES.size() - 1) * (N) * 2))
 #define SMALL_COEFF_COUNT (((CT_PRIMES.size() - 1 - MOD_SWITCH_COUNT) * (N) * 2))
-extern vector<int> CT_PRIMES;
\ No newline at end of file
+extern vector<int> CT_PRIMES;
+
+// KSWITCH_DIGITS, or the planned digit count for rows of num_col columns when it is 0
+size_t key_switch_digit_count(KernelContext &context, int num_col);
+
+// Placement of column_count column products of each of row_count rows at the compact level, shared by client and
+// server; the server sends its row count with the crypto params
+ColumnRotationPlan column_rotation_plan(KernelContext &context, size_t column_count, size_t row_count);
+
+// Slot group of a key from its SHA-256 hash, see KEYS_PER_QUERY
+uint32_t key_group(const unsigned char *hash);
+
+// Galois keys for the row rotations of the expansion of num_col columns and of column_plan for row_count rows,
+// shared by client and server
+RotationKeyPlan rotation_key_plan(
+    KernelContext &context, int num_col, size_t row_count, const ColumnRotationPlan &column_plan);
+
+// Low-order bits a compact response drops from its two polynomials at the last prime
+void compact_response_drop_bits(KernelContext &context, size_t &c0_drop_bits, size_t &c1_drop_bits);
+
+// Compression of the client artifacts of WireFormat.h: zstd with WIRE_COMPRESSION when SEAL supports it
+compr_mode_type wire_compr_mode();
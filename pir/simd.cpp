@@ -0,0 +1,809 @@
+#include "simd.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PANTHEON_X86
+#endif
+
+using namespace std;
+
+typedef unsigned __int128 uint128_t;
+
+// A product of two 61-bit values has at most 122 bits, so 64 of them fit in a 128-bit accumulator.
+#define LAZY_REDUCTION_SUMMAND_BOUND 64
+
+static SimdLevel detect_simd_level()
+{
+    SimdLevel level = SimdLevel::scalar;
+#ifdef PANTHEON_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        level = SimdLevel::avx2;
+    }
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq"))
+    {
+        level = SimdLevel::avx512;
+        if (__builtin_cpu_supports("avx512ifma"))
+        {
+            level = SimdLevel::avx512ifma;
+        }
+    }
+#endif
+
+    // Allow capping the level, e.g. to compare against the scalar path
+    const char *cap = getenv("PANTHEON_SIMD");
+    if (cap)
+    {
+        SimdLevel cap_level = level;
+        if (!strcmp(cap, "scalar"))
+        {
+            cap_level = SimdLevel::scalar;
+        }
+        else if (!strcmp(cap, "avx2"))
+        {
+            cap_level = SimdLevel::avx2;
+        }
+        else if (!strcmp(cap, "avx512"))
+        {
+            cap_level = SimdLevel::avx512;
+        }
+        else if (!strcmp(cap, "avx512ifma"))
+        {
+            cap_level = SimdLevel::avx512ifma;
+        }
+        level = min(level, cap_level);
+    }
+    return level;
+}
+
+SimdLevel simd_level()
+{
+    static const SimdLevel level = detect_simd_level();
+    return level;
+}
+
+const char *simd_level_name(SimdLevel level)
+{
+    switch (level)
+    {
+    case SimdLevel::avx2:
+        return "avx2";
+    case SimdLevel::avx512:
+        return "avx512";
+    case SimdLevel::avx512ifma:
+        return "avx512ifma";
+    default:
+        return "scalar";
+    }
+}
+
+// Same computation as seal::util::barrett_reduce_128
+static inline uint64_t barrett_reduce_u128(uint128_t input, uint64_t modulus, const uint64_t *const_ratio)
+{
+    uint64_t input0 = static_cast<uint64_t>(input);
+    uint64_t input1 = static_cast<uint64_t>(input >> 64);
+
+    // Round 1
+    uint64_t carry = static_cast<uint64_t>((uint128_t(input0) * const_ratio[0]) >> 64);
+    uint128_t tmp2 = uint128_t(input0) * const_ratio[1];
+    uint128_t sum = uint128_t(static_cast<uint64_t>(tmp2)) + carry;
+    uint64_t tmp1 = static_cast<uint64_t>(sum);
+    uint64_t tmp3 = static_cast<uint64_t>(tmp2 >> 64) + static_cast<uint64_t>(sum >> 64);
+
+    // Round 2
+    tmp2 = uint128_t(input1) * const_ratio[0];
+    sum = uint128_t(tmp1) + static_cast<uint64_t>(tmp2);
+    carry = static_cast<uint64_t>(tmp2 >> 64) + static_cast<uint64_t>(sum >> 64);
+
+    // This is all we care about
+    tmp1 = input1 * const_ratio[1] + tmp3 + carry;
+
+    // Barrett subtraction
+    tmp3 = input0 - tmp1 * modulus;
+    return tmp3 >= modulus ? tmp3 - modulus : tmp3;
+}
+
+static inline void store_reduced(uint128_t value, uint64_t modulus, const uint64_t *const_ratio, bool accumulate, uint64_t *out)
+{
+    uint64_t reduced = barrett_reduce_u128(value, modulus, const_ratio);
+    if (accumulate)
+    {
+        reduced += *out;
+        reduced = reduced >= modulus ? reduced - modulus : reduced;
+    }
+    *out = reduced;
+}
+
+typedef void (*dot_product_mod_fn)(
+    const uint64_t *, size_t, const uint64_t *, size_t, size_t, size_t, uint64_t, const uint64_t *, bool, uint64_t *);
+
+// Kernels below handle at most LAZY_REDUCTION_SUMMAND_BOUND factors and the coefficients [start, count).
+static void dot_product_mod_scalar(
+    const uint64_t *in, size_t in_stride, const uint64_t *factor, size_t factor_count, size_t start, size_t count,
+    uint64_t modulus, const uint64_t *const_ratio, bool accumulate, uint64_t *out)
+{
+    for (size_t k = start; k < count; k++)
+    {
+        uint128_t acc = 0;
+        for (size_t i = 0; i < factor_count; i++)
+        {
+            acc += uint128_t(in[i * in_stride + k]) * factor[i];
+        }
+        store_reduced(acc, modulus, const_ratio, accumulate, out + k);
+    }
+}
+
+#ifdef PANTHEON_X86
+/*
+Both SIMD paths split each 64-bit operand into 32-bit halves and accumulate the four partial products by
+32-bit column in 64-bit lanes:
+
+    col0 += lo(a0*b0)
+    col1 += hi(a0*b0) + lo(a0*b1) + lo(a1*b0)
+    col2 += hi(a0*b1) + hi(a1*b0) + lo(a1*b1)
+    col3 += hi(a1*b1)
+
+Each summand is below 2^32, so no column can overflow, and col0 + col1*2^32 + col2*2^64 + col3*2^96 is the
+exact 128-bit sum.
+*/
+static inline uint128_t combine_columns(uint64_t col0, uint64_t col1, uint64_t col2, uint64_t col3)
+{
+    return uint128_t(col0) + (uint128_t(col1) << 32) + (uint128_t(col2) << 64) + (uint128_t(col3) << 96);
+}
+
+__attribute__((target("avx2"))) static void dot_product_mod_avx2(
+    const uint64_t *in, size_t in_stride, const uint64_t *factor, size_t factor_count, size_t start, size_t count,
+    uint64_t modulus, const uint64_t *const_ratio, bool accumulate, uint64_t *out)
+{
+    const __m256i low_mask = _mm256_set1_epi64x(0xFFFFFFFFULL);
+    alignas(32) uint64_t col[4][4];
+
+    size_t k = start;
+    for (; k + 4 <= count; k += 4)
+    {
+        __m256i col0 = _mm256_setzero_si256();
+        __m256i col1 = _mm256_setzero_si256();
+        __m256i col2 = _mm256_setzero_si256();
+        __m256i col3 = _mm256_setzero_si256();
+        for (size_t i = 0; i < factor_count; i++)
+        {
+            __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i * in_stride + k));
+            __m256i a_hi = _mm256_srli_epi64(a, 32);
+            __m256i b = _mm256_set1_epi64x(static_cast<long long>(factor[i]));
+            __m256i b_hi = _mm256_set1_epi64x(static_cast<long long>(factor[i] >> 32));
+
+            __m256i p00 = _mm256_mul_epu32(a, b);
+            __m256i p01 = _mm256_mul_epu32(a, b_hi);
+            __m256i p10 = _mm256_mul_epu32(a_hi, b);
+            __m256i p11 = _mm256_mul_epu32(a_hi, b_hi);
+
+            col0 = _mm256_add_epi64(col0, _mm256_and_si256(p00, low_mask));
+            col1 = _mm256_add_epi64(col1, _mm256_srli_epi64(p00, 32));
+            col1 = _mm256_add_epi64(col1, _mm256_and_si256(p01, low_mask));
+            col1 = _mm256_add_epi64(col1, _mm256_and_si256(p10, low_mask));
+            col2 = _mm256_add_epi64(col2, _mm256_srli_epi64(p01, 32));
+            col2 = _mm256_add_epi64(col2, _mm256_srli_epi64(p10, 32));
+            col2 = _mm256_add_epi64(col2, _mm256_and_si256(p11, low_mask));
+            col3 = _mm256_add_epi64(col3, _mm256_srli_epi64(p11, 32));
+        }
+        _mm256_store_si256(reinterpret_cast<__m256i *>(col[0]), col0);
+        _mm256_store_si256(reinterpret_cast<__m256i *>(col[1]), col1);
+        _mm256_store_si256(reinterpret_cast<__m256i *>(col[2]), col2);
+        _mm256_store_si256(reinterpret_cast<__m256i *>(col[3]), col3);
+        for (size_t l = 0; l < 4; l++)
+        {
+            store_reduced(combine_columns(col[0][l], col[1][l], col[2][l], col[3][l]), modulus, const_ratio, accumulate, out + k + l);
+        }
+    }
+    dot_product_mod_scalar(in, in_stride, factor, factor_count, k, count, modulus, const_ratio, accumulate, out);
+}
+
+__attribute__((target("avx512f"))) static void dot_product_mod_avx512(
+    const uint64_t *in, size_t in_stride, const uint64_t *factor, size_t factor_count, size_t start, size_t count,
+    uint64_t modulus, const uint64_t *const_ratio, bool accumulate, uint64_t *out)
+{
+    const __m512i low_mask = _mm512_set1_epi64(0xFFFFFFFFLL);
+    alignas(64) uint64_t col[4][8];
+
+    size_t k = start;
+    for (; k + 8 <= count; k += 8)
+    {
+        __m512i col0 = _mm512_setzero_si512();
+        __m512i col1 = _mm512_setzero_si512();
+        __m512i col2 = _mm512_setzero_si512();
+        __m512i col3 = _mm512_setzero_si512();
+        for (size_t i = 0; i < factor_count; i++)
+        {
+            __m512i a = _mm512_loadu_si512(in + i * in_stride + k);
+            __m512i a_hi = _mm512_srli_epi64(a, 32);
+            __m512i b = _mm512_set1_epi64(static_cast<long long>(factor[i]));
+            __m512i b_hi = _mm512_set1_epi64(static_cast<long long>(factor[i] >> 32));
+
+            __m512i p00 = _mm512_mul_epu32(a, b);
+            __m512i p01 = _mm512_mul_epu32(a, b_hi);
+            __m512i p10 = _mm512_mul_epu32(a_hi, b);
+            __m512i p11 = _mm512_mul_epu32(a_hi, b_hi);
+
+            col0 = _mm512_add_epi64(col0, _mm512_and_si512(p00, low_mask));
+            col1 = _mm512_add_epi64(col1, _mm512_srli_epi64(p00, 32));
+            col1 = _mm512_add_epi64(col1, _mm512_and_si512(p01, low_mask));
+            col1 = _mm512_add_epi64(col1, _mm512_and_si512(p10, low_mask));
+            col2 = _mm512_add_epi64(col2, _mm512_srli_epi64(p01, 32));
+            col2 = _mm512_add_epi64(col2, _mm512_srli_epi64(p10, 32));
+            col2 = _mm512_add_epi64(col2, _mm512_and_si512(p11, low_mask));
+            col3 = _mm512_add_epi64(col3, _mm512_srli_epi64(p11, 32));
+        }
+        _mm512_store_si512(col[0], col0);
+        _mm512_store_si512(col[1], col1);
+        _mm512_store_si512(col[2], col2);
+        _mm512_store_si512(col[3], col3);
+        for (size_t l = 0; l < 8; l++)
+        {
+            store_reduced(combine_columns(col[0][l], col[1][l], col[2][l], col[3][l]), modulus, const_ratio, accumulate, out + k + l);
+        }
+    }
+    dot_product_mod_scalar(in, in_stride, factor, factor_count, k, count, modulus, const_ratio, accumulate, out);
+}
+#endif
+
+static dot_product_mod_fn select_dot_product_mod()
+{
+#ifdef PANTHEON_X86
+    switch (simd_level())
+    {
+    case SimdLevel::avx512ifma:
+    case SimdLevel::avx512:
+        return dot_product_mod_avx512;
+    case SimdLevel::avx2:
+        return dot_product_mod_avx2;
+    default:
+        break;
+    }
+#endif
+    return dot_product_mod_scalar;
+}
+
+void simd_dot_product_mod(
+    const uint64_t *in, size_t in_stride, const uint64_t *factor, size_t factor_count, size_t count, uint64_t modulus,
+    const uint64_t *const_ratio, uint64_t *out)
+{
+    static const dot_product_mod_fn dot_product_mod = select_dot_product_mod();
+
+    if (!factor_count)
+    {
+        fill_n(out, count, uint64_t(0));
+        return;
+    }
+
+    // Reduce once per LAZY_REDUCTION_SUMMAND_BOUND factors; in practice the whole base fits in one pass
+    for (size_t i = 0; i < factor_count; i += LAZY_REDUCTION_SUMMAND_BOUND)
+    {
+        size_t chunk = min(factor_count - i, size_t(LAZY_REDUCTION_SUMMAND_BOUND));
+        dot_product_mod(in + i * in_stride, in_stride, factor + i, chunk, 0, count, modulus, const_ratio, i != 0, out);
+    }
+}
+
+typedef void (*inner_product_mod_fn)(
+    const uint64_t *const *, const uint64_t *const *, size_t, size_t, size_t, uint64_t, const uint64_t *, bool,
+    uint64_t *);
+
+static void inner_product_mod_scalar(
+    const uint64_t *const *a, const uint64_t *const *b, size_t term_count, size_t start, size_t count,
+    uint64_t modulus, const uint64_t *const_ratio, bool accumulate, uint64_t *out)
+{
+    for (size_t k = start; k < count; k++)
+    {
+        uint128_t acc = 0;
+        for (size_t j = 0; j < term_count; j++)
+        {
+            acc += uint128_t(a[j][k]) * b[j][k];
+        }
+        store_reduced(acc, modulus, const_ratio, accumulate, out + k);
+    }
+}
+
+#ifdef PANTHEON_X86
+// Same column accumulation as the dot product kernels above
+__attribute__((target("avx2"))) static void inner_product_mod_avx2(
+    const uint64_t *const *a, const uint64_t *const *b, size_t term_count, size_t start, size_t count,
+    uint64_t modulus, const uint64_t *const_ratio, bool accumulate, uint64_t *out)
+{
+    const __m256i low_mask = _mm256_set1_epi64x(0xFFFFFFFFULL);
+    alignas(32) uint64_t col[4][4];
+
+    size_t k = start;
+    for (; k + 4 <= count; k += 4)
+    {
+        __m256i col0 = _mm256_setzero_si256();
+        __m256i col1 = _mm256_setzero_si256();
+        __m256i col2 = _mm256_setzero_si256();
+        __m256i col3 = _mm256_setzero_si256();
+        for (size_t j = 0; j < term_count; j++)
+        {
+            __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a[j] + k));
+            __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b[j] + k));
+            __m256i va_hi = _mm256_srli_epi64(va, 32);
+            __m256i vb_hi = _mm256_srli_epi64(vb, 32);
+
+            __m256i p00 = _mm256_mul_epu32(va, vb);
+            __m256i p01 = _mm256_mul_epu32(va, vb_hi);
+            __m256i p10 = _mm256_mul_epu32(va_hi, vb);
+            __m256i p11 = _mm256_mul_epu32(va_hi, vb_hi);
+
+            col0 = _mm256_add_epi64(col0, _mm256_and_si256(p00, low_mask));
+            col1 = _mm256_add_epi64(col1, _mm256_srli_epi64(p00, 32));
+            col1 = _mm256_add_epi64(col1, _mm256_and_si256(p01, low_mask));
+            col1 = _mm256_add_epi64(col1, _mm256_and_si256(p10, low_mask));
+            col2 = _mm256_add_epi64(col2, _mm256_srli_epi64(p01, 32));
+            col2 = _mm256_add_epi64(col2, _mm256_srli_epi64(p10, 32));
+            col2 = _mm256_add_epi64(col2, _mm256_and_si256(p11, low_mask));
+            col3 = _mm256_add_epi64(col3, _mm256_srli_epi64(p11, 32));
+        }
+        _mm256_store_si256(reinterpret_cast<__m256i *>(col[0]), col0);
+        _mm256_store_si256(reinterpret_cast<__m256i *>(col[1]), col1);
+        _mm256_store_si256(reinterpret_cast<__m256i *>(col[2]), col2);
+        _mm256_store_si256(reinterpret_cast<__m256i *>(col[3]), col3);
+        for (size_t l = 0; l < 4; l++)
+        {
+            store_reduced(combine_columns(col[0][l], col[1][l], col[2][l], col[3][l]), modulus, const_ratio, accumulate, out + k + l);
+        }
+    }
+    inner_product_mod_scalar(a, b, term_count, k, count, modulus, const_ratio, accumulate, out);
+}
+
+__attribute__((target("avx512f"))) static void inner_product_mod_avx512(
+    const uint64_t *const *a, const uint64_t *const *b, size_t term_count, size_t start, size_t count,
+    uint64_t modulus, const uint64_t *const_ratio, bool accumulate, uint64_t *out)
+{
+    const __m512i low_mask = _mm512_set1_epi64(0xFFFFFFFFLL);
+    alignas(64) uint64_t col[4][8];
+
+    size_t k = start;
+    for (; k + 8 <= count; k += 8)
+    {
+        __m512i col0 = _mm512_setzero_si512();
+        __m512i col1 = _mm512_setzero_si512();
+        __m512i col2 = _mm512_setzero_si512();
+        __m512i col3 = _mm512_setzero_si512();
+        for (size_t j = 0; j < term_count; j++)
+        {
+            __m512i va = _mm512_loadu_si512(a[j] + k);
+            __m512i vb = _mm512_loadu_si512(b[j] + k);
+            __m512i va_hi = _mm512_srli_epi64(va, 32);
+            __m512i vb_hi = _mm512_srli_epi64(vb, 32);
+
+            __m512i p00 = _mm512_mul_epu32(va, vb);
+            __m512i p01 = _mm512_mul_epu32(va, vb_hi);
+            __m512i p10 = _mm512_mul_epu32(va_hi, vb);
+            __m512i p11 = _mm512_mul_epu32(va_hi, vb_hi);
+
+            col0 = _mm512_add_epi64(col0, _mm512_and_si512(p00, low_mask));
+            col1 = _mm512_add_epi64(col1, _mm512_srli_epi64(p00, 32));
+            col1 = _mm512_add_epi64(col1, _mm512_and_si512(p01, low_mask));
+            col1 = _mm512_add_epi64(col1, _mm512_and_si512(p10, low_mask));
+            col2 = _mm512_add_epi64(col2, _mm512_srli_epi64(p01, 32));
+            col2 = _mm512_add_epi64(col2, _mm512_srli_epi64(p10, 32));
+            col2 = _mm512_add_epi64(col2, _mm512_and_si512(p11, low_mask));
+            col3 = _mm512_add_epi64(col3, _mm512_srli_epi64(p11, 32));
+        }
+        _mm512_store_si512(col[0], col0);
+        _mm512_store_si512(col[1], col1);
+        _mm512_store_si512(col[2], col2);
+        _mm512_store_si512(col[3], col3);
+        for (size_t l = 0; l < 8; l++)
+        {
+            store_reduced(combine_columns(col[0][l], col[1][l], col[2][l], col[3][l]), modulus, const_ratio, accumulate, out + k + l);
+        }
+    }
+    inner_product_mod_scalar(a, b, term_count, k, count, modulus, const_ratio, accumulate, out);
+}
+#endif
+
+static inner_product_mod_fn select_inner_product_mod()
+{
+#ifdef PANTHEON_X86
+    switch (simd_level())
+    {
+    case SimdLevel::avx512ifma:
+    case SimdLevel::avx512:
+        return inner_product_mod_avx512;
+    case SimdLevel::avx2:
+        return inner_product_mod_avx2;
+    default:
+        break;
+    }
+#endif
+    return inner_product_mod_scalar;
+}
+
+void simd_inner_product_mod(
+    const uint64_t *const *a, const uint64_t *const *b, size_t term_count, size_t count, uint64_t modulus,
+    const uint64_t *const_ratio, uint64_t *out)
+{
+    static const inner_product_mod_fn inner_product_mod = select_inner_product_mod();
+
+    if (!term_count)
+    {
+        fill_n(out, count, uint64_t(0));
+        return;
+    }
+
+    for (size_t j = 0; j < term_count; j += LAZY_REDUCTION_SUMMAND_BOUND)
+    {
+        size_t chunk = min(term_count - j, size_t(LAZY_REDUCTION_SUMMAND_BOUND));
+        inner_product_mod(a + j, b + j, chunk, 0, count, modulus, const_ratio, j != 0, out);
+    }
+}
+
+/*
+Elementwise kernels. The vector multiply uses Barrett reduction with n = bit length of the modulus (HAC 14.42):
+for x < 2^(2n), floor(x / modulus) - floor(floor(x / 2^(n-1)) * floor(2^(2n) / modulus) / 2^(n+1)) is at most 2,
+so two conditional subtractions finish the reduction. The factor is pre-shifted so that the division by
+2^(n+1) becomes the high half of a 64-bit (or, for IFMA52, 52-bit) product.
+*/
+#define IFMA_MODULUS_BOUND (uint64_t(1) << 50)
+
+struct BarrettFactor
+{
+    uint64_t bit_count;
+    uint64_t factor64;
+    uint64_t factor52;
+};
+
+static inline BarrettFactor make_barrett_factor(uint64_t modulus)
+{
+    BarrettFactor result;
+    result.bit_count = 64 - __builtin_clzll(modulus);
+    uint128_t mu = (uint128_t(1) << (2 * result.bit_count)) / modulus;
+    result.factor64 = static_cast<uint64_t>(mu << (63 - result.bit_count));
+    result.factor52 = result.bit_count <= 51 ? static_cast<uint64_t>(mu << (51 - result.bit_count)) : 0;
+    return result;
+}
+
+typedef void (*add_mod_fn)(const uint64_t *, const uint64_t *, size_t, size_t, uint64_t, uint64_t *);
+typedef void (*multiply_mod_fn)(
+    const uint64_t *, const uint64_t *, size_t, size_t, uint64_t, const uint64_t *, bool, uint64_t *);
+typedef void (*multiply_scalar_mod_fn)(const uint64_t *, size_t, size_t, uint64_t, uint64_t, uint64_t, uint64_t *);
+
+static void add_mod_scalar(const uint64_t *a, const uint64_t *b, size_t start, size_t count, uint64_t modulus, uint64_t *out)
+{
+    for (size_t k = start; k < count; k++)
+    {
+        uint64_t sum = a[k] + b[k];
+        out[k] = sum >= modulus ? sum - modulus : sum;
+    }
+}
+
+static void multiply_mod_scalar(
+    const uint64_t *a, const uint64_t *b, size_t start, size_t count, uint64_t modulus, const uint64_t *const_ratio,
+    bool accumulate, uint64_t *out)
+{
+    for (size_t k = start; k < count; k++)
+    {
+        store_reduced(uint128_t(a[k]) * b[k], modulus, const_ratio, accumulate, out + k);
+    }
+}
+
+static void multiply_scalar_mod_scalar(
+    const uint64_t *a, size_t start, size_t count, uint64_t operand, uint64_t quotient, uint64_t modulus, uint64_t *out)
+{
+    for (size_t k = start; k < count; k++)
+    {
+        uint64_t hi = static_cast<uint64_t>((uint128_t(a[k]) * quotient) >> 64);
+        uint64_t r = a[k] * operand - hi * modulus;
+        out[k] = r >= modulus ? r - modulus : r;
+    }
+}
+
+#ifdef PANTHEON_X86
+// Lanes stay below 2^63 here, so the signed comparison is exact
+__attribute__((target("avx2"))) static inline __m256i sub_if_ge_avx2(__m256i x, __m256i modulus)
+{
+    __m256i less = _mm256_cmpgt_epi64(modulus, x);
+    return _mm256_blendv_epi8(_mm256_sub_epi64(x, modulus), x, less);
+}
+
+__attribute__((target("avx2"))) static inline void multiply_wide_avx2(__m256i a, __m256i b, __m256i &hi, __m256i &lo)
+{
+    const __m256i low_mask = _mm256_set1_epi64x(0xFFFFFFFFULL);
+    __m256i a_hi = _mm256_srli_epi64(a, 32);
+    __m256i b_hi = _mm256_srli_epi64(b, 32);
+    __m256i p00 = _mm256_mul_epu32(a, b);
+    __m256i p01 = _mm256_mul_epu32(a, b_hi);
+    __m256i p10 = _mm256_mul_epu32(a_hi, b);
+    __m256i p11 = _mm256_mul_epu32(a_hi, b_hi);
+    __m256i mid = _mm256_add_epi64(
+        _mm256_srli_epi64(p00, 32), _mm256_add_epi64(_mm256_and_si256(p01, low_mask), _mm256_and_si256(p10, low_mask)));
+    lo = _mm256_or_si256(_mm256_and_si256(p00, low_mask), _mm256_slli_epi64(mid, 32));
+    hi = _mm256_add_epi64(
+        _mm256_add_epi64(p11, _mm256_srli_epi64(mid, 32)),
+        _mm256_add_epi64(_mm256_srli_epi64(p01, 32), _mm256_srli_epi64(p10, 32)));
+}
+
+__attribute__((target("avx2"))) static inline __m256i multiply_low_avx2(__m256i a, __m256i b)
+{
+    __m256i cross = _mm256_add_epi64(
+        _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)), _mm256_mul_epu32(_mm256_srli_epi64(a, 32), b));
+    return _mm256_add_epi64(_mm256_mul_epu32(a, b), _mm256_slli_epi64(cross, 32));
+}
+
+__attribute__((target("avx2"))) static void add_mod_avx2(
+    const uint64_t *a, const uint64_t *b, size_t start, size_t count, uint64_t modulus, uint64_t *out)
+{
+    const __m256i q = _mm256_set1_epi64x(static_cast<long long>(modulus));
+    size_t k = start;
+    for (; k + 4 <= count; k += 4)
+    {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + k));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + k));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + k), sub_if_ge_avx2(_mm256_add_epi64(va, vb), q));
+    }
+    add_mod_scalar(a, b, k, count, modulus, out);
+}
+
+__attribute__((target("avx2"))) static void multiply_mod_avx2(
+    const uint64_t *a, const uint64_t *b, size_t start, size_t count, uint64_t modulus, const uint64_t *const_ratio,
+    bool accumulate, uint64_t *out)
+{
+    BarrettFactor barrett = make_barrett_factor(modulus);
+    const __m256i q = _mm256_set1_epi64x(static_cast<long long>(modulus));
+    const __m256i two_q = _mm256_set1_epi64x(static_cast<long long>(modulus << 1));
+    const __m256i factor = _mm256_set1_epi64x(static_cast<long long>(barrett.factor64));
+    const __m128i shift_lo = _mm_cvtsi64_si128(static_cast<long long>(barrett.bit_count - 1));
+    const __m128i shift_hi = _mm_cvtsi64_si128(static_cast<long long>(65 - barrett.bit_count));
+
+    size_t k = start;
+    for (; k + 4 <= count; k += 4)
+    {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + k));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + k));
+        va = sub_if_ge_avx2(sub_if_ge_avx2(va, two_q), q);
+        vb = sub_if_ge_avx2(sub_if_ge_avx2(vb, two_q), q);
+
+        __m256i hi, lo, quotient, unused;
+        multiply_wide_avx2(va, vb, hi, lo);
+        __m256i c1 = _mm256_or_si256(_mm256_sll_epi64(hi, shift_hi), _mm256_srl_epi64(lo, shift_lo));
+        multiply_wide_avx2(c1, factor, quotient, unused);
+        __m256i r = _mm256_sub_epi64(lo, multiply_low_avx2(quotient, q));
+        r = sub_if_ge_avx2(sub_if_ge_avx2(r, q), q);
+        if (accumulate)
+        {
+            __m256i acc = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(out + k));
+            r = sub_if_ge_avx2(_mm256_add_epi64(r, acc), q);
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + k), r);
+    }
+    multiply_mod_scalar(a, b, k, count, modulus, const_ratio, accumulate, out);
+}
+
+__attribute__((target("avx2"))) static void multiply_scalar_mod_avx2(
+    const uint64_t *a, size_t start, size_t count, uint64_t operand, uint64_t quotient, uint64_t modulus, uint64_t *out)
+{
+    const __m256i q = _mm256_set1_epi64x(static_cast<long long>(modulus));
+    const __m256i w = _mm256_set1_epi64x(static_cast<long long>(operand));
+    const __m256i w_quotient = _mm256_set1_epi64x(static_cast<long long>(quotient));
+    size_t k = start;
+    for (; k + 4 <= count; k += 4)
+    {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + k));
+        __m256i hi, unused;
+        multiply_wide_avx2(va, w_quotient, hi, unused);
+        __m256i r = _mm256_sub_epi64(multiply_low_avx2(va, w), multiply_low_avx2(hi, q));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + k), sub_if_ge_avx2(r, q));
+    }
+    multiply_scalar_mod_scalar(a, k, count, operand, quotient, modulus, out);
+}
+
+__attribute__((target("avx512f,avx512dq"))) static inline __m512i sub_if_ge_avx512(__m512i x, __m512i modulus)
+{
+    return _mm512_min_epu64(x, _mm512_sub_epi64(x, modulus));
+}
+
+__attribute__((target("avx512f,avx512dq"))) static inline __m512i multiply_high_avx512(__m512i a, __m512i b)
+{
+    const __m512i low_mask = _mm512_set1_epi64(0xFFFFFFFFLL);
+    __m512i a_hi = _mm512_srli_epi64(a, 32);
+    __m512i b_hi = _mm512_srli_epi64(b, 32);
+    __m512i p00 = _mm512_mul_epu32(a, b);
+    __m512i p01 = _mm512_mul_epu32(a, b_hi);
+    __m512i p10 = _mm512_mul_epu32(a_hi, b);
+    __m512i p11 = _mm512_mul_epu32(a_hi, b_hi);
+    __m512i mid = _mm512_add_epi64(
+        _mm512_srli_epi64(p00, 32), _mm512_add_epi64(_mm512_and_si512(p01, low_mask), _mm512_and_si512(p10, low_mask)));
+    return _mm512_add_epi64(
+        _mm512_add_epi64(p11, _mm512_srli_epi64(mid, 32)),
+        _mm512_add_epi64(_mm512_srli_epi64(p01, 32), _mm512_srli_epi64(p10, 32)));
+}
+
+__attribute__((target("avx512f,avx512dq"))) static void add_mod_avx512(
+    const uint64_t *a, const uint64_t *b, size_t start, size_t count, uint64_t modulus, uint64_t *out)
+{
+    const __m512i q = _mm512_set1_epi64(static_cast<long long>(modulus));
+    size_t k = start;
+    for (; k + 8 <= count; k += 8)
+    {
+        __m512i va = _mm512_loadu_si512(a + k);
+        __m512i vb = _mm512_loadu_si512(b + k);
+        _mm512_storeu_si512(out + k, sub_if_ge_avx512(_mm512_add_epi64(va, vb), q));
+    }
+    add_mod_scalar(a, b, k, count, modulus, out);
+}
+
+__attribute__((target("avx512f,avx512dq"))) static void multiply_mod_avx512(
+    const uint64_t *a, const uint64_t *b, size_t start, size_t count, uint64_t modulus, const uint64_t *const_ratio,
+    bool accumulate, uint64_t *out)
+{
+    BarrettFactor barrett = make_barrett_factor(modulus);
+    const __m512i q = _mm512_set1_epi64(static_cast<long long>(modulus));
+    const __m512i two_q = _mm512_set1_epi64(static_cast<long long>(modulus << 1));
+    const __m512i factor = _mm512_set1_epi64(static_cast<long long>(barrett.factor64));
+    const __m128i shift_lo = _mm_cvtsi64_si128(static_cast<long long>(barrett.bit_count - 1));
+    const __m128i shift_hi = _mm_cvtsi64_si128(static_cast<long long>(65 - barrett.bit_count));
+
+    size_t k = start;
+    for (; k + 8 <= count; k += 8)
+    {
+        __m512i va = _mm512_loadu_si512(a + k);
+        __m512i vb = _mm512_loadu_si512(b + k);
+        va = sub_if_ge_avx512(sub_if_ge_avx512(va, two_q), q);
+        vb = sub_if_ge_avx512(sub_if_ge_avx512(vb, two_q), q);
+
+        __m512i hi = multiply_high_avx512(va, vb);
+        __m512i lo = _mm512_mullo_epi64(va, vb);
+        __m512i c1 = _mm512_or_si512(_mm512_sll_epi64(hi, shift_hi), _mm512_srl_epi64(lo, shift_lo));
+        __m512i quotient = multiply_high_avx512(c1, factor);
+        __m512i r = _mm512_sub_epi64(lo, _mm512_mullo_epi64(quotient, q));
+        r = sub_if_ge_avx512(sub_if_ge_avx512(r, q), q);
+        if (accumulate)
+        {
+            r = sub_if_ge_avx512(_mm512_add_epi64(r, _mm512_loadu_si512(out + k)), q);
+        }
+        _mm512_storeu_si512(out + k, r);
+    }
+    multiply_mod_scalar(a, b, k, count, modulus, const_ratio, accumulate, out);
+}
+
+// No IFMA52 variant: the input of a scalar multiplication is not bounded by the modulus
+__attribute__((target("avx512f,avx512dq"))) static void multiply_scalar_mod_avx512(
+    const uint64_t *a, size_t start, size_t count, uint64_t operand, uint64_t quotient, uint64_t modulus, uint64_t *out)
+{
+    const __m512i q = _mm512_set1_epi64(static_cast<long long>(modulus));
+    const __m512i w = _mm512_set1_epi64(static_cast<long long>(operand));
+    const __m512i w_quotient = _mm512_set1_epi64(static_cast<long long>(quotient));
+    size_t k = start;
+    for (; k + 8 <= count; k += 8)
+    {
+        __m512i va = _mm512_loadu_si512(a + k);
+        __m512i hi = multiply_high_avx512(va, w_quotient);
+        __m512i r = _mm512_sub_epi64(_mm512_mullo_epi64(va, w), _mm512_mullo_epi64(hi, q));
+        _mm512_storeu_si512(out + k, sub_if_ge_avx512(r, q));
+    }
+    multiply_scalar_mod_scalar(a, k, count, operand, quotient, modulus, out);
+}
+
+// Moduli below 2^50 only: operands and the Barrett quotient then fit the 52-bit multiplier
+__attribute__((target("avx512f,avx512dq,avx512ifma"))) static void multiply_mod_avx512ifma(
+    const uint64_t *a, const uint64_t *b, size_t start, size_t count, uint64_t modulus, const uint64_t *const_ratio,
+    bool accumulate, uint64_t *out)
+{
+    BarrettFactor barrett = make_barrett_factor(modulus);
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i low52_mask = _mm512_set1_epi64((1LL << 52) - 1);
+    const __m512i q = _mm512_set1_epi64(static_cast<long long>(modulus));
+    const __m512i two_q = _mm512_set1_epi64(static_cast<long long>(modulus << 1));
+    const __m512i factor = _mm512_set1_epi64(static_cast<long long>(barrett.factor52));
+    const __m128i shift_lo = _mm_cvtsi64_si128(static_cast<long long>(barrett.bit_count - 1));
+    const __m128i shift_hi = _mm_cvtsi64_si128(static_cast<long long>(53 - barrett.bit_count));
+
+    size_t k = start;
+    for (; k + 8 <= count; k += 8)
+    {
+        __m512i va = _mm512_loadu_si512(a + k);
+        __m512i vb = _mm512_loadu_si512(b + k);
+        va = sub_if_ge_avx512(sub_if_ge_avx512(va, two_q), q);
+        vb = sub_if_ge_avx512(sub_if_ge_avx512(vb, two_q), q);
+
+        // a * b = hi * 2^52 + lo
+        __m512i lo = _mm512_madd52lo_epu64(zero, va, vb);
+        __m512i hi = _mm512_madd52hi_epu64(zero, va, vb);
+        __m512i c1 = _mm512_or_si512(_mm512_sll_epi64(hi, shift_hi), _mm512_srl_epi64(lo, shift_lo));
+        __m512i quotient = _mm512_madd52hi_epu64(zero, c1, factor);
+        __m512i r = _mm512_and_si512(_mm512_sub_epi64(lo, _mm512_madd52lo_epu64(zero, quotient, q)), low52_mask);
+        r = sub_if_ge_avx512(sub_if_ge_avx512(r, q), q);
+        if (accumulate)
+        {
+            r = sub_if_ge_avx512(_mm512_add_epi64(r, _mm512_loadu_si512(out + k)), q);
+        }
+        _mm512_storeu_si512(out + k, r);
+    }
+    multiply_mod_scalar(a, b, k, count, modulus, const_ratio, accumulate, out);
+}
+#endif
+
+static add_mod_fn select_add_mod()
+{
+#ifdef PANTHEON_X86
+    switch (simd_level())
+    {
+    case SimdLevel::avx512ifma:
+    case SimdLevel::avx512:
+        return add_mod_avx512;
+    case SimdLevel::avx2:
+        return add_mod_avx2;
+    default:
+        break;
+    }
+#endif
+    return add_mod_scalar;
+}
+
+static multiply_mod_fn select_multiply_mod(bool small_modulus)
+{
+#ifdef PANTHEON_X86
+    switch (simd_level())
+    {
+    case SimdLevel::avx512ifma:
+        return small_modulus ? multiply_mod_avx512ifma : multiply_mod_avx512;
+    case SimdLevel::avx512:
+        return multiply_mod_avx512;
+    case SimdLevel::avx2:
+        return multiply_mod_avx2;
+    default:
+        break;
+    }
+#endif
+    return multiply_mod_scalar;
+}
+
+static multiply_scalar_mod_fn select_multiply_scalar_mod()
+{
+#ifdef PANTHEON_X86
+    switch (simd_level())
+    {
+    case SimdLevel::avx512ifma:
+    case SimdLevel::avx512:
+        return multiply_scalar_mod_avx512;
+    case SimdLevel::avx2:
+        return multiply_scalar_mod_avx2;
+    default:
+        break;
+    }
+#endif
+    return multiply_scalar_mod_scalar;
+}
+
+void simd_add_mod(const uint64_t *a, const uint64_t *b, size_t count, uint64_t modulus, uint64_t *out)
+{
+    static const add_mod_fn add_mod = select_add_mod();
+    add_mod(a, b, 0, count, modulus, out);
+}
+
+static inline multiply_mod_fn get_multiply_mod(uint64_t modulus)
+{
+    static const multiply_mod_fn multiply_mod = select_multiply_mod(false);
+    static const multiply_mod_fn multiply_mod_small = select_multiply_mod(true);
+    return modulus < IFMA_MODULUS_BOUND ? multiply_mod_small : multiply_mod;
+}
+
+void simd_multiply_mod(
+    const uint64_t *a, const uint64_t *b, size_t count, uint64_t modulus, const uint64_t *const_ratio, uint64_t *out)
+{
+    get_multiply_mod(modulus)(a, b, 0, count, modulus, const_ratio, false, out);
+}
+
+void simd_multiply_accumulate_mod(
+    const uint64_t *a, const uint64_t *b, size_t count, uint64_t modulus, const uint64_t *const_ratio, uint64_t *acc)
+{
+    get_multiply_mod(modulus)(a, b, 0, count, modulus, const_ratio, true, acc);
+}
+
+void simd_multiply_scalar_mod(
+    const uint64_t *a, size_t count, uint64_t operand, uint64_t quotient, uint64_t modulus, uint64_t *out)
+{
+    static const multiply_scalar_mod_fn multiply_scalar_mod = select_multiply_scalar_mod();
+    multiply_scalar_mod(a, 0, count, operand, quotient, modulus, out);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+Coefficient kernels with AVX2 / AVX-512 code paths, selected once at startup from the CPU features.
+They work on raw uint64_t arrays so that they can be used from any SEAL iterator. Moduli are at most
+61 bits, as in SEAL, and const_ratio is Modulus::const_ratio().data().
+
+Setting the environment variable PANTHEON_SIMD to "scalar", "avx2", "avx512" or "avx512ifma" caps the
+selected level. The AVX-512 level requires AVX512F and AVX512DQ; the IFMA52 kernels are used only for moduli
+below 2^50 and fall back to the AVX-512 kernels otherwise.
+*/
+
+enum class SimdLevel
+{
+    scalar = 0,
+    avx2 = 1,
+    avx512 = 2,
+    avx512ifma = 3
+};
+
+SimdLevel simd_level();
+const char *simd_level_name(SimdLevel level);
+
+// out[k] = sum_i in[i * in_stride + k] * factor[i] mod modulus, for k < count.
+// Products are accumulated in 128-bit lanes and reduced once per output coefficient.
+void simd_dot_product_mod(
+    const uint64_t *in, size_t in_stride, const uint64_t *factor, size_t factor_count, size_t count, uint64_t modulus,
+    const uint64_t *const_ratio, uint64_t *out);
+
+// out[k] = sum_j a[j][k] * b[j][k] mod modulus, for k < count; operands are below 2^61.
+// Same lazy 128-bit accumulation as simd_dot_product_mod, but with a coefficient-wise second operand.
+void simd_inner_product_mod(
+    const uint64_t *const *a, const uint64_t *const *b, size_t term_count, size_t count, uint64_t modulus,
+    const uint64_t *const_ratio, uint64_t *out);
+
+// out[k] = a[k] + b[k] mod modulus; a[k], b[k] < modulus.
+void simd_add_mod(const uint64_t *a, const uint64_t *b, size_t count, uint64_t modulus, uint64_t *out);
+
+// out[k] = a[k] * b[k] mod modulus; a[k], b[k] < 4 * modulus, e.g. lazy NTT outputs.
+void simd_multiply_mod(
+    const uint64_t *a, const uint64_t *b, size_t count, uint64_t modulus, const uint64_t *const_ratio, uint64_t *out);
+
+// acc[k] = acc[k] + a[k] * b[k] mod modulus; a[k], b[k] < 4 * modulus and acc[k] < modulus.
+void simd_multiply_accumulate_mod(
+    const uint64_t *a, const uint64_t *b, size_t count, uint64_t modulus, const uint64_t *const_ratio, uint64_t *acc);
+
+// out[k] = a[k] * operand mod modulus, where quotient = floor(operand * 2^64 / modulus) as in
+// seal::util::MultiplyUIntModOperand. a[k] may be any 64-bit value.
+void simd_multiply_scalar_mod(
+    const uint64_t *a, size_t count, uint64_t operand, uint64_t quotient, uint64_t modulus, uint64_t *out);
@@ -0,0 +1,123 @@
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <openssl/sha.h>
+#include "PIRClient.h"
+#include "PIRServer.h"
+#include "globals.h"
+
+/*
+Round trip of a batch of keys through the server with KEYS_PER_QUERY > 1, which the build of this test sets. The
+batch holds more keys than there are slot groups, so keys share a group and go to different queries; every value
+has to come back to its key, and the batch takes as many queries as its fullest group has keys. Returns 1 if any
+check fails.
+*/
+
+#define DB_KEY_COUNT 64
+#define BATCH_KEY_COUNT 12
+
+static int failures = 0;
+
+static void expect(bool condition, const char *what)
+{
+    if (!condition)
+    {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+// The slot group of a key, hashed as PIRClient and PIRServer do for keys of num_col columns
+static uint32_t group_of(const std::string &key, int num_col)
+{
+    std::vector<char> str(num_col * 4, 0);
+    std::copy(key.begin(), key.begin() + std::min(key.size(), str.size()), str.begin());
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const unsigned char *>(str.data()), str.size(), hash);
+    return key_group(hash);
+}
+
+static std::string run_query(PIRServer &server, const std::string &query)
+{
+    std::string response;
+    server.QueryExpand(query.data(), query.size());
+    server.Process1();
+    server.Process2(response);
+    return response;
+}
+
+int main()
+{
+    static_assert(KEYS_PER_QUERY > 1, "the batch test is built with several keys per query");
+    uint32_t key_size = 64, obj_size = 128;
+
+    std::vector<std::string> keys, values;
+    for (int i = 0; i < DB_KEY_COUNT; i++)
+    {
+        char key[16], value[16];
+        snprintf(key, sizeof(key), "key%02d", i);
+        snprintf(value, sizeof(value), "value-%02d", i);
+        keys.push_back(key);
+        values.push_back(value);
+    }
+
+    PIRServer server(1000, key_size, obj_size);
+    server.SetupCryptoParams();
+    PIRClient client(key_size, obj_size);
+    client.SetupCrypto(server.parms_ss);
+    server.SetupKeys(client.keys_ss);
+    client.SetOneCiphertext();
+    server.RecOneCiphertext(client.one_ct_ss);
+    server.SetupDB(keys, values);
+
+    // More keys than groups, so at least two keys collide in a group
+    std::vector<std::string> batch(keys.begin(), keys.begin() + BATCH_KEY_COUNT);
+    std::map<uint32_t, size_t> group_sizes;
+    for (auto &key : batch)
+    {
+        group_sizes[group_of(key, client.NUM_COL)]++;
+    }
+    size_t fullest = 0;
+    for (auto &group_size : group_sizes)
+    {
+        fullest = std::max(fullest, group_size.second);
+    }
+    expect(fullest > 1, "keys of the batch share a slot group");
+
+    auto queries = client.QueryMake(batch);
+    expect(queries.size() == fullest, "the batch takes one query per key of its fullest group");
+
+    std::vector<std::string> responses;
+    for (auto &query : queries)
+    {
+        responses.push_back(run_query(server, query));
+    }
+    auto results = client.ReconstructStr(responses);
+    expect(results.size() == batch.size(), "every key of the batch gets a value");
+    for (size_t k = 0; k < batch.size() && k < results.size(); k++)
+    {
+        if (results[k] != values[k])
+        {
+            printf("key %s: got \"%s\", expected \"%s\"\n", batch[k].c_str(), results[k].c_str(), values[k].c_str());
+            failures++;
+        }
+    }
+
+    // A single key asks every group for its hash and is read from its own group
+    std::stringstream qss;
+    client.QueryMake(keys[DB_KEY_COUNT - 1], qss);
+    std::stringstream response(run_query(server, qss.str()));
+    expect(client.ReconstructStr(response, keys[DB_KEY_COUNT - 1]) == values[DB_KEY_COUNT - 1],
+           "a single key comes back from its group");
+
+    if (failures)
+    {
+        printf("%d batch query checks failed\n", failures);
+        return 1;
+    }
+    printf("All batch query checks passed with %d keys per query\n", KEYS_PER_QUERY);
+    return 0;
+}
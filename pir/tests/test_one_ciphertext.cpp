@@ -0,0 +1,90 @@
+#include <cstdio>
+#include <sstream>
+#include <stdexcept>
+#include "PIRClient.h"
+#include "PIRServer.h"
+#include "WireFormat.h"
+#include "globals.h"
+
+/*
+Feeds PIRServer::RecOneCiphertext the one-ciphertext of a client and ciphertexts a client must not send: below the
+compact level, in NTT form and of size 3. The server runs its kernels without validation, so it has to reject them
+when they are loaded and keep the last good one-ciphertext. Returns 1 if any case fails.
+*/
+
+static int failures = 0;
+
+static void expect(bool condition, const char *what)
+{
+    if (!condition)
+    {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+static std::stringstream one_ciphertext_stream(const Ciphertext &encrypted)
+{
+    std::stringstream ss;
+    save_wire_header(ss, WireArtifact::one_ciphertext);
+    encrypted.save(ss);
+    return ss;
+}
+
+static bool rejected(PIRServer &server, const Ciphertext &encrypted)
+{
+    auto ss = one_ciphertext_stream(encrypted);
+    try
+    {
+        server.RecOneCiphertext(ss);
+    }
+    catch (const std::invalid_argument &)
+    {
+        return true;
+    }
+    return false;
+}
+
+int main()
+{
+    PIRServer server(1000, 64, 128);
+    server.SetupCryptoParams();
+    PIRClient client(64, 128);
+    client.SetupCrypto(server.parms_ss);
+
+    client.SetOneCiphertext();
+    server.RecOneCiphertext(client.one_ct_ss);
+    auto compact_pid = server.compact_pid;
+    expect(server.one_ct.parms_id() == compact_pid, "the client's one-ciphertext is kept at the compact level");
+
+    Plaintext one_pt("1");
+    Ciphertext encrypted;
+    client.encryptor->encrypt_symmetric(one_pt, encrypted);
+    auto first = one_ciphertext_stream(encrypted);
+    server.RecOneCiphertext(first);
+    expect(server.one_ct.parms_id() == compact_pid, "a first-level one-ciphertext is switched to the compact level");
+
+    Ciphertext too_low;
+    client.evaluator->mod_switch_to(encrypted, compact_pid, too_low);
+    client.evaluator->mod_switch_to_next_inplace(too_low);
+    expect(rejected(server, too_low), "a one-ciphertext below the compact level is rejected");
+
+    Ciphertext ntt = encrypted;
+    client.evaluator->transform_to_ntt_inplace(ntt);
+    expect(rejected(server, ntt), "a one-ciphertext in NTT form is rejected");
+
+    Ciphertext squared;
+    client.evaluator->square(encrypted, squared);
+    expect(rejected(server, squared), "a one-ciphertext of size 3 is rejected");
+
+    expect(server.one_ct.parms_id() == compact_pid && server.one_ct.size() == 2,
+           "a rejected one-ciphertext leaves the last good one in place");
+
+    if (failures)
+    {
+        printf("%d one-ciphertext checks failed\n", failures);
+        return 1;
+    }
+    printf("All one-ciphertext checks passed\n");
+    return 0;
+}
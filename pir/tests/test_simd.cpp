@@ -0,0 +1,202 @@
+#include "simd.h"
+#include <cstdio>
+#include <random>
+#include <vector>
+
+using namespace std;
+
+typedef unsigned __int128 uint128_t;
+
+/*
+Compares the kernels of simd.h at the level PANTHEON_SIMD selects with a plain 128-bit reference, for moduli of
+17 to 61 bits. Coefficient counts that are not a multiple of the vector width exercise the scalar tails, and more
+than 64 factors or terms the reductions between lazy passes. Returns 1 if any coefficient differs.
+*/
+
+#define MIN_MODULUS_BITS 17
+#define MAX_MODULUS_BITS 61
+
+static const size_t coeff_counts[] = { 1, 7, 8, 13, 64, 67 };
+static const size_t factor_counts[] = { 1, 5, 64, 65, 130 };
+
+static mt19937_64 rng(1);
+static size_t failures = 0;
+
+// const_ratio of seal::Modulus: floor(2^128 / modulus) in two words, then the remainder
+static void make_const_ratio(uint64_t modulus, uint64_t *const_ratio)
+{
+    uint128_t ratio = ~uint128_t(0) / modulus;
+    uint128_t remainder = ~uint128_t(0) % modulus + 1;
+    if (remainder == modulus)
+    {
+        ratio++;
+        remainder = 0;
+    }
+    const_ratio[0] = static_cast<uint64_t>(ratio);
+    const_ratio[1] = static_cast<uint64_t>(ratio >> 64);
+    const_ratio[2] = static_cast<uint64_t>(remainder);
+}
+
+// An odd modulus of exactly bits bits
+static uint64_t random_modulus(int bits)
+{
+    uint64_t top = uint64_t(1) << (bits - 1);
+    return top | (rng() & (top - 1)) | 1;
+}
+
+// Values below bound, with the edges 0 and bound - 1 at the front
+static vector<uint64_t> random_values(size_t count, uint64_t bound)
+{
+    vector<uint64_t> values(count);
+    for (size_t k = 0; k < count; k++)
+    {
+        values[k] = bound ? rng() % bound : rng();
+    }
+    values[0] = 0;
+    if (count > 1)
+    {
+        values[1] = bound - 1;
+    }
+    return values;
+}
+
+static void check(const char *kernel, uint64_t modulus, size_t count, const vector<uint64_t> &got, const vector<uint64_t> &expected)
+{
+    for (size_t k = 0; k < count; k++)
+    {
+        if (got[k] != expected[k])
+        {
+            if (failures < 20)
+            {
+                printf("%s: modulus %llu, count %zu: coefficient %zu is %llu, expected %llu\n", kernel,
+                       (unsigned long long)modulus, count, k, (unsigned long long)got[k], (unsigned long long)expected[k]);
+            }
+            failures++;
+            return;
+        }
+    }
+}
+
+static void test_dot_product(uint64_t modulus, const uint64_t *const_ratio, size_t count, size_t factor_count)
+{
+    size_t in_stride = count + 3;
+    auto in = random_values(factor_count * in_stride, modulus);
+    auto factor = random_values(factor_count, modulus);
+
+    vector<uint64_t> expected(count);
+    for (size_t k = 0; k < count; k++)
+    {
+        uint128_t acc = 0;
+        for (size_t i = 0; i < factor_count; i++)
+        {
+            acc = (acc + uint128_t(in[i * in_stride + k]) * factor[i]) % modulus;
+        }
+        expected[k] = static_cast<uint64_t>(acc);
+    }
+
+    vector<uint64_t> out(count);
+    simd_dot_product_mod(in.data(), in_stride, factor.data(), factor_count, count, modulus, const_ratio, out.data());
+    check("simd_dot_product_mod", modulus, count, out, expected);
+}
+
+static void test_inner_product(uint64_t modulus, const uint64_t *const_ratio, size_t count, size_t term_count)
+{
+    // Operands may be up to 2^61 regardless of the modulus
+    uint64_t bound = uint64_t(1) << 61;
+    vector<vector<uint64_t>> a(term_count), b(term_count);
+    vector<const uint64_t *> a_ptr(term_count), b_ptr(term_count);
+    for (size_t j = 0; j < term_count; j++)
+    {
+        a[j] = random_values(count, bound);
+        b[j] = random_values(count, bound);
+        a_ptr[j] = a[j].data();
+        b_ptr[j] = b[j].data();
+    }
+
+    vector<uint64_t> expected(count);
+    for (size_t k = 0; k < count; k++)
+    {
+        uint128_t acc = 0;
+        for (size_t j = 0; j < term_count; j++)
+        {
+            acc = (acc + uint128_t(a[j][k]) * b[j][k] % modulus) % modulus;
+        }
+        expected[k] = static_cast<uint64_t>(acc);
+    }
+
+    vector<uint64_t> out(count);
+    simd_inner_product_mod(a_ptr.data(), b_ptr.data(), term_count, count, modulus, const_ratio, out.data());
+    check("simd_inner_product_mod", modulus, count, out, expected);
+}
+
+static void test_elementwise(uint64_t modulus, const uint64_t *const_ratio, size_t count)
+{
+    auto a = random_values(count, modulus);
+    auto b = random_values(count, modulus);
+    vector<uint64_t> expected(count), out(count);
+
+    for (size_t k = 0; k < count; k++)
+    {
+        expected[k] = static_cast<uint64_t>((uint128_t(a[k]) + b[k]) % modulus);
+    }
+    simd_add_mod(a.data(), b.data(), count, modulus, out.data());
+    check("simd_add_mod", modulus, count, out, expected);
+
+    // Lazy NTT outputs reach 4 * modulus
+    auto lazy_a = random_values(count, 4 * modulus);
+    auto lazy_b = random_values(count, 4 * modulus);
+    for (size_t k = 0; k < count; k++)
+    {
+        expected[k] = static_cast<uint64_t>(uint128_t(lazy_a[k]) * lazy_b[k] % modulus);
+    }
+    simd_multiply_mod(lazy_a.data(), lazy_b.data(), count, modulus, const_ratio, out.data());
+    check("simd_multiply_mod", modulus, count, out, expected);
+
+    auto acc = random_values(count, modulus);
+    for (size_t k = 0; k < count; k++)
+    {
+        expected[k] = static_cast<uint64_t>((uint128_t(lazy_a[k]) * lazy_b[k] + acc[k]) % modulus);
+    }
+    simd_multiply_accumulate_mod(lazy_a.data(), lazy_b.data(), count, modulus, const_ratio, acc.data());
+    check("simd_multiply_accumulate_mod", modulus, count, acc, expected);
+
+    // Any 64-bit value times an operand below the modulus
+    auto any = random_values(count, 0);
+    any[0] = ~uint64_t(0);
+    uint64_t operand = rng() % modulus;
+    uint64_t quotient = static_cast<uint64_t>((uint128_t(operand) << 64) / modulus);
+    for (size_t k = 0; k < count; k++)
+    {
+        expected[k] = static_cast<uint64_t>(uint128_t(any[k]) * operand % modulus);
+    }
+    simd_multiply_scalar_mod(any.data(), count, operand, quotient, modulus, out.data());
+    check("simd_multiply_scalar_mod", modulus, count, out, expected);
+}
+
+int main()
+{
+    printf("SIMD level: %s\n", simd_level_name(simd_level()));
+    for (int bits = MIN_MODULUS_BITS; bits <= MAX_MODULUS_BITS; bits++)
+    {
+        uint64_t modulus = random_modulus(bits);
+        uint64_t const_ratio[3];
+        make_const_ratio(modulus, const_ratio);
+        for (size_t count : coeff_counts)
+        {
+            test_elementwise(modulus, const_ratio, count);
+            for (size_t factor_count : factor_counts)
+            {
+                test_dot_product(modulus, const_ratio, count, factor_count);
+                test_inner_product(modulus, const_ratio, count, factor_count);
+            }
+        }
+    }
+
+    if (failures)
+    {
+        printf("%zu kernel runs differ from the reference\n", failures);
+        return 1;
+    }
+    printf("All kernels match the reference\n");
+    return 0;
+}
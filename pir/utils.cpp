@@ -2,24 +2,27 @@
 #include <fstream>
 #include <filesystem>
 
-void my_add_inplace(SEALContext &context_, Ciphertext &encrypted1, Ciphertext &encrypted2)
+void my_add_inplace(KernelContext &context_, Ciphertext &encrypted1, Ciphertext &encrypted2)
 {
     // Verify parameters.
-    if (encrypted1.parms_id() != encrypted2.parms_id())
+    if (context_.validate())
     {
-        throw invalid_argument("encrypted1 and encrypted2 parameter mismatch");
-    }
-    if (encrypted1.is_ntt_form() != encrypted2.is_ntt_form())
-    {
-        throw invalid_argument("NTT form mismatch");
-    }
-    if (encrypted1.size() != encrypted2.size())
-    {
-        throw invalid_argument("encrypted1 and encrypted2 size mismatch");
+        if (encrypted1.parms_id() != encrypted2.parms_id())
+        {
+            throw invalid_argument("encrypted1 and encrypted2 parameter mismatch");
+        }
+        if (encrypted1.is_ntt_form() != encrypted2.is_ntt_form())
+        {
+            throw invalid_argument("NTT form mismatch");
+        }
+        if (encrypted1.size() != encrypted2.size())
+        {
+            throw invalid_argument("encrypted1 and encrypted2 size mismatch");
+        }
     }
 
     // Extract encryption parameters.
-    auto &context_data = *context_.get_context_data(encrypted1.parms_id());
+    auto &context_data = *context_.level(encrypted1.parms_id()).context_data;
     auto &parms = context_data.parms();
     auto &coeff_modulus = parms.coeff_modulus();
     size_t coeff_count = parms.poly_modulus_degree();
@@ -28,30 +31,31 @@ void my_add_inplace(SEALContext &context_, Ciphertext &encrypted1, Ciphertext &e
     auto iter1 = PolyIter(encrypted1);
     auto iter2 = PolyIter(encrypted2);
 
+    // The coefficient loop is already dispatched at runtime in simd.h, so the limb loop is left generic
 #pragma omp parallel for collapse(2)
     for (int i = 0; i < encrypted_size; i++)
     {
         for (int j = 0; j < coeff_modulus_size; j++)
         {
-            add_poly_coeffmod(iter1[i][j], iter2[i][j], coeff_count, coeff_modulus[j], iter1[i][j]);
+            simd_add_poly_coeffmod(iter1[i][j], iter2[i][j], coeff_count, coeff_modulus[j], iter1[i][j]);
         }
     }
 }
 
-void my_bfv_square(SEALContext &context_, Ciphertext &encrypted, MemoryPoolHandle pool, int num_threads)
+void my_bfv_square(KernelContext &context_, Ciphertext &encrypted, MemoryPoolHandle pool, int num_threads)
 
 {
     omp_set_num_threads(num_threads);
     chrono::high_resolution_clock::time_point time_start, time_end, total_start, total_end;
     time_start = chrono::high_resolution_clock::now();
 
-    if (encrypted.is_ntt_form())
+    if (context_.validate() && encrypted.is_ntt_form())
     {
         throw invalid_argument("encrypted cannot be in NTT form");
     }
 
     // Extract encryption parameters.
-    auto &context_data = *context_.get_context_data(encrypted.parms_id());
+    auto &context_data = *context_.level(encrypted.parms_id()).context_data;
     auto &parms = context_data.parms();
     size_t coeff_count = parms.poly_modulus_degree();  // N
     size_t base_q_size = parms.coeff_modulus().size(); // 13
@@ -99,7 +103,7 @@ void my_bfv_square(SEALContext &context_, Ciphertext &encrypted, MemoryPoolHandl
 
     // Resize encrypted to destination size
 
-    encrypted.resize(context_, context_data.parms_id(), dest_size);
+    encrypted.resize(dest_size);
 
     // Allocate space for a base q output of behz_extend_base_convert_to_ntt
     SEAL_ALLOCATE_GET_POLY_ITER(encrypted_q, encrypted_size, coeff_count, base_q_size, pool);
@@ -112,7 +116,7 @@ void my_bfv_square(SEALContext &context_, Ciphertext &encrypted, MemoryPoolHandl
     auto encrypted_iter = PolyIter(encrypted);
     SEAL_ALLOCATE_GET_RNS_ITER(temp, coeff_count, base_Bsk_m_tilde_size, pool);
 
-    SEAL_ALLOCATE_GET_RNS_ITER(temp2, (8192 * 4), base_q_size, pool); // Need to replace the hard coded value
+    SEAL_ALLOCATE_GET_RNS_ITER(temp2, coeff_count, base_q_size, pool);
 
     SEAL_ALLOCATE_ZERO_GET_POLY_ITER(temp_dest_q, dest_size, coeff_count, base_q_size, pool);
     SEAL_ALLOCATE_ZERO_GET_POLY_ITER(temp_dest_Bsk, dest_size, coeff_count, base_Bsk_size, pool);
@@ -147,23 +151,31 @@ void my_bfv_square(SEALContext &context_, Ciphertext &encrypted, MemoryPoolHandl
         SEAL_ALLOCATE_GET_COEFF_ITER(r_m_tilde, rns_tool->coeff_count(), pool);
         multiply_poly_scalar_coeffmod(input_m_tilde, rns_tool->coeff_count(), rns_tool->neg_inv_prod_q_mod_m_tilde(), rns_tool->m_tilde(), r_m_tilde);
 
+        // Montgomery reduction by m_tilde, with the trip counts fixed for the specialized shapes
+        dispatch_kernel_shape(coeff_count, base_Bsk_size, [&](auto fixed_coeff_count, auto fixed_Bsk_size) {
 #pragma omp parallel for
-        for (int i = 0; i < base_Bsk_size; i++)
-        {
-            MultiplyUIntModOperand prod_q_mod_Bsk_elt;
-            prod_q_mod_Bsk_elt.set(rns_tool->prod_q_mod_Bsk()[i], rns_tool->base_Bsk()->base()[i]);
-            SEAL_ITERATE(iter(temp[i], r_m_tilde, encrypted_Bsk[j][i]), rns_tool->coeff_count(), [&](auto J)
-                         {
-                    uint64_t temp = get<1>(J);
-                    if (temp >= m_tilde_div_2)
+            for (int i = 0; i < fixed_Bsk_size; i++)
+            {
+                auto &modulus = rns_tool->base_Bsk()->base()[i];
+                MultiplyUIntModOperand prod_q_mod_Bsk_elt;
+                prod_q_mod_Bsk_elt.set(rns_tool->prod_q_mod_Bsk()[i], modulus);
+                const uint64_t *temp_ptr = temp[i];
+                const uint64_t *r_m_tilde_ptr = r_m_tilde;
+                uint64_t *destination_ptr = encrypted_Bsk[j][i];
+                for (size_t l = 0; l < fixed_coeff_count; l++)
+                {
+                    uint64_t r = r_m_tilde_ptr[l];
+                    if (r >= m_tilde_div_2)
                     {
-                        temp += rns_tool->base_Bsk()->base()[i].value() - rns_tool->m_tilde().value();
+                        r += modulus.value() - rns_tool->m_tilde().value();
                     }
-                    get<2>(J) = multiply_uint_mod(
-                        multiply_add_uint_mod(temp, prod_q_mod_Bsk_elt, get<0>(J),rns_tool->base_Bsk()->base()[i]), rns_tool->inv_m_tilde_mod_Bsk()[i],
-                        rns_tool->base_Bsk()->base()[i]); });
-            ntt_negacyclic_harvey_lazy(encrypted_Bsk[j][i], base_Bsk_ntt_tables[i]);
-        }
+                    destination_ptr[l] = multiply_uint_mod(
+                        multiply_add_uint_mod(r, prod_q_mod_Bsk_elt, temp_ptr[l], modulus), rns_tool->inv_m_tilde_mod_Bsk()[i],
+                        modulus);
+                }
+                ntt_negacyclic_harvey_lazy(encrypted_Bsk[j][i], base_Bsk_ntt_tables[i]);
+            }
+        });
     }
     time_end = chrono::high_resolution_clock::now();
     // cout<<"Step 1 to 3 time: "<<(chrono::duration_cast<chrono::microseconds>(time_end - time_start)).count()<<endl;
@@ -190,10 +202,10 @@ void my_bfv_square(SEALContext &context_, Ciphertext &encrypted, MemoryPoolHandl
 #pragma omp parallel for num_threads(num_threads)
         for (int i = 0; i < base_size; i++)
         {
-            dyadic_product_coeffmod(in_iter[0][i], in_iter[0][i], out_iter[0].poly_modulus_degree(), base_iter[i], out_iter[0][i]);
-            dyadic_product_coeffmod(in_iter[0][i], in_iter[1][i], out_iter[1].poly_modulus_degree(), base_iter[i], out_iter[1][i]);
-            add_poly_coeffmod(out_iter[1][i], out_iter[1][i], out_iter[1].poly_modulus_degree(), base_iter[i], out_iter[1][i]);
-            dyadic_product_coeffmod(in_iter[1][i], in_iter[1][i], out_iter[2].poly_modulus_degree(), base_iter[i], out_iter[2][i]);
+            simd_dyadic_product_coeffmod(in_iter[0][i], in_iter[0][i], out_iter[0].poly_modulus_degree(), base_iter[i], out_iter[0][i]);
+            simd_dyadic_product_coeffmod(in_iter[0][i], in_iter[1][i], out_iter[1].poly_modulus_degree(), base_iter[i], out_iter[1][i]);
+            simd_add_poly_coeffmod(out_iter[1][i], out_iter[1][i], out_iter[1].poly_modulus_degree(), base_iter[i], out_iter[1][i]);
+            simd_dyadic_product_coeffmod(in_iter[1][i], in_iter[1][i], out_iter[2].poly_modulus_degree(), base_iter[i], out_iter[2][i]);
         }
     };
 
@@ -216,11 +228,11 @@ void my_bfv_square(SEALContext &context_, Ciphertext &encrypted, MemoryPoolHandl
         for (int j = 0; j < temp_dest_Bsk.coeff_modulus_size(); j++)
         { // 14
             inverse_ntt_negacyclic_harvey_lazy(temp_dest_Bsk[i][j], base_Bsk_ntt_tables[j]);
-            multiply_poly_scalar_coeffmod(temp_dest_Bsk[i][j], (temp_q_Bsk + base_q_size).poly_modulus_degree(), plain_modulus, base_Bsk[j], (temp_q_Bsk + base_q_size)[j]);
+            simd_multiply_poly_scalar_coeffmod(temp_dest_Bsk[i][j], (temp_q_Bsk + base_q_size).poly_modulus_degree(), plain_modulus, base_Bsk[j], (temp_q_Bsk + base_q_size)[j]);
             if (j < temp_dest_q.coeff_modulus_size())
             {
                 inverse_ntt_negacyclic_harvey_lazy(temp_dest_q[i][j], base_q_ntt_tables[j]);
-                multiply_poly_scalar_coeffmod(temp_dest_q[i][j], temp_q_Bsk.poly_modulus_degree(), plain_modulus, base_q[j], temp_q_Bsk[j]);
+                simd_multiply_poly_scalar_coeffmod(temp_dest_q[i][j], temp_q_Bsk.poly_modulus_degree(), plain_modulus, base_q[j], temp_q_Bsk[j]);
             }
         }
         my_fast_floor(rns_tool, temp_q_Bsk, temp_Bsk, pool, num_threads);
@@ -248,7 +260,7 @@ void my_fastbconv_m_tilde(const RNSTool *rns_tool, ConstRNSIter input, RNSIter d
     size_t base_Bsk_size = rns_tool->base_Bsk()->size(); // 14
     size_t base_q_size = rns_tool->base_q()->size();
 
-    SEAL_ALLOCATE_GET_RNS_ITER(temp, (8192 * 4), base_q_size, pool); // Need to replace the hard coded value
+    SEAL_ALLOCATE_GET_RNS_ITER(temp, input.poly_modulus_degree(), base_q_size, pool);
     // multiply_poly_scalar_coeffmod(input, base_q_size, rns_tool->m_tilde().value(), rns_tool->base_q()->base(), temp);
 
 #pragma omp parallel for num_threads(num_threads)
@@ -267,41 +279,56 @@ void my_fastbconv_m_tilde(const RNSTool *rns_tool, ConstRNSIter input, RNSIter d
 
 void my_fast_convert_array(const Pointer<BaseConverter> &conv, ConstRNSIter in, RNSIter out, MemoryPoolHandle pool, int num_threads)
 {
-    auto ibase_ = conv->ibase();
-    auto obase_ = conv->obase();
+    auto &ibase_ = conv->ibase();
+    auto &obase_ = conv->obase();
     size_t ibase_size = ibase_.size();
     size_t obase_size = obase_.size();
     size_t count = in.poly_modulus_degree();
 
-    // Note that the stride size is ibase_size
-    SEAL_ALLOCATE_GET_STRIDE_ITER(temp, uint64_t, count, ibase_size, pool);
+    // Note that temp is limb-major, so each output limb is a dot product over contiguous coefficient runs
+    SEAL_ALLOCATE_GET_RNS_ITER(temp, count, ibase_size, pool);
+    const uint64_t *in_data = in;
+    uint64_t *temp_data = temp;
 
-    omp_set_num_threads(num_threads);
+    // Work on tiles of coefficients so the scaled input of a tile stays in cache for every output limb
+    size_t tile_count = (count + FAST_CONVERT_TILE_SIZE - 1) / FAST_CONVERT_TILE_SIZE;
 
-#pragma omp parallel for collapse(2)
-    for (int i = 0; i < ibase_size; i++)
-    {
-        for (int j = 0; j < count; j++)
+    dispatch_kernel_shape(count, ibase_size, [&](auto fixed_count, auto fixed_ibase_size) {
+#pragma omp parallel for num_threads(num_threads)
+        for (int t = 0; t < tile_count; t++)
         {
-            if (ibase_.inv_punctured_prod_mod_base_array()[i].operand == 1)
+            size_t start = t * FAST_CONVERT_TILE_SIZE;
+            size_t tile_size = min<size_t>(FAST_CONVERT_TILE_SIZE, fixed_count - start);
+
+            for (size_t i = 0; i < fixed_ibase_size; i++)
             {
-                temp[j][i] = barrett_reduce_64(in[i][j], ibase_.base()[i]);
+                const uint64_t *in_ptr = in_data + i * fixed_count;
+                uint64_t *temp_ptr = temp_data + i * fixed_count;
+                if (ibase_.inv_punctured_prod_mod_base_array()[i].operand == 1)
+                {
+                    for (size_t j = start; j < start + tile_size; j++)
+                    {
+                        temp_ptr[j] = barrett_reduce_64(in_ptr[j], ibase_.base()[i]);
+                    }
+                }
+                else
+                {
+                    for (size_t j = start; j < start + tile_size; j++)
+                    {
+                        temp_ptr[j] = multiply_uint_mod(in_ptr[j], ibase_.inv_punctured_prod_mod_base_array()[i], ibase_.base()[i]);
+                    }
+                }
             }
-            else
+
+            for (int i = 0; i < obase_size; i++)
             {
-                temp[j][i] = multiply_uint_mod(in[i][j], ibase_.inv_punctured_prod_mod_base_array()[i], ibase_.base()[i]);
+                uint64_t *out_ptr = out[i];
+                simd_dot_product_mod(
+                    temp_data + start, fixed_count, conv->base_change_matrix()[i].get(), fixed_ibase_size, tile_size,
+                    obase_.base()[i].value(), obase_.base()[i].const_ratio().data(), out_ptr + start);
             }
         }
-    }
-
-#pragma omp parallel for collapse(2)
-    for (int i = 0; i < obase_size; i++)
-    {
-        for (int j = 0; j < count; j++)
-        {
-            out[i][j] = dot_product_mod(temp[j], conv->base_change_matrix()[i].get(), ibase_size, obase_.base()[i]);
-        }
-    }
+    });
 }
 
 void my_sm_mrq(const RNSTool *rns_tool, ConstRNSIter input, RNSIter destination, MemoryPoolHandle pool, int num_threads)
@@ -423,29 +450,27 @@ void my_fastbconv_sk(const RNSTool *rns_tool, ConstRNSIter input, RNSIter destin
     }
 }
 
-void my_relinearize_internal(SEALContext &context_, Ciphertext &encrypted, const RelinKeys &relin_keys, size_t destination_size, MemoryPoolHandle pool, int num_threads)
+void my_relinearize_internal(KernelContext &context_, Ciphertext &encrypted, const RelinKeys &relin_keys, size_t destination_size, MemoryPoolHandle pool, int num_threads)
 {
-    // Verify parameters.
-    auto context_data_ptr = context_.get_context_data(encrypted.parms_id());
-    if (!context_data_ptr)
-    {
-        throw invalid_argument("encrypted is not valid for encryption parameters");
-    }
-    if (relin_keys.parms_id() != context_.key_parms_id())
-    {
-        throw invalid_argument("relin_keys is not valid for encryption parameters");
-    }
-
     size_t encrypted_size = encrypted.size();
 
     // Verify parameters.
-    if (destination_size < 2 || destination_size > encrypted_size)
+    if (context_.validate())
     {
-        throw invalid_argument("destination_size must be at least 2 and less than or equal to current count");
-    }
-    if (relin_keys.size() < sub_safe(encrypted_size, size_t(2)))
-    {
-        throw invalid_argument("not enough relinearization keys");
+        // Throws for a parms_id from another context
+        context_.level(encrypted.parms_id());
+        if (relin_keys.parms_id() != context_.key_parms_id())
+        {
+            throw invalid_argument("relin_keys is not valid for encryption parameters");
+        }
+        if (destination_size < 2 || destination_size > encrypted_size)
+        {
+            throw invalid_argument("destination_size must be at least 2 and less than or equal to current count");
+        }
+        if (relin_keys.size() < sub_safe(encrypted_size, size_t(2)))
+        {
+            throw invalid_argument("not enough relinearization keys");
+        }
     }
 
     // If encrypted is already at the desired level, return
@@ -468,98 +493,23 @@ void my_relinearize_internal(SEALContext &context_, Ciphertext &encrypted, const
 
     // Put the output of final relinearization into destination.
     // Prepare destination only at this point because we are resizing down
-    encrypted.resize(context_, context_data_ptr->parms_id(), destination_size);
+    encrypted.resize(destination_size);
 }
 
-void my_switch_key_inplace(SEALContext &context_,
-                           Ciphertext &encrypted, ConstRNSIter target_iter, const KSwitchKeys &kswitch_keys, size_t kswitch_keys_index,
-                           MemoryPoolHandle pool, int num_threads)
+// Per-prime decomposition as in SEAL: digit j of target is reduced modulo every prime of the level and the special
+// prime and multiplied with key j. The products are written in NTT form to t_poly_prod, output prime by output prime.
+template <typename CoeffCount, typename DecompSize>
+static void my_accumulate_per_prime_products(
+    CoeffCount coeff_count, DecompSize decomp_modulus_size, KernelContext &context_, ConstRNSIter target_iter,
+    ConstRNSIter t_target, bool is_ntt_form, const vector<PublicKey> &key_vector, uint64_t *t_poly_prod,
+    MemoryPoolHandle pool)
 {
-    auto parms_id = encrypted.parms_id();
-    auto &context_data = *context_.get_context_data(parms_id);
-    auto &parms = context_data.parms();
-    auto &key_context_data = *context_.key_context_data();
-    auto &key_parms = key_context_data.parms();
-    auto scheme = parms.scheme();
-
-    omp_set_num_threads(num_threads);
-    // Verify parameters.
-    if (!is_metadata_valid_for(encrypted, context_) || !is_buffer_valid(encrypted))
-    {
-        throw invalid_argument("encrypted is not valid for encryption parameters");
-    }
-    if (!target_iter)
-    {
-        throw invalid_argument("target_iter");
-    }
-    if (!context_.using_keyswitching())
-    {
-        throw logic_error("keyswitching is not supported by the context");
-    }
-
-    // Don't validate all of kswitch_keys but just check the parms_id.
-    if (kswitch_keys.parms_id() != context_.key_parms_id())
-    {
-        throw invalid_argument("parameter mismatch");
-    }
-
-    if (kswitch_keys_index >= kswitch_keys.data().size())
-    {
-        throw out_of_range("kswitch_keys_index");
-    }
-    if (!pool)
-    {
-        throw invalid_argument("pool is uninitialized");
-    }
-    if (scheme == scheme_type::bfv && encrypted.is_ntt_form())
-    {
-        throw invalid_argument("BFV encrypted cannot be in NTT form");
-    }
-    if (scheme == scheme_type::ckks && !encrypted.is_ntt_form())
-    {
-        throw invalid_argument("CKKS encrypted must be in NTT form");
-    }
-
-    // Extract encryption parameters.
-    size_t coeff_count = parms.poly_modulus_degree();
-    size_t decomp_modulus_size = parms.coeff_modulus().size();
-    auto &key_modulus = key_parms.coeff_modulus();
-    size_t key_modulus_size = key_modulus.size();
-    size_t rns_modulus_size = decomp_modulus_size + 1;
-    auto key_ntt_tables = iter(key_context_data.small_ntt_tables());
-    auto modswitch_factors = key_context_data.rns_tool()->inv_q_last_mod_q();
-
-    // Size check
-    if (!product_fits_in(coeff_count, rns_modulus_size, size_t(2)))
-    {
-        throw logic_error("invalid parameters");
-    }
-
-    // Prepare input
-    auto &key_vector = kswitch_keys.data()[kswitch_keys_index];
+    auto &key_level = context_.key_level();
+    auto key_modulus = key_level.coeff_modulus;
+    size_t key_modulus_size = key_level.coeff_modulus_size;
+    auto key_ntt_tables = iter(key_level.ntt_tables);
     size_t key_component_count = key_vector[0].data().size();
-
-    // Check only the used component in KSwitchKeys.
-    for (auto &each_key : key_vector)
-    {
-        if (!is_metadata_valid_for(each_key, context_) || !is_buffer_valid(each_key))
-        {
-            throw invalid_argument("kswitch_keys is not valid for encryption parameters");
-        }
-    }
-
-    // Create a copy of target_iter
-    SEAL_ALLOCATE_GET_RNS_ITER(t_target, coeff_count, decomp_modulus_size, pool);
-    set_uint(target_iter, decomp_modulus_size * coeff_count, t_target);
-
-    // In CKKS t_target is in NTT form; switch back to normal form
-    if (scheme == scheme_type::ckks)
-    {
-        inverse_ntt_negacyclic_harvey(t_target, decomp_modulus_size, key_ntt_tables);
-    }
-
-    // Temporary result
-    auto t_poly_prod(allocate_zero_poly_array(key_component_count, coeff_count, rns_modulus_size, pool));
+    size_t rns_modulus_size = decomp_modulus_size + 1;
 
 #pragma omp parallel for
     for (int i = 0; i < rns_modulus_size; i++)
@@ -569,57 +519,60 @@ void my_switch_key_inplace(SEALContext &context_,
         size_t lazy_reduction_summand_bound = size_t(SEAL_MULTIPLY_ACCUMULATE_USER_MOD_MAX);
         size_t lazy_reduction_counter = lazy_reduction_summand_bound;
 
-        // Allocate memory for a lazy accumulator (128-bit coefficients)
+        // Allocate memory for a lazy accumulator (128-bit coefficients), component k at k * 2 * coeff_count
         auto t_poly_lazy(allocate_zero_poly_array(key_component_count, coeff_count, 2, pool));
+        uint64_t *accumulator = t_poly_lazy.get();
 
-        // Semantic misuse of PolyIter; this is really pointing to the data for a single RNS factor
-        PolyIter accumulator_iter(t_poly_lazy.get(), 2, coeff_count);
-        // #pragma omp parallel for num_threads(num_threads)
-        for (int j = 0; j < decomp_modulus_size; j++)
+        SEAL_ALLOCATE_GET_COEFF_ITER(t_ntt, coeff_count, pool);
+        for (size_t j = 0; j < decomp_modulus_size; j++)
         {
-            SEAL_ALLOCATE_GET_COEFF_ITER(t_ntt, coeff_count, pool);
-            ConstCoeffIter t_operand;
+            const uint64_t *t_operand;
 
-            // No need to perform RNS conversion (modular reduction)
-            if (key_modulus[j] <= key_modulus[key_index])
+            // An NTT-form input already holds this digit in NTT form modulo its own prime
+            if (is_ntt_form && key_index == j)
             {
-                set_uint(t_target[j], coeff_count, t_ntt);
+                t_operand = target_iter[j];
             }
-            // Perform RNS conversion (modular reduction)
             else
             {
-                modulo_poly_coeffs(t_target[j], coeff_count, key_modulus[key_index], t_ntt);
+                // No need to perform RNS conversion (modular reduction)
+                if (key_modulus[j] <= key_modulus[key_index])
+                {
+                    set_uint(t_target[j], coeff_count, t_ntt);
+                }
+                // Perform RNS conversion (modular reduction)
+                else
+                {
+                    modulo_poly_coeffs(t_target[j], coeff_count, key_modulus[key_index], t_ntt);
+                }
+                // NTT conversion lazy outputs in [0, 4q)
+                ntt_negacyclic_harvey_lazy(t_ntt, key_ntt_tables[key_index]);
+                t_operand = t_ntt;
             }
-            // NTT conversion lazy outputs in [0, 4q)
-            ntt_negacyclic_harvey_lazy(t_ntt, key_ntt_tables[key_index]);
-            t_operand = t_ntt;
 
             // Multiply with keys and modular accumulate products in a lazy fashion
-            SEAL_ITERATE(iter(key_vector[j].data(), accumulator_iter), key_component_count, [&](auto K)
-                         {
-                    if (!lazy_reduction_counter)
+            bool reduce = !lazy_reduction_counter;
+            for (size_t k = 0; k < key_component_count; k++)
+            {
+                const uint64_t *t_key = key_vector[j].data().data(k) + key_index * coeff_count;
+                uint64_t *t_acc = accumulator + k * 2 * coeff_count;
+                for (size_t l = 0; l < coeff_count; l++)
+                {
+                    unsigned long long qword[2]{ 0, 0 };
+                    multiply_uint64(t_operand[l], t_key[l], qword);
+                    add_uint128(qword, t_acc + 2 * l, qword);
+                    if (reduce)
                     {
-                        SEAL_ITERATE(iter(t_operand, get<0>(K)[key_index], get<1>(K)), coeff_count, [&](auto L) {
-                            unsigned long long qword[2]{ 0, 0 };
-                            multiply_uint64(get<0>(L), get<1>(L), qword);
-
-                            // Accumulate product of t_operand and t_key_acc to t_poly_lazy and reduce
-                            add_uint128(qword, get<2>(L).ptr(), qword);
-                            get<2>(L)[0] = barrett_reduce_128(qword, key_modulus[key_index]);
-                            get<2>(L)[1] = 0;
-                        });
+                        t_acc[2 * l] = barrett_reduce_128(qword, key_modulus[key_index]);
+                        t_acc[2 * l + 1] = 0;
                     }
                     else
                     {
-                        // Same as above but no reduction
-                        SEAL_ITERATE(iter(t_operand, get<0>(K)[key_index], get<1>(K)), coeff_count, [&](auto L) {
-                            unsigned long long qword[2]{ 0, 0 };
-                            multiply_uint64(get<0>(L), get<1>(L), qword);
-                            add_uint128(qword, get<2>(L).ptr(), qword);
-                            get<2>(L)[0] = qword[0];
-                            get<2>(L)[1] = qword[1];
-                        });
-                    } });
+                        t_acc[2 * l] = qword[0];
+                        t_acc[2 * l + 1] = qword[1];
+                    }
+                }
+            }
 
             if (!--lazy_reduction_counter)
             {
@@ -627,30 +580,133 @@ void my_switch_key_inplace(SEALContext &context_,
             }
         }
 
-        // PolyIter pointing to the destination t_poly_prod, shifted to the appropriate modulus
-        PolyIter t_poly_prod_iter(t_poly_prod.get() + (i * coeff_count), coeff_count, rns_modulus_size);
-
-        // Final modular reduction
-        // #pragma omp parallel for collapse(2)
-        for (int k = 0; k < key_component_count; k++)
+        // Final modular reduction into the limb of this prime in t_poly_prod
+        for (size_t k = 0; k < key_component_count; k++)
         {
-            for (int l = 0; l < coeff_count; l++)
+            uint64_t *t_prod = t_poly_prod + (k * rns_modulus_size + i) * coeff_count;
+            const uint64_t *t_acc = accumulator + k * 2 * coeff_count;
+            for (size_t l = 0; l < coeff_count; l++)
             {
                 if (lazy_reduction_counter == lazy_reduction_summand_bound)
                 {
-                    (*t_poly_prod_iter[k])[l] = static_cast<uint64_t>(*accumulator_iter[k][l]);
+                    t_prod[l] = t_acc[2 * l];
                 }
                 else
                 {
-                    (*t_poly_prod_iter[k])[l] = barrett_reduce_128(accumulator_iter[k][l].ptr(), key_modulus[key_index]);
+                    t_prod[l] = barrett_reduce_128(t_acc + 2 * l, key_modulus[key_index]);
                 }
             }
         }
     }
-    // Accumulated products are now stored in t_poly_prod
+}
+
+// Hybrid decomposition: every digit of target is raised to all primes of the level and the special prime by a
+// fast base conversion and multiplied with the key of its digit. The products are written to t_poly_prod as in
+// my_accumulate_per_prime_products.
+template <typename CoeffCount, typename DecompSize>
+static void my_accumulate_hybrid_products(
+    CoeffCount coeff_count, DecompSize decomp_modulus_size, KernelContext &context_, parms_id_type parms_id,
+    ConstRNSIter target_iter, ConstRNSIter t_target, bool is_ntt_form, const vector<PublicKey> &key_vector,
+    uint64_t *t_poly_prod, MemoryPoolHandle pool, int num_threads)
+{
+    auto &key_level = context_.key_level();
+    auto key_modulus = key_level.coeff_modulus;
+    size_t key_modulus_size = key_level.coeff_modulus_size;
+    auto key_ntt_tables = iter(key_level.ntt_tables);
+    size_t rns_modulus_size = decomp_modulus_size + 1;
+    size_t key_component_count = key_vector[0].data().size();
+
+    // Below the first level the trailing digits may be empty and are left out
+    auto &digits = context_.key_switch_digits(parms_id, key_vector.size());
+    size_t digit_count = digits.size();
+
+    // Digit d raised to the level: its own residues first, then the output of the conversion, which holds the
+    // data primes before the digit, the ones after it and the special prime
+    SEAL_ALLOCATE_GET_POLY_ITER(t_raised, digit_count, coeff_count, rns_modulus_size, pool);
+    for (size_t d = 0; d < digit_count; d++)
+    {
+        auto &digit = digits[d];
+        set_uint(t_target[digit.start], digit.size * coeff_count, t_raised[d]);
+        my_fast_convert_array(
+            digit.digit_to_rest_conv, ConstRNSIter(t_target[digit.start], coeff_count), t_raised[d] + digit.size, pool,
+            num_threads);
+    }
+
+#pragma omp parallel for num_threads(num_threads)
+    for (int i = 0; i < rns_modulus_size; i++)
+    {
+        size_t key_index = (i == decomp_modulus_size ? key_modulus_size - 1 : i);
+
+        // Lazy accumulator (128-bit coefficients); there are fewer digits than SEAL allows primes, so the sum of
+        // the products, each below 4 * q^2, never overflows
+        auto t_poly_lazy(allocate_zero_poly_array(key_component_count, coeff_count, 2, pool));
+        uint64_t *accumulator = t_poly_lazy.get();
+
+        for (size_t d = 0; d < digit_count; d++)
+        {
+            auto &digit = digits[d];
+            bool own_prime = i >= digit.start && i < digit.start + digit.size;
+            const uint64_t *t_operand;
+
+            // An NTT-form input already holds the digit in NTT form modulo its own primes
+            if (is_ntt_form && own_prime)
+            {
+                t_operand = target_iter[i];
+            }
+            else
+            {
+                size_t raised_index = own_prime ? i - digit.start : (i < digit.start ? digit.size + i : i);
+
+                // Every raised residue is used once, so it is transformed in place; lazy outputs are in [0, 4q)
+                ntt_negacyclic_harvey_lazy(t_raised[d][raised_index], key_ntt_tables[key_index]);
+                t_operand = t_raised[d][raised_index];
+            }
+
+            for (size_t k = 0; k < key_component_count; k++)
+            {
+                const uint64_t *t_key = key_vector[d].data().data(k) + key_index * coeff_count;
+                uint64_t *t_acc = accumulator + k * 2 * coeff_count;
+                for (size_t l = 0; l < coeff_count; l++)
+                {
+                    unsigned long long qword[2]{ 0, 0 };
+                    multiply_uint64(t_operand[l], t_key[l], qword);
+                    add_uint128(qword, t_acc + 2 * l, qword);
+                    t_acc[2 * l] = qword[0];
+                    t_acc[2 * l + 1] = qword[1];
+                }
+            }
+        }
+
+        for (size_t k = 0; k < key_component_count; k++)
+        {
+            uint64_t *t_prod = t_poly_prod + (k * rns_modulus_size + i) * coeff_count;
+            const uint64_t *t_acc = accumulator + k * 2 * coeff_count;
+            for (size_t l = 0; l < coeff_count; l++)
+            {
+                t_prod[l] = barrett_reduce_128(t_acc + 2 * l, key_modulus[key_index]);
+            }
+        }
+    }
+}
+
+// Divides the key switching products by the special prime and adds them to the components of encrypted. The
+// products are in NTT form; the result is added in the form encrypted is in.
+static void my_add_mod_down_products(
+    KernelContext &context_, Ciphertext &encrypted, uint64_t *t_poly_prod_ptr, size_t key_component_count,
+    MemoryPoolHandle pool, int num_threads)
+{
+    auto &level = context_.level(encrypted.parms_id());
+    auto &key_level = context_.key_level();
+    size_t coeff_count = level.coeff_count;
+    size_t decomp_modulus_size = level.coeff_modulus_size;
+    size_t rns_modulus_size = decomp_modulus_size + 1;
+    auto key_modulus = key_level.coeff_modulus;
+    size_t key_modulus_size = key_level.coeff_modulus_size;
+    auto key_ntt_tables = iter(key_level.ntt_tables);
+    auto modswitch_factors = key_level.rns_tool->inv_q_last_mod_q();
+    bool is_ntt_form = encrypted.is_ntt_form();
 
-    // Perform modulus switching with scaling
-    PolyIter t_poly_prod_iter(t_poly_prod.get(), coeff_count, rns_modulus_size);
+    PolyIter t_poly_prod_iter(t_poly_prod_ptr, coeff_count, rns_modulus_size);
     SEAL_ITERATE(iter(encrypted, t_poly_prod_iter), key_component_count, [&](auto I)
                  {
                      // Lazy reduction; this needs to be then reduced mod qi
@@ -686,7 +742,17 @@ void my_switch_key_inplace(SEALContext &context_,
                                       { K += fix; });
 
                          uint64_t qi_lazy = qi << 1; // some multiples of qi
-                         inverse_ntt_negacyclic_harvey_lazy(get<1>(I)[j], key_ntt_tables[j]);
+                         if (is_ntt_form)
+                         {
+                             // Bring the special prime part to NTT form instead of the products out of it; the
+                             // lazy NTT output is in [0, 4*qi)
+                             ntt_negacyclic_harvey_lazy(t_ntt, key_ntt_tables[j]);
+                             qi_lazy = qi << 2;
+                         }
+                         else
+                         {
+                             inverse_ntt_negacyclic_harvey_lazy(get<1>(I)[j], key_ntt_tables[j]);
+                         }
 
                          // ((ct mod qi) - (ct mod qk)) mod qi
                          SEAL_ITERATE(iter(get<1>(I)[j], t_ntt), coeff_count, [&](auto K)
@@ -695,70 +761,323 @@ void my_switch_key_inplace(SEALContext &context_,
                          // qk^(-1) * ((ct mod qi) - (ct mod qk)) mod qi
                          multiply_poly_scalar_coeffmod(get<1>(I)[j], coeff_count, modswitch_factors[j], key_modulus[j], get<1>(I)[j]);
                          add_poly_coeffmod(get<1>(I)[j], get<0>(I)[j], coeff_count, key_modulus[j], get<0>(I)[j]);
-                     } });
-}
-
-void my_bfv_multiply(SEALContext &context_, Ciphertext &encrypted1, Ciphertext &encrypted2, MemoryPoolHandle pool, int num_threads)
-
+                     } });}
+
+// Every digit of target raised to all primes of the level and the special prime in NTT form, lazily reduced to
+// [0, 4q) and with output prime i at limb i of t_raised[d]. Unlike my_accumulate_*_products the raised digits are
+// kept, so that the key switches of several rotations of the same target can share them.
+template <typename CoeffCount, typename DecompSize>
+static void my_raise_digits_ntt(
+    CoeffCount coeff_count, DecompSize decomp_modulus_size, KernelContext &context_, parms_id_type parms_id,
+    ConstRNSIter target_iter, bool is_ntt_form, size_t key_digit_count, PolyIter t_raised, MemoryPoolHandle pool,
+    int num_threads)
 {
-    if (encrypted1.is_ntt_form() || encrypted2.is_ntt_form())
+    auto &key_level = context_.key_level();
+    auto key_modulus = key_level.coeff_modulus;
+    size_t key_modulus_size = key_level.coeff_modulus_size;
+    auto key_ntt_tables = iter(key_level.ntt_tables);
+    size_t rns_modulus_size = decomp_modulus_size + 1;
+
+    // The modulus raise works on the coefficient form
+    SEAL_ALLOCATE_GET_RNS_ITER(t_target, coeff_count, decomp_modulus_size, pool);
+    set_uint(target_iter, decomp_modulus_size * coeff_count, t_target);
+    if (is_ntt_form)
     {
-        throw invalid_argument("encrypted1 or encrypted2 cannot be in NTT form");
+        inverse_ntt_negacyclic_harvey(t_target, decomp_modulus_size, key_ntt_tables);
     }
 
-    // Extract encryption parameters.
-    auto &context_data = *context_.get_context_data(encrypted1.parms_id());
-    auto &parms = context_data.parms();
-    size_t coeff_count = parms.poly_modulus_degree();
-    size_t base_q_size = parms.coeff_modulus().size();
-    size_t encrypted1_size = encrypted1.size();
-    size_t encrypted2_size = encrypted2.size();
-    uint64_t plain_modulus = parms.plain_modulus().value();
-
-    double new_scale = encrypted1.scale() * encrypted2.scale();
-
-    // Check that scale is positive and not too large
-    if (new_scale <= 0 || (static_cast<int>(log2(new_scale)) >= parms.plain_modulus().bit_count()))
+    if (key_digit_count == context_.key_switch_prime_count())
     {
-        throw invalid_argument("scale out of bounds");
+        // Digit j is the residue modulo prime j, reduced modulo every output prime
+#pragma omp parallel for num_threads(num_threads)
+        for (int i = 0; i < rns_modulus_size; i++)
+        {
+            size_t key_index = (i == decomp_modulus_size ? key_modulus_size - 1 : i);
+            for (size_t j = 0; j < decomp_modulus_size; j++)
+            {
+                uint64_t *t_out = t_raised[j][i];
+                if (is_ntt_form && key_index == j)
+                {
+                    set_uint(target_iter[j], coeff_count, t_out);
+                    continue;
+                }
+                if (key_modulus[j] <= key_modulus[key_index])
+                {
+                    set_uint(t_target[j], coeff_count, t_out);
+                }
+                else
+                {
+                    modulo_poly_coeffs(t_target[j], coeff_count, key_modulus[key_index], t_out);
+                }
+                ntt_negacyclic_harvey_lazy(t_out, key_ntt_tables[key_index]);
+            }
+        }
+        return;
     }
-    omp_set_num_threads(num_threads);
-
-    auto rns_tool = context_data.rns_tool();
-    size_t base_Bsk_size = rns_tool->base_Bsk()->size();
-    size_t base_Bsk_m_tilde_size = rns_tool->base_Bsk_m_tilde()->size();
 
-    // Determine destination.size()
-    size_t dest_size = sub_safe(add_safe(encrypted1_size, encrypted2_size), size_t(1));
-
-    // Size check
-    if (!product_fits_in(dest_size, coeff_count, base_Bsk_m_tilde_size))
+    // Below the first level the trailing digits may be empty and are left out
+    auto &digits = context_.key_switch_digits(parms_id, key_digit_count);
+    for (size_t d = 0; d < digits.size(); d++)
     {
-        throw logic_error("invalid parameters");
-    }
+        // The conversion output holds the data primes before the digit, the ones after it and the special prime
+        auto &digit = digits[d];
+        SEAL_ALLOCATE_GET_RNS_ITER(t_rest, coeff_count, rns_modulus_size - digit.size, pool);
+        my_fast_convert_array(
+            digit.digit_to_rest_conv, ConstRNSIter(t_target[digit.start], coeff_count), t_rest, pool, num_threads);
 
-    // Set up iterators for bases
-    auto base_q = iter(parms.coeff_modulus());
-    auto base_Bsk = iter(rns_tool->base_Bsk()->base());
+#pragma omp parallel for num_threads(num_threads)
+        for (int i = 0; i < rns_modulus_size; i++)
+        {
+            size_t key_index = (i == decomp_modulus_size ? key_modulus_size - 1 : i);
+            bool own_prime = i >= digit.start && i < digit.start + digit.size;
+            uint64_t *t_out = t_raised[d][i];
+            if (is_ntt_form && own_prime)
+            {
+                set_uint(target_iter[i], coeff_count, t_out);
+                continue;
+            }
+            const uint64_t *t_in = own_prime ? t_target[i] : t_rest[i < digit.start ? i : i - digit.size];
+            set_uint(t_in, coeff_count, t_out);
+            ntt_negacyclic_harvey_lazy(t_out, key_ntt_tables[key_index]);
+        }
+    }
+}
 
-    // Set up iterators for NTT tables
-    auto base_q_ntt_tables = iter(context_data.small_ntt_tables());
-    auto base_Bsk_ntt_tables = iter(rns_tool->base_Bsk_ntt_tables());
+// Products of raised digits with the key of their digit, written to t_poly_prod as in my_accumulate_*_products.
+// With a permutation the digits are read through it, which raises the target after the Galois automorphism.
+template <typename CoeffCount, typename DecompSize>
+static void my_accumulate_raised_products(
+    CoeffCount coeff_count, DecompSize decomp_modulus_size, KernelContext &context_, ConstPolyIter t_raised,
+    size_t digit_count, const uint32_t *permutation, const vector<PublicKey> &key_vector, uint64_t *t_poly_prod,
+    MemoryPoolHandle pool, int num_threads)
+{
+    auto &key_level = context_.key_level();
+    auto key_modulus = key_level.coeff_modulus;
+    size_t key_modulus_size = key_level.coeff_modulus_size;
+    size_t rns_modulus_size = decomp_modulus_size + 1;
+    size_t key_component_count = key_vector[0].data().size();
 
-    // Microsoft SEAL uses BEHZ-style RNS multiplication. This process is somewhat complex and consists of the
-    // following steps:
-    //
-    // (1) Lift encrypted1 and encrypted2 (initially in base q) to an extended base q U Bsk U {m_tilde}
-    // (2) Remove extra multiples of q from the results with Montgomery reduction, switching base to q U Bsk
-    // (3) Transform the data to NTT form
-    // (4) Compute the ciphertext polynomial product using dyadic multiplication
-    // (5) Transform the data back from NTT form
-    // (6) Multiply the result by t (plain_modulus)
-    // (7) Scale the result by q using a divide-and-floor algorithm, switching base to Bsk
-    // (8) Use Shenoy-Kumaresan method to convert the result to base q
+#pragma omp parallel for num_threads(num_threads)
+    for (int i = 0; i < rns_modulus_size; i++)
+    {
+        size_t key_index = (i == decomp_modulus_size ? key_modulus_size - 1 : i);
 
-    // Resize encrypted1 to destination size
-    encrypted1.resize(context_, context_data.parms_id(), dest_size);
+        // At most one digit per data prime, each product below 4 * q^2, so the 128-bit sums never overflow
+        auto t_poly_lazy(allocate_zero_poly_array(key_component_count, coeff_count, 2, pool));
+        uint64_t *accumulator = t_poly_lazy.get();
+
+        for (size_t d = 0; d < digit_count; d++)
+        {
+            const uint64_t *t_operand = t_raised[d][i];
+            for (size_t k = 0; k < key_component_count; k++)
+            {
+                const uint64_t *t_key = key_vector[d].data().data(k) + key_index * coeff_count;
+                uint64_t *t_acc = accumulator + k * 2 * coeff_count;
+                for (size_t l = 0; l < coeff_count; l++)
+                {
+                    unsigned long long qword[2]{ 0, 0 };
+                    multiply_uint64(t_operand[permutation ? permutation[l] : l], t_key[l], qword);
+                    add_uint128(qword, t_acc + 2 * l, qword);
+                    t_acc[2 * l] = qword[0];
+                    t_acc[2 * l + 1] = qword[1];
+                }
+            }
+        }
+
+        for (size_t k = 0; k < key_component_count; k++)
+        {
+            uint64_t *t_prod = t_poly_prod + (k * rns_modulus_size + i) * coeff_count;
+            const uint64_t *t_acc = accumulator + k * 2 * coeff_count;
+            for (size_t l = 0; l < coeff_count; l++)
+            {
+                t_prod[l] = barrett_reduce_128(t_acc + 2 * l, key_modulus[key_index]);
+            }
+        }
+    }
+}
+
+void my_switch_key_inplace(KernelContext &context_,
+                           Ciphertext &encrypted, ConstRNSIter target_iter, const KSwitchKeys &kswitch_keys, size_t kswitch_keys_index,
+                           MemoryPoolHandle pool, int num_threads)
+{
+    auto parms_id = encrypted.parms_id();
+    auto &context_data = *context_.level(parms_id).context_data;
+    auto &parms = context_data.parms();
+    auto &key_context_data = *context_.key_level().context_data;
+    auto &key_parms = key_context_data.parms();
+    auto scheme = parms.scheme();
+
+    omp_set_num_threads(num_threads);
+    // Verify parameters.
+    if (context_.validate())
+    {
+        if (!is_metadata_valid_for(encrypted, context_.seal_context()) || !is_buffer_valid(encrypted))
+        {
+            throw invalid_argument("encrypted is not valid for encryption parameters");
+        }
+        if (!target_iter)
+        {
+            throw invalid_argument("target_iter");
+        }
+        if (!context_.seal_context().using_keyswitching())
+        {
+            throw logic_error("keyswitching is not supported by the context");
+        }
+
+        // Don't validate all of kswitch_keys but just check the parms_id.
+        if (kswitch_keys.parms_id() != context_.key_parms_id())
+        {
+            throw invalid_argument("parameter mismatch");
+        }
+
+        if (kswitch_keys_index >= kswitch_keys.data().size())
+        {
+            throw out_of_range("kswitch_keys_index");
+        }
+        if (!pool)
+        {
+            throw invalid_argument("pool is uninitialized");
+        }
+        if (scheme == scheme_type::ckks && !encrypted.is_ntt_form())
+        {
+            throw invalid_argument("CKKS encrypted must be in NTT form");
+        }
+    }
+
+    // Extract encryption parameters.
+    size_t coeff_count = parms.poly_modulus_degree();
+    size_t decomp_modulus_size = parms.coeff_modulus().size();
+    auto &key_modulus = key_parms.coeff_modulus();
+    size_t key_modulus_size = key_modulus.size();
+    size_t rns_modulus_size = decomp_modulus_size + 1;
+    auto key_ntt_tables = iter(key_context_data.small_ntt_tables());
+
+    // Size check
+    if (!product_fits_in(coeff_count, rns_modulus_size, size_t(2)))
+    {
+        throw logic_error("invalid parameters");
+    }
+
+    // Prepare input
+    auto &key_vector = kswitch_keys.data()[kswitch_keys_index];
+    size_t key_component_count = key_vector[0].data().size();
+
+    // Check only the used component in KSwitchKeys.
+    if (context_.validate())
+    {
+        // One key per prime, or one per digit of a hybrid decomposition
+        if (!context_.is_key_switch_digit_count(key_vector.size()))
+        {
+            throw invalid_argument("kswitch_keys has an invalid number of digits");
+        }
+        for (auto &each_key : key_vector)
+        {
+            if (!is_metadata_valid_for(each_key, context_.seal_context()) || !is_buffer_valid(each_key))
+            {
+                throw invalid_argument("kswitch_keys is not valid for encryption parameters");
+            }
+        }
+    }
+
+    // target_iter is in the same form as encrypted. BFV ciphertexts may be in NTT form as well, in which case
+    // the result is produced in NTT form without leaving the evaluation domain.
+    bool is_ntt_form = encrypted.is_ntt_form();
+
+    // Create a copy of target_iter
+    SEAL_ALLOCATE_GET_RNS_ITER(t_target, coeff_count, decomp_modulus_size, pool);
+    set_uint(target_iter, decomp_modulus_size * coeff_count, t_target);
+
+    // An NTT-form t_target is switched back to normal form for the modulus raise
+    if (is_ntt_form)
+    {
+        inverse_ntt_negacyclic_harvey(t_target, decomp_modulus_size, key_ntt_tables);
+    }
+
+    // Temporary result
+    auto t_poly_prod(allocate_zero_poly_array(key_component_count, coeff_count, rns_modulus_size, pool));
+
+    // SEAL's per-prime decomposition has one key per data prime; anything else is a hybrid decomposition
+    if (key_vector.size() == context_.key_switch_prime_count())
+    {
+        dispatch_kernel_shape(coeff_count, decomp_modulus_size, [&](auto fixed_coeff_count, auto fixed_decomp_size) {
+            my_accumulate_per_prime_products(
+                fixed_coeff_count, fixed_decomp_size, context_, target_iter, t_target, is_ntt_form, key_vector,
+                t_poly_prod.get(), pool);
+        });
+    }
+    else
+    {
+        dispatch_kernel_shape(coeff_count, decomp_modulus_size, [&](auto fixed_coeff_count, auto fixed_decomp_size) {
+            my_accumulate_hybrid_products(
+                fixed_coeff_count, fixed_decomp_size, context_, parms_id, target_iter, t_target, is_ntt_form,
+                key_vector, t_poly_prod.get(), pool, num_threads);
+        });
+    }
+    // Accumulated products are now stored in t_poly_prod
+    my_add_mod_down_products(context_, encrypted, t_poly_prod.get(), key_component_count, pool, num_threads);
+}
+
+void my_bfv_multiply(KernelContext &context_, Ciphertext &encrypted1, Ciphertext &encrypted2, MemoryPoolHandle pool, int num_threads)
+
+{
+    if (context_.validate() && (encrypted1.is_ntt_form() || encrypted2.is_ntt_form()))
+    {
+        throw invalid_argument("encrypted1 or encrypted2 cannot be in NTT form");
+    }
+
+    // Extract encryption parameters.
+    auto &context_data = *context_.level(encrypted1.parms_id()).context_data;
+    auto &parms = context_data.parms();
+    size_t coeff_count = parms.poly_modulus_degree();
+    size_t base_q_size = parms.coeff_modulus().size();
+    size_t encrypted1_size = encrypted1.size();
+    size_t encrypted2_size = encrypted2.size();
+    uint64_t plain_modulus = parms.plain_modulus().value();
+
+    double new_scale = encrypted1.scale() * encrypted2.scale();
+
+    // Check that scale is positive and not too large
+    if (context_.validate() && (new_scale <= 0 || (static_cast<int>(log2(new_scale)) >= parms.plain_modulus().bit_count())))
+    {
+        throw invalid_argument("scale out of bounds");
+    }
+    omp_set_num_threads(num_threads);
+
+    auto rns_tool = context_data.rns_tool();
+    size_t base_Bsk_size = rns_tool->base_Bsk()->size();
+    size_t base_Bsk_m_tilde_size = rns_tool->base_Bsk_m_tilde()->size();
+
+    // Determine destination.size()
+    size_t dest_size = sub_safe(add_safe(encrypted1_size, encrypted2_size), size_t(1));
+
+    // Size check
+    if (!product_fits_in(dest_size, coeff_count, base_Bsk_m_tilde_size))
+    {
+        throw logic_error("invalid parameters");
+    }
+
+    // Set up iterators for bases
+    auto base_q = iter(parms.coeff_modulus());
+    auto base_Bsk = iter(rns_tool->base_Bsk()->base());
+
+    // Set up iterators for NTT tables
+    auto base_q_ntt_tables = iter(context_data.small_ntt_tables());
+    auto base_Bsk_ntt_tables = iter(rns_tool->base_Bsk_ntt_tables());
+
+    // Microsoft SEAL uses BEHZ-style RNS multiplication. This process is somewhat complex and consists of the
+    // following steps:
+    //
+    // (1) Lift encrypted1 and encrypted2 (initially in base q) to an extended base q U Bsk U {m_tilde}
+    // (2) Remove extra multiples of q from the results with Montgomery reduction, switching base to q U Bsk
+    // (3) Transform the data to NTT form
+    // (4) Compute the ciphertext polynomial product using dyadic multiplication
+    // (5) Transform the data back from NTT form
+    // (6) Multiply the result by t (plain_modulus)
+    // (7) Scale the result by q using a divide-and-floor algorithm, switching base to Bsk
+    // (8) Use Shenoy-Kumaresan method to convert the result to base q
+
+    // Resize encrypted1 to destination size
+    encrypted1.resize(dest_size);
 
     // This lambda function takes as input an IterTuple with three components:
     //
@@ -879,9 +1198,7 @@ void my_bfv_multiply(SEALContext &context_, Ciphertext &encrypted1, Ciphertext &
 #pragma omp parallel for num_threads(num_threads)
                 for (int k = 0; k < base_size; k++)
                 {
-                    SEAL_ALLOCATE_GET_COEFF_ITER(temp, coeff_count, pool);
-                    dyadic_product_coeffmod(shifted_in1_iter[j][k], shifted_reversed_in2_iter[j][k], coeff_count, base_iter[k], temp);
-                    add_poly_coeffmod(temp, shifted_out_iter[k], coeff_count, base_iter[k], shifted_out_iter[k]);
+                    simd_dyadic_product_accumulate_coeffmod(shifted_in1_iter[j][k], shifted_reversed_in2_iter[j][k], coeff_count, base_iter[k], shifted_out_iter[k]);
                 }
             }
         };
@@ -909,11 +1226,11 @@ void my_bfv_multiply(SEALContext &context_, Ciphertext &encrypted1, Ciphertext &
         for (int j = 0; j < temp_dest_Bsk.coeff_modulus_size(); j++)
         { // 14
             inverse_ntt_negacyclic_harvey_lazy(temp_dest_Bsk[i][j], base_Bsk_ntt_tables[j]);
-            multiply_poly_scalar_coeffmod(temp_dest_Bsk[i][j], (temp_q_Bsk + base_q_size).poly_modulus_degree(), plain_modulus, base_Bsk[j], (temp_q_Bsk + base_q_size)[j]);
+            simd_multiply_poly_scalar_coeffmod(temp_dest_Bsk[i][j], (temp_q_Bsk + base_q_size).poly_modulus_degree(), plain_modulus, base_Bsk[j], (temp_q_Bsk + base_q_size)[j]);
             if (j < temp_dest_q.coeff_modulus_size())
             {
                 inverse_ntt_negacyclic_harvey_lazy(temp_dest_q[i][j], base_q_ntt_tables[j]);
-                multiply_poly_scalar_coeffmod(temp_dest_q[i][j], temp_q_Bsk.poly_modulus_degree(), plain_modulus, base_q[j], temp_q_Bsk[j]);
+                simd_multiply_poly_scalar_coeffmod(temp_dest_q[i][j], temp_q_Bsk.poly_modulus_degree(), plain_modulus, base_q[j], temp_q_Bsk[j]);
             }
         }
         my_fast_floor(rns_tool, temp_q_Bsk, temp_Bsk, pool, num_threads);
@@ -922,22 +1239,25 @@ void my_bfv_multiply(SEALContext &context_, Ciphertext &encrypted1, Ciphertext &
     // Set the scale
 }
 
-void my_mod_switch_scale_to_next(SEALContext &context_,
+void my_mod_switch_scale_to_next(KernelContext &context_,
                                  Ciphertext &encrypted, Ciphertext &destination, MemoryPoolHandle pool, int num_threads)
 {
     // Assuming at this point encrypted is already validated.
-    auto context_data_ptr = context_.get_context_data(encrypted.parms_id());
-    if (context_data_ptr->parms().scheme() == scheme_type::bfv && encrypted.is_ntt_form())
-    {
-        throw invalid_argument("BFV encrypted cannot be in NTT form");
-    }
-    if (context_data_ptr->parms().scheme() == scheme_type::ckks && !encrypted.is_ntt_form())
-    {
-        throw invalid_argument("CKKS encrypted must be in NTT form");
-    }
-    if (!pool)
+    auto context_data_ptr = context_.level(encrypted.parms_id()).context_data;
+    if (context_.validate())
     {
-        throw invalid_argument("pool is uninitialized");
+        if (context_data_ptr->parms().scheme() == scheme_type::bfv && encrypted.is_ntt_form())
+        {
+            throw invalid_argument("BFV encrypted cannot be in NTT form");
+        }
+        if (context_data_ptr->parms().scheme() == scheme_type::ckks && !encrypted.is_ntt_form())
+        {
+            throw invalid_argument("CKKS encrypted must be in NTT form");
+        }
+        if (!pool)
+        {
+            throw invalid_argument("pool is uninitialized");
+        }
     }
 
     // Extract encryption parameters.
@@ -956,7 +1276,7 @@ void my_mod_switch_scale_to_next(SEALContext &context_,
     auto coeff_count_ = rns_tool->coeff_count();
     auto base_q_ = rns_tool->base_q();
     size_t base_q_size = base_q_->size();
-    destination.resize(context_, next_context_data.parms_id(), encrypted_size);
+    destination.resize(context_.seal_context(), next_context_data.parms_id(), encrypted_size);
     auto destination_iter = iter(destination);
 
     // #pragma omp parallel for   // Increases time, need to check again
@@ -986,7 +1306,7 @@ void my_mod_switch_scale_to_next(SEALContext &context_,
     }
 
     // Copy result to destination
-    // destination.resize(context_, next_context_data.parms_id(), encrypted_size);
+    // destination.resize(context_.seal_context(), next_context_data.parms_id(), encrypted_size);
     // SEAL_ITERATE(iter(encrypted_copy, destination), encrypted_size, [&](auto I) {
     //     //set_poly(get<0>(I), coeff_count, next_coeff_modulus_size, get<1>(I));
     // });
@@ -995,24 +1315,118 @@ void my_mod_switch_scale_to_next(SEALContext &context_,
     destination.is_ntt_form() = encrypted.is_ntt_form();
 }
 
-void my_transform_to_ntt_inplace(SEALContext &context_, Ciphertext &encrypted, int num_threads)
+void my_mod_switch_scale_to(KernelContext &context_,
+                            Ciphertext &encrypted, Ciphertext &destination, parms_id_type parms_id, MemoryPoolHandle pool, int num_threads)
 {
     // Verify parameters.
-    if (!is_metadata_valid_for(encrypted, context_) || !is_buffer_valid(encrypted))
+    auto context_data_ptr = context_.level(encrypted.parms_id()).context_data;
+    auto target_context_data_ptr = context_.level(parms_id).context_data;
+    if (context_.validate())
+    {
+        if (context_data_ptr->chain_index() < target_context_data_ptr->chain_index())
+        {
+            throw invalid_argument("cannot switch to higher level modulus");
+        }
+        if (context_data_ptr->parms().scheme() != scheme_type::bfv || encrypted.is_ntt_form())
+        {
+            throw invalid_argument("encrypted must be a BFV ciphertext not in NTT form");
+        }
+        if (!pool)
+        {
+            throw invalid_argument("pool is uninitialized");
+        }
+    }
+
+    // Is there anything to do?
+    if (encrypted.parms_id() == parms_id)
+    {
+        if (&destination != &encrypted)
+        {
+            destination = encrypted;
+        }
+        return;
+    }
+
+    // Extract encryption parameters.
+    auto &context_data = *context_data_ptr;
+    auto &coeff_modulus = context_data.parms().coeff_modulus();
+    size_t coeff_count = context_data.parms().poly_modulus_degree();
+    size_t encrypted_size = encrypted.size();
+    auto &tool = context_.rescale_tool(encrypted.parms_id(), parms_id);
+    size_t keep_size = tool.keep_size;
+    size_t drop_size = tool.drop_size;
+
+    // Compute round(ct / P) in the remaining base as (ct + floor(P/2) - [ct + floor(P/2)]_P) * P^(-1). The
+    // residue modulo P is lifted to all remaining primes with a single fast base conversion, instead of one
+    // divide-and-round per dropped prime. The conversion may be off by a small multiple of P, which only adds
+    // at most drop_size to each coefficient, the same order as the rounding error of a single mod switch.
+    SEAL_ALLOCATE_GET_POLY_ITER(rescaled, encrypted_size, coeff_count, keep_size, pool);
+    SEAL_ALLOCATE_GET_RNS_ITER(drop_lift, coeff_count, drop_size, pool);
+    SEAL_ALLOCATE_GET_RNS_ITER(drop_in_keep, coeff_count, keep_size, pool);
+    auto encrypted_iter = iter(encrypted);
+
+    for (int i = 0; i < encrypted_size; i++)
     {
-        throw invalid_argument("encrypted is not valid for encryption parameters");
+        // Add floor(P/2) to change from flooring to rounding
+#pragma omp parallel for num_threads(num_threads)
+        for (int j = 0; j < drop_size; j++)
+        {
+            add_poly_scalar_coeffmod(encrypted_iter[i][keep_size + j], coeff_count, tool.half_mod_drop[j], coeff_modulus[keep_size + j], drop_lift[j]);
+        }
+
+        my_fast_convert_array(tool.drop_to_keep_conv, drop_lift, drop_in_keep, pool, num_threads);
+
+#pragma omp parallel for num_threads(num_threads)
+        for (int j = 0; j < keep_size; j++)
+        {
+            add_poly_scalar_coeffmod(encrypted_iter[i][j], coeff_count, tool.half_mod_keep[j], coeff_modulus[j], rescaled[i][j]);
+            sub_poly_coeffmod(rescaled[i][j], drop_in_keep[j], coeff_count, coeff_modulus[j], rescaled[i][j]);
+            multiply_poly_scalar_coeffmod(rescaled[i][j], coeff_count, tool.inv_drop_prod_mod_keep[j], coeff_modulus[j], rescaled[i][j]);
+        }
     }
 
-    auto context_data_ptr = context_.get_context_data(encrypted.parms_id());
+    // Copy result to destination; encrypted may alias destination, so this happens last
+    bool is_ntt_form = encrypted.is_ntt_form();
+    destination.resize(context_.seal_context(), parms_id, encrypted_size);
+    auto destination_iter = iter(destination);
+    for (int i = 0; i < encrypted_size; i++)
+    {
+        set_poly(rescaled[i], coeff_count, keep_size, destination_iter[i]);
+    }
+    destination.is_ntt_form() = is_ntt_form;
+}
+
+parms_id_type get_lower_parms_id(KernelContext &context_, parms_id_type parms_id, int drop_count)
+{
+    auto context_data_ptr = context_.level(parms_id).context_data;
+    for (int k = 0; k < drop_count && context_data_ptr; k++)
+    {
+        context_data_ptr = context_data_ptr->next_context_data().get();
+    }
     if (!context_data_ptr)
     {
-        throw invalid_argument("encrypted is not valid for encryption parameters");
+        throw invalid_argument("drop_count exceeds the modulus switching chain");
     }
-    if (encrypted.is_ntt_form())
+    return context_data_ptr->parms_id();
+}
+
+void my_transform_to_ntt_inplace(KernelContext &context_, Ciphertext &encrypted, int num_threads)
+{
+    // Verify parameters.
+    if (context_.validate())
     {
-        throw invalid_argument("encrypted is already in NTT form");
+        if (!is_metadata_valid_for(encrypted, context_.seal_context()) || !is_buffer_valid(encrypted))
+        {
+            throw invalid_argument("encrypted is not valid for encryption parameters");
+        }
+        if (encrypted.is_ntt_form())
+        {
+            throw invalid_argument("encrypted is already in NTT form");
+        }
     }
 
+    auto context_data_ptr = context_.level(encrypted.parms_id()).context_data;
+
     // Extract encryption parameters.
     auto &context_data = *context_data_ptr;
     auto &parms = context_data.parms();
@@ -1044,23 +1458,22 @@ void my_transform_to_ntt_inplace(SEALContext &context_, Ciphertext &encrypted, i
     encrypted.is_ntt_form() = true;
 }
 
-void my_transform_from_ntt_inplace(SEALContext &context_, Ciphertext &encrypted_ntt, int num_threads)
+void my_transform_from_ntt_inplace(KernelContext &context_, Ciphertext &encrypted_ntt, int num_threads)
 {
     // Verify parameters.
-    if (!is_metadata_valid_for(encrypted_ntt, context_) || !is_buffer_valid(encrypted_ntt))
+    if (context_.validate())
     {
-        throw invalid_argument("encrypted is not valid for encryption parameters");
+        if (!is_metadata_valid_for(encrypted_ntt, context_.seal_context()) || !is_buffer_valid(encrypted_ntt))
+        {
+            throw invalid_argument("encrypted is not valid for encryption parameters");
+        }
+        if (!encrypted_ntt.is_ntt_form())
+        {
+            throw invalid_argument("encrypted_ntt is not in NTT form");
+        }
     }
 
-    auto context_data_ptr = context_.get_context_data(encrypted_ntt.parms_id());
-    if (!context_data_ptr)
-    {
-        throw invalid_argument("encrypted_ntt is not valid for encryption parameters");
-    }
-    if (!encrypted_ntt.is_ntt_form())
-    {
-        throw invalid_argument("encrypted_ntt is not in NTT form");
-    }
+    auto context_data_ptr = context_.level(encrypted_ntt.parms_id()).context_data;
 
     // Extract encryption parameters.
     auto &context_data = *context_data_ptr;
@@ -1095,28 +1508,39 @@ void my_transform_from_ntt_inplace(SEALContext &context_, Ciphertext &encrypted_
     encrypted_ntt.is_ntt_form() = false;
 }
 
-void my_multiply_plain_ntt(SEALContext &context_, Ciphertext &encrypted_ntt, const Plaintext &plain_ntt, int num_threads)
+void my_multiply_plain_ntt(KernelContext &context_, Ciphertext &encrypted_ntt, const Plaintext &plain_ntt, int num_threads)
+{
+    // The product is coefficient-wise, so the destination may alias the input
+    my_multiply_plain_ntt(context_, encrypted_ntt, plain_ntt, encrypted_ntt, num_threads);
+}
+
+void my_multiply_plain_ntt(KernelContext &context_, const Ciphertext &encrypted_ntt, const Plaintext &plain_ntt, Ciphertext &destination, int num_threads)
 {
     // Verify parameters.
-    if (!plain_ntt.is_ntt_form())
+    if (context_.validate())
     {
-        throw invalid_argument("plain_ntt is not in NTT form");
-    }
-    if (encrypted_ntt.parms_id() != plain_ntt.parms_id())
-    {
-        throw invalid_argument("encrypted_ntt and plain_ntt parameter mismatch");
+        if (!encrypted_ntt.is_ntt_form())
+        {
+            throw invalid_argument("encrypted_ntt is not in NTT form");
+        }
+        if (!plain_ntt.is_ntt_form())
+        {
+            throw invalid_argument("plain_ntt is not in NTT form");
+        }
+        if (encrypted_ntt.parms_id() != plain_ntt.parms_id())
+        {
+            throw invalid_argument("encrypted_ntt and plain_ntt parameter mismatch");
+        }
     }
 
     // Extract encryption parameters.
-    auto &context_data = *context_.get_context_data(encrypted_ntt.parms_id());
+    auto &context_data = *context_.level(encrypted_ntt.parms_id()).context_data;
     auto &parms = context_data.parms();
     auto &coeff_modulus = parms.coeff_modulus();
     size_t coeff_count = parms.poly_modulus_degree();
     size_t coeff_modulus_size = coeff_modulus.size();
     size_t encrypted_ntt_size = encrypted_ntt.size();
 
-    auto encrypted_ntt_iter = iter(encrypted_ntt);
-
     // Size check
     if (!product_fits_in(encrypted_ntt_size, coeff_count, coeff_modulus_size))
     {
@@ -1125,152 +1549,538 @@ void my_multiply_plain_ntt(SEALContext &context_, Ciphertext &encrypted_ntt, con
 
     double new_scale = encrypted_ntt.scale() * plain_ntt.scale();
 
-    ConstRNSIter plain_ntt_iter(plain_ntt.data(), coeff_count);
+    // Reuses the buffer of destination when it is large enough
+    if (&destination != &encrypted_ntt)
+    {
+        destination.resize(context_.seal_context(), encrypted_ntt.parms_id(), encrypted_ntt_size);
+        destination.is_ntt_form() = true;
+    }
 
+    dispatch_kernel_shape(coeff_count, coeff_modulus_size, [&](auto fixed_coeff_count, auto fixed_modulus_size) {
 #pragma omp parallel for collapse(2) num_threads(num_threads)
-    for (int i = 0; i < encrypted_ntt_size; i++)
+        for (int i = 0; i < encrypted_ntt_size; i++)
+        {
+            for (int j = 0; j < fixed_modulus_size; j++)
+            {
+                size_t offset = j * fixed_coeff_count;
+                simd_dyadic_product_coeffmod(
+                    encrypted_ntt.data(i) + offset, plain_ntt.data() + offset, fixed_coeff_count, coeff_modulus[j],
+                    destination.data(i) + offset);
+            }
+        }
+    });
+
+    // Set the scale
+    destination.scale() = new_scale;
+}
+
+void my_multiply_plain_accumulate_ntt(KernelContext &context_, const Ciphertext &encrypted_ntt, const Plaintext &plain_ntt, Ciphertext &destination, int num_threads)
+{
+    // Verify parameters.
+    if (context_.validate())
     {
-        for (int j = 0; j < coeff_modulus_size; j++)
+        if (!encrypted_ntt.is_ntt_form() || !destination.is_ntt_form())
+        {
+            throw invalid_argument("encrypted_ntt or destination is not in NTT form");
+        }
+        if (!plain_ntt.is_ntt_form())
         {
-            dyadic_product_coeffmod(encrypted_ntt_iter[i][j], plain_ntt_iter[j], coeff_count, coeff_modulus[j], encrypted_ntt_iter[i][j]);
+            throw invalid_argument("plain_ntt is not in NTT form");
+        }
+        if (encrypted_ntt.parms_id() != plain_ntt.parms_id() || encrypted_ntt.parms_id() != destination.parms_id())
+        {
+            throw invalid_argument("encrypted_ntt, plain_ntt and destination parameter mismatch");
+        }
+        if (encrypted_ntt.size() != destination.size())
+        {
+            throw invalid_argument("encrypted_ntt and destination size mismatch");
         }
     }
 
-    // Set the scale
-    encrypted_ntt.scale() = new_scale;
+    // Extract encryption parameters.
+    auto &context_data = *context_.level(encrypted_ntt.parms_id()).context_data;
+    auto &parms = context_data.parms();
+    auto &coeff_modulus = parms.coeff_modulus();
+    size_t coeff_count = parms.poly_modulus_degree();
+    size_t coeff_modulus_size = coeff_modulus.size();
+    size_t encrypted_ntt_size = encrypted_ntt.size();
+
+    dispatch_kernel_shape(coeff_count, coeff_modulus_size, [&](auto fixed_coeff_count, auto fixed_modulus_size) {
+#pragma omp parallel for collapse(2) num_threads(num_threads)
+        for (int i = 0; i < encrypted_ntt_size; i++)
+        {
+            for (int j = 0; j < fixed_modulus_size; j++)
+            {
+                size_t offset = j * fixed_coeff_count;
+                simd_dyadic_product_accumulate_coeffmod(
+                    encrypted_ntt.data(i) + offset, plain_ntt.data() + offset, fixed_coeff_count, coeff_modulus[j],
+                    destination.data(i) + offset);
+            }
+        }
+    });
 }
 
-void my_rotate_internal(SEALContext context_, Ciphertext &encrypted, int steps, const GaloisKeys &galois_keys, MemoryPoolHandle pool, int num_threads)
+// destination[c] = sum_j encrypted_ntt[j] * plain_ntt[c * encrypted_ntt.size() + j], for c < column_count.
+// Products are accumulated without intermediate reduction, and each tile of the inputs is reused for all columns.
+void my_dot_product_plain_ntt(
+    KernelContext &context_, const vector<Ciphertext> &encrypted_ntt, const Plaintext *plain_ntt, size_t column_count,
+    vector<Ciphertext> &destination, int num_threads)
 {
-    auto context_data_ptr = context_.get_context_data(encrypted.parms_id());
-    if (!context_data_ptr)
+    // Verify parameters.
+    if (encrypted_ntt.empty())
     {
-        throw invalid_argument("encrypted is not valid for encryption parameters");
+        throw invalid_argument("encrypted_ntt is empty");
     }
-    if (!context_data_ptr->qualifiers().using_batching)
+    size_t term_count = encrypted_ntt.size();
+    auto parms_id = encrypted_ntt[0].parms_id();
+    size_t encrypted_size = encrypted_ntt[0].size();
+    if (context_.validate())
     {
-        throw logic_error("encryption parameters do not support batching");
+        for (size_t j = 0; j < term_count; j++)
+        {
+            if (!encrypted_ntt[j].is_ntt_form())
+            {
+                throw invalid_argument("encrypted_ntt is not in NTT form");
+            }
+            if (encrypted_ntt[j].parms_id() != parms_id || encrypted_ntt[j].size() != encrypted_size)
+            {
+                throw invalid_argument("encrypted_ntt parameter mismatch");
+            }
+        }
+        for (size_t i = 0; i < column_count * term_count; i++)
+        {
+            if (!plain_ntt[i].is_ntt_form())
+            {
+                throw invalid_argument("plain_ntt is not in NTT form");
+            }
+            if (plain_ntt[i].parms_id() != parms_id)
+            {
+                throw invalid_argument("encrypted_ntt and plain_ntt parameter mismatch");
+            }
+        }
     }
-    if (galois_keys.parms_id() != context_.key_parms_id())
+
+    // Extract encryption parameters.
+    auto &context_data = *context_.level(parms_id).context_data;
+    auto &parms = context_data.parms();
+    auto &coeff_modulus = parms.coeff_modulus();
+    size_t coeff_count = parms.poly_modulus_degree();
+    size_t coeff_modulus_size = coeff_modulus.size();
+
+    destination.resize(column_count);
+    for (size_t c = 0; c < column_count; c++)
     {
-        throw invalid_argument("galois_keys is not valid for encryption parameters");
+        destination[c].resize(context_.seal_context(), parms_id, encrypted_size);
+        destination[c].is_ntt_form() = true;
+        destination[c].scale() = encrypted_ntt[0].scale() * plain_ntt[c * term_count].scale();
     }
 
-    // Is there anything to do?
-    if (steps == 0)
+    size_t tile_count = (coeff_count + DOT_PRODUCT_TILE_SIZE - 1) / DOT_PRODUCT_TILE_SIZE;
+
+#pragma omp parallel num_threads(num_threads)
     {
-        return;
+        // Operand pointers of a tile, allocated once per thread rather than once per tile
+        vector<const uint64_t *> encrypted_tile(term_count);
+        vector<const uint64_t *> plain_tile(term_count);
+
+#pragma omp for collapse(2)
+        for (int j = 0; j < coeff_modulus_size; j++)
+        {
+            for (int t = 0; t < tile_count; t++)
+            {
+                size_t offset = j * coeff_count + t * DOT_PRODUCT_TILE_SIZE;
+                size_t tile_size = min<size_t>(DOT_PRODUCT_TILE_SIZE, coeff_count - t * DOT_PRODUCT_TILE_SIZE);
+                for (size_t i = 0; i < encrypted_size; i++)
+                {
+                    for (size_t k = 0; k < term_count; k++)
+                    {
+                        encrypted_tile[k] = encrypted_ntt[k].data(i) + offset;
+                    }
+                    for (size_t c = 0; c < column_count; c++)
+                    {
+                        for (size_t k = 0; k < term_count; k++)
+                        {
+                            plain_tile[k] = plain_ntt[c * term_count + k].data() + offset;
+                        }
+                        simd_inner_product_mod(
+                            encrypted_tile.data(), plain_tile.data(), term_count, tile_size, coeff_modulus[j].value(),
+                            coeff_modulus[j].const_ratio().data(), destination[c].data(i) + offset);
+                    }
+                }
+            }
+        }
     }
+}
 
-    size_t coeff_count = context_data_ptr->parms().poly_modulus_degree();
-    auto galois_tool = context_data_ptr->galois_tool();
+void my_rotate_internal(KernelContext &context_, Ciphertext &encrypted, int steps, const GaloisKeys &galois_keys, MemoryPoolHandle pool, int num_threads)
+{
+    my_rotate_internal(context_, encrypted, steps, galois_keys, encrypted, move(pool), num_threads);
+}
 
-    // Check if Galois key is generated or not.
-    if (galois_keys.has_key(galois_tool->get_elt_from_step(steps)))
+void my_rotate_internal(KernelContext &context_, const Ciphertext &encrypted, int steps, const GaloisKeys &galois_keys, Ciphertext &destination, MemoryPoolHandle pool, int num_threads)
+{
+    if (context_.validate())
     {
-        // Perform rotation and key switching
-        my_apply_galois_inplace(context_, encrypted, galois_tool->get_elt_from_step(steps), galois_keys, move(pool), num_threads);
+        if (!context_.level(encrypted.parms_id()).context_data->qualifiers().using_batching)
+        {
+            throw logic_error("encryption parameters do not support batching");
+        }
+        if (galois_keys.parms_id() != context_.key_parms_id())
+        {
+            throw invalid_argument("galois_keys is not valid for encryption parameters");
+        }
     }
-    else
+
+    // Is there anything to do?
+    if (steps == 0)
     {
-        throw invalid_argument("Galois key not present");
+        if (&destination != &encrypted)
+        {
+            destination = encrypted;
+        }
+        return;
     }
+
+    // Perform rotation and key switching
+    my_apply_galois(context_, encrypted, context_.galois_elt_from_step(steps), galois_keys, destination, move(pool), num_threads);
 }
 
-void my_conjugate_internal(SEALContext context_, Ciphertext &encrypted, const GaloisKeys &galois_keys, MemoryPoolHandle pool, int num_threads)
+void my_conjugate_internal(KernelContext &context_, Ciphertext &encrypted, const GaloisKeys &galois_keys, MemoryPoolHandle pool, int num_threads)
 {
-    // Verify parameters.
-    auto context_data_ptr = context_.get_context_data(encrypted.parms_id());
-    if (!context_data_ptr)
-    {
-        throw std::invalid_argument("encrypted is not valid for encryption parameters");
-    }
+    my_conjugate_internal(context_, encrypted, galois_keys, encrypted, move(pool), num_threads);
+}
 
-    // Extract encryption parameters.
-    auto &context_data = *context_data_ptr;
-    if (!context_data.qualifiers().using_batching)
+void my_conjugate_internal(KernelContext &context_, const Ciphertext &encrypted, const GaloisKeys &galois_keys, Ciphertext &destination, MemoryPoolHandle pool, int num_threads)
+{
+    // Verify parameters.
+    if (context_.validate() && !context_.level(encrypted.parms_id()).context_data->qualifiers().using_batching)
     {
         throw std::logic_error("encryption parameters do not support batching");
     }
 
-    auto galois_tool = context_data.galois_tool();
-
     // Perform rotation and key switching
-    my_apply_galois_inplace(context_, encrypted, galois_tool->get_elt_from_step(0), galois_keys, std::move(pool), num_threads);
+    my_apply_galois(context_, encrypted, context_.galois_elt_from_step(0), galois_keys, destination, std::move(pool), num_threads);
+}
+
+void my_apply_galois_inplace(KernelContext &context_, Ciphertext &encrypted, uint32_t galois_elt, const GaloisKeys &galois_keys, MemoryPoolHandle pool, int num_threads)
+{
+    my_apply_galois(context_, encrypted, galois_elt, galois_keys, encrypted, move(pool), num_threads);
 }
 
-void my_apply_galois_inplace(SEALContext context_, Ciphertext &encrypted, uint32_t galois_elt, const GaloisKeys &galois_keys, MemoryPoolHandle pool, int num_threads)
+void my_apply_galois(KernelContext &context_, const Ciphertext &encrypted, uint32_t galois_elt, const GaloisKeys &galois_keys, Ciphertext &destination, MemoryPoolHandle pool, int num_threads)
 {
+    auto &level = context_.level(encrypted.parms_id());
+    size_t coeff_count = level.coeff_count;
+    size_t coeff_modulus_size = level.coeff_modulus_size;
+    size_t encrypted_size = encrypted.size();
+
     // Verify parameters.
-    if (!is_metadata_valid_for(encrypted, context_) || !is_buffer_valid(encrypted))
+    if (context_.validate())
     {
-        throw invalid_argument("encrypted is not valid for encryption parameters");
+        if (!is_metadata_valid_for(encrypted, context_.seal_context()) || !is_buffer_valid(encrypted))
+        {
+            throw invalid_argument("encrypted is not valid for encryption parameters");
+        }
+
+        // Don't validate all of galois_keys but just check the parms_id.
+        if (galois_keys.parms_id() != context_.key_parms_id())
+        {
+            throw invalid_argument("galois_keys is not valid for encryption parameters");
+        }
+
+        // Check if Galois key is generated or not.
+        if (!galois_keys.has_key(galois_elt))
+        {
+            throw invalid_argument("Galois key not present");
+        }
+
+        uint64_t m = mul_safe(static_cast<uint64_t>(coeff_count), uint64_t(2));
+        if (!(galois_elt & 1) || unsigned_geq(galois_elt, m))
+        {
+            throw invalid_argument("Galois element is not valid");
+        }
+        if (encrypted_size > 2)
+        {
+            throw invalid_argument("encrypted size must be 2");
+        }
+        if (level.parms->scheme() != scheme_type::bfv)
+        {
+            throw logic_error("scheme not implemented");
+        }
     }
 
-    // Don't validate all of galois_keys but just check the parms_id.
-    if (galois_keys.parms_id() != context_.key_parms_id())
+    // Precomputed once per Galois element, instead of an index multiplication per coefficient. In NTT form the
+    // automorphism is a plain permutation of the slots, and key switching keeps the result in NTT form.
+    bool is_ntt_form = encrypted.is_ntt_form();
+    const uint32_t *permutation = is_ntt_form ? context_.galois_permutation_ntt(galois_elt) : context_.galois_permutation(galois_elt);
+    auto apply_permutation = [&](ConstCoeffIter operand, size_t i, CoeffIter result)
     {
-        throw invalid_argument("galois_keys is not valid for encryption parameters");
-    }
+        if (is_ntt_form)
+        {
+            my_apply_galois_ntt_permutation(operand, permutation, coeff_count, result);
+        }
+        else
+        {
+            my_apply_galois_permutation(operand, permutation, coeff_count, level.coeff_modulus[i], result);
+        }
+    };
 
-    auto &context_data = *context_.get_context_data(encrypted.parms_id());
-    auto &parms = context_data.parms();
-    auto &coeff_modulus = parms.coeff_modulus();
-    size_t coeff_count = parms.poly_modulus_degree();
-    size_t coeff_modulus_size = coeff_modulus.size();
-    size_t encrypted_size = encrypted.size();
-    // Use key_context_data where permutation tables exist since previous runs.
-    auto galois_tool = context_.key_context_data()->galois_tool();
+    SEAL_ALLOCATE_GET_RNS_ITER(temp, coeff_count, coeff_modulus_size, pool);
 
-    // Size check
-    if (!product_fits_in(coeff_count, coeff_modulus_size))
+    // Reuses the buffer of destination when it is large enough
+    bool is_inplace = (&destination == &encrypted);
+    if (!is_inplace)
     {
-        throw logic_error("invalid parameters");
+        destination.resize(context_.seal_context(), encrypted.parms_id(), encrypted_size);
+        destination.is_ntt_form() = is_ntt_form;
+        destination.scale() = encrypted.scale();
     }
 
-    // Check if Galois key is generated or not.
-    if (!galois_keys.has_key(galois_elt))
+    // DO NOT CHANGE EXECUTION ORDER OF FOLLOWING SECTION
+    // BEGIN: Apply Galois for each ciphertext
+    // Execution order is sensitive, since apply_galois is not inplace!
+    // Out of place, the first component is permuted straight into destination; in place it goes through temp.
+
+    auto encrypted_iter = iter(encrypted);
+    auto destination_iter = iter(destination);
+
+#pragma omp parallel for num_threads(num_threads)
+    for (int i = 0; i < coeff_modulus_size; i++)
     {
-        throw invalid_argument("Galois key not present");
+        if (is_inplace)
+        {
+            apply_permutation(encrypted_iter[0][i], i, temp[i]);
+            set_poly(temp[i], coeff_count, 1, destination_iter[0][i]);
+        }
+        else
+        {
+            apply_permutation(encrypted_iter[0][i], i, destination_iter[0][i]);
+        }
+        apply_permutation(encrypted_iter[1][i], i, temp[i]);
+        set_zero_poly(coeff_count, 1, destination_iter[1][i]);
     }
 
-    uint64_t m = mul_safe(static_cast<uint64_t>(coeff_count), uint64_t(2));
+    // Calculate (temp * galois_key[0], temp * galois_key[1]) + (ct[0], 0)
+    my_switch_key_inplace(context_, destination, temp, static_cast<const KSwitchKeys &>(galois_keys), GaloisKeys::get_index(galois_elt), pool, num_threads);
+}
+
+void my_rotate_hoisted(KernelContext &context_, const Ciphertext &encrypted, const vector<int> &steps, const GaloisKeys &galois_keys, vector<Ciphertext> &destinations, MemoryPoolHandle pool, int num_threads)
+{
+    auto parms_id = encrypted.parms_id();
+    auto &level = context_.level(parms_id);
+    size_t coeff_count = level.coeff_count;
+    size_t coeff_modulus_size = level.coeff_modulus_size;
+    size_t rns_modulus_size = coeff_modulus_size + 1;
+
+    // Verify parameters.
+    if (context_.validate())
+    {
+        if (!is_metadata_valid_for(encrypted, context_.seal_context()) || !is_buffer_valid(encrypted))
+        {
+            throw invalid_argument("encrypted is not valid for encryption parameters");
+        }
+        if (!level.context_data->qualifiers().using_batching)
+        {
+            throw logic_error("encryption parameters do not support batching");
+        }
+        if (galois_keys.parms_id() != context_.key_parms_id())
+        {
+            throw invalid_argument("galois_keys is not valid for encryption parameters");
+        }
+        if (encrypted.size() != 2)
+        {
+            throw invalid_argument("encrypted size must be 2");
+        }
+        if (destinations.size() != steps.size())
+        {
+            throw invalid_argument("destinations must have one ciphertext per step");
+        }
+        for (int step : steps)
+        {
+            if (step && !galois_keys.has_key(context_.galois_elt_from_step(step)))
+            {
+                throw invalid_argument("Galois key not present");
+            }
+        }
+    }
 
-    // Verify parameters
-    if (!(galois_elt & 1) || unsigned_geq(galois_elt, m))
+    // The second component is raised once; every destination must be distinct from encrypted, whose first
+    // component is read again for every step
+    size_t key_digit_count = 0;
+    for (size_t k = 0; k < steps.size(); k++)
     {
-        throw invalid_argument("Galois element is not valid");
+        if (&destinations[k] == &encrypted)
+        {
+            throw invalid_argument("destinations must not alias encrypted");
+        }
+        if (steps[k] && !key_digit_count)
+        {
+            key_digit_count = galois_keys.key(context_.galois_elt_from_step(steps[k])).size();
+        }
     }
-    if (encrypted_size > 2)
+    if (!key_digit_count)
     {
-        throw invalid_argument("encrypted size must be 2");
+        for (auto &destination : destinations)
+        {
+            destination = encrypted;
+        }
+        return;
     }
 
-    if (parms.scheme() != scheme_type::bfv)
+    bool is_ntt_form = encrypted.is_ntt_form();
+    size_t raised_count = key_digit_count == context_.key_switch_prime_count()
+                              ? coeff_modulus_size
+                              : context_.key_switch_digits(parms_id, key_digit_count).size();
+    SEAL_ALLOCATE_GET_POLY_ITER(t_raised, raised_count, coeff_count, rns_modulus_size, pool);
+    auto encrypted_iter = iter(encrypted);
+    dispatch_kernel_shape(coeff_count, coeff_modulus_size, [&](auto fixed_coeff_count, auto fixed_decomp_size) {
+        my_raise_digits_ntt(
+            fixed_coeff_count, fixed_decomp_size, context_, parms_id, encrypted_iter[1], is_ntt_form, key_digit_count,
+            t_raised, pool, num_threads);
+    });
+
+    for (size_t k = 0; k < steps.size(); k++)
     {
+        auto &destination = destinations[k];
+        if (!steps[k])
+        {
+            destination = encrypted;
+            continue;
+        }
+        uint32_t galois_elt = context_.galois_elt_from_step(steps[k]);
 
-        throw logic_error("scheme not implemented");
+        destination.resize(context_.seal_context(), parms_id, 2);
+        destination.is_ntt_form() = is_ntt_form;
+        destination.scale() = encrypted.scale();
+
+        // The first component is permuted straight into destination
+        auto destination_iter = iter(destination);
+        const uint32_t *permutation = is_ntt_form ? context_.galois_permutation_ntt(galois_elt) : context_.galois_permutation(galois_elt);
+#pragma omp parallel for num_threads(num_threads)
+        for (int i = 0; i < coeff_modulus_size; i++)
+        {
+            if (is_ntt_form)
+            {
+                my_apply_galois_ntt_permutation(encrypted_iter[0][i], permutation, coeff_count, destination_iter[0][i]);
+            }
+            else
+            {
+                my_apply_galois_permutation(encrypted_iter[0][i], permutation, coeff_count, level.coeff_modulus[i], destination_iter[0][i]);
+            }
+            set_zero_poly(coeff_count, 1, destination_iter[1][i]);
+        }
+
+        // The raised digits are in NTT form whatever the form of encrypted, so they take the NTT permutation
+        const uint32_t *permutation_ntt = context_.galois_permutation_ntt(galois_elt);
+        auto &key_vector = galois_keys.data()[GaloisKeys::get_index(galois_elt)];
+        auto t_poly_prod(allocate_zero_poly_array(2, coeff_count, rns_modulus_size, pool));
+        dispatch_kernel_shape(coeff_count, coeff_modulus_size, [&](auto fixed_coeff_count, auto fixed_decomp_size) {
+            my_accumulate_raised_products(
+                fixed_coeff_count, fixed_decomp_size, context_, t_raised, raised_count, permutation_ntt, key_vector,
+                t_poly_prod.get(), pool, num_threads);
+        });
+        my_add_mod_down_products(context_, destination, t_poly_prod.get(), 2, pool, num_threads);
     }
+}
 
-    SEAL_ALLOCATE_GET_RNS_ITER(temp, coeff_count, coeff_modulus_size, pool);
+vector<uint64_t> my_pack_ciphertext(KernelContext &context_, const Ciphertext &encrypted, size_t c0_drop_bits, size_t c1_drop_bits)
+{
+    // The format is fixed by the header and the level, so it is checked even without validation
+    auto &level = context_.level(encrypted.parms_id());
+    if (level.coeff_modulus_size != 1 || encrypted.size() != 2 || encrypted.is_ntt_form())
+    {
+        throw invalid_argument("encrypted must be a two-component ciphertext at one prime not in NTT form");
+    }
+    auto &modulus = level.coeff_modulus[0];
+    size_t modulus_bits = static_cast<size_t>(modulus.bit_count());
+    size_t drop_bits[2] = { c0_drop_bits, c1_drop_bits };
+    if (c0_drop_bits >= modulus_bits || c1_drop_bits >= modulus_bits)
+    {
+        throw invalid_argument("cannot drop every bit of a coefficient");
+    }
 
-    // DO NOT CHANGE EXECUTION ORDER OF FOLLOWING SECTION
-    // BEGIN: Apply Galois for each ciphertext
-    // Execution order is sensitive, since apply_galois is not inplace!
+    size_t coeff_count = level.coeff_count;
+    size_t packed_bits = coeff_count * (2 * modulus_bits - c0_drop_bits - c1_drop_bits);
+    vector<uint64_t> packed(1 + (packed_bits + 63) / 64, 0);
+    packed[0] = static_cast<uint64_t>(c0_drop_bits) | (static_cast<uint64_t>(c1_drop_bits) << 32);
 
-    auto encrypted_iter = iter(encrypted);
+    size_t bit = 64;
+    for (size_t j = 0; j < 2; j++)
+    {
+        size_t keep_bits = modulus_bits - drop_bits[j];
+        uint64_t half = drop_bits[j] ? uint64_t(1) << (drop_bits[j] - 1) : 0;
+        const uint64_t *poly = encrypted.data(j);
+        for (size_t k = 0; k < coeff_count; k++)
+        {
+            // Nearest multiple of 2^drop_bits; rounding past the top of the word lands within 2^(drop_bits - 1)
+            // of q, which is 0
+            uint64_t value = (poly[k] + half) >> drop_bits[j];
+            if (value >> keep_bits)
+            {
+                value = 0;
+            }
+            size_t offset = bit % 64;
+            packed[bit / 64] |= value << offset;
+            if (offset + keep_bits > 64)
+            {
+                packed[bit / 64 + 1] = value >> (64 - offset);
+            }
+            bit += keep_bits;
+        }
+    }
+    return packed;
+}
 
-#pragma omp parallel for num_threads(num_threads)
-    for (int i = 0; i < coeff_modulus_size; i++)
+void my_unpack_ciphertext(KernelContext &context_, const vector<uint64_t> &packed, parms_id_type parms_id, Ciphertext &destination)
+{
+    auto &level = context_.level(parms_id);
+    if (level.coeff_modulus_size != 1)
+    {
+        throw invalid_argument("parms_id must be a level with one prime");
+    }
+    if (packed.empty())
     {
-        galois_tool->apply_galois(encrypted_iter[0][i], galois_elt, coeff_modulus[i], temp[i]);
-        set_poly(temp[i], coeff_count, 1, encrypted_iter[0][i]);
-        galois_tool->apply_galois(encrypted_iter[1][i], galois_elt, coeff_modulus[i], temp[i]);
-        set_zero_poly(coeff_count, 1, encrypted_iter[1][i]);
+        throw invalid_argument("packed ciphertext is empty");
+    }
+    auto &modulus = level.coeff_modulus[0];
+    size_t modulus_bits = static_cast<size_t>(modulus.bit_count());
+    size_t drop_bits[2] = { static_cast<size_t>(packed[0] & 0xFFFFFFFFU), static_cast<size_t>(packed[0] >> 32) };
+    if (drop_bits[0] >= modulus_bits || drop_bits[1] >= modulus_bits)
+    {
+        throw invalid_argument("packed ciphertext is invalid");
     }
 
-    // Calculate (temp * galois_key[0], temp * galois_key[1]) + (ct[0], 0)
-    my_switch_key_inplace(context_, encrypted, temp, static_cast<const KSwitchKeys &>(galois_keys), GaloisKeys::get_index(galois_elt), pool, num_threads);
+    size_t coeff_count = level.coeff_count;
+    size_t packed_bits = coeff_count * (2 * modulus_bits - drop_bits[0] - drop_bits[1]);
+    if (packed.size() != 1 + (packed_bits + 63) / 64)
+    {
+        throw invalid_argument("packed ciphertext is invalid");
+    }
+
+    destination.resize(context_.seal_context(), parms_id, 2);
+    destination.is_ntt_form() = false;
+
+    size_t bit = 64;
+    for (size_t j = 0; j < 2; j++)
+    {
+        size_t keep_bits = modulus_bits - drop_bits[j];
+        uint64_t mask = (uint64_t(1) << keep_bits) - 1;
+        uint64_t *poly = destination.data(j);
+        for (size_t k = 0; k < coeff_count; k++)
+        {
+            size_t offset = bit % 64;
+            uint64_t value = packed[bit / 64] >> offset;
+            if (offset + keep_bits > 64)
+            {
+                value |= packed[bit / 64 + 1] << (64 - offset);
+            }
+
+            // Below 2^modulus_bits, so one subtraction reduces it
+            value = (value & mask) << drop_bits[j];
+            poly[k] = value >= modulus.value() ? value - modulus.value() : value;
+            bit += keep_bits;
+        }
+    }
 }
 
 void saveToBinaryFile(const std::string &filename, const std::string &data)
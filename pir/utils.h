@@ -29,6 +29,9 @@
 #include <chrono>
 
 #include "omp.h"
+#include "simd.h"
+#include "KernelContext.h"
+#include "KernelShape.h"
 
 using namespace seal;
 using namespace seal::util;
@@ -36,28 +39,51 @@ using namespace seal::util;
 using namespace std;
 
 // int NUM_OMP_THREAD = 4;
-void my_add_inplace(SEALContext &context_, Ciphertext &encrypted1, Ciphertext &encrypted2);
-void my_bfv_square(SEALContext &context_, Ciphertext &encrypted, MemoryPoolHandle pool, int num_threads);
+
+// Coefficients per tile in my_fast_convert_array
+#define FAST_CONVERT_TILE_SIZE 256
+// Coefficients per tile in my_dot_product_plain_ntt; one tile of every input ciphertext should stay in L2
+#define DOT_PRODUCT_TILE_SIZE 512
+
+void my_add_inplace(KernelContext &context_, Ciphertext &encrypted1, Ciphertext &encrypted2);
+void my_bfv_square(KernelContext &context_, Ciphertext &encrypted, MemoryPoolHandle pool, int num_threads);
 void my_fastbconv_m_tilde(const RNSTool *rns_tool, ConstRNSIter input, RNSIter destination, MemoryPoolHandle pool, int num_threads);
 void my_fast_convert_array(const Pointer<BaseConverter> &conv, ConstRNSIter in, RNSIter out, MemoryPoolHandle pool, int num_threads);
 void my_sm_mrq(const RNSTool *rns_tool, ConstRNSIter input, RNSIter destination, MemoryPoolHandle pool, int num_threads);
 void my_fast_floor(const RNSTool *rns_tool, ConstRNSIter input, RNSIter destination, MemoryPoolHandle pool, int num_threads);
 void my_fastbconv_sk(const RNSTool *rns_tool, ConstRNSIter input, RNSIter destination, MemoryPoolHandle pool, int num_threads);
 
-void my_relinearize_internal(SEALContext &context_, Ciphertext &encrypted, const RelinKeys &relin_keys, size_t destination_size, MemoryPoolHandle pool, int num_threads);
+void my_relinearize_internal(KernelContext &context_, Ciphertext &encrypted, const RelinKeys &relin_keys, size_t destination_size, MemoryPoolHandle pool, int num_threads);
 // void my_switch_key_inplace( SEALContext &context_,
 //         Ciphertext &encrypted, ConstRNSIter target_iter, const KSwitchKeys &kswitch_keys, size_t kswitch_keys_index,
 //         MemoryPoolHandle pool);
-void my_bfv_multiply(SEALContext &context_, Ciphertext &encrypted1, Ciphertext &encrypted2, MemoryPoolHandle pool, int num_threads);
-void my_mod_switch_scale_to_next(SEALContext &context_, Ciphertext &encrypted, Ciphertext &destination, MemoryPoolHandle pool, int num_threads);
-void my_transform_to_ntt_inplace(SEALContext &context_, Ciphertext &encrypted, int num_threads);
-void my_transform_from_ntt_inplace(SEALContext &context_, Ciphertext &encrypted_ntt, int num_threads);
-void my_multiply_plain_ntt(SEALContext &context_, Ciphertext &encrypted_ntt, const Plaintext &plain_ntt, int num_threads);
-void my_rotate_internal(SEALContext context_, Ciphertext &encrypted, int steps, const GaloisKeys &galois_keys, MemoryPoolHandle pool, int num_threads);
-void my_conjugate_internal(SEALContext context_, Ciphertext &encrypted, const GaloisKeys &galois_keys, MemoryPoolHandle pool, int num_threads);
-void my_apply_galois_inplace(SEALContext context_, Ciphertext &encrypted, uint32_t galois_elt, const GaloisKeys &galois_keys, MemoryPoolHandle pool, int num_threads);
+void my_bfv_multiply(KernelContext &context_, Ciphertext &encrypted1, Ciphertext &encrypted2, MemoryPoolHandle pool, int num_threads);
+void my_mod_switch_scale_to_next(KernelContext &context_, Ciphertext &encrypted, Ciphertext &destination, MemoryPoolHandle pool, int num_threads);
+// Drops every prime between the level of encrypted and parms_id with a single rounding step
+void my_mod_switch_scale_to(KernelContext &context_, Ciphertext &encrypted, Ciphertext &destination, parms_id_type parms_id, MemoryPoolHandle pool, int num_threads);
+parms_id_type get_lower_parms_id(KernelContext &context_, parms_id_type parms_id, int drop_count);
+void my_transform_to_ntt_inplace(KernelContext &context_, Ciphertext &encrypted, int num_threads);
+void my_transform_from_ntt_inplace(KernelContext &context_, Ciphertext &encrypted_ntt, int num_threads);
+void my_multiply_plain_ntt(KernelContext &context_, Ciphertext &encrypted_ntt, const Plaintext &plain_ntt, int num_threads);
+void my_multiply_plain_ntt(KernelContext &context_, const Ciphertext &encrypted_ntt, const Plaintext &plain_ntt, Ciphertext &destination, int num_threads);
+// destination += encrypted_ntt * plain_ntt, all in NTT form at the same level
+void my_multiply_plain_accumulate_ntt(KernelContext &context_, const Ciphertext &encrypted_ntt, const Plaintext &plain_ntt, Ciphertext &destination, int num_threads);
+void my_dot_product_plain_ntt(
+    KernelContext &context_, const vector<Ciphertext> &encrypted_ntt, const Plaintext *plain_ntt, size_t column_count,
+    vector<Ciphertext> &destination, int num_threads);
+void my_rotate_internal(KernelContext &context_, Ciphertext &encrypted, int steps, const GaloisKeys &galois_keys, MemoryPoolHandle pool, int num_threads);
+void my_conjugate_internal(KernelContext &context_, Ciphertext &encrypted, const GaloisKeys &galois_keys, MemoryPoolHandle pool, int num_threads);
+void my_apply_galois_inplace(KernelContext &context_, Ciphertext &encrypted, uint32_t galois_elt, const GaloisKeys &galois_keys, MemoryPoolHandle pool, int num_threads);
+
+// Out-of-place variants: the result is written into the existing buffer of destination, which may alias the input
+void my_rotate_internal(KernelContext &context_, const Ciphertext &encrypted, int steps, const GaloisKeys &galois_keys, Ciphertext &destination, MemoryPoolHandle pool, int num_threads);
+void my_conjugate_internal(KernelContext &context_, const Ciphertext &encrypted, const GaloisKeys &galois_keys, Ciphertext &destination, MemoryPoolHandle pool, int num_threads);
+void my_apply_galois(KernelContext &context_, const Ciphertext &encrypted, uint32_t galois_elt, const GaloisKeys &galois_keys, Ciphertext &destination, MemoryPoolHandle pool, int num_threads);
+// Rotations of encrypted by every step, which share the decomposition of its second component into raised digits.
+// Destinations must not alias encrypted.
+void my_rotate_hoisted(KernelContext &context_, const Ciphertext &encrypted, const vector<int> &steps, const GaloisKeys &galois_keys, vector<Ciphertext> &destinations, MemoryPoolHandle pool, int num_threads);
 void my_switch_key_inplace(
-    SEALContext &context_, Ciphertext &encrypted, ConstRNSIter target_iter, const KSwitchKeys &kswitch_keys, size_t kswitch_keys_index,
+    KernelContext &context_, Ciphertext &encrypted, ConstRNSIter target_iter, const KSwitchKeys &kswitch_keys, size_t kswitch_keys_index,
     MemoryPoolHandle pool, int num_threads);
 
 inline void my_inverse_ntt_negacyclic_harvey(PolyIter operand, std::size_t size, ConstNTTTablesIter tables)
@@ -72,6 +98,57 @@ inline void my_inverse_ntt_negacyclic_harvey(PolyIter operand, std::size_t size,
     }
 }
 
+// Single-limb versions of the SEAL coefficient ops, dispatched to the kernels in simd.h
+inline void simd_add_poly_coeffmod(
+    ConstCoeffIter operand1, ConstCoeffIter operand2, std::size_t coeff_count, const Modulus &modulus, CoeffIter result)
+{
+    simd_add_mod(operand1, operand2, coeff_count, modulus.value(), result);
+}
+
+// Operands may be lazily reduced NTT outputs in [0, 4 * modulus)
+inline void simd_dyadic_product_coeffmod(
+    ConstCoeffIter operand1, ConstCoeffIter operand2, std::size_t coeff_count, const Modulus &modulus, CoeffIter result)
+{
+    simd_multiply_mod(operand1, operand2, coeff_count, modulus.value(), modulus.const_ratio().data(), result);
+}
+
+// result += operand1 * operand2
+inline void simd_dyadic_product_accumulate_coeffmod(
+    ConstCoeffIter operand1, ConstCoeffIter operand2, std::size_t coeff_count, const Modulus &modulus, CoeffIter result)
+{
+    simd_multiply_accumulate_mod(operand1, operand2, coeff_count, modulus.value(), modulus.const_ratio().data(), result);
+}
+
+inline void simd_multiply_poly_scalar_coeffmod(
+    ConstCoeffIter poly, std::size_t coeff_count, std::uint64_t scalar, const Modulus &modulus, CoeffIter result)
+{
+    MultiplyUIntModOperand temp_scalar;
+    temp_scalar.set(barrett_reduce_64(scalar, modulus), modulus);
+    simd_multiply_scalar_mod(poly, coeff_count, temp_scalar.operand, temp_scalar.quotient, modulus.value(), result);
+}
+
+// Same result as GaloisTool::apply_galois, with the index table from KernelContext::galois_permutation
+inline void my_apply_galois_permutation(
+    ConstCoeffIter operand, const uint32_t *permutation, std::size_t coeff_count, const Modulus &modulus, CoeffIter result)
+{
+    for (std::size_t i = 0; i < coeff_count; i++)
+    {
+        uint32_t index = permutation[i] & ~KernelContext::GALOIS_NEGATE_FLAG;
+        uint64_t value = operand[i];
+        result[index] = (permutation[i] & KernelContext::GALOIS_NEGATE_FLAG) ? negate_uint_mod(value, modulus) : value;
+    }
+}
+
+// Same result as GaloisTool::apply_galois_ntt, with the index table from KernelContext::galois_permutation_ntt
+inline void my_apply_galois_ntt_permutation(
+    ConstCoeffIter operand, const uint32_t *permutation, std::size_t coeff_count, CoeffIter result)
+{
+    for (std::size_t i = 0; i < coeff_count; i++)
+    {
+        result[i] = operand[permutation[i]];
+    }
+}
+
 inline void my_add_poly_coeffmod(
     ConstRNSIter operand1, ConstRNSIter operand2, std::size_t coeff_modulus_size, ConstModulusIter modulus,
     RNSIter result, int num_threads)
@@ -81,7 +158,7 @@ inline void my_add_poly_coeffmod(
 #pragma omp parallel for num_threads(num_threads)
     for (int i = 0; i < coeff_modulus_size; i++)
     {
-        add_poly_coeffmod(operand1[i], operand2[i], poly_modulus_degree, modulus[i], result[i]);
+        simd_add_poly_coeffmod(operand1[i], operand2[i], poly_modulus_degree, modulus[i], result[i]);
     }
 }
 
@@ -93,7 +170,7 @@ inline void my_dyadic_product_coeffmod(
 #pragma omp parallel for num_threads(num_threads)
     for (int i = 0; i < coeff_modulus_size; i++)
     {
-        dyadic_product_coeffmod(operand1[i], operand2[i], poly_modulus_degree, modulus[i], result[i]);
+        simd_dyadic_product_coeffmod(operand1[i], operand2[i], poly_modulus_degree, modulus[i], result[i]);
     }
 }
 
@@ -115,9 +192,15 @@ inline void my_multiply_poly_scalar_coeffmod(ConstRNSIter poly, std::size_t coef
 #pragma omp parallel for num_threads(num_threads)
     for (int i = 0; i < coeff_modulus_size; i++)
     {
-        multiply_poly_scalar_coeffmod(poly[i], poly_modulus_degree, scalar, modulus[i], result[i]);
+        simd_multiply_poly_scalar_coeffmod(poly[i], poly_modulus_degree, scalar, modulus[i], result[i]);
     }
 }
 
+// Two-component BFV ciphertext at one prime, not in NTT form, rounded to multiples of 2^c0_drop_bits and
+// 2^c1_drop_bits and bit-packed after a header word with both drop counts
+vector<uint64_t> my_pack_ciphertext(KernelContext &context_, const Ciphertext &encrypted, size_t c0_drop_bits, size_t c1_drop_bits);
+// Inverse of my_pack_ciphertext at the one-prime level of parms_id; the dropped bits come back as zeros
+void my_unpack_ciphertext(KernelContext &context_, const vector<uint64_t> &packed, parms_id_type parms_id, Ciphertext &destination);
+
 void saveToBinaryFile(const std::string &filename, const std::string &data);
 std::string loadFromBinaryFile(const std::string &filename);
\ No newline at end of file
@@ -77,6 +77,7 @@ int main(int argc, char *argv[]) {
     parms.set_plain_modulus(PLAIN_MODULUS);
 
     SEALContext context(parms);
+    KernelContext kernel_context(context);
     auto pid = context.first_parms_id();
 
     uint64_t plain_modulus = parms.plain_modulus().value();
@@ -100,7 +101,8 @@ int main(int argc, char *argv[]) {
         rotation_steps.insert(i);
     }
 
-    for (int i = 1; i <= (pir_num_columns_per_obj / 2); i *= 2)
+    // The workers' rotation tree and placement only rotate by powers of two below the column count
+    for (int i = 1; i < (pir_num_columns_per_obj / 2); i *= 2)
     {
         rotation_steps.insert(-i);
     }
@@ -126,14 +128,18 @@ int main(int argc, char *argv[]) {
         one_mat.push_back(1);
     }
     batch_encoder.encode(one_mat, one_pt);
-    Serializable<Ciphertext> one_ct = encryptor.encrypt_symmetric(one_pt);
+    // Seeded at the compact level, so the master and workers have nothing to switch
+    auto compact_pid = get_lower_parms_id(kernel_context, pid, MOD_SWITCH_COUNT);
     stringstream oss;
-    one_ct.save(oss);
+    save_wire_header(oss, WireArtifact::one_ciphertext);
+    save_seeded_encryption(kernel_context, secret_key, one_pt, compact_pid, oss, wire_compr_mode());
 
     std::stringstream gkss, rkss, qss;
     string serialized_gal_key, serialized_relin_key, serialized_one_ct ;
-    galois_keys.save(gkss);
-    relin_keys.save(rkss);
+    save_wire_header(gkss, WireArtifact::galois_keys);
+    galois_keys.save(gkss, wire_compr_mode());
+    save_wire_header(rkss, WireArtifact::relin_keys);
+    relin_keys.save(rkss, wire_compr_mode());
     serialized_gal_key = gkss.str();
     serialized_relin_key = rkss.str();
     serialized_one_ct = oss.str();
@@ -141,11 +147,7 @@ int main(int argc, char *argv[]) {
     vector<uint64_t> query_mat(N, 0), response_mat(N, 0);
     Plaintext query_pt, response_pt;
     Ciphertext response;  
-    response.load(context, oss);
-    for (int k = 0; k < MOD_SWITCH_COUNT; k++)
-    {
-        evaluator.mod_switch_to_next_inplace(response);
-    }
+    response.resize(context, compact_pid, 2);
 
     query_client.call("sendKeys", serialized_gal_key, serialized_relin_key, serialized_one_ct);
     sleep(50);
@@ -168,7 +170,8 @@ int main(int argc, char *argv[]) {
     batch_encoder.encode(query_mat, query_pt);
 
     Serializable <Ciphertext> ser_query = encryptor.encrypt_symmetric(query_pt);
-    ser_query.save(qss);
+    save_wire_header(qss, WireArtifact::query);
+    ser_query.save(qss, wire_compr_mode());
     string serialized_query = qss.str();
     time_end = chrono::high_resolution_clock::now();
     query_gen_time = chrono::duration_cast<chrono::microseconds>(time_end - total_start).count();
@@ -176,8 +179,12 @@ int main(int argc, char *argv[]) {
     vector<uint64_t> ct = query_client.call("sendQuery", serialized_query).as<vector<uint64_t>>();
     response_rcv_timestamp = chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now().time_since_epoch()).count();
 
-    assert(ct.size() == SMALL_COEFF_COUNT );
-    std::copy(ct.begin(), ct.end(), response.data());
+    if (COMPACT_RESPONSE) {
+        my_unpack_ciphertext(kernel_context, ct, context.last_parms_id(), response);
+    } else {
+        assert(ct.size() == SMALL_COEFF_COUNT );
+        std::copy(ct.begin(), ct.end(), response.data());
+    }
     decryptor.decrypt(response, response_pt);
     batch_encoder.decode(response_pt, response_mat);
  
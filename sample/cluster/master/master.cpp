@@ -13,6 +13,7 @@ pthread_mutex_t sent_client_response_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t sent_client_response_cond = PTHREAD_COND_INITIALIZER;
 
 SEALContext *context;
+KernelContext *kernel_context;
 Evaluator *evaluator;
 
 vector<uint64_t> sendQuery(string _serialized_query);
@@ -90,6 +91,7 @@ int main(int argc, char **argv) {
 
     //parms.set_plain_modulus(17);
     context = new SEALContext(parms);
+    kernel_context = new KernelContext(*context);
     auto pid = context->first_parms_id();
     evaluator = new Evaluator(*context);
 
@@ -101,11 +103,9 @@ int main(int argc, char **argv) {
 
     Ciphertext one_ct;
     stringstream oss(serialized_one_ct);
+    load_wire_header(oss, WireArtifact::one_ciphertext);
     one_ct.load(*context, oss);
-    for (int k = 0; k < MOD_SWITCH_COUNT; k++)
-    {
-        evaluator->mod_switch_to_next_inplace(one_ct);
-    }
+    my_mod_switch_scale_to(*kernel_context, one_ct, one_ct, get_lower_parms_id(*kernel_context, pid, MOD_SWITCH_COUNT), MemoryManager::GetPool(), 1);
     for(int i = 0; i < NUM_GROUP; i++) {
         worker_response.push_back(one_ct);
     }
@@ -142,10 +142,17 @@ vector<uint64_t> sendQuery(string _serialized_query) {
     result = worker_response[0];
     for(int i = 1; i < worker_response.size(); i++) {
         // evaluator->add_inplace(result, worker_response[i]);  // TO DO : parallelize the addition
-        my_add_inplace(*context, result, worker_response[i]);
+        my_add_inplace(*kernel_context, result, worker_response[i]);
     }
 
-    std::copy(result.data(), result.data() + SMALL_COEFF_COUNT, response.begin()); 
+    if (COMPACT_RESPONSE) {
+        size_t c0_drop_bits, c1_drop_bits;
+        compact_response_drop_bits(*kernel_context, c0_drop_bits, c1_drop_bits);
+        my_mod_switch_scale_to(*kernel_context, result, result, context->last_parms_id(), MemoryManager::GetPool(), 1);
+        response = my_pack_ciphertext(*kernel_context, result, c0_drop_bits, c1_drop_bits);
+    } else {
+        std::copy(result.data(), result.data() + SMALL_COEFF_COUNT, response.begin()); 
+    }
 
     pthread_mutex_lock(&sent_client_response_lock);
     pthread_cond_broadcast(&sent_client_response_cond);
@@ -66,7 +66,9 @@ uint32_t pir_db_rows;
 /***********************************/
 
 SEALContext *context;
+KernelContext *kernel_context;
 
+KernelArena *column_arena;
 MemoryPoolHandle *column_pools;
 
 
@@ -215,6 +217,7 @@ int main(int argc, char *argv[]) {
 
     parms.set_plain_modulus(PLAIN_MODULUS);
     context = new SEALContext(parms);
+    kernel_context = new KernelContext(*context);
 
     auto pid = context->first_parms_id();
     uint64_t plain_modulus = parms.plain_modulus().value();
@@ -226,9 +229,10 @@ int main(int argc, char *argv[]) {
 
     evaluator = new Evaluator(*context);
 
+    column_arena = new KernelArena(*kernel_context, NUM_COL_THIS_WORKER);
     column_pools = new MemoryPoolHandle[NUM_COL_THIS_WORKER];
     for(int i = 0; i < NUM_COL_THIS_WORKER; i++) {
-        column_pools[i] = MemoryPoolHandle::New();
+        column_pools[i] = column_arena->pool(i);
     }
 
     preallocate_memory();
@@ -344,9 +348,10 @@ vector<uint64_t> sendQuery(string _serialized_query) {
         }
     }
     stringstream qss(_serialized_query);
+    load_wire_header(qss, WireArtifact::query);
     server_query_ct->load(*context, qss);
 
-    my_transform_to_ntt_inplace(*context, *server_query_ct, TOTAL_MACHINE_THREAD);
+    my_transform_to_ntt_inplace(*kernel_context, *server_query_ct, TOTAL_MACHINE_THREAD);
     for (int i = 0; i < NUM_COL_THIS_WORKER; i++)
     {
         if (pthread_create(&(query_expansion_thread[i]), NULL, expand_query, (void *)&(expansion_thread_id[i])))
@@ -405,7 +410,7 @@ vector<uint64_t> sendQuery(string _serialized_query) {
     }
     for(int i = 1; i < NUM_PIR_THREAD; i++) {
         // evaluator->add_inplace(pir_results[0], pir_results[i]);
-        my_add_inplace(*context, pir_results[0], pir_results[i]);
+        my_add_inplace(*kernel_context, pir_results[0], pir_results[i]);
     }
 
     std::copy(pir_results[0].data(), pir_results[0].data() + SMALL_COEFF_COUNT, worker_response.begin());
@@ -433,7 +438,7 @@ void *process_pir(void *arg) {
     while(mask <= start_idx) {
         if(start_idx & mask) {
             // evaluator->rotate_rows_inplace(pir_results[my_id], -mask, *galois_keys);
-            my_rotate_internal(*context, pir_results[my_id] , -mask, *galois_keys, MemoryManager::GetPool(), TOTAL_MACHINE_THREAD/NUM_PIR_THREAD);
+            my_rotate_internal(*kernel_context, pir_results[my_id] , -mask, *galois_keys, MemoryManager::GetPool(), TOTAL_MACHINE_THREAD/NUM_PIR_THREAD);
 
         }
         mask <<= 1;
@@ -447,18 +452,24 @@ void sendKeys(string _serialized_gal_key, string _serialized_relin_key, string _
     stringstream gkss(_serialized_gal_key);
     stringstream rkss(_serialized_relin_key);
     stringstream oss(_serialized_one_ct);
-    galois_keys->load(*context,gkss);
+    // Hybrid keys have one key per digit, which SEAL's own load rejects
+    load_wire_header(gkss, WireArtifact::galois_keys);
+    load_wire_header(rkss, WireArtifact::relin_keys);
+    load_wire_header(oss, WireArtifact::one_ciphertext);
+    size_t digit_count = my_load_kswitch_keys(*kernel_context, gkss, *galois_keys);
 
-    relin_keys->load(*context, rkss);
+    if (my_load_kswitch_keys(*kernel_context, rkss, *relin_keys) != digit_count) {
+        throw logic_error("relinearization and Galois keys use different decompositions");
+    }
+    if (digit_count != kernel_context->key_switch_digit_count()) {
+        kernel_context->set_key_switch_digit_count(digit_count);
+        preallocate_memory();
+    }
 
     one_ct->load(*context, oss);
 
-    for (int k = 0; k < MOD_SWITCH_COUNT; k++)
-    {
-        evaluator->mod_switch_to_next_inplace(*one_ct);
-    }
-
-    compact_pid = one_ct->parms_id();
+    compact_pid = get_lower_parms_id(*kernel_context, context->first_parms_id(), MOD_SWITCH_COUNT);
+    my_mod_switch_scale_to(*kernel_context, *one_ct, *one_ct, compact_pid, MemoryManager::GetPool(), TOTAL_MACHINE_THREAD);
     if(!GROUP_LEADER) {
         group_client = new rpc::client*[1];
         int leader_id = (WORKER_ID / GROUP_SIZE) * GROUP_SIZE;
@@ -549,19 +560,17 @@ void *expand_query(void *arg)
     // evaluator->multiply_plain(*server_query_ct, masks[id], expanded_query[id]);
     // evaluator->transform_from_ntt_inplace(expanded_query[id]);
 
-    expanded_query[id] = *server_query_ct;
-    my_multiply_plain_ntt(*context, expanded_query[id], masks[id], NUM_EXPANSION_THREAD);
-    my_transform_from_ntt_inplace(*context, expanded_query[id], NUM_EXPANSION_THREAD);
+    my_multiply_plain_ntt(*kernel_context, *server_query_ct, masks[id], expanded_query[id], NUM_EXPANSION_THREAD);
+    my_transform_from_ntt_inplace(*kernel_context, expanded_query[id], NUM_EXPANSION_THREAD);
     Ciphertext temp_ct;
 
     for (int i = N / (2 * NUM_COL_THIS_WORKER); i < N / 2; i *= 2)
     {
         //evaluator->rotate_rows(expanded_query[id], i, *galois_keys, temp_ct);
-        temp_ct = expanded_query[id];
-        //my_rotate_internal(*context, temp_ct, i, *galois_keys, MemoryManager::GetPool(), NUM_EXPANSION_THREAD);
-        my_rotate_internal(*context, temp_ct, i, *galois_keys, column_pools[id], NUM_EXPANSION_THREAD);
+        //my_rotate_internal(*kernel_context, temp_ct, i, *galois_keys, MemoryManager::GetPool(), NUM_EXPANSION_THREAD);
+        my_rotate_internal(*kernel_context, expanded_query[id], i, *galois_keys, temp_ct, column_pools[id], NUM_EXPANSION_THREAD);
         //evaluator->add_inplace(expanded_query[id], temp_ct);
-        my_add_inplace(*context, expanded_query[id], temp_ct);
+        my_add_inplace(*kernel_context, expanded_query[id], temp_ct);
     }
     return NULL;
 }
@@ -614,8 +623,8 @@ void *process_rows(void *arg)
 
             // #pragma omp parallel for
             // for(int j = 0; j < NUM_COL_THIS_WORKER; j+=diff) {
-            //     my_bfv_multiply(*context, column_results[j], column_results[j + (diff/2)]);
-            //     my_relinearize_internal(*context, column_results[j] ,*relin_keys, 2, MemoryManager::GetPool());
+            //     my_bfv_multiply(*kernel_context, column_results[j], column_results[j + (diff/2)]);
+            //     my_relinearize_internal(*kernel_context, column_results[j] ,*relin_keys, 2, MemoryManager::GetPool());
             // }
 
             for(int i = 0; i < mult_args.size(); i++) {
@@ -651,25 +660,25 @@ void *process_rows(void *arg)
             Ciphertext ct = group_response_queue.front();
             group_response_queue.pop();
             pthread_mutex_unlock(&group_response_lock);
-            my_bfv_multiply(*context, column_results[0], ct, column_pools[0], TOTAL_MACHINE_THREAD);
-            my_relinearize_internal(*context, column_results[0] ,*relin_keys, 2, column_pools[0], TOTAL_MACHINE_THREAD); 
+            my_bfv_multiply(*kernel_context, column_results[0], ct, column_pools[0], TOTAL_MACHINE_THREAD);
+            my_relinearize_internal(*kernel_context, column_results[0] ,*relin_keys, 2, column_pools[0], TOTAL_MACHINE_THREAD); 
             ++group_response_count;
         }
 
         time_start = chrono::high_resolution_clock::now();
         // evaluator->transform_to_ntt_inplace(column_results[0]);
         // evaluator->multiply_plain_inplace(column_results[0], mult_pt[row_idx]);
-        Ciphertext temp_ct = column_results[0];
+        Ciphertext temp_ct;
         // evaluator->rotate_columns(column_results[0], *galois_keys, temp_ct);
-        my_conjugate_internal(*context, temp_ct, *galois_keys, column_pools[0], TOTAL_MACHINE_THREAD/NUM_ROW_THREAD);
+        my_conjugate_internal(*kernel_context, column_results[0], *galois_keys, temp_ct, column_pools[0], TOTAL_MACHINE_THREAD/NUM_ROW_THREAD);
 
-        my_bfv_multiply(*context, column_results[0], temp_ct, column_pools[0], TOTAL_MACHINE_THREAD/ NUM_ROW_THREAD);
-        my_relinearize_internal(*context, column_results[0] ,*relin_keys, 2, MemoryManager::GetPool(), TOTAL_MACHINE_THREAD / NUM_ROW_THREAD);
+        my_bfv_multiply(*kernel_context, column_results[0], temp_ct, column_pools[0], TOTAL_MACHINE_THREAD/ NUM_ROW_THREAD);
+        my_relinearize_internal(*kernel_context, column_results[0] ,*relin_keys, 2, column_pools[0], TOTAL_MACHINE_THREAD / NUM_ROW_THREAD);
 
-        my_transform_to_ntt_inplace(*context, column_results[0], (TOTAL_MACHINE_THREAD / NUM_ROW_THREAD));
-        // my_multiply_plain_ntt(*context, column_results[0], mult_pt[row_idx], (TOTAL_MACHINE_THREAD / NUM_ROW_THREAD));
+        my_transform_to_ntt_inplace(*kernel_context, column_results[0], (TOTAL_MACHINE_THREAD / NUM_ROW_THREAD));
+        // my_multiply_plain_ntt(*kernel_context, column_results[0], mult_pt[row_idx], (TOTAL_MACHINE_THREAD / NUM_ROW_THREAD));
 
-        row_result[row_idx] = column_results[0];
+        std::swap(row_result[row_idx], column_results[0]);
  
         time_end = chrono::high_resolution_clock::now();
         //row_agg_time[row_idx] = (chrono::duration_cast<chrono::microseconds>(time_end - time_start)).count();
@@ -688,9 +697,9 @@ void *multiply_columns(void *arg) {
     int diff = mult_arg.diff;
     int num_threads = TOTAL_MACHINE_THREAD / (NUM_COL_THIS_WORKER / diff);
 
-    my_bfv_multiply(*context, column_results[id], column_results[id + (diff/2)], column_pools[id], num_threads);
+    my_bfv_multiply(*kernel_context, column_results[id], column_results[id + (diff/2)], column_pools[id], num_threads);
 
-    my_relinearize_internal(*context, column_results[id] ,*relin_keys, 2, column_pools[id], num_threads); 
+    my_relinearize_internal(*kernel_context, column_results[id] ,*relin_keys, 2, column_pools[id], num_threads); 
 }
 
 
@@ -714,20 +723,19 @@ void *process_columns(void *arg) {
             //time_start = chrono::high_resolution_clock::now();
 
             //evaluator->square_inplace(sub);
-            my_bfv_square(*context, sub, column_pools[i], NUM_EXPONENT_THREAD);
+            my_bfv_square(*kernel_context, sub, column_pools[i], NUM_EXPONENT_THREAD);
             //time_end = chrono::high_resolution_clock::now();
             //square_time.push_back((chrono::duration_cast<chrono::microseconds>(time_end - time_start)).count());
 
             //evaluator->relinearize_inplace(sub, *relin_keys);
-            my_relinearize_internal(*context, sub, *relin_keys, 2, column_pools[i], NUM_EXPONENT_THREAD);
+            my_relinearize_internal(*kernel_context, sub, *relin_keys, 2, column_pools[i], NUM_EXPONENT_THREAD);
         }
         //auto time_end = chrono::high_resolution_clock::now();
         //exp_time.push_back((chrono::duration_cast<chrono::microseconds>(time_end - time_start)).count());
 
-        for(int k = 0; k < MOD_SWITCH_COUNT; k++) {
-            my_mod_switch_scale_to_next(*context, sub, sub, column_pools[i], NUM_EXPONENT_THREAD);
-        }
-        evaluator->sub(*one_ct, sub, (col_arg.column_result)[i]);
+        my_mod_switch_scale_to(*kernel_context, sub, sub, compact_pid, column_pools[i], NUM_EXPONENT_THREAD);
+        evaluator->sub(*one_ct, sub, sub);
+        std::swap((col_arg.column_result)[i], sub);
 
     }
     time_end = chrono::high_resolution_clock::now(); 
@@ -777,30 +785,29 @@ Ciphertext get_sum(Ciphertext *query, uint32_t start, uint32_t end)
         int mid = next_power_of_two / 2;
         seal::Ciphertext left_sum = get_sum(query, start, start + mid - 1);
         seal::Ciphertext right_sum = get_sum(query, start + mid, end);
-        my_rotate_internal(*context, right_sum, -mid, *galois_keys, column_pools[0], TOTAL_MACHINE_THREAD);
+        my_rotate_internal(*kernel_context, right_sum, -mid, *galois_keys, column_pools[0], TOTAL_MACHINE_THREAD);
         //evaluator->rotate_rows_inplace(right_sum, -mid, *galois_keys);
         //evaluator->add_inplace(left_sum, right_sum);
-        my_add_inplace(*context, left_sum, right_sum);
+        my_add_inplace(*kernel_context, left_sum, right_sum);
         return left_sum;
     }
     else
     {
 
-        seal::Ciphertext column_sum = query[0];
+        seal::Ciphertext column_sum;
         seal::Ciphertext temp_ct;
         //evaluator->multiply_plain(query[0], pir_encoded_db[pir_num_query_ciphertext * start], column_sum);
-        my_multiply_plain_ntt(*context, column_sum, pir_encoded_db[pir_num_query_ciphertext * start], TOTAL_MACHINE_THREAD);
+        my_multiply_plain_ntt(*kernel_context, query[0], pir_encoded_db[pir_num_query_ciphertext * start], column_sum, TOTAL_MACHINE_THREAD);
 
         for (int j = 1; j < pir_num_query_ciphertext; j++)
         {
-            temp_ct = query[j];
-            my_multiply_plain_ntt(*context, temp_ct, pir_encoded_db[pir_num_query_ciphertext * start + j], TOTAL_MACHINE_THREAD);
+            my_multiply_plain_ntt(*kernel_context, query[j], pir_encoded_db[pir_num_query_ciphertext * start + j], temp_ct, TOTAL_MACHINE_THREAD);
 
             // evaluator->multiply_plain(query[j], pir_encoded_db[pir_num_query_ciphertext * start + j], temp_ct);
             // evaluator->add_inplace(column_sum, temp_ct);
-            my_add_inplace(*context, column_sum, temp_ct);
+            my_add_inplace(*kernel_context, column_sum, temp_ct);
         }
-        my_transform_from_ntt_inplace(*context, column_sum, TOTAL_MACHINE_THREAD);
+        my_transform_from_ntt_inplace(*kernel_context, column_sum, TOTAL_MACHINE_THREAD);
         //evaluator->transform_from_ntt_inplace(column_sum);
         return column_sum;
     }
@@ -873,48 +880,17 @@ void pir_encode_db(std::vector<std::vector<uint64_t>> db)
 
 void preallocate_memory() {
 
-    #pragma omp parallel for num_threads(NUM_COL_THIS_WORKER)
+    // Reserve what the kernels take from each column pool, at the top level and after mod switching
+    auto first_pid = context->first_parms_id();
+    auto pid = get_lower_parms_id(*kernel_context, first_pid, MOD_SWITCH_COUNT);
     for(int i = 0; i < NUM_COL_THIS_WORKER; i++) {
-        SEAL_ALLOCATE_GET_POLY_ITER(temp, 3, N, 13, column_pools[i]);
-        SEAL_ALLOCATE_GET_POLY_ITER(temp2, 3, N, 14, column_pools[i]);
-        SEAL_ALLOCATE_GET_RNS_ITER(temp4, (8192*4), 15, column_pools[i]);
-        SEAL_ALLOCATE_GET_RNS_ITER(temp5, (8192*4), 14, column_pools[i]);
-        SEAL_ALLOCATE_GET_RNS_ITER(temp6, (8192*4), 13, column_pools[i]);
-        SEAL_ALLOCATE_GET_COEFF_ITER(r_m_tilde,N, column_pools[i]);
-        SEAL_ALLOCATE_GET_COEFF_ITER(temp7, N, column_pools[i]);
-
-        SEAL_ALLOCATE_GET_STRIDE_ITER(temp8, uint64_t, N, 13, column_pools[i]);
-        SEAL_ALLOCATE_GET_STRIDE_ITER(temp9, uint64_t, N, 5, column_pools[i]);
-
-        SEAL_ALLOCATE_GET_RNS_ITER(temp10, N, 27, column_pools[i]);
-        SEAL_ALLOCATE_GET_RNS_ITER(temp11, N, 26, column_pools[i]);
-        SEAL_ALLOCATE_GET_RNS_ITER(temp12, N, 24, column_pools[i]);
-        SEAL_ALLOCATE_GET_RNS_ITER(temp13, N, 22, column_pools[i]);
-        SEAL_ALLOCATE_GET_RNS_ITER(temp14, N, 20, column_pools[i]);
-        SEAL_ALLOCATE_GET_RNS_ITER(temp15, N, 18, column_pools[i]);
-        SEAL_ALLOCATE_GET_RNS_ITER(temp16, N, 16, column_pools[i]);
-        SEAL_ALLOCATE_GET_RNS_ITER(temp17, N, 12, column_pools[i]);
-
-
-        auto t_poly_prod(allocate_zero_poly_array(2, N, 14, column_pools[i]));
-        auto t_poly_lazy(allocate_zero_poly_array(2, N, 2, column_pools[i]));
-        auto t_poly_lazy2(allocate_zero_poly_array(2, N, 2, column_pools[i]));
-        auto t_poly_lazy3(allocate_zero_poly_array(2, N, 2, column_pools[i]));
-
-        SEAL_ALLOCATE_GET_RNS_ITER(temp18, N, 7, column_pools[i]);
-        SEAL_ALLOCATE_GET_RNS_ITER(temp19, N, 7, column_pools[i]);
-
-        SEAL_ALLOCATE_GET_POLY_ITER(encrypted1_q, 2, N, 5, column_pools[i]);
-        SEAL_ALLOCATE_GET_POLY_ITER(encrypted1_Bsk, 2, N, 6, column_pools[i]);
-        SEAL_ALLOCATE_GET_POLY_ITER(encrypted1_q2, 2, N, 5, column_pools[i]);
-
-        SEAL_ALLOCATE_GET_RNS_ITER(temp_q_Bsk, N, 11, column_pools[i]);
-        SEAL_ALLOCATE_GET_RNS_ITER(temp_q_Bsk2, N, 6, column_pools[i]);
-        SEAL_ALLOCATE_GET_RNS_ITER(temp20, N, 1, column_pools[i]);
-
-        SEAL_ALLOCATE_GET_POLY_ITER(temp21, 1, N, 1, column_pools[i]);
-
-        auto t_poly_prod2(allocate_zero_poly_array(2, N, 2, column_pools[i]));
-
-    }
+        column_arena->reserve_rotate(i, first_pid, NUM_EXPANSION_THREAD);
+        column_arena->reserve_square(i, first_pid);
+        column_arena->reserve_relinearize(i, first_pid, NUM_EXPONENT_THREAD);
+        column_arena->reserve_rescale(i, first_pid, pid);
+        column_arena->reserve_multiply(i, pid);
+        column_arena->reserve_relinearize(i, pid, TOTAL_MACHINE_THREAD);
+    }
+    column_arena->reserve_rotate(0, pid, TOTAL_MACHINE_THREAD);
+    column_arena->warm_up();
 }
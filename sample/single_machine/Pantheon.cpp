@@ -100,6 +100,7 @@ vector<Plaintext> masks;
 uint64_t number_of_items = 0;
 
 SEALContext *context;
+KernelContext *kernel_context;
 
 MemoryPoolHandle *column_pools;
 
@@ -230,11 +231,21 @@ int main(int argc, char **argv)
     parms.set_plain_modulus(PLAIN_MODULUS);
 
     context = new SEALContext(parms);
+    kernel_context = new KernelContext(*context);
     auto pid = context->first_parms_id();
     uint64_t plain_modulus = parms.plain_modulus().value();
     KeyGenerator keygen(*context);
     SecretKey secret_key = keygen.secret_key();
-    keygen.create_relin_keys(relin_keys);
+    kernel_context->set_key_switch_digit_count(key_switch_digit_count(*kernel_context, NUM_COL));
+    bool per_prime = kernel_context->key_switch_digit_count() == kernel_context->key_switch_prime_count();
+    if (per_prime)
+    {
+        keygen.create_relin_keys(relin_keys);
+    }
+    else
+    {
+        my_create_relin_keys(*kernel_context, secret_key, false, relin_keys);
+    }
 
     set<int> rotation_steps;
     rotation_steps.insert(0);
@@ -248,7 +259,19 @@ int main(int argc, char **argv)
     {
         rotation_steps.insert(-i);
     }
-    keygen.create_galois_keys(vector<int>(rotation_steps.begin(), rotation_steps.end()), galois_keys);
+    if (per_prime)
+    {
+        keygen.create_galois_keys(vector<int>(rotation_steps.begin(), rotation_steps.end()), galois_keys);
+    }
+    else
+    {
+        vector<uint32_t> galois_elts;
+        for (int step : rotation_steps)
+        {
+            galois_elts.push_back(kernel_context->galois_elt_from_step(step));
+        }
+        my_create_galois_keys(*kernel_context, secret_key, galois_elts, false, galois_keys);
+    }
 
     Encryptor encryptor(*context, secret_key);
     evaluator = new Evaluator(*context);
@@ -286,12 +309,8 @@ int main(int argc, char **argv)
 
     encryptor.encrypt_symmetric(one_pt, *one_ct);
 
-    for (int k = 0; k < MOD_SWITCH_COUNT; k++)
-    {
-        evaluator->mod_switch_to_next_inplace(*one_ct);
-    }
-
-    compact_pid = one_ct->parms_id();
+    compact_pid = get_lower_parms_id(*kernel_context, one_ct->parms_id(), MOD_SWITCH_COUNT);
+    my_mod_switch_scale_to(*kernel_context, *one_ct, *one_ct, compact_pid, MemoryManager::GetPool(), TOTAL_MACHINE_THREAD);
 #pragma endregion
 
 #pragma region SetupDB
@@ -418,7 +437,7 @@ int main(int argc, char **argv)
 
     time_start = chrono::high_resolution_clock::now();
     cpu_start = clock();
-    my_transform_to_ntt_inplace(*context, *server_query_ct, TOTAL_MACHINE_THREAD);
+    my_transform_to_ntt_inplace(*kernel_context, *server_query_ct, TOTAL_MACHINE_THREAD);
     for (int i = 0; i < NUM_COL; i++)
     {
         if (pthread_create(&(query_expansion_thread[i]), NULL, expand_query, (void *)&(expansion_thread_id[i])))
@@ -488,7 +507,7 @@ int main(int argc, char **argv)
     }
     for (int i = 1; i < NUM_PIR_THREAD; i++)
     {
-        my_add_inplace(*context, pir_results[0], pir_results[i]);
+        my_add_inplace(*kernel_context, pir_results[0], pir_results[i]);
     }
     cpu_end = clock();
     time_end = chrono::high_resolution_clock::now();
@@ -600,16 +619,14 @@ void *expand_query(void *arg)
 {
     int id = *((int *)arg);
 
-    expanded_query[id] = *server_query_ct;
-    my_multiply_plain_ntt(*context, expanded_query[id], masks[id], NUM_EXPANSION_THREAD);
-    my_transform_from_ntt_inplace(*context, expanded_query[id], NUM_EXPANSION_THREAD);
+    my_multiply_plain_ntt(*kernel_context, *server_query_ct, masks[id], expanded_query[id], NUM_EXPANSION_THREAD);
+    my_transform_from_ntt_inplace(*kernel_context, expanded_query[id], NUM_EXPANSION_THREAD);
     Ciphertext temp_ct;
 
     for (int i = N / (2 * NUM_COL); i < N / 2; i *= 2)
     {
-        temp_ct = expanded_query[id];
-        my_rotate_internal(*context, temp_ct, i, galois_keys, column_pools[id], NUM_EXPANSION_THREAD);
-        my_add_inplace(*context, expanded_query[id], temp_ct);
+        my_rotate_internal(*kernel_context, expanded_query[id], i, galois_keys, temp_ct, column_pools[id], NUM_EXPANSION_THREAD);
+        my_add_inplace(*kernel_context, expanded_query[id], temp_ct);
     }
     return NULL;
 }
@@ -676,13 +693,13 @@ void *process_rows(void *arg)
             }
         }
 
-        Ciphertext temp_ct = column_results[0];
-        my_conjugate_internal(*context, temp_ct, galois_keys, column_pools[0], TOTAL_MACHINE_THREAD / NUM_ROW_THREAD);
+        Ciphertext temp_ct;
+        my_conjugate_internal(*kernel_context, column_results[0], galois_keys, temp_ct, column_pools[0], TOTAL_MACHINE_THREAD / NUM_ROW_THREAD);
 
-        my_bfv_multiply(*context, column_results[0], temp_ct, column_pools[0], TOTAL_MACHINE_THREAD / NUM_ROW_THREAD);
-        my_relinearize_internal(*context, column_results[0], relin_keys, 2, MemoryManager::GetPool(), TOTAL_MACHINE_THREAD / NUM_ROW_THREAD);
-        my_transform_to_ntt_inplace(*context, column_results[0], TOTAL_MACHINE_THREAD);
-        row_result[row_idx] = column_results[0];
+        my_bfv_multiply(*kernel_context, column_results[0], temp_ct, column_pools[0], TOTAL_MACHINE_THREAD / NUM_ROW_THREAD);
+        my_relinearize_internal(*kernel_context, column_results[0], relin_keys, 2, MemoryManager::GetPool(), TOTAL_MACHINE_THREAD / NUM_ROW_THREAD);
+        my_transform_to_ntt_inplace(*kernel_context, column_results[0], TOTAL_MACHINE_THREAD);
+        std::swap(row_result[row_idx], column_results[0]);
     }
 }
 
@@ -699,7 +716,7 @@ void *process_pir(void *arg)
     {
         if (start_idx & mask)
         {
-            my_rotate_internal(*context, pir_results[my_id], -mask, galois_keys, MemoryManager::GetPool(), TOTAL_MACHINE_THREAD / NUM_PIR_THREAD);
+            my_rotate_internal(*kernel_context, pir_results[my_id], -mask, galois_keys, MemoryManager::GetPool(), TOTAL_MACHINE_THREAD / NUM_PIR_THREAD);
         }
         mask <<= 1;
     }
@@ -713,8 +730,8 @@ void *multiply_columns(void *arg)
     int diff = mult_arg.diff;
     int num_threads = TOTAL_MACHINE_THREAD / (NUM_COL / diff);
 
-    my_bfv_multiply(*context, column_results[id], column_results[id + (diff / 2)], column_pools[id], num_threads);
-    my_relinearize_internal(*context, column_results[id], relin_keys, 2, column_pools[id], num_threads);
+    my_bfv_multiply(*kernel_context, column_results[id], column_results[id + (diff / 2)], column_pools[id], num_threads);
+    my_relinearize_internal(*kernel_context, column_results[id], relin_keys, 2, column_pools[id], num_threads);
 }
 
 void *process_columns(void *arg)
@@ -734,14 +751,12 @@ void *process_columns(void *arg)
 
         for (int k = 0; k < 16; k++)
         {
-            my_bfv_square(*context, sub, column_pools[i], NUM_EXPONENT_THREAD);
-            my_relinearize_internal(*context, sub, relin_keys, 2, column_pools[i], NUM_EXPONENT_THREAD);
-        }
-        for (int k = 0; k < MOD_SWITCH_COUNT; k++)
-        {
-            my_mod_switch_scale_to_next(*context, sub, sub, column_pools[i], NUM_EXPONENT_THREAD);
+            my_bfv_square(*kernel_context, sub, column_pools[i], NUM_EXPONENT_THREAD);
+            my_relinearize_internal(*kernel_context, sub, relin_keys, 2, column_pools[i], NUM_EXPONENT_THREAD);
         }
-        evaluator->sub(*one_ct, sub, (col_arg.column_result)[i]);
+        my_mod_switch_scale_to(*kernel_context, sub, sub, compact_pid, column_pools[i], NUM_EXPONENT_THREAD);
+        evaluator->sub(*one_ct, sub, sub);
+        std::swap((col_arg.column_result)[i], sub);
     }
 }
 
@@ -759,24 +774,23 @@ Ciphertext get_sum(Ciphertext *query, uint32_t start, uint32_t end)
         int mid = next_power_of_two / 2;
         seal::Ciphertext left_sum = get_sum(query, start, start + mid - 1);
         seal::Ciphertext right_sum = get_sum(query, start + mid, end);
-        my_rotate_internal(*context, right_sum, -mid, galois_keys, column_pools[0], TOTAL_MACHINE_THREAD / NUM_PIR_THREAD);
-        my_add_inplace(*context, left_sum, right_sum);
+        my_rotate_internal(*kernel_context, right_sum, -mid, galois_keys, column_pools[0], TOTAL_MACHINE_THREAD / NUM_PIR_THREAD);
+        my_add_inplace(*kernel_context, left_sum, right_sum);
         return left_sum;
     }
     else
     {
 
-        seal::Ciphertext column_sum = query[0];
+        seal::Ciphertext column_sum;
         seal::Ciphertext temp_ct;
-        my_multiply_plain_ntt(*context, column_sum, pir_encoded_db[pir_num_query_ciphertext * start], TOTAL_MACHINE_THREAD / NUM_PIR_THREAD);
+        my_multiply_plain_ntt(*kernel_context, query[0], pir_encoded_db[pir_num_query_ciphertext * start], column_sum, TOTAL_MACHINE_THREAD / NUM_PIR_THREAD);
 
         for (int j = 1; j < pir_num_query_ciphertext; j++)
         {
-            temp_ct = query[j];
-            my_multiply_plain_ntt(*context, temp_ct, pir_encoded_db[pir_num_query_ciphertext * start + j], TOTAL_MACHINE_THREAD / NUM_PIR_THREAD);
-            my_add_inplace(*context, column_sum, temp_ct);
+            my_multiply_plain_ntt(*kernel_context, query[j], pir_encoded_db[pir_num_query_ciphertext * start + j], temp_ct, TOTAL_MACHINE_THREAD / NUM_PIR_THREAD);
+            my_add_inplace(*kernel_context, column_sum, temp_ct);
         }
-        my_transform_from_ntt_inplace(*context, column_sum, TOTAL_MACHINE_THREAD / NUM_PIR_THREAD);
+        my_transform_from_ntt_inplace(*kernel_context, column_sum, TOTAL_MACHINE_THREAD / NUM_PIR_THREAD);
         return column_sum;
     }
 }
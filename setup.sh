@@ -17,7 +17,7 @@ popd
 sudo apt-get -y install clang
 
 pushd SEAL_parallel
-cmake -S . -B build -DCMAKE_VERBOSE_MAKEFILE=ON -DCMAKE_C_COMPILER=clang -DCMAKE_CXX_COMPILER=clang++ -DSEAL_USE_INTEL_HEXL=ON -DBUILD_SHARED_LIBS=OFF -DSEAL_USE_MSGSL=OFF -DSEAL_USE_ZLIB=OFF -DSEAL_USE_ZSTD=OFF
+cmake -S . -B build -DCMAKE_VERBOSE_MAKEFILE=ON -DCMAKE_C_COMPILER=clang -DCMAKE_CXX_COMPILER=clang++ -DSEAL_USE_INTEL_HEXL=ON -DBUILD_SHARED_LIBS=OFF -DSEAL_USE_MSGSL=OFF -DSEAL_USE_ZLIB=OFF -DSEAL_USE_ZSTD=ON
 cmake --build build
 sudo cmake --install build
 popd